@@ -0,0 +1,59 @@
+#include "bit_writer.h"
+
+#include <bit>
+#include <stdexcept>
+
+void bit_writer::write_bits(uint64_t value, int count)
+{
+	if (count < 0 or count > 56)
+		throw std::invalid_argument("bit_writer: invalid bit count");
+	if (count == 0)
+		return;
+
+	pending = (pending << count) | (value & (~uint64_t(0) >> (64 - count)));
+	pending_bits += count;
+	while (pending_bits >= 8)
+	{
+		pending_bits -= 8;
+		bytes.push_back(pending >> pending_bits);
+	}
+}
+
+namespace
+{
+// Code of codeNum: as many leading zeros as bits after the leading one of
+// codeNum + 1, up to 33 bits for 2^32 - 1
+void write_exp_golomb(bit_writer & w, uint64_t code_num)
+{
+	uint64_t value = code_num + 1;
+	int length = std::bit_width(value);
+	w.write_bits(0, length - 1);
+	w.write_bits(value, length);
+}
+} // namespace
+
+void bit_writer::write_ue(uint32_t value)
+{
+	write_exp_golomb(*this, value);
+}
+
+void bit_writer::write_se(int32_t value)
+{
+	// 0, 1, -1, 2, -2...
+	int64_t v = value;
+	write_exp_golomb(*this, v > 0 ? uint64_t(2 * v - 1) : uint64_t(-2 * v));
+}
+
+void bit_writer::write_trailing_bits()
+{
+	write_bits(1, 1);
+	if (pending_bits)
+		write_bits(0, 8 - pending_bits);
+}
+
+const std::vector<uint8_t> & bit_writer::data() const
+{
+	if (not byte_aligned())
+		throw std::logic_error("bit_writer: not byte aligned");
+	return bytes;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// MSB first bit writer for H.264 and H.265 syntax elements (u(n), ue(v),
+// se(v)). Produces an RBSP, emulation prevention is left to the caller.
+class bit_writer
+{
+	std::vector<uint8_t> bytes;
+	// bits not yet in bytes, the last bit_count % 8 written
+	uint64_t pending = 0;
+	int pending_bits = 0;
+
+public:
+	// u(n), the low count bits of value, count at most 56
+	void write_bits(uint64_t value, int count);
+	void write_flag(bool value)
+	{
+		write_bits(value, 1);
+	}
+	// Exp-Golomb codes
+	void write_ue(uint32_t value);
+	void write_se(int32_t value);
+	// rbsp_trailing_bits: a one then zeros up to the next byte
+	void write_trailing_bits();
+
+	size_t bit_count() const
+	{
+		return 8 * bytes.size() + pending_bits;
+	}
+	bool byte_aligned() const
+	{
+		return pending_bits == 0;
+	}
+
+	// Written bytes, the writer must be byte aligned
+	const std::vector<uint8_t> & data() const;
+};
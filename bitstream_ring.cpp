@@ -0,0 +1,122 @@
+#include "bitstream_ring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+static size_t align(size_t value, size_t alignment)
+{
+	if (alignment == 0)
+		return value;
+	return alignment * ((value + alignment - 1) / alignment);
+}
+
+bitstream_ring::bitstream_ring(void * base, size_t capacity, size_t alignment) :
+        base((uint8_t *)base),
+        s(std::make_shared<state>())
+{
+	s->capacity = capacity;
+	s->alignment = alignment;
+}
+
+std::optional<bitstream_ring::allocation> bitstream_ring::allocate(size_t size)
+{
+	std::lock_guard lock(s->mutex);
+
+	size = align(size, s->alignment);
+	if (size == 0 or size > s->capacity)
+		return {};
+
+	size_t offset;
+	if (s->entries.empty())
+	{
+		offset = 0;
+	}
+	else
+	{
+		size_t tail = s->entries.front().offset;
+		if (s->head > tail)
+		{
+			// free space is [head, capacity) and [0, tail)
+			if (s->head + size <= s->capacity)
+				offset = s->head;
+			else if (size <= tail)
+				offset = 0;
+			else
+				return {};
+		}
+		else
+		{
+			// wrapped, free space is [head, tail)
+			if (s->head + size <= tail)
+				offset = s->head;
+			else
+				return {};
+		}
+	}
+
+	uint64_t id = s->first_id + s->entries.size();
+	s->entries.push_back({
+	        .offset = offset,
+	        .size = size,
+	        .released = false,
+	});
+	s->head = offset + size;
+
+	return allocation{
+	        .id = id,
+	        .offset = offset,
+	        .size = size,
+	};
+}
+
+bitstream_ring::region bitstream_ring::commit(const allocation & a, size_t offset, size_t size)
+{
+	if (offset + size > a.size)
+		throw std::out_of_range("bitstream_ring::commit");
+
+	{
+		std::lock_guard lock(s->mutex);
+		auto & e = s->entries[a.id - s->first_id];
+		// keep at least one byte so that a non-empty ring never has head == tail
+		e.size = align(std::max<size_t>(offset + size, 1), s->alignment);
+		if (a.id + 1 == s->first_id + s->entries.size())
+			s->head = e.offset + e.size;
+	}
+
+	region r;
+	r.h = std::make_shared<holder>(s, a.id);
+	r.bytes = {base + a.offset + offset, size};
+	return r;
+}
+
+void bitstream_ring::cancel(const allocation & a)
+{
+	s->release(a.id);
+}
+
+size_t bitstream_ring::used() const
+{
+	std::lock_guard lock(s->mutex);
+	if (s->entries.empty())
+		return 0;
+	size_t tail = s->entries.front().offset;
+	if (s->head > tail)
+		return s->head - tail;
+	return s->capacity - tail + s->head;
+}
+
+void bitstream_ring::state::release(uint64_t id)
+{
+	std::lock_guard lock(mutex);
+	assert(id >= first_id and id < first_id + entries.size());
+	entries[id - first_id].released = true;
+
+	while (not entries.empty() and entries.front().released)
+	{
+		entries.pop_front();
+		++first_id;
+	}
+	if (entries.empty())
+		head = 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+
+// Ring allocator over the mapped encoder output buffer.
+// Regions are reserved in order at an advancing offset, and freed when the
+// last handle referencing them is destroyed. Releasing can be done from any
+// thread, out of order: space is reclaimed once all older regions are free.
+//
+// A reservation is only trimmed to the committed bytes when it is the newest
+// one. With several frames in flight, later frames are already reserved when
+// a frame is committed, so its region keeps the whole reservation: capacity
+// must cover one reservation per frame in flight and per region held.
+class bitstream_ring
+{
+	struct entry
+	{
+		size_t offset;
+		size_t size;
+		bool released;
+	};
+
+	struct state
+	{
+		std::mutex mutex;
+		size_t capacity;
+		size_t alignment;
+		// next free offset
+		size_t head = 0;
+		// id of entries.front()
+		uint64_t first_id = 0;
+		std::deque<entry> entries;
+
+		void release(uint64_t id);
+	};
+
+	struct holder
+	{
+		std::shared_ptr<state> ring;
+		uint64_t id;
+
+		~holder()
+		{
+			ring->release(id);
+		}
+	};
+
+	uint8_t * base;
+	std::shared_ptr<state> s;
+
+public:
+	struct allocation
+	{
+		uint64_t id;
+		size_t offset;
+		size_t size;
+	};
+
+	// Reference-counted read-only view of encoded data, the underlying region
+	// stays reserved until the last copy is destroyed. The reserved size may
+	// be the whole allocation rather than size(), see commit.
+	class region
+	{
+		friend class bitstream_ring;
+		std::shared_ptr<const holder> h;
+		std::span<const uint8_t> bytes;
+
+	public:
+		region() = default;
+
+		std::span<const uint8_t> data() const
+		{
+			return bytes;
+		}
+
+		size_t size() const
+		{
+			return bytes.size();
+		}
+
+		// Keeps the region alive, for consumers that do not know about bitstream_ring
+		std::shared_ptr<const void> owner() const
+		{
+			return h;
+		}
+
+		void reset()
+		{
+			h.reset();
+			bytes = {};
+		}
+
+		explicit operator bool() const
+		{
+			return bool(h);
+		}
+	};
+
+	bitstream_ring(void * base, size_t capacity, size_t alignment);
+
+	// Reserve size bytes, returns nothing if there is not enough contiguous free space
+	std::optional<allocation> allocate(size_t size);
+
+	// Return a handle to the range [offset, offset + size) of the allocation,
+	// and give back the bytes after it if nothing was allocated since.
+	// Otherwise the handle keeps the whole allocation reserved.
+	region commit(const allocation &, size_t offset, size_t size);
+
+	// Free the allocation without creating a handle
+	void cancel(const allocation &);
+
+	// Number of bytes between the oldest reserved region and the head
+	size_t used() const;
+
+	size_t capacity() const
+	{
+		return s->capacity;
+	}
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Lock-free bounded multi-producer multi-consumer queue (D. Vyukov's design).
+// Each cell carries a sequence number telling whether it is ready to be
+// written or read for a given position, so producers and consumers only
+// contend on their own position counter.
+template <typename T>
+class bounded_queue
+{
+	struct cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<cell[]> cells;
+	size_t mask;
+
+	alignas(64) std::atomic<size_t> enqueue_pos{0};
+	alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+public:
+	// capacity is rounded up to a power of two
+	explicit bounded_queue(size_t capacity) :
+	        cells(new cell[std::bit_ceil(std::max<size_t>(capacity, 2))]),
+	        mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1)
+	{
+		for (size_t i = 0; i <= mask; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	bounded_queue(const bounded_queue &) = delete;
+	bounded_queue & operator=(const bounded_queue &) = delete;
+
+	bool try_push(const T & value)
+	{
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell & c = cells[pos & mask];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			auto diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					c.data = value;
+					c.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				// full
+				return false;
+			}
+			else
+			{
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T & value)
+	{
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell & c = cells[pos & mask];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			auto diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0)
+			{
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					value = std::move(c.data);
+					c.sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				// empty
+				return false;
+			}
+			else
+			{
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Only exact when no push or pop is in progress
+	size_t size() const
+	{
+		size_t pushed = enqueue_pos.load(std::memory_order_relaxed);
+		size_t popped = dequeue_pos.load(std::memory_order_relaxed);
+		return pushed > popped ? pushed - popped : 0;
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+};
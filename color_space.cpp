@@ -0,0 +1,23 @@
+#include "color_space.h"
+
+ycbcr_matrix make_ycbcr_matrix(color_matrix matrix, color_range range)
+{
+	const float kr = matrix == color_matrix::bt601 ? 0.299f : 0.2126f;
+	const float kb = matrix == color_matrix::bt601 ? 0.114f : 0.0722f;
+	const float kg = 1 - kr - kb;
+
+	const bool full = range == color_range::full;
+	const float y_scale = full ? 1 : 219.f / 255;
+	const float y_offset = full ? 0 : 16.f / 255;
+	const float c_scale = full ? 1 : 224.f / 255;
+	const float c_offset = 128.f / 255;
+
+	// Cb = (B - Y) / (2 - 2 Kb), Cr = (R - Y) / (2 - 2 Kr)
+	const float cb = c_scale / (2 * (1 - kb));
+	const float cr = c_scale / (2 * (1 - kr));
+	return {
+	        .y = {y_scale * kr, y_scale * kg, y_scale * kb, y_offset},
+	        .cb = {-cb * kr, -cb * kg, cb * (1 - kb), c_offset},
+	        .cr = {cr * (1 - kr), -cr * kg, -cr * kb, c_offset},
+	};
+}
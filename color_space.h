@@ -0,0 +1,28 @@
+#pragma once
+
+// RGB to Y'CbCr conversion parameters, shared by the GPU and CPU converters
+
+enum class color_matrix
+{
+	bt601,
+	bt709,
+};
+
+enum class color_range
+{
+	// Y in [16, 235], Cb and Cr in [16, 240]
+	limited,
+	// all values in [0, 255]
+	full,
+};
+
+// Rows of the RGB to Y'CbCr matrix, the fourth column is the offset.
+// Inputs and outputs are normalised to [0, 1].
+struct ycbcr_matrix
+{
+	float y[4];
+	float cb[4];
+	float cr[4];
+};
+
+ycbcr_matrix make_ycbcr_matrix(color_matrix, color_range);
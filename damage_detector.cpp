@@ -0,0 +1,282 @@
+#include "damage_detector.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DAMAGE_DETECTOR_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define DAMAGE_DETECTOR_NEON 1
+#endif
+
+namespace
+{
+// Whether size bytes at a and b differ
+using differs_fn = bool (*)(const uint8_t * a, const uint8_t * b, size_t size);
+
+bool differs_scalar(const uint8_t * a, const uint8_t * b, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+	{
+		if (a[i] != b[i])
+			return true;
+	}
+	return false;
+}
+
+#ifdef DAMAGE_DETECTOR_X86
+__attribute__((target("sse2"))) bool differs_sse2(const uint8_t * a, const uint8_t * b, size_t size)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			return true;
+	}
+	return differs_scalar(a + i, b + i, size - i);
+}
+
+// 64 bytes per iteration, one branch for two vectors
+__attribute__((target("avx2"))) bool differs_avx2(const uint8_t * a, const uint8_t * b, size_t size)
+{
+	size_t i = 0;
+	for (; i + 64 <= size; i += 64)
+	{
+		__m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+		__m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)), _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+		if (unsigned(_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1))) != 0xffffffff)
+			return true;
+	}
+	return differs_sse2(a + i, b + i, size - i);
+}
+#endif
+
+#ifdef DAMAGE_DETECTOR_NEON
+bool differs_neon(const uint8_t * a, const uint8_t * b, size_t size)
+{
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		uint8x16_t x = vorrq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)),
+		                        veorq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16)));
+		if (vmaxvq_u8(x))
+			return true;
+	}
+	for (; i + 16 <= size; i += 16)
+	{
+		if (vmaxvq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i))))
+			return true;
+	}
+	return differs_scalar(a + i, b + i, size - i);
+}
+#endif
+
+struct implementation
+{
+	differs_fn differs;
+	const char * name;
+};
+
+implementation select_implementation()
+{
+#if defined(DAMAGE_DETECTOR_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return {differs_avx2, "avx2"};
+	if (__builtin_cpu_supports("sse2"))
+		return {differs_sse2, "sse2"};
+#elif defined(DAMAGE_DETECTOR_NEON)
+	return {differs_neon, "neon"};
+#endif
+	return {differs_scalar, "scalar"};
+}
+
+const implementation impl = select_implementation();
+
+void mark_changed_tiles(const uint8_t * current, const uint8_t * previous, size_t size, size_t tile_size, uint8_t * flags, differs_fn differs)
+{
+	for (size_t offset = 0; offset < size; offset += tile_size, ++flags)
+	{
+		if (not *flags and differs(current + offset, previous + offset, std::min(tile_size, size - offset)))
+			*flags = 1;
+	}
+}
+
+// Rows of a plane and of its tiles, in bytes for the widths
+struct plane_layout
+{
+	size_t row_size;
+	uint32_t height;
+	size_t tile_size;
+	uint32_t tile_height;
+};
+
+int plane_count(host_pixel_format format)
+{
+	return format == host_pixel_format::i420 ? 3 : 1;
+}
+
+plane_layout get_layout(host_pixel_format format, uint32_t width, uint32_t height, const damage_detector::config & cfg, int plane)
+{
+	if (format != host_pixel_format::i420)
+		return {4 * size_t(width), height, 4 * size_t(cfg.tile_width), cfg.tile_height};
+	if (plane == 0)
+		return {width, height, cfg.tile_width, cfg.tile_height};
+	return {(width + 1) / 2, (height + 1) / 2, cfg.tile_width / 2, cfg.tile_height / 2};
+}
+} // namespace
+
+void mark_changed_tiles(const uint8_t * current, const uint8_t * previous, size_t size, size_t tile_size, uint8_t * flags)
+{
+	mark_changed_tiles(current, previous, size, tile_size, flags, impl.differs);
+}
+
+void mark_changed_tiles_scalar(const uint8_t * current, const uint8_t * previous, size_t size, size_t tile_size, uint8_t * flags)
+{
+	mark_changed_tiles(current, previous, size, tile_size, flags, differs_scalar);
+}
+
+const char * damage_detector_isa()
+{
+	return impl.name;
+}
+
+damage_detector::damage_detector(const config & cfg) :
+        cfg(cfg)
+{
+	if (cfg.tile_width == 0 or cfg.tile_height == 0 or cfg.tile_width % 2 or cfg.tile_height % 2)
+		throw std::invalid_argument("damage_detector: tile sizes must be even and not 0");
+}
+
+std::span<const damage_rect> damage_detector::detect(const host_frame & frame)
+{
+	if (not has_previous or frame.format != format or frame.width != width or frame.height != height)
+	{
+		format = frame.format;
+		width = frame.width;
+		height = frame.height;
+		columns = (uint64_t(width) + cfg.tile_width - 1) / cfg.tile_width;
+		rows = (uint64_t(height) + cfg.tile_height - 1) / cfg.tile_height;
+		changed.assign(size_t(columns) * rows, 1);
+		store(frame, false);
+		has_previous = true;
+		build_rects();
+		return rects;
+	}
+
+	std::ranges::fill(changed, 0);
+	for (int p = 0; p < plane_count(format); ++p)
+	{
+		auto l = get_layout(format, width, height, cfg, p);
+		for (uint32_t y = 0; y < l.height; ++y)
+		{
+			uint8_t * flags = changed.data() + size_t(y / l.tile_height) * columns;
+			// nothing left to find in this row of tiles
+			if (not std::memchr(flags, 0, columns))
+			{
+				y = (y / l.tile_height + 1) * l.tile_height - 1;
+				continue;
+			}
+			mark_changed_tiles(frame.planes[p] + y * frame.strides[p],
+			                   previous[p].data() + y * l.row_size,
+			                   l.row_size,
+			                   l.tile_size,
+			                   flags);
+		}
+	}
+
+	store(frame, true);
+	build_rects();
+	return rects;
+}
+
+void damage_detector::store(const host_frame & frame, bool changed_only)
+{
+	for (int p = 0; p < plane_count(format); ++p)
+	{
+		auto l = get_layout(format, width, height, cfg, p);
+		if (not changed_only)
+			previous[p].resize(l.row_size * l.height);
+
+		for (uint32_t y = 0; y < l.height; ++y)
+		{
+			const uint8_t * src = frame.planes[p] + y * frame.strides[p];
+			uint8_t * dst = previous[p].data() + y * l.row_size;
+			if (not changed_only)
+			{
+				std::memcpy(dst, src, l.row_size);
+				continue;
+			}
+
+			// one copy per run of changed tiles
+			const uint8_t * flags = changed.data() + size_t(y / l.tile_height) * columns;
+			for (uint32_t x = 0; x < columns;)
+			{
+				if (not flags[x])
+				{
+					++x;
+					continue;
+				}
+				uint32_t end = x + 1;
+				while (end < columns and flags[end])
+					++end;
+				size_t offset = x * l.tile_size;
+				std::memcpy(dst + offset, src + offset, std::min(end * l.tile_size, l.row_size) - offset);
+				x = end;
+			}
+		}
+	}
+}
+
+void damage_detector::build_rects()
+{
+	rects.clear();
+	// rectangles reaching the bottom of the previous row of tiles, in
+	// column order: a run with the same columns extends them downwards
+	std::vector<size_t> open;
+	std::vector<size_t> next_open;
+	for (uint32_t ty = 0; ty < rows; ++ty)
+	{
+		const uint8_t * flags = changed.data() + size_t(ty) * columns;
+		uint32_t y = ty * cfg.tile_height;
+		uint32_t tile_height = std::min(cfg.tile_height, height - y);
+		auto above = open.begin();
+		next_open.clear();
+		for (uint32_t tx = 0; tx < columns;)
+		{
+			if (not flags[tx])
+			{
+				++tx;
+				continue;
+			}
+			uint32_t end = tx + 1;
+			while (end < columns and flags[end])
+				++end;
+
+			damage_rect r{
+			        .x = tx * cfg.tile_width,
+			        .y = y,
+			        .width = uint32_t(std::min<uint64_t>(uint64_t(end) * cfg.tile_width, width) - tx * cfg.tile_width),
+			        .height = tile_height,
+			};
+			while (above != open.end() and rects[*above].x < r.x)
+				++above;
+			if (above != open.end() and rects[*above].x == r.x and rects[*above].width == r.width)
+			{
+				rects[*above].height += tile_height;
+				next_open.push_back(*above);
+			}
+			else
+			{
+				next_open.push_back(rects.size());
+				rects.push_back(r);
+			}
+			tx = end;
+		}
+		std::swap(open, next_open);
+	}
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "nv12_convert.h"
+
+// Host-side detection of the parts of a frame that changed since the
+// previous one, for mostly static sources such as desktops. Frames are
+// compared in tiles, against a copy of the previous frame. Does not depend
+// on Vulkan.
+// Comparisons use SSE2, AVX2 or NEON when available, selected at runtime;
+// the _scalar variant is the reference implementation.
+
+// Rectangle of a frame, in pixels
+struct damage_rect
+{
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	bool operator==(const damage_rect &) const = default;
+};
+
+// Compare one row of size bytes, split in segments of tile_size bytes, the
+// last one possibly shorter. flags[i] is set to 1 if segment i differs
+// between current and previous; segments whose flag is already set are not
+// compared.
+void mark_changed_tiles(const uint8_t * current, const uint8_t * previous, size_t size, size_t tile_size, uint8_t * flags);
+void mark_changed_tiles_scalar(const uint8_t * current, const uint8_t * previous, size_t size, size_t tile_size, uint8_t * flags);
+
+// Name of the selected implementation
+const char * damage_detector_isa();
+
+class damage_detector
+{
+public:
+	struct config
+	{
+		// in pixels, even so that I420 chroma tiles are whole samples
+		uint32_t tile_width = 64;
+		uint32_t tile_height = 64;
+	};
+
+private:
+	config cfg;
+
+	// previous frame, planes tightly packed
+	bool has_previous = false;
+	host_pixel_format format = host_pixel_format::bgra;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<uint8_t> previous[3];
+
+	uint32_t columns = 0;
+	uint32_t rows = 0;
+	std::vector<uint8_t> changed;
+	std::vector<damage_rect> rects;
+
+	void store(const host_frame &, bool changed_only);
+	void build_rects();
+
+public:
+	// Throws if a tile size is 0 or odd
+	damage_detector(const config & cfg);
+	damage_detector() :
+	        damage_detector(config{}) {}
+
+	// Compares frame with the previous one and keeps a copy of it. Returns
+	// the changed area as rectangles of whole tiles, clipped to the frame and
+	// not overlapping; empty if the frame is identical. The first frame, and
+	// frames of another size or format, are damaged entirely.
+	// Valid until the next call.
+	std::span<const damage_rect> detect(const host_frame & frame);
+
+	// Forget the previous frame, the next one is damaged entirely
+	void reset()
+	{
+		has_previous = false;
+	}
+
+	// Changed tiles of the last detect, row major, 1 if changed
+	std::span<const uint8_t> tiles() const
+	{
+		return changed;
+	}
+	uint32_t tile_columns() const
+	{
+		return columns;
+	}
+	uint32_t tile_rows() const
+	{
+		return rows;
+	}
+	const config & get_config() const
+	{
+		return cfg;
+	}
+};
@@ -0,0 +1,282 @@
+#include "encode_scheduler.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+namespace
+{
+vk::Semaphore create_timeline(vk::Device device)
+{
+	vk::StructureChain timeline_create{
+	        vk::SemaphoreCreateInfo{},
+	        vk::SemaphoreTypeCreateInfo{
+	                .semaphoreType = vk::SemaphoreType::eTimeline,
+	                .initialValue = 0,
+	        },
+	};
+	return device.createSemaphore(timeline_create.get());
+}
+} // namespace
+
+encode_scheduler::encode_scheduler(vk::PhysicalDevice physical_device, vk::Device device, uint32_t encode_queue_family_index, size_t worker_count) :
+        device(device)
+{
+	auto families = physical_device.getQueueFamilyProperties();
+	if (encode_queue_family_index >= families.size() or
+	    not(families[encode_queue_family_index].queueFlags & vk::QueueFlagBits::eVideoEncodeKHR))
+		throw std::runtime_error("encode_scheduler needs a video encode queue family");
+	if (worker_count == 0)
+		throw std::runtime_error("encode_scheduler needs at least one worker");
+
+	const uint32_t queue_count = families[encode_queue_family_index].queueCount;
+
+	for (uint32_t i = 0; i < queue_count; ++i)
+	{
+		auto & q = queues.emplace_back(std::make_shared<submit_queue>());
+		q->queue = device.getQueue(encode_queue_family_index, i);
+		q->family_index = encode_queue_family_index;
+	}
+	queue_streams.resize(queue_count, 0);
+
+	for (size_t i = 0; i < worker_count; ++i)
+	{
+		auto & w = workers.emplace_back(std::make_unique<worker>());
+		w->wake_semaphore = create_timeline(device);
+		w->thread = std::thread([this, w = w.get()]() { run(*w); });
+	}
+}
+
+encode_scheduler::~encode_scheduler()
+{
+	for (auto & w: workers)
+	{
+		std::lock_guard lock(w->mutex);
+		w->quit = true;
+		if (std::exchange(w->sleeping, false))
+			device.signalSemaphore({.semaphore = w->wake_semaphore, .value = w->wake_value});
+	}
+	for (auto & w: workers)
+	{
+		w->thread.join();
+		device.destroy(w->wake_semaphore);
+	}
+}
+
+encode_scheduler::stream_id encode_scheduler::add_stream(const encoder_factory & create, frame_callback on_frame)
+{
+	std::lock_guard lock(streams_mutex);
+
+	size_t queue = std::ranges::min_element(queue_streams) - queue_streams.begin();
+	stream_id id = next_id;
+	worker * w = workers[id % workers.size()].get();
+
+	auto encoder = create(queues[queue]);
+	video_encoder * encoder_ptr = encoder.get();
+
+	{
+		std::lock_guard worker_lock(w->mutex);
+		w->new_streams.emplace(id,
+		                       stream{
+		                               .encoder = std::move(encoder),
+		                               .on_frame = std::move(on_frame),
+		                               .queue = queue,
+		                       });
+	}
+
+	++queue_streams[queue];
+	stream_index.emplace(id,
+	                     stream_index_entry{
+	                             .w = w,
+	                             .encoder = encoder_ptr,
+	                             .queue = queue,
+	                     });
+	return next_id++;
+}
+
+void encode_scheduler::remove_stream(stream_id id)
+{
+	std::lock_guard lock(streams_mutex);
+	auto it = stream_index.find(id);
+	if (it == stream_index.end())
+		throw std::out_of_range("invalid stream id");
+
+	worker * w = it->second.w;
+	--queue_streams[it->second.queue];
+	stream_index.erase(it);
+
+	add_job(*w, {.id = id, .remove = true});
+}
+
+video_encoder & encode_scheduler::encoder(stream_id id)
+{
+	std::shared_lock lock(streams_mutex);
+	return *stream_index.at(id).encoder;
+}
+
+void encode_scheduler::encode(stream_id id, const video_encoder::input_image & input, vk::Semaphore wait_semaphore, uint64_t wait_value, uint32_t src_queue)
+{
+	worker * w;
+	{
+		std::shared_lock lock(streams_mutex);
+		w = stream_index.at(id).w;
+	}
+
+	add_job(*w,
+	        {
+	                .id = id,
+	                .input = input,
+	                .wait_semaphore = wait_semaphore,
+	                .wait_value = wait_value,
+	                .src_queue = src_queue,
+	        });
+}
+
+void encode_scheduler::add_job(worker & w, job j)
+{
+	std::lock_guard lock(w.mutex);
+	w.jobs.push_back(std::move(j));
+	if (std::exchange(w.sleeping, false))
+		device.signalSemaphore({.semaphore = w.wake_semaphore, .value = w.wake_value});
+}
+
+void encode_scheduler::submit(stream_id id, stream & s, const job & j)
+{
+	try
+	{
+		s.encoder->submit_frame(j.input, j.wait_semaphore, j.wait_value, j.src_queue);
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "stream " << id << ": " << e.what() << std::endl;
+		s.encoder->release_input_image(j.input);
+		// a signaled binary semaphore cannot be reused until it is waited on
+		if (j.wait_semaphore and j.wait_value == 0)
+		{
+			try
+			{
+				s.encoder->discard_wait_semaphores({&j.wait_semaphore, 1});
+			}
+			catch (std::exception & ex)
+			{
+				std::cerr << "stream " << id << ": " << ex.what() << std::endl;
+			}
+		}
+	}
+}
+
+bool encode_scheduler::retire(stream_id id, stream & s)
+{
+	try
+	{
+		auto frame = s.encoder->poll_frame();
+		if (not frame)
+			return false;
+
+		if (s.on_frame)
+			s.on_frame(id, std::move(*frame));
+		return true;
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "stream " << id << ": " << e.what() << std::endl;
+		return false;
+	}
+}
+
+bool encode_scheduler::process(stream_id id, stream & s)
+{
+	while (retire(id, s))
+	{
+	}
+
+	while (not s.queued.empty())
+	{
+		const job & j = s.queued.front();
+		if (j.remove)
+			return s.encoder->frames_pending() > 0;
+		if (s.encoder->frames_pending() == s.encoder->max_frames_in_flight())
+			break;
+		submit(id, s, j);
+		s.queued.pop_front();
+	}
+	return true;
+}
+
+void encode_scheduler::sleep(worker & w)
+{
+	// Wake up when the oldest frame of any stream is encoded
+	std::vector<vk::Semaphore> semaphores{w.wake_semaphore};
+	std::vector<uint64_t> values{0};
+	for (const auto & [id, s]: w.streams)
+	{
+		if (size_t pending = s.encoder->frames_pending())
+		{
+			semaphores.push_back(s.encoder->encode_semaphore());
+			values.push_back(video_encoder::timeline_value(s.encoder->next_frame() - pending));
+		}
+	}
+
+	{
+		std::lock_guard lock(w.mutex);
+		if (w.quit or not w.jobs.empty() or not w.new_streams.empty())
+			return;
+		values[0] = ++w.wake_value;
+		w.sleeping = true;
+	}
+
+	try
+	{
+		(void)device.waitSemaphores(
+		        vk::SemaphoreWaitInfo{
+		                .flags = vk::SemaphoreWaitFlagBits::eAny,
+		                .semaphoreCount = uint32_t(semaphores.size()),
+		                .pSemaphores = semaphores.data(),
+		                .pValues = values.data(),
+		        },
+		        UINT64_MAX);
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "encode_scheduler: " << e.what() << std::endl;
+	}
+
+	// Whoever cleared sleeping already signaled values[0], under the mutex
+	std::lock_guard lock(w.mutex);
+	w.sleeping = false;
+}
+
+void encode_scheduler::run(worker & w)
+{
+	std::vector<job> jobs;
+	while (true)
+	{
+		{
+			std::lock_guard lock(w.mutex);
+			if (w.quit)
+				break;
+
+			w.streams.merge(w.new_streams);
+			std::swap(jobs, w.jobs);
+		}
+
+		for (auto & j: jobs)
+		{
+			auto it = w.streams.find(j.id);
+			if (it != w.streams.end())
+				it->second.queued.push_back(std::move(j));
+		}
+		jobs.clear();
+
+		std::erase_if(w.streams, [&](auto & entry) {
+			return not process(entry.first, entry.second);
+		});
+
+		sleep(w);
+	}
+
+	// Encoders wait for their pending frames when destroyed
+	w.streams.clear();
+	w.new_streams.clear();
+}
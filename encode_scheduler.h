@@ -0,0 +1,131 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "video_encoder.h"
+
+// Runs many encoder sessions over all the queues of the encode queue family.
+// Each stream is bound to one queue, the least used one when it is created,
+// and to one worker thread that records and submits all its frames, so the
+// command pools of a worker's encoders are only ever used by that thread.
+// Submissions to a queue are serialised by that queue's own mutex.
+//
+// A worker never blocks on one stream: frames of a stream with all its
+// frames in flight wait in that stream's queue, and the idle worker sleeps
+// until a job is added or the oldest frame of one of its streams is
+// encoded.
+class encode_scheduler
+{
+public:
+	using stream_id = uint64_t;
+	using encoder_factory = std::function<std::unique_ptr<video_encoder>(std::shared_ptr<submit_queue>)>;
+	// Called on the worker thread, in submission order for each stream
+	using frame_callback = std::function<void(stream_id, video_encoder::encoded_frame)>;
+
+private:
+	struct job
+	{
+		stream_id id;
+		video_encoder::input_image input;
+		vk::Semaphore wait_semaphore;
+		uint64_t wait_value;
+		uint32_t src_queue;
+		// stream removal
+		bool remove = false;
+	};
+
+	struct stream
+	{
+		std::unique_ptr<video_encoder> encoder;
+		frame_callback on_frame;
+		size_t queue;
+		// jobs waiting for a frame of the stream to be retired
+		std::deque<job> queued;
+	};
+
+	struct worker
+	{
+		// protects jobs, new_streams, quit, wake_value and sleeping
+		std::mutex mutex;
+		std::vector<job> jobs;
+		std::map<stream_id, stream> new_streams;
+		bool quit = false;
+
+		// Host timeline semaphore the worker waits on with the encoders'.
+		// Before sleeping it increments wake_value and sets sleeping, the
+		// thread that adds work while it sleeps clears sleeping and signals
+		// wake_value, so signals always increase.
+		vk::Semaphore wake_semaphore;
+		uint64_t wake_value = 0;
+		bool sleeping = false;
+
+		// only accessed by the worker thread
+		std::map<stream_id, stream> streams;
+		std::thread thread;
+	};
+
+	struct stream_index_entry
+	{
+		worker * w;
+		video_encoder * encoder;
+		size_t queue;
+	};
+
+	vk::Device device;
+	std::vector<std::shared_ptr<submit_queue>> queues;
+	std::vector<std::unique_ptr<worker>> workers;
+
+	// only taken exclusively for stream creation and removal
+	std::shared_mutex streams_mutex;
+	stream_id next_id = 0;
+	std::vector<size_t> queue_streams;
+	std::map<stream_id, stream_index_entry> stream_index;
+
+	void run(worker &);
+	// Adds a job under the worker mutex and wakes it up
+	void add_job(worker &, job);
+	void sleep(worker &);
+	void submit(stream_id, stream &, const job &);
+	bool retire(stream_id, stream &);
+	// Submits the queued jobs of the stream while it has room for them,
+	// returns false once a removed stream has retired all its frames
+	bool process(stream_id, stream &);
+
+public:
+	// Uses every queue of the encode family, the device must have been
+	// created with all of them
+	encode_scheduler(vk::PhysicalDevice physical_device, vk::Device device, uint32_t encode_queue_family_index, size_t worker_count);
+	encode_scheduler(const encode_scheduler &) = delete;
+	~encode_scheduler();
+
+	// Create an encoder bound to the least used queue
+	stream_id add_stream(const encoder_factory & create, frame_callback on_frame);
+	void remove_stream(stream_id);
+
+	// The encoder must only be used to acquire and release input images, and
+	// not after the stream is removed
+	video_encoder & encoder(stream_id);
+
+	// Queue the encode of an input image acquired from the stream encoder,
+	// once wait_semaphore is signaled, or reaches wait_value for a timeline
+	// semaphore
+	void encode(stream_id, const video_encoder::input_image &, vk::Semaphore wait_semaphore, uint64_t wait_value, uint32_t src_queue);
+	void encode(stream_id id, const video_encoder::input_image & input, vk::Semaphore wait_semaphore, uint32_t src_queue)
+	{
+		encode(id, input, wait_semaphore, 0, src_queue);
+	}
+
+	size_t queue_count() const
+	{
+		return queues.size();
+	}
+};
@@ -0,0 +1,121 @@
+#include "encode_telemetry.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+size_t latency_histogram::bucket(uint64_t value)
+{
+	constexpr uint64_t sub_count = 1 << sub_bits;
+	if (value < sub_count)
+		return value;
+	int msb = std::bit_width(value) - 1;
+	if (msb >= max_bits)
+		return bucket_count - 1;
+	int shift = msb - sub_bits;
+	return (size_t(shift + 1) << sub_bits) + ((value >> shift) - sub_count);
+}
+
+uint64_t latency_histogram::bucket_min(size_t bucket)
+{
+	constexpr uint64_t sub_count = 1 << sub_bits;
+	if (bucket < sub_count)
+		return bucket;
+	int shift = int(bucket >> sub_bits) - 1;
+	return ((bucket & (sub_count - 1)) + sub_count) << shift;
+}
+
+uint64_t latency_histogram::bucket_max(size_t bucket)
+{
+	if (bucket + 1 == bucket_count)
+		return UINT64_MAX;
+	return bucket_min(bucket + 1) - 1;
+}
+
+void latency_histogram::record(uint64_t value)
+{
+	counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+	uint64_t current = max.load(std::memory_order_relaxed);
+	while (current < value and not max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+	{
+	}
+}
+
+latency_histogram::snapshot latency_histogram::read() const
+{
+	snapshot s;
+	s.counts.resize(bucket_count);
+	for (size_t i = 0; i < bucket_count; ++i)
+	{
+		s.counts[i] = counts[i].load(std::memory_order_relaxed);
+		s.count += s.counts[i];
+	}
+	// may lag behind the buckets while values are recorded
+	s.sum = sum.load(std::memory_order_relaxed);
+	s.max = max.load(std::memory_order_relaxed);
+	return s;
+}
+
+uint64_t latency_histogram::snapshot::percentile(double p) const
+{
+	if (count == 0)
+		return 0;
+	uint64_t rank = std::max<uint64_t>(1, std::ceil(std::clamp(p, 0., 1.) * count));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < counts.size(); ++i)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+			return std::min(bucket_max(i), max);
+	}
+	return max;
+}
+
+void encode_telemetry::add(const frame_record & f)
+{
+	frames.fetch_add(1, std::memory_order_relaxed);
+	if (f.intra)
+		intra_frames.fetch_add(1, std::memory_order_relaxed);
+	if (f.failed())
+		failed_frames.fetch_add(1, std::memory_order_relaxed);
+	bytes.fetch_add(f.bytes, std::memory_order_relaxed);
+
+	submit.record(f.submitted - f.submit);
+	encode.record(f.completed - f.submitted);
+	if (f.device_time)
+		device.record(*f.device_time);
+	readback.record(f.retired - f.completed);
+	total.record(f.retired - f.submit);
+}
+
+void encode_telemetry::add_skipped()
+{
+	skipped_frames.fetch_add(1, std::memory_order_relaxed);
+}
+
+encode_telemetry::snapshot encode_telemetry::read() const
+{
+	return {
+	        .time = clock::now(),
+	        .frames = frames.load(std::memory_order_relaxed),
+	        .intra_frames = intra_frames.load(std::memory_order_relaxed),
+	        .failed_frames = failed_frames.load(std::memory_order_relaxed),
+	        .skipped_frames = skipped_frames.load(std::memory_order_relaxed),
+	        .bytes = bytes.load(std::memory_order_relaxed),
+	        .submit = submit.read(),
+	        .encode = encode.read(),
+	        .device = device.read(),
+	        .readback = readback.read(),
+	        .total = total.read(),
+	};
+}
+
+double encode_telemetry::bitrate(const snapshot & before, const snapshot & after)
+{
+	std::chrono::duration<double> elapsed = after.time - before.time;
+	if (elapsed.count() <= 0)
+		return 0;
+	return 8. * (after.bytes - before.bytes) / elapsed.count();
+}
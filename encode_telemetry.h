@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Per-frame timings and counters of an encoder, aggregated into histograms
+// that a monitoring thread can read while frames are encoded. Does not
+// depend on Vulkan.
+
+// Latency histogram with buckets of bounded relative size: values below
+// 2^sub_bits have their own bucket, each following power of two is split
+// in 2^sub_bits buckets, so a bucket spans at most 1/16 of its values.
+// Recording is lock-free, reads are consistent per bucket only.
+class latency_histogram
+{
+public:
+	static constexpr int sub_bits = 4;
+	// larger values go in the last bucket, 2^40 ns is about 18 minutes
+	static constexpr int max_bits = 40;
+	static constexpr size_t bucket_count = size_t(max_bits - sub_bits + 1) << sub_bits;
+
+	static size_t bucket(uint64_t value);
+	// smallest and largest values of a bucket
+	static uint64_t bucket_min(size_t bucket);
+	static uint64_t bucket_max(size_t bucket);
+
+	struct snapshot
+	{
+		std::vector<uint64_t> counts;
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		uint64_t max = 0;
+
+		// Upper bound of the value below which fraction p of the values are,
+		// p between 0 and 1, 0 if there are no values
+		uint64_t percentile(double p) const;
+		double mean() const
+		{
+			return count ? double(sum) / count : 0;
+		}
+	};
+
+	void record(uint64_t value);
+	void record(std::chrono::nanoseconds value)
+	{
+		record(uint64_t(std::max<std::chrono::nanoseconds::rep>(value.count(), 0)));
+	}
+	snapshot read() const;
+
+private:
+	std::array<std::atomic<uint64_t>, bucket_count> counts = {};
+	std::atomic<uint64_t> count = 0;
+	std::atomic<uint64_t> sum = 0;
+	std::atomic<uint64_t> max = 0;
+};
+
+class encode_telemetry
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	// What happened to one frame, from submit_frame to its retirement
+	struct frame_record
+	{
+		uint64_t ticket = 0;
+		bool intra = false;
+		bool idr = false;
+		// DPB slot of the reconstructed picture, and number of references
+		int32_t setup_slot = -1;
+		uint32_t references = 0;
+
+		// host times: submit_frame called and returned, encode observed
+		// complete by poll_frame or wait_frame, encoded data returned
+		clock::time_point submit{};
+		clock::time_point submitted{};
+		clock::time_point completed{};
+		clock::time_point retired{};
+		// execution time on the encode queue, from timestamp queries, if
+		// the queue supports them
+		std::optional<std::chrono::nanoseconds> device_time = std::nullopt;
+
+		uint32_t bytes = 0;
+		// VkQueryResultStatusKHR of the feedback query, 1 when complete,
+		// negative on failure, 0 if the result could not be read
+		int32_t status = 1;
+		bool failed() const
+		{
+			return status <= 0;
+		}
+	};
+
+	struct snapshot
+	{
+		clock::time_point time;
+		uint64_t frames = 0;
+		uint64_t intra_frames = 0;
+		uint64_t failed_frames = 0;
+		// not encoded because the input did not change, not in frames
+		uint64_t skipped_frames = 0;
+		uint64_t bytes = 0;
+
+		// host time in submit_frame
+		latency_histogram::snapshot submit;
+		// from the end of submit_frame to completion: queueing on the
+		// encode queue and execution
+		latency_histogram::snapshot encode;
+		// execution only, empty if timestamps are not supported
+		latency_histogram::snapshot device;
+		// from completion to retirement: how long the frame waited for
+		// poll_frame or wait_frame, and the readback
+		latency_histogram::snapshot readback;
+		// from submit_frame to retirement
+		latency_histogram::snapshot total;
+	};
+
+	// Called by the encoder when a frame is retired
+	void add(const frame_record &);
+	// Called by the encoder when a frame is skipped
+	void add_skipped();
+	snapshot read() const;
+
+	// Average bitrate in bits per second between two snapshots of the same
+	// stream, 0 if no time elapsed
+	static double bitrate(const snapshot & before, const snapshot & after);
+
+private:
+	std::atomic<uint64_t> frames = 0;
+	std::atomic<uint64_t> intra_frames = 0;
+	std::atomic<uint64_t> failed_frames = 0;
+	std::atomic<uint64_t> skipped_frames = 0;
+	std::atomic<uint64_t> bytes = 0;
+
+	latency_histogram submit;
+	latency_histogram encode;
+	latency_histogram device;
+	latency_histogram readback;
+	latency_histogram total;
+};
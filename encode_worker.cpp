@@ -0,0 +1,272 @@
+#include "encode_worker.h"
+
+#include <array>
+#include <iostream>
+
+namespace
+{
+vk::Semaphore create_timeline(vk::Device device)
+{
+	vk::StructureChain timeline_create{
+	        vk::SemaphoreCreateInfo{},
+	        vk::SemaphoreTypeCreateInfo{
+	                .semaphoreType = vk::SemaphoreType::eTimeline,
+	                .initialValue = 0,
+	        },
+	};
+	return device.createSemaphore(timeline_create.get());
+}
+} // namespace
+
+encode_worker::encode_worker(vk::Device device, video_encoder & encoder, size_t queue_size, backpressure policy, frame_callback on_frame) :
+        device(device),
+        encoder(encoder),
+        policy(policy),
+        on_frame(std::move(on_frame)),
+        frames(queue_size),
+        // every queued frame may be dropped, plus the one being pushed
+        dropped_semaphores(frames.capacity() + 1),
+        wake_semaphore(create_timeline(device)),
+        thread([this]() { run(); })
+{
+}
+
+encode_worker::~encode_worker()
+{
+	quit = true;
+	wake();
+	thread.join();
+	device.destroy(wake_semaphore);
+}
+
+void encode_worker::wake()
+{
+	// orders the queue updates before the load of sleeping, see sleep()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.exchange(false))
+		device.signalSemaphore({.semaphore = wake_semaphore, .value = wake_value.load()});
+}
+
+void encode_worker::sleep()
+{
+	uint64_t value = wake_value.load(std::memory_order_relaxed) + 1;
+	wake_value.store(value);
+	sleeping.store(true);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	// a producer that pushed before sleeping was set did not signal
+	bool idle = frames.size() == 0 and dropped_semaphores.size() == 0 and not quit;
+	try
+	{
+		if (idle)
+		{
+			std::array semaphores{wake_semaphore, encoder.encode_semaphore()};
+			std::array values{value, in_flight.empty() ? 0 : video_encoder::timeline_value(in_flight.front().ticket)};
+			(void)device.waitSemaphores(
+			        vk::SemaphoreWaitInfo{
+			                .flags = vk::SemaphoreWaitFlagBits::eAny,
+			                .semaphoreCount = in_flight.empty() ? 1u : 2u,
+			                .pSemaphores = semaphores.data(),
+			                .pValues = values.data(),
+			        },
+			        UINT64_MAX);
+		}
+
+		// The producer that cleared sleeping signals value, it must be
+		// reached before the next value is published
+		if (not sleeping.exchange(false))
+		{
+			(void)device.waitSemaphores(
+			        vk::SemaphoreWaitInfo{
+			                .semaphoreCount = 1,
+			                .pSemaphores = &wake_semaphore,
+			                .pValues = &value,
+			        },
+			        UINT64_MAX);
+		}
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "encode_worker: " << e.what() << std::endl;
+	}
+}
+
+void encode_worker::discard(std::span<const vk::Semaphore> semaphores)
+{
+	try
+	{
+		encoder.discard_wait_semaphores(semaphores);
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "encode_worker: " << e.what() << std::endl;
+	}
+}
+
+void encode_worker::discard_dropped()
+{
+	std::vector<vk::Semaphore> semaphores;
+	vk::Semaphore semaphore;
+	while (dropped_semaphores.try_pop(semaphore))
+		semaphores.push_back(semaphore);
+	if (not semaphores.empty())
+		discard(semaphores);
+}
+
+void encode_worker::drop(const frame & f, bool on_worker)
+{
+	++dropped;
+	encoder.release_input_image(f.input);
+	// later timeline waits cover the value of the dropped frame
+	if (not f.wait_semaphore or f.wait_value != 0)
+		return;
+
+	// only producers go through the queue, which the worker drains
+	if (on_worker)
+	{
+		discard({&f.wait_semaphore, 1});
+		return;
+	}
+
+	// The worker drains this queue faster than frames can be dropped, only
+	// spin if it is extremely late
+	while (not dropped_semaphores.try_push(f.wait_semaphore))
+		std::this_thread::yield();
+	wake();
+}
+
+bool encode_worker::push(const frame & f)
+{
+	entry e{
+	        .f = f,
+	        .pushed = clock::now(),
+	};
+
+	while (true)
+	{
+		// a pop after this load makes the wait below return immediately
+		uint64_t popped = pop_count.load();
+		if (frames.try_push(e))
+			break;
+
+		switch (policy)
+		{
+			case backpressure::block:
+				pop_count.wait(popped);
+				break;
+			case backpressure::drop_oldest: {
+				entry oldest;
+				if (frames.try_pop(oldest))
+					drop(oldest.f, false);
+				break;
+			}
+			case backpressure::drop_newest:
+				drop(f, false);
+				return false;
+		}
+	}
+
+	++pushed;
+	wake();
+	return true;
+}
+
+void encode_worker::submit(const entry & e)
+{
+	auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - e.pushed).count();
+	handoff_total_ns += latency;
+	uint64_t max = handoff_max_ns.load(std::memory_order_relaxed);
+	while (uint64_t(latency) > max and not handoff_max_ns.compare_exchange_weak(max, latency))
+	{
+	}
+
+	try
+	{
+		// Make room by retiring the oldest frame
+		if (encoder.frames_pending() == encoder.max_frames_in_flight())
+			retire(UINT64_MAX);
+
+		uint64_t ticket = encoder.submit_frame(e.f.input, e.f.wait_semaphore, e.f.wait_value, e.f.src_queue);
+		in_flight.push_back({.f = e.f, .ticket = ticket});
+	}
+	catch (std::exception & ex)
+	{
+		std::cerr << "encode_worker: " << ex.what() << std::endl;
+		drop(e.f, true);
+	}
+}
+
+bool encode_worker::retire(uint64_t timeout)
+{
+	if (in_flight.empty())
+		return false;
+
+	try
+	{
+		auto encoded_frame = encoder.poll_frame(timeout);
+		if (not encoded_frame)
+			return false;
+
+		frame f = in_flight.front().f;
+		in_flight.pop_front();
+		++encoded;
+		if (on_frame)
+			on_frame(f, std::move(*encoded_frame));
+		return true;
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "encode_worker: " << e.what() << std::endl;
+		return false;
+	}
+}
+
+void encode_worker::run()
+{
+	while (true)
+	{
+		discard_dropped();
+
+		entry e;
+		bool submitted = false;
+		while (frames.try_pop(e))
+		{
+			++pop_count;
+			pop_count.notify_all();
+			submit(e);
+			submitted = true;
+			// producers dropping frames meanwhile wait for room in the queue
+			discard_dropped();
+		}
+
+		while (retire(0))
+		{
+		}
+
+		if (submitted)
+			continue;
+
+		if (quit)
+		{
+			while (retire(UINT64_MAX))
+			{
+			}
+			return;
+		}
+
+		sleep();
+	}
+}
+
+encode_worker::metrics encode_worker::get_metrics() const
+{
+	uint64_t popped = pop_count.load();
+	return {
+	        .queue_depth = frames.size(),
+	        .pushed = pushed.load(),
+	        .dropped = dropped.load(),
+	        .encoded = encoded.load(),
+	        .handoff_latency_avg = std::chrono::nanoseconds(popped ? handoff_total_ns.load() / popped : 0),
+	        .handoff_latency_max = std::chrono::nanoseconds(handoff_max_ns.load()),
+	};
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <span>
+#include <thread>
+
+#include <vulkan/vulkan.hpp>
+
+#include "bounded_queue.h"
+#include "video_encoder.h"
+
+// Runs submission and readback of an encoder on a dedicated thread.
+// Producers hand frames over through a lock-free bounded queue, and never
+// wait on the encoder unless the backpressure policy is block. The idle
+// worker sleeps until the oldest frame in flight is encoded or a producer
+// signals its wake semaphore, it never polls.
+class encode_worker
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	struct frame
+	{
+		// acquired from the encoder, given back to its pool when the frame is
+		// submitted or dropped
+		video_encoder::input_image input;
+		// signaled by the producer when the input image is ready
+		vk::Semaphore wait_semaphore;
+		// 0 for a binary semaphore, timeline value to wait for otherwise
+		uint64_t wait_value = 0;
+		uint32_t src_queue;
+		clock::time_point timestamp;
+	};
+
+	// What to do when a frame is pushed while the queue is full
+	enum class backpressure
+	{
+		// wait until the worker makes room
+		block,
+		// discard the oldest queued frame
+		drop_oldest,
+		// discard the pushed frame
+		drop_newest,
+	};
+
+	struct metrics
+	{
+		size_t queue_depth;
+		uint64_t pushed;
+		uint64_t dropped;
+		uint64_t encoded;
+		// time between push and the worker picking the frame up
+		std::chrono::nanoseconds handoff_latency_avg;
+		std::chrono::nanoseconds handoff_latency_max;
+	};
+
+	// Called on the worker thread, in submission order
+	using frame_callback = std::function<void(const frame &, video_encoder::encoded_frame)>;
+
+private:
+	struct entry
+	{
+		frame f;
+		clock::time_point pushed;
+	};
+
+	struct pending_frame
+	{
+		frame f;
+		uint64_t ticket;
+	};
+
+	vk::Device device;
+	video_encoder & encoder;
+	const backpressure policy;
+	frame_callback on_frame;
+
+	bounded_queue<entry> frames;
+	// binary wait semaphores of dropped frames, to be unsignaled by the worker
+	bounded_queue<vk::Semaphore> dropped_semaphores;
+
+	// Host timeline semaphore the worker waits on with the encoder's. Before
+	// sleeping it publishes the next value and sets sleeping, the producer
+	// that clears sleeping signals that value, so signals always increase.
+	vk::Semaphore wake_semaphore;
+	std::atomic<uint64_t> wake_value = 0;
+	std::atomic<bool> sleeping = false;
+
+	// incremented on each pop to wake up producers, for use with
+	// std::atomic::wait
+	std::atomic<uint64_t> pop_count = 0;
+
+	std::atomic<uint64_t> pushed = 0;
+	std::atomic<uint64_t> dropped = 0;
+	std::atomic<uint64_t> encoded = 0;
+	std::atomic<uint64_t> handoff_total_ns = 0;
+	std::atomic<uint64_t> handoff_max_ns = 0;
+
+	// frames submitted to the encoder, not retired yet
+	std::deque<pending_frame> in_flight;
+
+	std::atomic<bool> quit = false;
+	// last member, started once everything else is initialised
+	std::thread thread;
+
+	void run();
+	void wake();
+	void sleep();
+	void discard(std::span<const vk::Semaphore>);
+	// semaphores of frames dropped by producers
+	void discard_dropped();
+	// on_worker: called by the worker thread, which must not wait for room
+	// in dropped_semaphores
+	void drop(const frame &, bool on_worker);
+	void submit(const entry &);
+	bool retire(uint64_t timeout);
+
+public:
+	encode_worker(vk::Device device, video_encoder & encoder, size_t queue_size, backpressure policy, frame_callback on_frame);
+	encode_worker(const encode_worker &) = delete;
+	// Encodes the frames that are still queued before returning
+	~encode_worker();
+
+	// Returns false if the frame was dropped. Can be called from several threads.
+	bool push(const frame &);
+
+	metrics get_metrics() const;
+};
@@ -0,0 +1,417 @@
+#include "fmp4_muxer.h"
+
+#include <iostream>
+#include <stdexcept>
+
+#include "nal_utils.h"
+
+namespace
+{
+const uint8_t nal_type_idr = 5;
+const uint8_t nal_type_sps = 7;
+const uint8_t nal_type_pps = 8;
+
+// sample_depends_on 2: does not depend on others
+const uint32_t sync_sample_flags = 0x02000000;
+// sample_depends_on 1, sample_is_non_sync_sample
+const uint32_t non_sync_sample_flags = 0x01010000;
+
+// Appends ISO BMFF boxes to a buffer, sizes are patched when boxes are closed
+class box_writer
+{
+	std::vector<uint8_t> & out;
+	std::vector<size_t> open_boxes;
+
+public:
+	box_writer(std::vector<uint8_t> & out) :
+	        out(out) {}
+
+	void u8(uint8_t value)
+	{
+		out.push_back(value);
+	}
+	void u16(uint16_t value)
+	{
+		u8(value >> 8);
+		u8(value);
+	}
+	void u24(uint32_t value)
+	{
+		u8(value >> 16);
+		u16(value);
+	}
+	void u32(uint32_t value)
+	{
+		u16(value >> 16);
+		u16(value);
+	}
+	void u64(uint64_t value)
+	{
+		u32(value >> 32);
+		u32(value);
+	}
+	void fourcc(const char * type)
+	{
+		out.insert(out.end(), type, type + 4);
+	}
+	void bytes(std::span<const uint8_t> data)
+	{
+		out.insert(out.end(), data.begin(), data.end());
+	}
+	void zeros(size_t count)
+	{
+		out.insert(out.end(), count, 0);
+	}
+	void matrix()
+	{
+		for (uint32_t value: {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000})
+			u32(value);
+	}
+
+	void begin(const char * type)
+	{
+		open_boxes.push_back(out.size());
+		u32(0);
+		fourcc(type);
+	}
+	void begin_full(const char * type, uint8_t version, uint32_t flags)
+	{
+		begin(type);
+		u8(version);
+		u24(flags);
+	}
+	void end()
+	{
+		size_t start = open_boxes.back();
+		open_boxes.pop_back();
+		patch_u32(start, out.size() - start);
+	}
+
+	size_t position() const
+	{
+		return out.size();
+	}
+	void patch_u32(size_t position, uint32_t value)
+	{
+		out[position] = value >> 24;
+		out[position + 1] = value >> 16;
+		out[position + 2] = value >> 8;
+		out[position + 3] = value;
+	}
+};
+} // namespace
+
+fmp4_muxer::fmp4_muxer(const config & cfg, std::span<const uint8_t> sps_pps, write_callback write) :
+        cfg(cfg), write(std::move(write))
+{
+	std::span<const uint8_t> sps;
+	std::span<const uint8_t> pps;
+	for_each_nal_unit(sps_pps, [&](std::span<const uint8_t> nal) {
+		switch (nal[0] & 0x1f)
+		{
+			case nal_type_sps:
+				sps = nal;
+				break;
+			case nal_type_pps:
+				pps = nal;
+				break;
+		}
+	});
+	if (sps.size() < 4 or pps.empty())
+		throw std::invalid_argument("fmp4_muxer: missing SPS or PPS");
+
+	write_init_segment(sps, pps);
+}
+
+fmp4_muxer::~fmp4_muxer()
+{
+	try
+	{
+		flush();
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "~fmp4_muxer: " << e.what() << std::endl;
+	}
+}
+
+void fmp4_muxer::write_init_segment(std::span<const uint8_t> sps, std::span<const uint8_t> pps)
+{
+	header.clear();
+	box_writer w(header);
+
+	w.begin("ftyp");
+	w.fourcc("iso6"); // major brand
+	w.u32(0);         // minor version
+	for (auto brand: {"iso6", "cmfc", "avc1", "mp41"})
+		w.fourcc(brand);
+	w.end();
+
+	w.begin("moov");
+	{
+		w.begin_full("mvhd", 0, 0);
+		w.u32(0); // creation time
+		w.u32(0); // modification time
+		w.u32(cfg.timescale);
+		w.u32(0);          // duration, given by fragments
+		w.u32(0x00010000); // rate
+		w.u16(0x0100);     // volume
+		w.zeros(10);
+		w.matrix();
+		w.zeros(24);
+		w.u32(2); // next track ID
+		w.end();
+
+		w.begin("trak");
+		{
+			w.begin_full("tkhd", 0, 0x3); // enabled, in movie
+			w.u32(0);                     // creation time
+			w.u32(0);                     // modification time
+			w.u32(1);                     // track ID
+			w.u32(0);
+			w.u32(0); // duration
+			w.zeros(8);
+			w.u16(0); // layer
+			w.u16(0); // alternate group
+			w.u16(0); // volume
+			w.u16(0);
+			w.matrix();
+			w.u32(cfg.width << 16);
+			w.u32(cfg.height << 16);
+			w.end();
+
+			w.begin("mdia");
+			{
+				w.begin_full("mdhd", 0, 0);
+				w.u32(0); // creation time
+				w.u32(0); // modification time
+				w.u32(cfg.timescale);
+				w.u32(0);      // duration
+				w.u16(0x55c4); // language: und
+				w.u16(0);
+				w.end();
+
+				w.begin_full("hdlr", 0, 0);
+				w.u32(0);
+				w.fourcc("vide");
+				w.zeros(12);
+				w.bytes(std::span((const uint8_t *)"VideoHandler", 13));
+				w.end();
+
+				w.begin("minf");
+				{
+					w.begin_full("vmhd", 0, 1);
+					w.zeros(8); // graphics mode, opcolor
+					w.end();
+
+					w.begin("dinf");
+					w.begin_full("dref", 0, 0);
+					w.u32(1);
+					w.begin_full("url ", 0, 1); // data in the same file
+					w.end();
+					w.end();
+					w.end();
+
+					w.begin("stbl");
+					{
+						w.begin_full("stsd", 0, 0);
+						w.u32(1);
+						w.begin("avc1");
+						w.zeros(6);
+						w.u16(1); // data reference index
+						w.zeros(16);
+						w.u16(cfg.width);
+						w.u16(cfg.height);
+						w.u32(0x00480000); // 72 dpi
+						w.u32(0x00480000);
+						w.u32(0);
+						w.u16(1); // frame count
+						w.zeros(32);
+						w.u16(0x0018); // depth
+						w.u16(0xffff);
+
+						w.begin("avcC");
+						w.u8(1);
+						w.u8(sps[1]); // profile
+						w.u8(sps[2]); // constraint flags
+						w.u8(sps[3]); // level
+						w.u8(0xff);   // 4 bytes NAL unit lengths
+						w.u8(0xe1);   // 1 SPS
+						w.u16(sps.size());
+						w.bytes(sps);
+						w.u8(1);
+						w.u16(pps.size());
+						w.bytes(pps);
+						if (sps[1] == 100 or sps[1] == 110 or sps[1] == 122 or sps[1] == 144)
+						{
+							// encoder input is always 8 bits 4:2:0
+							w.u8(0xfc | 1);
+							w.u8(0xf8);
+							w.u8(0xf8);
+							w.u8(0);
+						}
+						w.end();
+
+						w.end(); // avc1
+						w.end(); // stsd
+
+						// samples are described in fragments
+						for (auto type: {"stts", "stsc", "stco"})
+						{
+							w.begin_full(type, 0, 0);
+							w.u32(0);
+							w.end();
+						}
+						w.begin_full("stsz", 0, 0);
+						w.u32(0);
+						w.u32(0);
+						w.end();
+					}
+					w.end(); // stbl
+				}
+				w.end(); // minf
+			}
+			w.end(); // mdia
+		}
+		w.end(); // trak
+
+		w.begin("mvex");
+		w.begin_full("trex", 0, 0);
+		w.u32(1); // track ID
+		w.u32(1); // sample description index
+		w.u32(0); // duration
+		w.u32(0); // size
+		w.u32(0); // flags
+		w.end();
+		w.end();
+	}
+	w.end(); // moov
+
+	iovec v{header.data(), header.size()};
+	write(std::span(&v, 1));
+}
+
+void fmp4_muxer::add_frame(std::span<const uint8_t> data, std::shared_ptr<const void> owner, uint64_t timestamp)
+{
+	sample s{
+	        .nal_units = {},
+	        .owner = std::move(owner),
+	        .timestamp = timestamp,
+	        .size = 0,
+	        .keyframe = false,
+	};
+	for_each_nal_unit(data, [&](std::span<const uint8_t> nal) {
+		s.nal_units.push_back(nal);
+		s.size += 4 + nal.size();
+		if ((nal[0] & 0x1f) == nal_type_idr)
+			s.keyframe = true;
+	});
+	if (s.nal_units.empty())
+		return;
+
+	if (first_frame)
+	{
+		first_timestamp = timestamp;
+		first_frame = false;
+	}
+
+	if (not samples.empty() and timestamp - samples.front().timestamp >= cfg.fragment_duration)
+		write_fragment(timestamp);
+
+	samples.push_back(std::move(s));
+}
+
+void fmp4_muxer::flush()
+{
+	if (samples.empty())
+		return;
+
+	uint64_t duration = last_duration;
+	if (samples.size() > 1)
+		duration = samples.back().timestamp - samples[samples.size() - 2].timestamp;
+	if (duration == 0)
+		duration = 1;
+	write_fragment(samples.back().timestamp + duration);
+}
+
+void fmp4_muxer::write_fragment(uint64_t end_timestamp)
+{
+	header.clear();
+	box_writer w(header);
+
+	size_t data_offset;
+	size_t nal_unit_count = 0;
+	uint64_t payload_size = 0;
+
+	w.begin("moof");
+	{
+		w.begin_full("mfhd", 0, 0);
+		w.u32(sequence_number++);
+		w.end();
+
+		w.begin("traf");
+		{
+			w.begin_full("tfhd", 0, 0x020000); // default base is moof
+			w.u32(1);
+			w.end();
+
+			w.begin_full("tfdt", 1, 0);
+			w.u64(samples.front().timestamp - first_timestamp);
+			w.end();
+
+			// data offset, sample duration, size and flags
+			w.begin_full("trun", 0, 0x000701);
+			w.u32(samples.size());
+			data_offset = w.position();
+			w.u32(0);
+			for (size_t i = 0; i < samples.size(); ++i)
+			{
+				const auto & s = samples[i];
+				uint64_t next = i + 1 < samples.size() ? samples[i + 1].timestamp : end_timestamp;
+				last_duration = next - s.timestamp;
+				w.u32(last_duration);
+				w.u32(s.size);
+				w.u32(s.keyframe ? sync_sample_flags : non_sync_sample_flags);
+
+				nal_unit_count += s.nal_units.size();
+				payload_size += s.size;
+			}
+			w.end();
+		}
+		w.end(); // traf
+	}
+	w.end(); // moof
+
+	if (payload_size + 8 > UINT32_MAX)
+		throw std::runtime_error("fmp4_muxer: fragment too large");
+
+	// samples start right after the mdat header
+	w.patch_u32(data_offset, header.size() + 8);
+	w.u32(payload_size + 8);
+	w.fourcc("mdat");
+
+	// All prefixes are written before iov points into the buffer
+	prefixes.clear();
+	box_writer prefix_writer(prefixes);
+	for (const auto & s: samples)
+	{
+		for (auto nal: s.nal_units)
+			prefix_writer.u32(nal.size());
+	}
+
+	iov.clear();
+	iov.push_back({header.data(), header.size()});
+	uint8_t * prefix = prefixes.data();
+	for (const auto & s: samples)
+	{
+		for (auto nal: s.nal_units)
+		{
+			iov.push_back({prefix, 4});
+			iov.push_back({const_cast<uint8_t *>(nal.data()), nal.size()});
+			prefix += 4;
+		}
+	}
+
+	write(iov);
+	samples.clear();
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <sys/uio.h>
+
+// Streaming fragmented MP4 (CMAF) writer for a single H.264 track.
+// The initialisation segment (ftyp, moov) is written on construction, then
+// each fragment (moof, mdat) once its duration is reached. Output is only
+// ever appended, and only the frames of the current fragment are kept.
+//
+// Frame data is not copied: length prefixes replace the start codes as
+// separate entries in the gather list, pointing into the frames.
+class fmp4_muxer
+{
+public:
+	struct config
+	{
+		uint32_t width;
+		uint32_t height;
+		// units per second of timestamps
+		uint32_t timescale = 90000;
+		// a fragment is written once it holds at least this duration, in
+		// timescale units. Frames of the fragment keep their output regions
+		// reserved, the encoder output buffer must be large enough.
+		uint64_t fragment_duration = 45000;
+	};
+
+	// Receives the output, the iovecs are valid until it returns
+	using write_callback = std::function<void(std::span<const iovec>)>;
+
+private:
+	struct sample
+	{
+		// NAL units, in the frame data
+		std::vector<std::span<const uint8_t>> nal_units;
+		// keeps the frame data alive until the fragment is written
+		std::shared_ptr<const void> owner;
+		uint64_t timestamp;
+		uint32_t size;
+		bool keyframe;
+	};
+
+	config cfg;
+	write_callback write;
+
+	uint32_t sequence_number = 1;
+	bool first_frame = true;
+	uint64_t first_timestamp = 0;
+	uint32_t last_duration = 0;
+	std::vector<sample> samples;
+
+	// storage for box headers and length prefixes of the fragment being written
+	std::vector<uint8_t> header;
+	std::vector<uint8_t> prefixes;
+	std::vector<iovec> iov;
+
+	void write_init_segment(std::span<const uint8_t> sps, std::span<const uint8_t> pps);
+	void write_fragment(uint64_t end_timestamp);
+
+public:
+	// sps_pps as returned by video_encoder_h264::get_sps_pps
+	fmp4_muxer(const config &, std::span<const uint8_t> sps_pps, write_callback write);
+	fmp4_muxer(const fmp4_muxer &) = delete;
+	// Writes the pending fragment
+	~fmp4_muxer();
+
+	// Add an Annex B access unit, IDR frames are marked as sync samples.
+	// owner keeps data alive, for instance bitstream_ring::region::owner().
+	// Timestamps must increase.
+	void add_frame(std::span<const uint8_t> data, std::shared_ptr<const void> owner, uint64_t timestamp);
+
+	// Write the pending fragment now, the duration of its last frame is
+	// guessed from the previous one
+	void flush();
+};
@@ -0,0 +1,312 @@
+#include "h264_parameter_sets.h"
+
+#include "bit_writer.h"
+#include "nal_utils.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace
+{
+std::vector<uint8_t> make_nal_unit(uint8_t nal_ref_idc, uint8_t nal_unit_type, const bit_writer & rbsp)
+{
+	const auto & payload = rbsp.data();
+	std::vector<uint8_t> nal{0, 0, 0, 1, uint8_t((nal_ref_idc << 5) | nal_unit_type)};
+	size_t header_size = nal.size();
+	nal.resize(header_size + max_escaped_size(payload.size()));
+	nal.resize(header_size + add_emulation_prevention(payload, nal.data() + header_size));
+	return nal;
+}
+
+// profile_idc values with chroma_format_idc and bit depths in the SPS
+bool has_chroma_info(int profile_idc)
+{
+	switch (profile_idc)
+	{
+		case 100:
+		case 110:
+		case 122:
+		case 244:
+		case 44:
+		case 83:
+		case 86:
+		case 118:
+		case 128:
+		case 138:
+		case 139:
+		case 134:
+		case 135:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// StdVideoH264LevelIdc enumerates the levels, level_idc is 10 times the
+// level number
+uint8_t level_idc(StdVideoH264LevelIdc level)
+{
+	static const uint8_t values[] = {10, 11, 12, 13, 20, 21, 22, 30, 31, 32, 40, 41, 42, 50, 51, 52, 60, 61, 62};
+	if (size_t(level) >= std::size(values))
+		throw std::invalid_argument("write_h264_sps: invalid level");
+	return values[level];
+}
+
+void write_hrd_parameters(bit_writer & w, const StdVideoH264HrdParameters & hrd)
+{
+	if (hrd.cpb_cnt_minus1 >= STD_VIDEO_H264_CPB_CNT_LIST_SIZE)
+		throw std::invalid_argument("write_h264_sps: invalid cpb_cnt_minus1");
+
+	w.write_ue(hrd.cpb_cnt_minus1);
+	w.write_bits(hrd.bit_rate_scale, 4);
+	w.write_bits(hrd.cpb_size_scale, 4);
+	for (uint32_t i = 0; i <= hrd.cpb_cnt_minus1; ++i)
+	{
+		w.write_ue(hrd.bit_rate_value_minus1[i]);
+		w.write_ue(hrd.cpb_size_value_minus1[i]);
+		w.write_flag(hrd.cbr_flag[i]);
+	}
+	w.write_bits(hrd.initial_cpb_removal_delay_length_minus1, 5);
+	w.write_bits(hrd.cpb_removal_delay_length_minus1, 5);
+	w.write_bits(hrd.dpb_output_delay_length_minus1, 5);
+	w.write_bits(hrd.time_offset_length, 5);
+}
+
+// E.1.1
+void write_vui(bit_writer & w, const StdVideoH264SequenceParameterSetVui & vui)
+{
+	const auto & f = vui.flags;
+
+	w.write_flag(f.aspect_ratio_info_present_flag);
+	if (f.aspect_ratio_info_present_flag)
+	{
+		w.write_bits(vui.aspect_ratio_idc, 8);
+		if (vui.aspect_ratio_idc == STD_VIDEO_H264_ASPECT_RATIO_IDC_EXTENDED_SAR)
+		{
+			w.write_bits(vui.sar_width, 16);
+			w.write_bits(vui.sar_height, 16);
+		}
+	}
+
+	w.write_flag(f.overscan_info_present_flag);
+	if (f.overscan_info_present_flag)
+		w.write_flag(f.overscan_appropriate_flag);
+
+	w.write_flag(f.video_signal_type_present_flag);
+	if (f.video_signal_type_present_flag)
+	{
+		w.write_bits(vui.video_format, 3);
+		w.write_flag(f.video_full_range_flag);
+		w.write_flag(f.color_description_present_flag);
+		if (f.color_description_present_flag)
+		{
+			w.write_bits(vui.colour_primaries, 8);
+			w.write_bits(vui.transfer_characteristics, 8);
+			w.write_bits(vui.matrix_coefficients, 8);
+		}
+	}
+
+	w.write_flag(f.chroma_loc_info_present_flag);
+	if (f.chroma_loc_info_present_flag)
+	{
+		w.write_ue(vui.chroma_sample_loc_type_top_field);
+		w.write_ue(vui.chroma_sample_loc_type_bottom_field);
+	}
+
+	w.write_flag(f.timing_info_present_flag);
+	if (f.timing_info_present_flag)
+	{
+		w.write_bits(vui.num_units_in_tick, 32);
+		w.write_bits(vui.time_scale, 32);
+		w.write_flag(f.fixed_frame_rate_flag);
+	}
+
+	// Both HRDs use the same parameters, the structure only has one
+	bool hrd = f.nal_hrd_parameters_present_flag or f.vcl_hrd_parameters_present_flag;
+	if (hrd and not vui.pHrdParameters)
+		throw std::invalid_argument("write_h264_sps: missing HRD parameters");
+	w.write_flag(f.nal_hrd_parameters_present_flag);
+	if (f.nal_hrd_parameters_present_flag)
+		write_hrd_parameters(w, *vui.pHrdParameters);
+	w.write_flag(f.vcl_hrd_parameters_present_flag);
+	if (f.vcl_hrd_parameters_present_flag)
+		write_hrd_parameters(w, *vui.pHrdParameters);
+	if (hrd)
+		w.write_flag(false); // low_delay_hrd_flag
+
+	w.write_flag(false); // pic_struct_present_flag
+
+	w.write_flag(f.bitstream_restriction_flag);
+	if (f.bitstream_restriction_flag)
+	{
+		w.write_flag(true); // motion_vectors_over_pic_boundaries_flag
+		w.write_ue(0);      // max_bytes_per_pic_denom, no limit
+		w.write_ue(0);      // max_bits_per_mb_denom, no limit
+		w.write_ue(15);     // log2_max_mv_length_horizontal
+		w.write_ue(15);     // log2_max_mv_length_vertical
+		w.write_ue(vui.max_num_reorder_frames);
+		w.write_ue(vui.max_dec_frame_buffering);
+	}
+}
+} // namespace
+
+// 7.3.2.1.1
+std::vector<uint8_t> write_h264_sps(const StdVideoH264SequenceParameterSet & sps)
+{
+	const auto & f = sps.flags;
+	if (f.seq_scaling_matrix_present_flag)
+		throw std::invalid_argument("write_h264_sps: scaling matrices are not supported");
+	if (f.vui_parameters_present_flag and not sps.pSequenceParameterSetVui)
+		throw std::invalid_argument("write_h264_sps: missing VUI");
+	if (sps.pic_order_cnt_type == STD_VIDEO_H264_POC_TYPE_1 and
+	    sps.num_ref_frames_in_pic_order_cnt_cycle > 0 and not sps.pOffsetForRefFrame)
+		throw std::invalid_argument("write_h264_sps: missing offset_for_ref_frame");
+
+	bit_writer w;
+	w.write_bits(sps.profile_idc, 8);
+	w.write_flag(f.constraint_set0_flag);
+	w.write_flag(f.constraint_set1_flag);
+	w.write_flag(f.constraint_set2_flag);
+	w.write_flag(f.constraint_set3_flag);
+	w.write_flag(f.constraint_set4_flag);
+	w.write_flag(f.constraint_set5_flag);
+	w.write_bits(0, 2); // reserved_zero_2bits
+	w.write_bits(level_idc(sps.level_idc), 8);
+	w.write_ue(sps.seq_parameter_set_id);
+
+	if (has_chroma_info(sps.profile_idc))
+	{
+		w.write_ue(sps.chroma_format_idc);
+		if (sps.chroma_format_idc == STD_VIDEO_H264_CHROMA_FORMAT_IDC_444)
+			w.write_flag(f.separate_colour_plane_flag);
+		w.write_ue(sps.bit_depth_luma_minus8);
+		w.write_ue(sps.bit_depth_chroma_minus8);
+		w.write_flag(f.qpprime_y_zero_transform_bypass_flag);
+		w.write_flag(false); // seq_scaling_matrix_present_flag
+	}
+
+	w.write_ue(sps.log2_max_frame_num_minus4);
+	w.write_ue(sps.pic_order_cnt_type);
+	if (sps.pic_order_cnt_type == STD_VIDEO_H264_POC_TYPE_0)
+	{
+		w.write_ue(sps.log2_max_pic_order_cnt_lsb_minus4);
+	}
+	else if (sps.pic_order_cnt_type == STD_VIDEO_H264_POC_TYPE_1)
+	{
+		w.write_flag(f.delta_pic_order_always_zero_flag);
+		w.write_se(sps.offset_for_non_ref_pic);
+		w.write_se(sps.offset_for_top_to_bottom_field);
+		w.write_ue(sps.num_ref_frames_in_pic_order_cnt_cycle);
+		for (uint32_t i = 0; i < sps.num_ref_frames_in_pic_order_cnt_cycle; ++i)
+			w.write_se(sps.pOffsetForRefFrame[i]);
+	}
+
+	w.write_ue(sps.max_num_ref_frames);
+	w.write_flag(f.gaps_in_frame_num_value_allowed_flag);
+	w.write_ue(sps.pic_width_in_mbs_minus1);
+	w.write_ue(sps.pic_height_in_map_units_minus1);
+	w.write_flag(f.frame_mbs_only_flag);
+	if (not f.frame_mbs_only_flag)
+		w.write_flag(f.mb_adaptive_frame_field_flag);
+	w.write_flag(f.direct_8x8_inference_flag);
+
+	w.write_flag(f.frame_cropping_flag);
+	if (f.frame_cropping_flag)
+	{
+		w.write_ue(sps.frame_crop_left_offset);
+		w.write_ue(sps.frame_crop_right_offset);
+		w.write_ue(sps.frame_crop_top_offset);
+		w.write_ue(sps.frame_crop_bottom_offset);
+	}
+
+	w.write_flag(f.vui_parameters_present_flag);
+	if (f.vui_parameters_present_flag)
+		write_vui(w, *sps.pSequenceParameterSetVui);
+
+	w.write_trailing_bits();
+	return make_nal_unit(3, 7, w);
+}
+
+// 7.3.2.2
+std::vector<uint8_t> write_h264_pps(const StdVideoH264PictureParameterSet & pps)
+{
+	const auto & f = pps.flags;
+	if (f.pic_scaling_matrix_present_flag)
+		throw std::invalid_argument("write_h264_pps: scaling matrices are not supported");
+
+	bit_writer w;
+	w.write_ue(pps.pic_parameter_set_id);
+	w.write_ue(pps.seq_parameter_set_id);
+	w.write_flag(f.entropy_coding_mode_flag);
+	w.write_flag(f.bottom_field_pic_order_in_frame_present_flag);
+	w.write_ue(0); // num_slice_groups_minus1
+	w.write_ue(pps.num_ref_idx_l0_default_active_minus1);
+	w.write_ue(pps.num_ref_idx_l1_default_active_minus1);
+	w.write_flag(f.weighted_pred_flag);
+	w.write_bits(pps.weighted_bipred_idc, 2);
+	w.write_se(pps.pic_init_qp_minus26);
+	w.write_se(pps.pic_init_qs_minus26);
+	w.write_se(pps.chroma_qp_index_offset);
+	w.write_flag(f.deblocking_filter_control_present_flag);
+	w.write_flag(f.constrained_intra_pred_flag);
+	w.write_flag(f.redundant_pic_cnt_present_flag);
+
+	// Only written when they differ from the values inferred when absent,
+	// decoders limited to the Main profile may not expect them
+	if (f.transform_8x8_mode_flag or pps.second_chroma_qp_index_offset != pps.chroma_qp_index_offset)
+	{
+		w.write_flag(f.transform_8x8_mode_flag);
+		w.write_flag(false); // pic_scaling_matrix_present_flag
+		w.write_se(pps.second_chroma_qp_index_offset);
+	}
+
+	w.write_trailing_bits();
+	return make_nal_unit(3, 8, w);
+}
+
+StdVideoH264SequenceParameterSetVui make_h264_low_latency_vui(const h264_vui_config & cfg)
+{
+	if (cfg.framerate_num == 0 or cfg.framerate_den == 0 or cfg.framerate_num > UINT32_MAX / 2)
+		throw std::invalid_argument("make_h264_low_latency_vui: invalid frame rate");
+
+	// Table E-3 to E-5
+	uint8_t colour = cfg.matrix == color_matrix::bt709 ? 1 // BT.709
+	                                                   : 6; // BT.601 525 lines, SMPTE 170M
+
+	return {
+	        .flags =
+	                {
+	                        .aspect_ratio_info_present_flag = 0,
+	                        .overscan_info_present_flag = 0,
+	                        .overscan_appropriate_flag = 0,
+	                        .video_signal_type_present_flag = 1,
+	                        .video_full_range_flag = cfg.range == color_range::full,
+	                        .color_description_present_flag = 1,
+	                        .chroma_loc_info_present_flag = 0,
+	                        .timing_info_present_flag = 1,
+	                        // frames are submitted when they are rendered
+	                        .fixed_frame_rate_flag = 0,
+	                        .bitstream_restriction_flag = 1,
+	                        .nal_hrd_parameters_present_flag = 0,
+	                        .vcl_hrd_parameters_present_flag = 0,
+	                },
+	        .aspect_ratio_idc = STD_VIDEO_H264_ASPECT_RATIO_IDC_UNSPECIFIED,
+	        .sar_width = 0,
+	        .sar_height = 0,
+	        .video_format = 5, // unspecified
+	        .colour_primaries = colour,
+	        .transfer_characteristics = colour,
+	        .matrix_coefficients = colour,
+	        // a tick is a field: 2 ticks per frame
+	        .num_units_in_tick = cfg.framerate_den,
+	        .time_scale = 2 * cfg.framerate_num,
+	        .max_num_reorder_frames = 0,
+	        // cannot be less than the number of references
+	        .max_dec_frame_buffering = uint8_t(std::max<uint32_t>(cfg.max_num_ref_frames, 1)),
+	        .chroma_sample_loc_type_top_field = 0,
+	        .chroma_sample_loc_type_bottom_field = 0,
+	        .reserved1 = 0,
+	        .pHrdParameters = nullptr,
+	};
+}
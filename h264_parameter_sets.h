@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <vk_video/vulkan_video_codec_h264std.h>
+
+#include "color_space.h"
+
+// Host writers for H.264 parameter sets, from the structures given to the
+// Vulkan implementation. Implementations write their own with
+// vkGetEncodedVideoSessionParametersKHR but may leave out the VUI.
+//
+// Both return a NAL unit with a 4 bytes start code and emulation
+// prevention. Scaling matrices are not supported.
+std::vector<uint8_t> write_h264_sps(const StdVideoH264SequenceParameterSet &);
+std::vector<uint8_t> write_h264_pps(const StdVideoH264PictureParameterSet &);
+
+struct h264_vui_config
+{
+	uint32_t framerate_num = 60;
+	uint32_t framerate_den = 1;
+	color_matrix matrix = color_matrix::bt709;
+	color_range range = color_range::limited;
+	// max_num_ref_frames of the SPS
+	uint32_t max_num_ref_frames = 1;
+};
+
+// VUI of a stream without frame reordering: frames can be output as soon
+// as they are decoded, so decoders do not need to buffer frames. Also
+// carries the frame rate and colour description.
+StdVideoH264SequenceParameterSetVui make_h264_low_latency_vui(const h264_vui_config &);
@@ -0,0 +1,144 @@
+#include "host_upload.h"
+
+#include <array>
+#include <stdexcept>
+
+namespace
+{
+vk::Result wait(vk::Device device, vk::Semaphore semaphore, uint64_t value)
+{
+	return device.waitSemaphores(
+	        vk::SemaphoreWaitInfo{
+	                .semaphoreCount = 1,
+	                .pSemaphores = &semaphore,
+	                .pValues = &value,
+	        },
+	        UINT64_MAX);
+}
+} // namespace
+
+host_upload::host_upload(vk::Device device,
+                         std::shared_ptr<mini_vma> allocator_,
+                         vk::Extent2D extent,
+                         uint32_t depth,
+                         const nv12_converter::config & cfg) :
+        device(device), allocator(std::move(allocator_)), extent(extent), converter(cfg)
+{
+	if (depth == 0)
+		throw std::invalid_argument("host_upload depth must be at least 1");
+
+	// tightly packed planes, offsets aligned for copies on any queue
+	const uint32_t chroma_width = (extent.width + 1) / 2;
+	const uint32_t chroma_height = (extent.height + 1) / 2;
+	cbcr_offset = align(extent.width * extent.height, 256);
+	const vk::DeviceSize slot_size = align(cbcr_offset + 2 * chroma_width * chroma_height, 256);
+
+	buffer = device.createBuffer({
+	        .size = slot_size * depth,
+	        .usage = vk::BufferUsageFlagBits::eTransferSrc,
+	        .sharingMode = vk::SharingMode::eExclusive,
+	});
+	// Only written by the host, sequentially: coherent memory avoids flushes
+	memory = allocator->bind(buffer, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+
+	for (uint32_t i = 0; i < depth; ++i)
+		slots.push_back({.offset = i * slot_size});
+}
+
+host_upload::~host_upload()
+{
+	// wait for pending copies
+	for (auto & s: slots)
+	{
+		if (s.semaphore)
+			(void)wait(device, s.semaphore, s.value);
+	}
+	device.destroy(buffer);
+	allocator->free(memory);
+}
+
+void host_upload::upload(vk::CommandBuffer cmd_buf,
+                         const host_frame & frame,
+                         vk::Image destination,
+                         uint32_t src_family,
+                         uint32_t dst_family,
+                         vk::Semaphore done,
+                         uint64_t done_value)
+{
+	if (frame.width != extent.width or frame.height != extent.height)
+		throw std::invalid_argument("host frame size does not match the upload extent");
+
+	auto & s = slots[next];
+	next = (next + 1) % slots.size();
+
+	if (s.semaphore)
+	{
+		auto res = wait(device, s.semaphore, s.value);
+		if (res != vk::Result::eSuccess)
+			throw std::runtime_error("failed to wait for staging slot: " + vk::to_string(res));
+	}
+
+	uint8_t * base = (uint8_t *)memory.mapped + s.offset;
+	const uint32_t chroma_width = (extent.width + 1) / 2;
+	converter.convert(frame,
+	                  nv12_planes{
+	                          .y = base,
+	                          .y_stride = extent.width,
+	                          .cbcr = base + cbcr_offset,
+	                          .cbcr_stride = 2 * chroma_width,
+	                  });
+	s.semaphore = done;
+	s.value = done_value;
+
+	// previous content is discarded
+	vk::ImageMemoryBarrier2 barrier{
+	        .srcStageMask = vk::PipelineStageFlagBits2KHR::eNone,
+	        .srcAccessMask = vk::AccessFlagBits2::eNone,
+	        .dstStageMask = vk::PipelineStageFlagBits2KHR::eTransfer,
+	        .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+	        .oldLayout = vk::ImageLayout::eUndefined,
+	        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+	        .image = destination,
+	        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+	                             .baseMipLevel = 0,
+	                             .levelCount = 1,
+	                             .baseArrayLayer = 0,
+	                             .layerCount = 1},
+	};
+	vk::DependencyInfo dep_info{};
+	dep_info.setImageMemoryBarriers(barrier);
+	cmd_buf.pipelineBarrier2(dep_info);
+
+	std::array regions{
+	        vk::BufferImageCopy{
+	                .bufferOffset = s.offset,
+	                .imageSubresource = {
+	                        .aspectMask = vk::ImageAspectFlagBits::ePlane0,
+	                        .layerCount = 1,
+	                },
+	                .imageExtent = {extent.width, extent.height, 1},
+	        },
+	        vk::BufferImageCopy{
+	                .bufferOffset = s.offset + cbcr_offset,
+	                .imageSubresource = {
+	                        .aspectMask = vk::ImageAspectFlagBits::ePlane1,
+	                        .layerCount = 1,
+	                },
+	                .imageExtent = {chroma_width, (extent.height + 1) / 2, 1},
+	        },
+	};
+	cmd_buf.copyBufferToImage(buffer, destination, vk::ImageLayout::eTransferDstOptimal, regions);
+
+	if (src_family != dst_family)
+	{
+		barrier.srcStageMask = vk::PipelineStageFlagBits2KHR::eTransfer;
+		barrier.srcAccessMask = vk::AccessFlagBits2::eTransferWrite;
+		barrier.dstStageMask = vk::PipelineStageFlagBits2KHR::eNone;
+		barrier.dstAccessMask = vk::AccessFlagBits2::eNone;
+		barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+		barrier.newLayout = vk::ImageLayout::eVideoEncodeSrcKHR;
+		barrier.srcQueueFamilyIndex = src_family;
+		barrier.dstQueueFamilyIndex = dst_family;
+		cmd_buf.pipelineBarrier2(dep_info);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+#include "memory_allocator.h"
+#include "nv12_convert.h"
+
+// Host input path: frames in host memory are converted to NV12 directly in
+// a persistently mapped staging buffer, then copied to the two planes of
+// the encoder input image.
+//
+// The staging buffer is a ring of depth slots, a slot is reused once the
+// semaphore value given when it was recorded is reached.
+//
+// Static frames need no upload: when damage_detector finds no change, skip
+// the frame with video_encoder::skip_frame instead.
+class host_upload
+{
+	struct slot
+	{
+		vk::DeviceSize offset;
+		vk::Semaphore semaphore;
+		uint64_t value = 0;
+	};
+
+	vk::Device device;
+	std::shared_ptr<mini_vma> allocator;
+	vk::Extent2D extent;
+
+	vk::Buffer buffer;
+	mini_vma::allocation memory;
+	// offset of the CbCr plane in a slot
+	vk::DeviceSize cbcr_offset;
+	size_t next = 0;
+	std::vector<slot> slots;
+
+	nv12_converter converter;
+
+public:
+	host_upload(vk::Device device,
+	            std::shared_ptr<mini_vma> allocator,
+	            vk::Extent2D extent,
+	            uint32_t depth = 2,
+	            const nv12_converter::config & cfg = {});
+	host_upload(const host_upload &) = delete;
+	~host_upload();
+
+	// Convert frame into the next slot, waiting for it to be free, and record
+	// its copy into destination. frame must have the extent given at creation.
+	// done is a timeline semaphore that reaches done_value once cmd_buf has
+	// executed, such as video_encoder::input_semaphore().
+	// destination is left in transfer destination layout: when src_family and
+	// dst_family differ, its ownership is released to dst_family with a
+	// transition to video encode source, as acquired by video_encoder with
+	// the default encoder_settings::input_layout.
+	void upload(vk::CommandBuffer cmd_buf,
+	            const host_frame & frame,
+	            vk::Image destination,
+	            uint32_t src_family,
+	            uint32_t dst_family,
+	            vk::Semaphore done,
+	            uint64_t done_value);
+};
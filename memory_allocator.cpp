@@ -1,9 +1,10 @@
 #include "memory_allocator.h"
 
-#include <map>
+#include <algorithm>
+#include <cassert>
 #include <stdexcept>
 
-uint32_t get_memory_type(vk::PhysicalDevice phys_dev, uint32_t type_bits, vk::MemoryPropertyFlags memory_props)
+std::optional<uint32_t> find_memory_type(vk::PhysicalDevice phys_dev, uint32_t type_bits, vk::MemoryPropertyFlags memory_props)
 {
 	auto mem_prop = phys_dev.getMemoryProperties();
 
@@ -16,61 +17,255 @@ uint32_t get_memory_type(vk::PhysicalDevice phys_dev, uint32_t type_bits, vk::Me
 				return i;
 		}
 	}
+	return {};
+}
+
+uint32_t get_memory_type(vk::PhysicalDevice phys_dev, uint32_t type_bits, vk::MemoryPropertyFlags memory_props)
+{
+	if (auto i = find_memory_type(phys_dev, type_bits, memory_props))
+		return *i;
 	throw std::runtime_error("Failed to get memory type");
 }
 
-void mini_vma::request(vk::MemoryRequirements requirement,
-                       decltype(alloc_request::bind_cb) cb,
-                       vk::MemoryPropertyFlags props)
+mini_vma::mini_vma(vk::PhysicalDevice physical_device, vk::Device device, vk::DeviceSize block_size) :
+        physical_device(physical_device),
+        device(device),
+        memory_properties(physical_device.getMemoryProperties()),
+        block_size(block_size)
 {
-	requests.emplace_back(requirement, cb, props);
-};
+	auto limits = physical_device.getProperties().limits;
+	granularity = std::max(limits.bufferImageGranularity, limits.nonCoherentAtomSize);
+	pools.resize(memory_properties.memoryTypeCount);
+	heaps.resize(memory_properties.memoryHeapCount);
+}
+
+mini_vma::~mini_vma()
+{
+	for (auto & pool: pools)
+	{
+		for (auto & b: pool)
+			device.freeMemory(b->memory);
+	}
+	for (auto memory: dedicated_memory)
+		device.freeMemory(memory);
+}
 
-std::vector<vk::DeviceMemory> mini_vma::alloc_and_bind(
-        vk::PhysicalDevice physical_device,
-        vk::Device device)
+mini_vma::allocation mini_vma::allocate_device_memory(vk::DeviceSize size,
+                                                      uint32_t memory_type,
+                                                      const vk::MemoryDedicatedAllocateInfo * dedicated)
 {
-	struct mem_status
+	auto memory = device.allocateMemory({
+	        .pNext = dedicated,
+	        .allocationSize = size,
+	        .memoryTypeIndex = memory_type,
+	});
+
+	void * mapped = nullptr;
+	if (memory_properties.memoryTypes[memory_type].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)
 	{
-		vk::DeviceMemory mem;
-		size_t alloc_size = 0;
+		try
+		{
+			mapped = device.mapMemory(memory, 0, VK_WHOLE_SIZE);
+		}
+		catch (...)
+		{
+			device.freeMemory(memory);
+			throw;
+		}
+	}
+
+	auto & heap = heaps[memory_properties.memoryTypes[memory_type].heapIndex];
+	heap.reserved += size;
+	++heap.device_memory_count;
+
+	return {
+	        .memory = memory,
+	        .offset = 0,
+	        .size = size,
+	        .memory_type = memory_type,
+	        .mapped = mapped,
 	};
-	std::map<uint32_t, mem_status> statuses;
+}
 
-	for (auto & request: requests)
+mini_vma::allocation mini_vma::allocate(const vk::MemoryRequirements & requirements,
+                                        vk::MemoryPropertyFlags props,
+                                        const vk::MemoryDedicatedAllocateInfo * dedicated)
+{
+	uint32_t memory_type = get_memory_type(physical_device, requirements.memoryTypeBits, props);
+	auto & heap = heaps[memory_properties.memoryTypes[memory_type].heapIndex];
+
+	std::lock_guard lock(mutex);
+
+	if (dedicated or requirements.size > block_size / 2)
 	{
-		request.mem_index = get_memory_type(
-		        physical_device, request.requirement.memoryTypeBits, request.props);
-		auto & status = statuses[request.mem_index];
-		request.offset = align(status.alloc_size, request.requirement.alignment);
-		status.alloc_size = request.offset + request.requirement.size;
+		auto a = allocate_device_memory(requirements.size, memory_type, dedicated);
+		dedicated_memory.push_back(a.memory);
+		heap.allocated += a.size;
+		++heap.allocation_count;
+		return a;
 	}
 
-	std::vector<vk::DeviceMemory> memories;
-	try
+	// Keep buffers and optimal images apart, and do not let cached ranges of
+	// different allocations share an atom
+	vk::DeviceSize alignment = std::max(requirements.alignment, granularity);
+	vk::DeviceSize size = alignment * ((requirements.size + alignment - 1) / alignment);
+
+	auto & pool = pools[memory_type];
+	block * b = nullptr;
+	std::optional<uint64_t> offset;
+	for (auto & candidate: pool)
 	{
-		for (auto & [index, status]: statuses)
+		offset = candidate->ranges.allocate(size, alignment);
+		if (offset)
 		{
-			memories.push_back(device.allocateMemory({
-			        .allocationSize = status.alloc_size,
-			        .memoryTypeIndex = index,
-			}));
-			status.mem = memories.back();
+			b = candidate.get();
+			break;
 		}
-		for (auto & request: requests)
+	}
+
+	if (not b)
+	{
+		auto mem = allocate_device_memory(block_size, memory_type, nullptr);
+		b = pool.emplace_back(new block{
+		                              .memory = mem.memory,
+		                              .memory_type = memory_type,
+		                              .ranges = range_allocator(block_size),
+		                              .mapped = mem.mapped,
+		                      })
+		            .get();
+		offset = b->ranges.allocate(size, alignment);
+		assert(offset);
+	}
+
+	heap.allocated += size;
+	++heap.allocation_count;
+
+	return {
+	        .memory = b->memory,
+	        .offset = *offset,
+	        .size = size,
+	        .memory_type = memory_type,
+	        .mapped = b->mapped ? (uint8_t *)b->mapped + *offset : nullptr,
+	        .owner = b,
+	};
+}
+
+mini_vma::allocation mini_vma::allocate(const vk::MemoryRequirements & requirements, vk::MemoryPropertyFlags props)
+{
+	return allocate(requirements, props, nullptr);
+}
+
+void mini_vma::free(const allocation & a)
+{
+	if (not a.memory)
+		return;
+
+	std::lock_guard lock(mutex);
+	auto & heap = heaps[memory_properties.memoryTypes[a.memory_type].heapIndex];
+	heap.allocated -= a.size;
+	--heap.allocation_count;
+
+	if (not a.owner)
+	{
+		std::erase(dedicated_memory, a.memory);
+		device.freeMemory(a.memory);
+		heap.reserved -= a.size;
+		--heap.device_memory_count;
+		return;
+	}
+
+	a.owner->ranges.free(a.offset, a.size);
+
+	// Keep one empty block per memory type around for the next user
+	if (a.owner->ranges.empty())
+	{
+		auto & pool = pools[a.memory_type];
+		auto empty_blocks = std::ranges::count_if(pool, [](const auto & b) { return b->ranges.empty(); });
+		if (empty_blocks > 1)
 		{
-			request.bind_cb(statuses[request.mem_index].mem,
-			                request.offset);
+			auto i = std::ranges::find_if(pool, [&](const auto & b) { return b.get() == a.owner; });
+			device.freeMemory(a.owner->memory);
+			heap.reserved -= a.owner->ranges.capacity();
+			--heap.device_memory_count;
+			pool.erase(i);
 		}
-		requests.clear();
-		return memories;
+	}
+}
+
+mini_vma::allocation mini_vma::bind(vk::Image image, vk::MemoryPropertyFlags props)
+{
+	auto [req, dedicated_req] = device.getImageMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>({.image = image});
+
+	vk::MemoryDedicatedAllocateInfo dedicated_info{.image = image};
+	bool dedicated = dedicated_req.prefersDedicatedAllocation or dedicated_req.requiresDedicatedAllocation;
+
+	auto a = allocate(req.memoryRequirements, props, dedicated ? &dedicated_info : nullptr);
+	try
+	{
+		device.bindImageMemory(image, a.memory, a.offset);
 	}
 	catch (...)
 	{
-		for (auto & mem: memories)
+		free(a);
+		throw;
+	}
+	return a;
+}
+
+mini_vma::allocation mini_vma::bind(vk::Buffer buffer, vk::MemoryPropertyFlags props)
+{
+	auto [req, dedicated_req] = device.getBufferMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>({.buffer = buffer});
+
+	vk::MemoryDedicatedAllocateInfo dedicated_info{.buffer = buffer};
+	bool dedicated = dedicated_req.prefersDedicatedAllocation or dedicated_req.requiresDedicatedAllocation;
+
+	auto a = allocate(req.memoryRequirements, props, dedicated ? &dedicated_info : nullptr);
+	try
+	{
+		device.bindBufferMemory(buffer, a.memory, a.offset);
+	}
+	catch (...)
+	{
+		free(a);
+		throw;
+	}
+	return a;
+}
+
+std::vector<mini_vma::allocation> mini_vma::bind(vk::VideoSessionKHR video_session, vk::MemoryPropertyFlags props)
+{
+	std::vector<allocation> allocations;
+	std::vector<vk::BindVideoSessionMemoryInfoKHR> video_session_bind;
+	try
+	{
+		for (const auto & req: device.getVideoSessionMemoryRequirementsKHR(video_session))
 		{
-			device.freeMemory(mem);
+			// Fall back to any memory type the session accepts
+			vk::MemoryPropertyFlags req_props = props;
+			if (not find_memory_type(physical_device, req.memoryRequirements.memoryTypeBits, props))
+				req_props = {};
+
+			const auto & a = allocations.emplace_back(allocate(req.memoryRequirements, req_props, nullptr));
+			video_session_bind.push_back({
+			        .memoryBindIndex = req.memoryBindIndex,
+			        .memory = a.memory,
+			        .memoryOffset = a.offset,
+			        .memorySize = req.memoryRequirements.size,
+			});
 		}
+		device.bindVideoSessionMemoryKHR(video_session, video_session_bind);
+	}
+	catch (...)
+	{
+		for (auto & a: allocations)
+			free(a);
 		throw;
 	}
+	return allocations;
+}
+
+std::vector<mini_vma::heap_usage> mini_vma::usage() const
+{
+	std::lock_guard lock(mutex);
+	return heaps;
 }
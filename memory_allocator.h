@@ -1,9 +1,14 @@
 #pragma once
 
 #include <cstdint>
-#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
 #include <vulkan/vulkan.hpp>
 
+#include "range_allocator.h"
+
 inline uint32_t align(uint32_t value, uint32_t alignment)
 {
 	if (alignment == 0)
@@ -11,27 +16,82 @@ inline uint32_t align(uint32_t value, uint32_t alignment)
 	return alignment * ((value + alignment - 1) / alignment);
 }
 
+std::optional<uint32_t> find_memory_type(vk::PhysicalDevice phys_dev, uint32_t type_bits, vk::MemoryPropertyFlags memory_props);
 uint32_t get_memory_type(vk::PhysicalDevice phys_dev, uint32_t type_bits, vk::MemoryPropertyFlags memory_props);
 
+// Long-lived device memory allocator, shared between encoders.
+// Small allocations are suballocated from blocks of block_size bytes, one
+// pool of blocks per memory type. Resources that prefer a dedicated
+// allocation, or that are too large for a block, get their own vk::DeviceMemory.
+// Host visible blocks are persistently mapped.
 class mini_vma
 {
-	struct alloc_request
+	struct block
+	{
+		vk::DeviceMemory memory;
+		uint32_t memory_type;
+		range_allocator ranges;
+		void * mapped = nullptr;
+	};
+
+public:
+	struct allocation
+	{
+		vk::DeviceMemory memory;
+		vk::DeviceSize offset = 0;
+		vk::DeviceSize size = 0;
+		uint32_t memory_type = 0;
+		// nullptr if the memory is not host visible
+		void * mapped = nullptr;
+		// nullptr for dedicated allocations
+		block * owner = nullptr;
+	};
+
+	struct heap_usage
 	{
-		vk::MemoryRequirements requirement;
-		std::function<void(vk::DeviceMemory, size_t)> bind_cb;
-		vk::MemoryPropertyFlags props;
-		uint32_t mem_index = 0;
-		size_t offset = 0;
+		// memory obtained from the driver
+		vk::DeviceSize reserved = 0;
+		// memory handed out to users
+		vk::DeviceSize allocated = 0;
+		size_t device_memory_count = 0;
+		size_t allocation_count = 0;
 	};
 
-	std::vector<alloc_request> requests;
+private:
+	vk::PhysicalDevice physical_device;
+	vk::Device device;
+	vk::PhysicalDeviceMemoryProperties memory_properties;
+	vk::DeviceSize block_size;
+	vk::DeviceSize granularity;
+
+	mutable std::mutex mutex;
+	std::vector<std::vector<std::unique_ptr<block>>> pools;
+	// dedicated allocations not freed yet, released with the allocator
+	std::vector<vk::DeviceMemory> dedicated_memory;
+	std::vector<heap_usage> heaps;
+
+	allocation allocate_device_memory(vk::DeviceSize size,
+	                                  uint32_t memory_type,
+	                                  const vk::MemoryDedicatedAllocateInfo * dedicated);
+	allocation allocate(const vk::MemoryRequirements & requirements,
+	                    vk::MemoryPropertyFlags props,
+	                    const vk::MemoryDedicatedAllocateInfo * dedicated);
 
 public:
-	void request(vk::MemoryRequirements requirement,
-	             decltype(alloc_request::bind_cb) cb,
-	             vk::MemoryPropertyFlags props);
+	mini_vma(vk::PhysicalDevice physical_device, vk::Device device, vk::DeviceSize block_size = 64 * 1024 * 1024);
+	mini_vma(const mini_vma &) = delete;
+	mini_vma & operator=(const mini_vma &) = delete;
+	~mini_vma();
+
+	allocation allocate(const vk::MemoryRequirements & requirements, vk::MemoryPropertyFlags props);
+	void free(const allocation &);
+
+	// Allocate and bind memory for a resource, honouring
+	// VkMemoryDedicatedRequirements
+	allocation bind(vk::Image image, vk::MemoryPropertyFlags props);
+	allocation bind(vk::Buffer buffer, vk::MemoryPropertyFlags props);
+	std::vector<allocation> bind(vk::VideoSessionKHR video_session, vk::MemoryPropertyFlags props);
 
-	std::vector<vk::DeviceMemory> alloc_and_bind(
-	        vk::PhysicalDevice physical_device,
-	        vk::Device device);
+	// Indexed by memory heap
+	std::vector<heap_usage> usage() const;
 };
@@ -0,0 +1,212 @@
+#include "nal_utils.h"
+
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NAL_UTILS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define NAL_UTILS_NEON 1
+#endif
+
+namespace
+{
+// First position of 00 00 x with lo <= x <= hi
+using find_fn = const uint8_t * (*)(const uint8_t * p, const uint8_t * end, uint8_t lo, uint8_t hi);
+
+const uint8_t * find_scalar(const uint8_t * p, const uint8_t * end, uint8_t lo, uint8_t hi)
+{
+	for (; p + 3 <= end; ++p)
+	{
+		if (p[0] == 0 and p[1] == 0 and uint8_t(p[2] - lo) <= uint8_t(hi - lo))
+			return p;
+	}
+	return end;
+}
+
+#ifdef NAL_UTILS_X86
+// Each vector iteration compares 16 or 32 positions, reading 2 bytes ahead
+__attribute__((target("sse2"))) const uint8_t * find_sse2(const uint8_t * p, const uint8_t * end, uint8_t lo, uint8_t hi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi8(lo);
+	const __m128i range = _mm_set1_epi8(hi - lo);
+	for (; p + 18 <= end; p += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)p);
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+		__m128i c = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), low);
+		__m128i zeros = _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero));
+		__m128i third = _mm_cmpeq_epi8(_mm_min_epu8(c, range), c);
+		if (int mask = _mm_movemask_epi8(_mm_and_si128(zeros, third)))
+			return p + std::countr_zero(unsigned(mask));
+	}
+	return find_scalar(p, end, lo, hi);
+}
+
+__attribute__((target("avx2"))) const uint8_t * find_avx2(const uint8_t * p, const uint8_t * end, uint8_t lo, uint8_t hi)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i low = _mm256_set1_epi8(lo);
+	const __m256i range = _mm256_set1_epi8(hi - lo);
+	for (; p + 34 <= end; p += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)p);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+		__m256i c = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), low);
+		__m256i zeros = _mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero));
+		__m256i third = _mm256_cmpeq_epi8(_mm256_min_epu8(c, range), c);
+		if (unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(zeros, third)))
+			return p + std::countr_zero(mask);
+	}
+	return find_sse2(p, end, lo, hi);
+}
+#endif
+
+#ifdef NAL_UTILS_NEON
+const uint8_t * find_neon(const uint8_t * p, const uint8_t * end, uint8_t lo, uint8_t hi)
+{
+	const uint8x16_t low = vdupq_n_u8(lo);
+	const uint8x16_t range = vdupq_n_u8(hi - lo);
+	for (; p + 18 <= end; p += 16)
+	{
+		uint8x16_t a = vld1q_u8(p);
+		uint8x16_t b = vld1q_u8(p + 1);
+		uint8x16_t c = vsubq_u8(vld1q_u8(p + 2), low);
+		uint8x16_t match = vandq_u8(vandq_u8(vceqzq_u8(a), vceqzq_u8(b)), vcleq_u8(c, range));
+		// no movemask on NEON, locate the match with the scalar loop
+		if (vmaxvq_u8(match))
+			return find_scalar(p, p + 18, lo, hi);
+	}
+	return find_scalar(p, end, lo, hi);
+}
+#endif
+
+struct implementation
+{
+	find_fn find;
+	const char * name;
+};
+
+implementation select_implementation()
+{
+#if defined(NAL_UTILS_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return {find_avx2, "avx2"};
+	if (__builtin_cpu_supports("sse2"))
+		return {find_sse2, "sse2"};
+#elif defined(NAL_UTILS_NEON)
+	return {find_neon, "neon"};
+#endif
+	return {find_scalar, "scalar"};
+}
+
+const implementation impl = select_implementation();
+
+size_t remove_emulation_prevention(std::span<const uint8_t> in, uint8_t * out, find_fn find)
+{
+	const uint8_t * p = in.data();
+	const uint8_t * end = p + in.size();
+	uint8_t * o = out;
+	while (true)
+	{
+		const uint8_t * epb = find(p, end, 3, 3);
+		// keep the two zeros, drop the 03
+		size_t size = (epb == end ? end : epb + 2) - p;
+		if (size)
+			std::memmove(o, p, size);
+		o += size;
+		if (epb == end)
+			return o - out;
+		p = epb + 3;
+	}
+}
+
+size_t add_emulation_prevention(std::span<const uint8_t> in, uint8_t * out, find_fn find)
+{
+	const uint8_t * p = in.data();
+	const uint8_t * end = p + in.size();
+	uint8_t * o = out;
+	while (true)
+	{
+		const uint8_t * hit = find(p, end, 0, 3);
+		size_t size = (hit == end ? end : hit + 2) - p;
+		if (size)
+			std::memcpy(o, p, size);
+		o += size;
+		if (hit == end)
+			break;
+		*o++ = 3;
+		p = hit + 2;
+	}
+
+	// an RBSP ending with a cabac_zero_word gets a final 03
+	if (o != out and o[-1] == 0)
+		*o++ = 3;
+	return o - out;
+}
+} // namespace
+
+const uint8_t * find_start_code(const uint8_t * begin, const uint8_t * end)
+{
+	return impl.find(begin, end, 1, 1);
+}
+
+const uint8_t * find_start_code_scalar(const uint8_t * begin, const uint8_t * end)
+{
+	return find_scalar(begin, end, 1, 1);
+}
+
+size_t remove_emulation_prevention(std::span<const uint8_t> in, uint8_t * out)
+{
+	return remove_emulation_prevention(in, out, impl.find);
+}
+
+size_t remove_emulation_prevention_scalar(std::span<const uint8_t> in, uint8_t * out)
+{
+	size_t written = 0;
+	int zeros = 0;
+	for (uint8_t byte: in)
+	{
+		if (zeros >= 2 and byte == 3)
+		{
+			zeros = 0;
+			continue;
+		}
+		zeros = byte == 0 ? zeros + 1 : 0;
+		out[written++] = byte;
+	}
+	return written;
+}
+
+size_t add_emulation_prevention(std::span<const uint8_t> in, uint8_t * out)
+{
+	return add_emulation_prevention(in, out, impl.find);
+}
+
+size_t add_emulation_prevention_scalar(std::span<const uint8_t> in, uint8_t * out)
+{
+	size_t written = 0;
+	int zeros = 0;
+	for (uint8_t byte: in)
+	{
+		if (zeros >= 2 and byte <= 3)
+		{
+			out[written++] = 3;
+			zeros = 0;
+		}
+		zeros = byte == 0 ? zeros + 1 : 0;
+		out[written++] = byte;
+	}
+	if (written > 0 and out[written - 1] == 0)
+		out[written++] = 3;
+	return written;
+}
+
+const char * nal_utils_isa()
+{
+	return impl.name;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Helpers for Annex B byte streams (H.264 and H.265).
+// Searches use SSE2, AVX2 or NEON when available, selected at runtime;
+// the _scalar variants are the reference implementations.
+
+// First 00 00 01 start code in [begin, end), end if there is none
+const uint8_t * find_start_code(const uint8_t * begin, const uint8_t * end);
+const uint8_t * find_start_code_scalar(const uint8_t * begin, const uint8_t * end);
+
+// Copy a NAL unit payload without its emulation prevention bytes.
+// out must hold in.size() bytes and may be in.data(). Returns the size
+// written.
+size_t remove_emulation_prevention(std::span<const uint8_t> in, uint8_t * out);
+size_t remove_emulation_prevention_scalar(std::span<const uint8_t> in, uint8_t * out);
+
+// Copy an RBSP, inserting emulation prevention bytes. out must hold
+// max_escaped_size(in.size()) bytes and must not overlap in. Returns the
+// size written.
+size_t add_emulation_prevention(std::span<const uint8_t> in, uint8_t * out);
+size_t add_emulation_prevention_scalar(std::span<const uint8_t> in, uint8_t * out);
+
+inline size_t max_escaped_size(size_t size)
+{
+	return size + size / 2 + 1;
+}
+
+// Name of the selected implementation
+const char * nal_utils_isa();
+
+// Call f(std::span<const uint8_t>) for each NAL unit of an Annex B stream,
+// without start codes and trailing zero bytes
+template <typename F>
+void for_each_nal_unit(std::span<const uint8_t> annexb, F && f)
+{
+	const uint8_t * end = annexb.data() + annexb.size();
+	const uint8_t * p = find_start_code(annexb.data(), end);
+	while (p != end)
+	{
+		const uint8_t * nal = p + 3;
+		const uint8_t * next = find_start_code(nal, end);
+
+		// the leading zero of 4 bytes start codes and trailing zeros are not
+		// part of the NAL unit
+		const uint8_t * nal_end = next;
+		while (nal_end > nal and nal_end[-1] == 0)
+			--nal_end;
+
+		if (nal_end > nal)
+			f(std::span<const uint8_t>(nal, nal_end));
+		p = next;
+	}
+}
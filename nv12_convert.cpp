@@ -0,0 +1,390 @@
+#include "nv12_convert.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NV12_CONVERT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define NV12_CONVERT_NEON 1
+#endif
+
+namespace
+{
+// Luma of rows r0 and r1 (y1 may be null), and chroma of the pair, from
+// column 0. Coefficients are in memory channel order. Returns the number of
+// columns converted, always even, the rest is done by rgb_pair_scalar.
+using rgb_pair_fn = uint32_t (*)(const uint8_t * r0, const uint8_t * r1, uint8_t * y0, uint8_t * y1, uint8_t * cbcr, uint32_t width, const nv12_coefficients & c);
+// Interleave chroma samples, returns the number of samples written
+using interleave_fn = uint32_t (*)(const uint8_t * u, const uint8_t * v, uint8_t * cbcr, uint32_t count);
+
+uint8_t clamp8(int32_t value)
+{
+	return std::clamp(value, 0, 255);
+}
+
+void rgb_pair_scalar(const uint8_t * r0, const uint8_t * r1, uint8_t * y0, uint8_t * y1, uint8_t * cbcr, uint32_t first, uint32_t width, const nv12_coefficients & c)
+{
+	auto luma = [&](const uint8_t * p) {
+		return clamp8((c.y[0] * p[0] + c.y[1] * p[1] + c.y[2] * p[2] + c.y_offset) >> 14);
+	};
+	for (uint32_t x = first; x < width; ++x)
+	{
+		y0[x] = luma(r0 + 4 * x);
+		if (y1)
+			y1[x] = luma(r1 + 4 * x);
+	}
+
+	for (uint32_t x = first; x < width; x += 2)
+	{
+		uint32_t x1 = std::min(x + 1, width - 1);
+		int32_t s[3];
+		for (int k = 0; k < 3; ++k)
+			s[k] = r0[4 * x + k] + r0[4 * x1 + k] + r1[4 * x + k] + r1[4 * x1 + k];
+		cbcr[x] = clamp8((c.cb[0] * s[0] + c.cb[1] * s[1] + c.cb[2] * s[2] + c.c_offset) >> 16);
+		cbcr[x + 1] = clamp8((c.cr[0] * s[0] + c.cr[1] * s[1] + c.cr[2] * s[2] + c.c_offset) >> 16);
+	}
+}
+
+uint32_t rgb_pair_none(const uint8_t *, const uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint32_t, const nv12_coefficients &)
+{
+	return 0;
+}
+
+void interleave_scalar(const uint8_t * u, const uint8_t * v, uint8_t * cbcr, uint32_t first, uint32_t count)
+{
+	for (uint32_t i = first; i < count; ++i)
+	{
+		cbcr[2 * i] = u[i];
+		cbcr[2 * i + 1] = v[i];
+	}
+}
+
+uint32_t interleave_none(const uint8_t *, const uint8_t *, uint8_t *, uint32_t)
+{
+	return 0;
+}
+
+#ifdef NV12_CONVERT_X86
+// 8 int32 to 8 bytes with unsigned saturation, in the low half
+__attribute__((target("avx2"))) __m128i pack8_avx2(__m256i v)
+{
+	__m256i p = _mm256_packs_epi32(v, v);
+	p = _mm256_packus_epi16(p, p);
+	return _mm_unpacklo_epi32(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+}
+
+// a and b hold 4 pixels each as 16 bits channels
+__attribute__((target("avx2"))) __m128i luma8_avx2(__m256i a, __m256i b, __m256i coef, __m256i offset)
+{
+	// two sums per pixel, then [0 1 4 5 | 2 3 6 7]
+	__m256i v = _mm256_hadd_epi32(_mm256_madd_epi16(a, coef), _mm256_madd_epi16(b, coef));
+	v = _mm256_permute4x64_epi64(v, 0xd8);
+	return pack8_avx2(_mm256_srai_epi32(_mm256_add_epi32(v, offset), 14));
+}
+
+__attribute__((target("avx2"))) uint32_t rgb_pair_avx2(const uint8_t * r0, const uint8_t * r1, uint8_t * y0, uint8_t * y1, uint8_t * cbcr, uint32_t width, const nv12_coefficients & c)
+{
+	const __m256i coef_y = _mm256_setr_epi16(
+	        c.y[0], c.y[1], c.y[2], 0, c.y[0], c.y[1], c.y[2], 0,
+	        c.y[0], c.y[1], c.y[2], 0, c.y[0], c.y[1], c.y[2], 0);
+	const __m256i coef_c = _mm256_setr_epi16(
+	        c.cb[0], c.cb[1], c.cb[2], 0, c.cr[0], c.cr[1], c.cr[2], 0,
+	        c.cb[0], c.cb[1], c.cb[2], 0, c.cr[0], c.cr[1], c.cr[2], 0);
+	const __m256i offset_y = _mm256_set1_epi32(c.y_offset);
+	const __m256i offset_c = _mm256_set1_epi32(c.c_offset);
+	const __m256i chroma_order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8)
+	{
+		__m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(r0 + 4 * x)));
+		__m256i b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(r0 + 4 * x + 16)));
+		__m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(r1 + 4 * x)));
+		__m256i b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(r1 + 4 * x + 16)));
+
+		_mm_storel_epi64((__m128i *)(y0 + x), luma8_avx2(a0, b0, coef_y, offset_y));
+		if (y1)
+			_mm_storel_epi64((__m128i *)(y1 + x), luma8_avx2(a1, b1, coef_y, offset_y));
+
+		// sums of 2x2 pixels in the low half of each lane, duplicated so
+		// that Cb and Cr are computed together
+		__m256i sa = _mm256_add_epi16(a0, a1);
+		__m256i sb = _mm256_add_epi16(b0, b1);
+		sa = _mm256_shuffle_epi32(_mm256_add_epi16(sa, _mm256_srli_si256(sa, 8)), 0x44);
+		sb = _mm256_shuffle_epi32(_mm256_add_epi16(sb, _mm256_srli_si256(sb, 8)), 0x44);
+
+		// [cb0 cr0 cb2 cr2 | cb1 cr1 cb3 cr3]
+		__m256i v = _mm256_hadd_epi32(_mm256_madd_epi16(sa, coef_c), _mm256_madd_epi16(sb, coef_c));
+		v = _mm256_permutevar8x32_epi32(v, chroma_order);
+		_mm_storel_epi64((__m128i *)(cbcr + x), pack8_avx2(_mm256_srai_epi32(_mm256_add_epi32(v, offset_c), 16)));
+	}
+	return x;
+}
+
+__attribute__((target("avx2"))) uint32_t interleave_avx2(const uint8_t * u, const uint8_t * v, uint8_t * cbcr, uint32_t count)
+{
+	uint32_t i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(u + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(v + i));
+		__m256i lo = _mm256_unpacklo_epi8(a, b);
+		__m256i hi = _mm256_unpackhi_epi8(a, b);
+		// unpack works within lanes
+		_mm256_storeu_si256((__m256i *)(cbcr + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(cbcr + 2 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	return i;
+}
+#endif
+
+#ifdef NV12_CONVERT_NEON
+// 8 values of 3 channels, coefficients and offset in units of 2^-shift
+template <int shift>
+uint8x8_t dot8_neon(int16x8_t c0, int16x8_t c1, int16x8_t c2, const int16_t * coef, int32_t offset)
+{
+	int32x4_t lo = vdupq_n_s32(offset);
+	int32x4_t hi = lo;
+	lo = vmlal_n_s16(lo, vget_low_s16(c0), coef[0]);
+	hi = vmlal_n_s16(hi, vget_high_s16(c0), coef[0]);
+	lo = vmlal_n_s16(lo, vget_low_s16(c1), coef[1]);
+	hi = vmlal_n_s16(hi, vget_high_s16(c1), coef[1]);
+	lo = vmlal_n_s16(lo, vget_low_s16(c2), coef[2]);
+	hi = vmlal_n_s16(hi, vget_high_s16(c2), coef[2]);
+	int16x8_t v = vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, shift)), vqmovn_s32(vshrq_n_s32(hi, shift)));
+	return vqmovun_s16(v);
+}
+
+int16x8_t widen_low(uint8x16_t v)
+{
+	return vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+}
+
+int16x8_t widen_high(uint8x16_t v)
+{
+	return vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+}
+
+uint8x16_t luma16_neon(const uint8x16x4_t & p, const nv12_coefficients & c)
+{
+	uint8x8_t lo = dot8_neon<14>(widen_low(p.val[0]), widen_low(p.val[1]), widen_low(p.val[2]), c.y, c.y_offset);
+	uint8x8_t hi = dot8_neon<14>(widen_high(p.val[0]), widen_high(p.val[1]), widen_high(p.val[2]), c.y, c.y_offset);
+	return vcombine_u8(lo, hi);
+}
+
+uint32_t rgb_pair_neon(const uint8_t * r0, const uint8_t * r1, uint8_t * y0, uint8_t * y1, uint8_t * cbcr, uint32_t width, const nv12_coefficients & c)
+{
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		// deinterleaved channels
+		uint8x16x4_t p0 = vld4q_u8(r0 + 4 * x);
+		uint8x16x4_t p1 = vld4q_u8(r1 + 4 * x);
+
+		vst1q_u8(y0 + x, luma16_neon(p0, c));
+		if (y1)
+			vst1q_u8(y1 + x, luma16_neon(p1, c));
+
+		// sums of 2x2 pixels, 8 chroma samples
+		int16x8_t s[3];
+		for (int k = 0; k < 3; ++k)
+			s[k] = vreinterpretq_s16_u16(vpadalq_u8(vpaddlq_u8(p0.val[k]), p1.val[k]));
+
+		uint8x8x2_t out;
+		out.val[0] = dot8_neon<16>(s[0], s[1], s[2], c.cb, c.c_offset);
+		out.val[1] = dot8_neon<16>(s[0], s[1], s[2], c.cr, c.c_offset);
+		vst2_u8(cbcr + x, out);
+	}
+	return x;
+}
+
+uint32_t interleave_neon(const uint8_t * u, const uint8_t * v, uint8_t * cbcr, uint32_t count)
+{
+	uint32_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		uint8x16x2_t out;
+		out.val[0] = vld1q_u8(u + i);
+		out.val[1] = vld1q_u8(v + i);
+		vst2q_u8(cbcr + 2 * i, out);
+	}
+	return i;
+}
+#endif
+
+struct implementation
+{
+	rgb_pair_fn rgb_pair;
+	interleave_fn interleave;
+	const char * name;
+};
+
+const implementation scalar_impl{rgb_pair_none, interleave_none, "scalar"};
+
+implementation select_implementation()
+{
+#if defined(NV12_CONVERT_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return {rgb_pair_avx2, interleave_avx2, "avx2"};
+#elif defined(NV12_CONVERT_NEON)
+	return {rgb_pair_neon, interleave_neon, "neon"};
+#endif
+	return scalar_impl;
+}
+
+const implementation impl = select_implementation();
+
+// Coefficients in memory channel order
+nv12_coefficients in_memory_order(nv12_coefficients c, host_pixel_format format)
+{
+	if (format == host_pixel_format::bgra)
+	{
+		std::swap(c.y[0], c.y[2]);
+		std::swap(c.cb[0], c.cb[2]);
+		std::swap(c.cr[0], c.cr[2]);
+	}
+	return c;
+}
+
+void convert(const host_frame & src, const nv12_planes & dst, const nv12_coefficients & coefficients, uint32_t first_row, uint32_t last_row, const implementation & impl)
+{
+	assert(first_row % 2 == 0);
+	last_row = std::min(last_row, src.height);
+	const uint32_t width = src.width;
+	const uint32_t chroma_width = (width + 1) / 2;
+	const nv12_coefficients c = in_memory_order(coefficients, src.format);
+
+	for (uint32_t y = first_row; y < last_row; y += 2)
+	{
+		const bool second = y + 1 < last_row;
+		uint8_t * y0 = dst.y + y * dst.y_stride;
+		uint8_t * y1 = second ? y0 + dst.y_stride : nullptr;
+		uint8_t * cbcr = dst.cbcr + (y / 2) * dst.cbcr_stride;
+
+		if (src.format == host_pixel_format::i420)
+		{
+			const uint8_t * luma = src.planes[0] + y * src.strides[0];
+			std::memcpy(y0, luma, width);
+			if (y1)
+				std::memcpy(y1, luma + src.strides[0], width);
+
+			const uint8_t * u = src.planes[1] + (y / 2) * src.strides[1];
+			const uint8_t * v = src.planes[2] + (y / 2) * src.strides[2];
+			interleave_scalar(u, v, cbcr, impl.interleave(u, v, cbcr, chroma_width), chroma_width);
+		}
+		else
+		{
+			const uint8_t * r0 = src.planes[0] + y * src.strides[0];
+			// the last row is repeated for odd heights
+			const uint8_t * r1 = y + 1 < src.height ? r0 + src.strides[0] : r0;
+			uint32_t done = impl.rgb_pair(r0, r1, y0, y1, cbcr, width, c);
+			rgb_pair_scalar(r0, r1, y0, y1, cbcr, done, width, c);
+		}
+	}
+}
+} // namespace
+
+nv12_coefficients make_nv12_coefficients(const ycbcr_matrix & m)
+{
+	// Round each row so that its sum is exact: white and grey map to the
+	// nominal values
+	auto row = [](const float (&in)[4], int16_t (&out)[3]) {
+		const float scale = 1 << 14;
+		out[0] = std::lround(in[0] * scale);
+		out[2] = std::lround(in[2] * scale);
+		out[1] = std::lround((in[0] + in[1] + in[2]) * scale) - out[0] - out[2];
+	};
+
+	nv12_coefficients c;
+	row(m.y, c.y);
+	row(m.cb, c.cb);
+	row(m.cr, c.cr);
+	// chroma is computed on sums of 4 samples, with 2 more bits
+	c.y_offset = std::lround(m.y[3] * 255 * (1 << 14)) + (1 << 13);
+	c.c_offset = std::lround(m.cb[3] * 255 * (1 << 16)) + (1 << 15);
+	return c;
+}
+
+void convert_to_nv12(const host_frame & src, const nv12_planes & dst, const nv12_coefficients & c, uint32_t first_row, uint32_t last_row)
+{
+	convert(src, dst, c, first_row, last_row, impl);
+}
+
+void convert_to_nv12_scalar(const host_frame & src, const nv12_planes & dst, const nv12_coefficients & c, uint32_t first_row, uint32_t last_row)
+{
+	convert(src, dst, c, first_row, last_row, scalar_impl);
+}
+
+const char * nv12_convert_isa()
+{
+	return impl.name;
+}
+
+nv12_converter::nv12_converter(const config & cfg) :
+        coefficients(make_nv12_coefficients(make_ycbcr_matrix(cfg.matrix, cfg.range)))
+{
+	for (uint32_t band = 1; band < cfg.threads; ++band)
+		workers.emplace_back([this, band]() { run(band); });
+}
+
+nv12_converter::~nv12_converter()
+{
+	quit = true;
+	++generation;
+	generation.notify_all();
+	for (auto & worker: workers)
+		worker.join();
+}
+
+void nv12_converter::convert_band(uint32_t band)
+{
+	if (band >= band_count)
+		return;
+
+	// bands start on even rows
+	uint32_t chroma_rows = (src->height + 1) / 2;
+	uint32_t first = 2 * (chroma_rows * band / band_count);
+	uint32_t last = 2 * (chroma_rows * (band + 1) / band_count);
+	convert_to_nv12(*src, *dst, coefficients, first, last);
+}
+
+void nv12_converter::run(uint32_t band)
+{
+	uint64_t seen = 0;
+	while (true)
+	{
+		generation.wait(seen);
+		seen = generation.load();
+		if (quit)
+			return;
+
+		convert_band(band);
+		if (pending.fetch_sub(1) == 1)
+			pending.notify_one();
+	}
+}
+
+void nv12_converter::convert(const host_frame & src, const nv12_planes & dst)
+{
+	this->src = &src;
+	this->dst = &dst;
+	band_count = std::clamp<uint32_t>((src.height + 1) / 2, 1, threads());
+
+	if (not workers.empty())
+	{
+		pending = workers.size();
+		++generation;
+		generation.notify_all();
+	}
+
+	convert_band(0);
+
+	for (uint32_t left = pending.load(); left != 0; left = pending.load())
+		pending.wait(left);
+}
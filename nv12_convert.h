@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "color_space.h"
+
+// Host-side conversion of RGB and I420 frames to NV12, for sources that are
+// produced on the CPU. Does not depend on Vulkan.
+// Uses AVX2 or NEON when available, selected at runtime; the _scalar
+// variants are the reference implementations and give identical results.
+
+enum class host_pixel_format
+{
+	// 8 bits per channel, in memory order
+	bgra,
+	rgba,
+	// Y, U and V planes, chroma subsampled by 2 in both directions
+	i420,
+};
+
+struct host_frame
+{
+	host_pixel_format format;
+	uint32_t width;
+	uint32_t height;
+	// one plane for bgra and rgba, three for i420
+	const uint8_t * planes[3];
+	// in bytes
+	size_t strides[3];
+};
+
+struct nv12_planes
+{
+	uint8_t * y;
+	size_t y_stride;
+	// interleaved Cb and Cr, (width + 1) / 2 samples per row
+	uint8_t * cbcr;
+	size_t cbcr_stride;
+};
+
+// Fixed point matrix, coefficients in units of 2^-14
+struct nv12_coefficients
+{
+	int16_t y[3];
+	int16_t cb[3];
+	int16_t cr[3];
+	// offsets including rounding, for the luma and the chroma sums
+	int32_t y_offset;
+	int32_t c_offset;
+};
+
+nv12_coefficients make_nv12_coefficients(const ycbcr_matrix &);
+
+// Convert rows [first_row, last_row) of src. first_row must be even, each
+// chroma row is the average of two luma rows, with the last row and column
+// repeated for odd sizes. I420 planes are copied, the matrix is not used.
+void convert_to_nv12(const host_frame & src, const nv12_planes & dst, const nv12_coefficients &, uint32_t first_row, uint32_t last_row);
+void convert_to_nv12_scalar(const host_frame & src, const nv12_planes & dst, const nv12_coefficients &, uint32_t first_row, uint32_t last_row);
+
+// Name of the selected implementation
+const char * nv12_convert_isa();
+
+// Converts whole frames, split in bands of rows over a fixed set of threads.
+// The calling thread converts the first band.
+class nv12_converter
+{
+public:
+	struct config
+	{
+		color_matrix matrix = color_matrix::bt709;
+		color_range range = color_range::limited;
+		// including the calling thread
+		uint32_t threads = 1;
+	};
+
+private:
+	nv12_coefficients coefficients;
+
+	// job shared with the workers, valid while pending is not 0
+	const host_frame * src = nullptr;
+	const nv12_planes * dst = nullptr;
+	uint32_t band_count = 1;
+
+	std::atomic<uint64_t> generation = 0;
+	std::atomic<uint32_t> pending = 0;
+	std::atomic<bool> quit = false;
+	std::vector<std::thread> workers;
+
+	void convert_band(uint32_t band);
+	void run(uint32_t band);
+
+public:
+	nv12_converter(const config & cfg);
+	nv12_converter() :
+	        nv12_converter(config{}) {}
+	nv12_converter(const nv12_converter &) = delete;
+	~nv12_converter();
+
+	// Not thread safe, returns once the whole frame is converted
+	void convert(const host_frame & src, const nv12_planes & dst);
+
+	uint32_t threads() const
+	{
+		return workers.size() + 1;
+	}
+};
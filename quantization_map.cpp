@@ -0,0 +1,59 @@
+#include "quantization_map.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+delta_qp_map::delta_qp_map(uint32_t picture_width, uint32_t picture_height, uint32_t texel_width, uint32_t texel_height) :
+        texel_width(texel_width), texel_height(texel_height)
+{
+	if (texel_width == 0 or texel_height == 0)
+		throw std::invalid_argument("delta_qp_map: empty texel");
+	width = (picture_width + texel_width - 1) / texel_width;
+	height = (picture_height + texel_height - 1) / texel_height;
+	values.resize(size_t(width) * height);
+}
+
+void delta_qp_map::add(const qp_region & region)
+{
+	if (region.width == 0 or region.height == 0)
+		return;
+
+	// texels from the one holding the first pixel to the one holding the
+	// last, 64 bits so that regions up to UINT32_MAX do not wrap
+	uint64_t x0 = region.x / texel_width;
+	uint64_t y0 = region.y / texel_height;
+	uint64_t x1 = std::min<uint64_t>((uint64_t(region.x) + region.width - 1) / texel_width + 1, width);
+	uint64_t y1 = std::min<uint64_t>((uint64_t(region.y) + region.height - 1) / texel_height + 1, height);
+	if (x0 >= x1 or y0 >= y1)
+		return;
+
+	int8_t value = std::clamp<int32_t>(region.delta_qp, INT8_MIN, INT8_MAX);
+	for (uint64_t y = y0; y < y1; ++y)
+		std::fill(values.begin() + y * width + x0, values.begin() + y * width + x1, value);
+}
+
+void delta_qp_map::clamp(int32_t min_delta, int32_t max_delta)
+{
+	if (min_delta > max_delta)
+		throw std::invalid_argument("delta_qp_map: empty range");
+	for (auto & v: values)
+		v = std::clamp<int32_t>(v, min_delta, max_delta);
+}
+
+bool delta_qp_map::empty() const
+{
+	return std::ranges::all_of(values, [](int8_t v) { return v == 0; });
+}
+
+delta_qp_map make_delta_qp_map(uint32_t picture_width,
+                               uint32_t picture_height,
+                               uint32_t texel_width,
+                               uint32_t texel_height,
+                               std::span<const qp_region> regions)
+{
+	delta_qp_map map(picture_width, picture_height, texel_width, texel_height);
+	for (const auto & region: regions)
+		map.add(region);
+	return map;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Rectangle of the picture in pixels, coded with a QP offset: negative
+// values spend more bits on the region, positive values fewer.
+struct qp_region
+{
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	int32_t delta_qp = 0;
+};
+
+// QP offsets of the blocks of a picture, row major, one texel per
+// texel_width x texel_height pixels. This is the content of a quantization
+// delta map image (VK_KHR_video_encode_quantization_map).
+struct delta_qp_map
+{
+	// size of a texel, in pixels
+	uint32_t texel_width = 16;
+	uint32_t texel_height = 16;
+	// in texels
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<int8_t> values;
+
+	delta_qp_map() = default;
+	// Map of zeros covering a picture_width x picture_height picture, partial
+	// texels on the right and bottom edges included
+	delta_qp_map(uint32_t picture_width, uint32_t picture_height, uint32_t texel_width, uint32_t texel_height);
+
+	int8_t & at(uint32_t x, uint32_t y)
+	{
+		return values[y * width + x];
+	}
+	int8_t at(uint32_t x, uint32_t y) const
+	{
+		return values[y * width + x];
+	}
+
+	// Sets the texels the region overlaps, even partially, so that the
+	// region edges get its QP. Later regions overwrite earlier ones:
+	// add backgrounds first, then the details on top of them.
+	void add(const qp_region &);
+	// Limits the values to what the implementation supports
+	void clamp(int32_t min_delta, int32_t max_delta);
+
+	// All texels are 0, the map would not change anything
+	bool empty() const;
+};
+
+// Map for regions in order, see delta_qp_map::add
+delta_qp_map make_delta_qp_map(uint32_t picture_width,
+                               uint32_t picture_height,
+                               uint32_t texel_width,
+                               uint32_t texel_height,
+                               std::span<const qp_region> regions);
@@ -0,0 +1,78 @@
+#include "range_allocator.h"
+
+#include <cassert>
+#include <iterator>
+
+range_allocator::range_allocator(uint64_t size) :
+        size(size), free_bytes(size)
+{
+	if (size > 0)
+		free_ranges.emplace(0, size);
+}
+
+std::optional<uint64_t> range_allocator::allocate(uint64_t size, uint64_t alignment)
+{
+	if (size == 0)
+		return {};
+	if (alignment == 0)
+		alignment = 1;
+
+	auto best = free_ranges.end();
+	uint64_t best_offset = 0;
+	for (auto i = free_ranges.begin(); i != free_ranges.end(); ++i)
+	{
+		auto [offset, length] = *i;
+		uint64_t aligned = alignment * ((offset + alignment - 1) / alignment);
+		if (aligned + size > offset + length)
+			continue;
+		if (best == free_ranges.end() or length < best->second)
+		{
+			best = i;
+			best_offset = aligned;
+			if (length == size)
+				break;
+		}
+	}
+
+	if (best == free_ranges.end())
+		return {};
+
+	auto [offset, length] = *best;
+	free_ranges.erase(best);
+	if (best_offset > offset)
+		free_ranges.emplace(offset, best_offset - offset);
+	if (best_offset + size < offset + length)
+		free_ranges.emplace(best_offset + size, offset + length - best_offset - size);
+
+	free_bytes -= size;
+	return best_offset;
+}
+
+void range_allocator::free(uint64_t offset, uint64_t size)
+{
+	assert(offset + size <= this->size);
+	free_bytes += size;
+
+	auto next = free_ranges.lower_bound(offset);
+	assert(next == free_ranges.end() or next->first >= offset + size);
+
+	if (next != free_ranges.begin())
+	{
+		auto prev = std::prev(next);
+		assert(prev->first + prev->second <= offset);
+		if (prev->first + prev->second == offset)
+		{
+			offset = prev->first;
+			size += prev->second;
+			free_ranges.erase(prev);
+		}
+	}
+
+	if (next != free_ranges.end() and next->first == offset + size)
+	{
+		size += next->second;
+		free_ranges.erase(next);
+	}
+
+	free_ranges.emplace(offset, size);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+
+// Free list over a range of [0, size), used to suballocate device memory blocks.
+// Adjacent free ranges are merged when freeing.
+class range_allocator
+{
+	uint64_t size;
+	uint64_t free_bytes;
+	// offset -> size of each free range
+	std::map<uint64_t, uint64_t> free_ranges;
+
+public:
+	range_allocator(uint64_t size);
+
+	// Best fit allocation, returns the offset of the allocated range
+	std::optional<uint64_t> allocate(uint64_t size, uint64_t alignment);
+	void free(uint64_t offset, uint64_t size);
+
+	uint64_t capacity() const
+	{
+		return size;
+	}
+
+	uint64_t available() const
+	{
+		return free_bytes;
+	}
+
+	bool empty() const
+	{
+		return free_bytes == size;
+	}
+
+	size_t fragments() const
+	{
+		return free_ranges.size();
+	}
+};
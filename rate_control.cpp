@@ -0,0 +1,64 @@
+#include "rate_control.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+vbv_model::vbv_model(const rate_control & rc) :
+        cbr(rc.rc_mode == rate_control::mode::cbr)
+{
+	if (rc.framerate_num == 0 or rc.framerate_den == 0)
+		throw std::invalid_argument("invalid frame rate");
+
+	// sizes are relative to the average bitrate, as virtualBufferSizeInMs
+	double bitrate = rc.target_bitrate;
+	framerate = double(rc.framerate_num) / rc.framerate_den;
+	buffer_size = bitrate * rc.virtual_buffer_size_ms / 1000;
+	bits_per_frame = rc.peak_bitrate() / framerate;
+	fullness = std::min<double>(bitrate * rc.initial_virtual_buffer_size_ms / 1000, buffer_size);
+}
+
+vbv_model::result vbv_model::add_frame(size_t frame_bytes)
+{
+	double bits = 8. * frame_bytes;
+	++frames;
+	total_bits += 8 * frame_bytes;
+
+	result r{};
+	if (bits > fullness)
+	{
+		// the decoder would have to wait for the end of the frame
+		r.underflow = true;
+		++underflow_count;
+		fullness = 0;
+	}
+	else
+	{
+		fullness -= bits;
+	}
+	r.fullness = fullness;
+
+	fullness += bits_per_frame;
+	if (fullness > buffer_size)
+	{
+		if (cbr)
+		{
+			r.overflow = true;
+			++overflow_count;
+		}
+		fullness = buffer_size;
+	}
+
+	return r;
+}
+
+size_t vbv_model::max_frame_bytes() const
+{
+	return fullness / 8;
+}
+
+double vbv_model::average_bitrate() const
+{
+	if (frames == 0)
+		return 0;
+	return total_bits * framerate / frames;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct rate_control
+{
+	enum class mode
+	{
+		// whatever the implementation does without rate control information
+		driver_default,
+		// constant bitrate, at target_bitrate
+		cbr,
+		// variable bitrate, averaging target_bitrate, capped at max_bitrate
+		vbr,
+		// rate control disabled, fixed QP per frame type
+		cqp,
+	};
+	mode rc_mode = mode::driver_default;
+
+	// in bits per second
+	uint64_t target_bitrate = 10'000'000;
+	// 0 for target_bitrate
+	uint64_t max_bitrate = 0;
+
+	// Size of the decoder buffer, and its fullness when the first frame is
+	// decoded, in milliseconds at target_bitrate
+	uint32_t virtual_buffer_size_ms = 1000;
+	uint32_t initial_virtual_buffer_size_ms = 500;
+
+	uint32_t framerate_num = 60;
+	uint32_t framerate_den = 1;
+
+	// for cqp, clamped to what the implementation supports
+	int32_t qp_i = 26;
+	int32_t qp_p = 28;
+
+	uint64_t peak_bitrate() const
+	{
+		if (rc_mode == mode::cbr or max_bitrate == 0)
+			return target_bitrate;
+		return max_bitrate;
+	}
+};
+
+// Host model of the hypothetical decoder buffer (H.264 annex C), fed with
+// the byte counts of encoded frames.
+// The buffer is sized at the target bitrate and fills at the peak bitrate,
+// each frame is removed at once when it is decoded. A frame larger than the
+// buffer content underflows, in CBR the buffer must not be full when a frame arrives or it overflows
+// (the encoder would need filler data), in VBR arrival pauses instead.
+class vbv_model
+{
+	double buffer_size;
+	double framerate;
+	// bits entering the buffer between two frames
+	double bits_per_frame;
+	bool cbr;
+
+	double fullness;
+	uint64_t frames = 0;
+	uint64_t total_bits = 0;
+	uint64_t underflow_count = 0;
+	uint64_t overflow_count = 0;
+
+public:
+	vbv_model(const rate_control &);
+
+	struct result
+	{
+		// buffer fullness after the frame was removed, in bits
+		double fullness;
+		bool underflow;
+		bool overflow;
+	};
+
+	// Account for an encoded frame of frame_bytes
+	result add_frame(size_t frame_bytes);
+
+	// Largest frame that can be removed now without underflowing
+	size_t max_frame_bytes() const;
+
+	// Fullness when the next frame is removed, in bits
+	double level() const
+	{
+		return fullness;
+	}
+	// in bits
+	double capacity() const
+	{
+		return buffer_size;
+	}
+	uint64_t underflows() const
+	{
+		return underflow_count;
+	}
+	uint64_t overflows() const
+	{
+		return overflow_count;
+	}
+
+	// Bitrate actually produced, in bits per second
+	double average_bitrate() const;
+};
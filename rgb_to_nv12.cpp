@@ -0,0 +1,274 @@
+#include "rgb_to_nv12.h"
+
+#include "spirv_rgb_to_nv12.h"
+
+namespace
+{
+const uint32_t sets_per_pool = 16;
+// as in rgb_to_nv12.comp
+const uint32_t local_size = 8;
+} // namespace
+
+rgb_to_nv12::rgb_to_nv12(vk::Device device, const config & cfg) :
+        device(device), matrix(make_ycbcr_matrix(cfg.matrix, cfg.range))
+{
+	sampler = device.createSampler({
+	        .magFilter = vk::Filter::eNearest,
+	        .minFilter = vk::Filter::eNearest,
+	        .mipmapMode = vk::SamplerMipmapMode::eNearest,
+	        .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+	        .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+	        .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+	});
+
+	std::array ds_layout_binding{
+	        vk::DescriptorSetLayoutBinding{
+	                .binding = 0,
+	                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+	                .descriptorCount = 1,
+	                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+	                .pImmutableSamplers = &sampler,
+	        },
+	        vk::DescriptorSetLayoutBinding{
+	                .binding = 1,
+	                .descriptorType = vk::DescriptorType::eStorageImage,
+	                .descriptorCount = 1,
+	                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+	        },
+	        vk::DescriptorSetLayoutBinding{
+	                .binding = 2,
+	                .descriptorType = vk::DescriptorType::eStorageImage,
+	                .descriptorCount = 1,
+	                .stageFlags = vk::ShaderStageFlagBits::eCompute,
+	        },
+	};
+
+	ds_layout = device.createDescriptorSetLayout({
+	        .bindingCount = ds_layout_binding.size(),
+	        .pBindings = ds_layout_binding.data(),
+	});
+
+	vk::PushConstantRange pc_range{
+	        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+	        .offset = 0,
+	        .size = sizeof(ycbcr_matrix),
+	};
+
+	layout = device.createPipelineLayout({
+	        .setLayoutCount = 1,
+	        .pSetLayouts = &ds_layout,
+	        .pushConstantRangeCount = 1,
+	        .pPushConstantRanges = &pc_range,
+	});
+
+	auto shader = device.createShaderModule({
+	        .codeSize = sizeof(spirv_rgb_to_nv12),
+	        .pCode = spirv_rgb_to_nv12,
+	});
+
+	vk::Result res;
+	std::tie(res, pipeline) = device.createComputePipeline(
+	        nullptr, vk::ComputePipelineCreateInfo{
+	                         .stage = {
+	                                 .stage = vk::ShaderStageFlagBits::eCompute,
+	                                 .module = shader,
+	                                 .pName = "main",
+	                         },
+	                         .layout = layout,
+	                 });
+	device.destroyShaderModule(shader);
+}
+
+rgb_to_nv12::~rgb_to_nv12()
+{
+	clear_cache();
+	for (auto pool: pools)
+		device.destroy(pool);
+	device.destroy(pipeline);
+	device.destroy(layout);
+	device.destroy(ds_layout);
+	device.destroy(sampler);
+}
+
+void rgb_to_nv12::set_config(const config & cfg)
+{
+	matrix = make_ycbcr_matrix(cfg.matrix, cfg.range);
+}
+
+vk::DescriptorSet rgb_to_nv12::allocate_set()
+{
+	if (not pools.empty())
+	{
+		try
+		{
+			return device.allocateDescriptorSets({
+			        .descriptorPool = pools.back(),
+			        .descriptorSetCount = 1,
+			        .pSetLayouts = &ds_layout,
+			})[0];
+		}
+		catch (vk::OutOfPoolMemoryError &)
+		{
+		}
+	}
+
+	std::array pool_size{
+	        vk::DescriptorPoolSize{
+	                .type = vk::DescriptorType::eCombinedImageSampler,
+	                .descriptorCount = sets_per_pool,
+	        },
+	        vk::DescriptorPoolSize{
+	                .type = vk::DescriptorType::eStorageImage,
+	                .descriptorCount = 2 * sets_per_pool,
+	        },
+	};
+	pools.push_back(device.createDescriptorPool({
+	        .maxSets = sets_per_pool,
+	        .poolSizeCount = pool_size.size(),
+	        .pPoolSizes = pool_size.data(),
+	}));
+
+	return device.allocateDescriptorSets({
+	        .descriptorPool = pools.back(),
+	        .descriptorSetCount = 1,
+	        .pSetLayouts = &ds_layout,
+	})[0];
+}
+
+const rgb_to_nv12::targets & rgb_to_nv12::get_targets(vk::ImageView source, vk::ImageLayout source_layout, vk::Image destination)
+{
+	auto key = std::make_pair(VkImageView(source), VkImage(destination));
+	if (auto it = cache.find(key); it != cache.end())
+		return it->second;
+
+	targets t{};
+
+	// plane views of the multi-planar image, only used for storage
+	vk::ImageViewUsageCreateInfo view_usage{
+	        .usage = vk::ImageUsageFlagBits::eStorage,
+	};
+	std::array formats = {vk::Format::eR8Unorm, vk::Format::eR8G8Unorm};
+	std::array aspects = {vk::ImageAspectFlagBits::ePlane0, vk::ImageAspectFlagBits::ePlane1};
+	for (int i = 0; i < 2; ++i)
+	{
+		auto & view = i == 0 ? t.y : t.cbcr;
+		view = device.createImageView({
+		        .pNext = &view_usage,
+		        .image = destination,
+		        .viewType = vk::ImageViewType::e2D,
+		        .format = formats[i],
+		        .subresourceRange = {.aspectMask = aspects[i],
+		                             .baseMipLevel = 0,
+		                             .levelCount = 1,
+		                             .baseArrayLayer = 0,
+		                             .layerCount = 1},
+		});
+	}
+
+	t.set = allocate_set();
+
+	vk::DescriptorImageInfo desc_img_info_source{
+	        .imageView = source,
+	        .imageLayout = source_layout,
+	};
+	vk::DescriptorImageInfo desc_img_info_y{
+	        .imageView = t.y,
+	        .imageLayout = vk::ImageLayout::eGeneral,
+	};
+	vk::DescriptorImageInfo desc_img_info_cbcr{
+	        .imageView = t.cbcr,
+	        .imageLayout = vk::ImageLayout::eGeneral,
+	};
+
+	device.updateDescriptorSets(
+	        {
+	                vk::WriteDescriptorSet{
+	                        .dstSet = t.set,
+	                        .dstBinding = 0,
+	                        .descriptorCount = 1,
+	                        .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+	                        .pImageInfo = &desc_img_info_source,
+	                },
+	                vk::WriteDescriptorSet{
+	                        .dstSet = t.set,
+	                        .dstBinding = 1,
+	                        .descriptorCount = 1,
+	                        .descriptorType = vk::DescriptorType::eStorageImage,
+	                        .pImageInfo = &desc_img_info_y,
+	                },
+	                vk::WriteDescriptorSet{
+	                        .dstSet = t.set,
+	                        .dstBinding = 2,
+	                        .descriptorCount = 1,
+	                        .descriptorType = vk::DescriptorType::eStorageImage,
+	                        .pImageInfo = &desc_img_info_cbcr,
+	                },
+	        },
+	        nullptr);
+
+	return cache.emplace(key, t).first->second;
+}
+
+void rgb_to_nv12::clear_cache()
+{
+	for (auto & [key, t]: cache)
+	{
+		device.destroy(t.y);
+		device.destroy(t.cbcr);
+	}
+	cache.clear();
+	for (auto pool: pools)
+		device.resetDescriptorPool(pool);
+}
+
+void rgb_to_nv12::record(vk::CommandBuffer cmd_buf,
+                         vk::ImageView source,
+                         vk::ImageLayout source_layout,
+                         vk::Image destination,
+                         vk::Extent2D extent,
+                         uint32_t src_family,
+                         uint32_t dst_family)
+{
+	const targets & t = get_targets(source, source_layout, destination);
+
+	// previous content is discarded
+	vk::ImageMemoryBarrier2 barrier{
+	        .srcStageMask = vk::PipelineStageFlagBits2KHR::eNone,
+	        .srcAccessMask = vk::AccessFlagBits2::eNone,
+	        .dstStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader,
+	        .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+	        .oldLayout = vk::ImageLayout::eUndefined,
+	        .newLayout = vk::ImageLayout::eGeneral,
+	        .image = destination,
+	        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+	                             .baseMipLevel = 0,
+	                             .levelCount = 1,
+	                             .baseArrayLayer = 0,
+	                             .layerCount = 1},
+	};
+	vk::DependencyInfo dep_info{};
+	dep_info.setImageMemoryBarriers(barrier);
+	cmd_buf.pipelineBarrier2(dep_info);
+
+	cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
+	cmd_buf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, layout, 0, t.set, {});
+	cmd_buf.pushConstants<ycbcr_matrix>(layout, vk::ShaderStageFlagBits::eCompute, 0, matrix);
+
+	// one invocation per chroma sample
+	uint32_t chroma_width = (extent.width + 1) / 2;
+	uint32_t chroma_height = (extent.height + 1) / 2;
+	cmd_buf.dispatch((chroma_width + local_size - 1) / local_size, (chroma_height + local_size - 1) / local_size, 1);
+
+	if (src_family != dst_family)
+	{
+		barrier.srcStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader;
+		barrier.srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite;
+		barrier.dstStageMask = vk::PipelineStageFlagBits2KHR::eNone;
+		barrier.dstAccessMask = vk::AccessFlagBits2::eNone;
+		barrier.oldLayout = vk::ImageLayout::eGeneral;
+		barrier.newLayout = vk::ImageLayout::eVideoEncodeSrcKHR;
+		barrier.srcQueueFamilyIndex = src_family;
+		barrier.dstQueueFamilyIndex = dst_family;
+		cmd_buf.pipelineBarrier2(dep_info);
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <map>
+#include <utility>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+#include "color_space.h"
+
+// Compute stage converting an RGB image to the two planes of an NV12 encoder
+// input image, created with encoder_settings::input_storage. The planes are
+// written through R8 and R8G8 views, without intermediate images or copies.
+//
+// The source is read through a sampler, so RGBA and BGRA formats both work.
+// Descriptor sets and plane views are created on first use of each source
+// and destination pair and kept until clear_cache.
+class rgb_to_nv12
+{
+public:
+	struct config
+	{
+		color_matrix matrix = color_matrix::bt709;
+		color_range range = color_range::limited;
+	};
+
+private:
+	struct targets
+	{
+		vk::DescriptorSet set;
+		vk::ImageView y;
+		vk::ImageView cbcr;
+	};
+
+	vk::Device device;
+	ycbcr_matrix matrix;
+
+	vk::Sampler sampler;
+	vk::DescriptorSetLayout ds_layout;
+	vk::PipelineLayout layout;
+	vk::Pipeline pipeline;
+
+	// a new pool is added when the last one is full
+	std::vector<vk::DescriptorPool> pools;
+	std::map<std::pair<VkImageView, VkImage>, targets> cache;
+
+	vk::DescriptorSet allocate_set();
+	const targets & get_targets(vk::ImageView source, vk::ImageLayout source_layout, vk::Image destination);
+
+public:
+	rgb_to_nv12(vk::Device device, const config & cfg);
+	rgb_to_nv12(vk::Device device) :
+	        rgb_to_nv12(device, config{}) {}
+	rgb_to_nv12(const rgb_to_nv12 &) = delete;
+	~rgb_to_nv12();
+
+	// Takes effect for commands recorded afterwards
+	void set_config(const config & cfg);
+
+	// Convert the extent area of source into destination.
+	// source must be in source_layout, with its content visible to compute
+	// shaders. destination is left in general layout: when src_family and
+	// dst_family differ, its ownership is released to dst_family with a
+	// transition to video encode source, as acquired by video_encoder with
+	// encoder_settings::input_layout set to general.
+	void record(vk::CommandBuffer cmd_buf,
+	            vk::ImageView source,
+	            vk::ImageLayout source_layout,
+	            vk::Image destination,
+	            vk::Extent2D extent,
+	            uint32_t src_family,
+	            uint32_t dst_family);
+
+	// Destroy the views and descriptor sets of all pairs, no recorded command
+	// using them may be pending
+	void clear_cache();
+};
@@ -0,0 +1,191 @@
+#include "rtp_packetizer.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "nal_utils.h"
+
+namespace
+{
+const size_t rtp_header_size = 12;
+
+const uint8_t nal_type_idr = 5;
+const uint8_t nal_type_sps = 7;
+const uint8_t nal_type_stap_a = 24;
+const uint8_t nal_type_fu_a = 28;
+
+void write_be16(uint8_t * out, uint16_t value)
+{
+	out[0] = value >> 8;
+	out[1] = value;
+}
+
+void write_be32(uint8_t * out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+} // namespace
+
+rtp_packetizer::rtp_packetizer(const config & cfg) :
+        cfg(cfg), sequence(cfg.initial_sequence)
+{
+	// room for the RTP and FU-A headers and at least one payload byte
+	if (cfg.mtu < rtp_header_size + 3)
+		throw std::invalid_argument("rtp_packetizer: mtu too small");
+}
+
+size_t rtp_packetizer::max_payload() const
+{
+	return cfg.mtu - rtp_header_size;
+}
+
+void rtp_packetizer::set_parameter_sets(std::span<const uint8_t> annexb)
+{
+	parameter_sets.assign(annexb.begin(), annexb.end());
+}
+
+void rtp_packetizer::split_nal_units(std::span<const uint8_t> annexb)
+{
+	for_each_nal_unit(annexb, [this](std::span<const uint8_t> nal) {
+		nal_units.push_back({nal.data(), nal.size()});
+	});
+}
+
+uint8_t * rtp_packetizer::begin_packet(size_t header_size)
+{
+	// headers must not be reallocated once iov points into it
+	headers.resize(rtp_header_size + header_size);
+	iov.clear();
+	iov.push_back({headers.data(), headers.size()});
+	return headers.data() + rtp_header_size;
+}
+
+void rtp_packetizer::add_payload(const uint8_t * data, size_t size)
+{
+	iov.push_back({const_cast<uint8_t *>(data), size});
+}
+
+void rtp_packetizer::emit(bool marker, const packet_callback & on_packet)
+{
+	uint8_t * h = headers.data();
+	// version 2, no padding, no extension, no CSRC
+	h[0] = 0x80;
+	h[1] = (marker ? 0x80 : 0) | (cfg.payload_type & 0x7f);
+	write_be16(h + 2, sequence++);
+	write_be32(h + 4, timestamp);
+	write_be32(h + 8, cfg.ssrc);
+
+	on_packet(iov);
+}
+
+void rtp_packetizer::single(const nal_unit & nal, bool marker, const packet_callback & on_packet)
+{
+	begin_packet(0);
+	add_payload(nal.data, nal.size);
+	emit(marker, on_packet);
+}
+
+void rtp_packetizer::aggregate(std::span<const nal_unit> nals, bool marker, const packet_callback & on_packet)
+{
+	// STAP-A header, then a 16 bits size before each NAL unit
+	uint8_t * h = begin_packet(1 + 2 * nals.size());
+	uint8_t f = 0;
+	uint8_t nri = 0;
+	for (const auto & nal: nals)
+	{
+		f |= nal.data[0] & 0x80;
+		nri = std::max<uint8_t>(nri, nal.data[0] & 0x60);
+	}
+	*h++ = f | nri | nal_type_stap_a;
+
+	// the first size is contiguous with the RTP header
+	write_be16(h, nals[0].size);
+	h += 2;
+	iov[0].iov_len = rtp_header_size + 3;
+	add_payload(nals[0].data, nals[0].size);
+	for (const auto & nal: nals.subspan(1))
+	{
+		write_be16(h, nal.size);
+		iov.push_back({h, 2});
+		h += 2;
+		add_payload(nal.data, nal.size);
+	}
+
+	emit(marker, on_packet);
+}
+
+void rtp_packetizer::fragment(const nal_unit & nal, bool marker, const packet_callback & on_packet)
+{
+	const size_t fragment_size = max_payload() - 2;
+
+	// the NAL unit header is carried by the FU indicator and header
+	uint8_t nal_header = nal.data[0];
+	const uint8_t * data = nal.data + 1;
+	size_t remaining = nal.size - 1;
+
+	bool start = true;
+	while (remaining > 0)
+	{
+		size_t size = std::min(remaining, fragment_size);
+		bool end = size == remaining;
+
+		uint8_t * h = begin_packet(2);
+		h[0] = (nal_header & 0xe0) | nal_type_fu_a;
+		h[1] = (start ? 0x80 : 0) | (end ? 0x40 : 0) | (nal_header & 0x1f);
+		add_payload(data, size);
+		emit(marker and end, on_packet);
+
+		data += size;
+		remaining -= size;
+		start = false;
+	}
+}
+
+void rtp_packetizer::packetize(std::span<const uint8_t> access_unit, uint32_t timestamp, const packet_callback & on_packet)
+{
+	this->timestamp = timestamp;
+
+	nal_units.clear();
+	split_nal_units(access_unit);
+
+	auto has_type = [&](uint8_t type) {
+		return std::ranges::any_of(nal_units, [type](const nal_unit & nal) { return (nal.data[0] & 0x1f) == type; });
+	};
+	if (not parameter_sets.empty() and has_type(nal_type_idr) and not has_type(nal_type_sps))
+	{
+		std::vector<nal_unit> frame_nal_units = std::move(nal_units);
+		nal_units.clear();
+		split_nal_units(parameter_sets);
+		nal_units.insert(nal_units.end(), frame_nal_units.begin(), frame_nal_units.end());
+	}
+
+	const size_t max = max_payload();
+	for (size_t i = 0; i < nal_units.size();)
+	{
+		const auto & nal = nal_units[i];
+		if (nal.size > max)
+		{
+			fragment(nal, i + 1 == nal_units.size(), on_packet);
+			++i;
+			continue;
+		}
+
+		// take as many following NAL units as fit in a STAP-A
+		size_t end = i + 1;
+		if (cfg.aggregate)
+		{
+			size_t size = 1 + 2 + nal.size;
+			while (end < nal_units.size() and size + 2 + nal_units[end].size <= max)
+				size += 2 + nal_units[end++].size;
+		}
+
+		if (end - i > 1)
+			aggregate(std::span(nal_units).subspan(i, end - i), end == nal_units.size(), on_packet);
+		else
+			single(nal, i + 1 == nal_units.size(), on_packet);
+		i = end;
+	}
+}
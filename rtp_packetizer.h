@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include <sys/uio.h>
+
+// RTP payloader for H.264 (RFC 6184, non-interleaved mode).
+// NAL units that fit in a packet are sent as is, or aggregated in STAP-A
+// packets with their neighbours; larger ones are split in FU-A fragments.
+// Packets are returned as scatter/gather lists: headers live in the
+// packetizer, payload entries point into the packetized access unit, so
+// no encoded byte is copied.
+class rtp_packetizer
+{
+public:
+	struct config
+	{
+		// maximum size of an RTP packet, headers included
+		size_t mtu = 1200;
+		uint8_t payload_type = 96;
+		uint32_t ssrc = 0;
+		uint16_t initial_sequence = 0;
+		// use STAP-A for consecutive small NAL units
+		bool aggregate = true;
+	};
+
+	// Called for each packet, the iovecs are valid until it returns
+	using packet_callback = std::function<void(std::span<const iovec>)>;
+
+private:
+	config cfg;
+	uint16_t sequence;
+	uint32_t timestamp;
+
+	// Annex B SPS and PPS, sent before IDR frames
+	std::vector<uint8_t> parameter_sets;
+
+	// storage of the current packet
+	std::vector<uint8_t> headers;
+	std::vector<iovec> iov;
+
+	struct nal_unit
+	{
+		const uint8_t * data;
+		size_t size;
+	};
+	std::vector<nal_unit> nal_units;
+
+	void split_nal_units(std::span<const uint8_t> annexb);
+	uint8_t * begin_packet(size_t header_size);
+	void add_payload(const uint8_t * data, size_t size);
+	void emit(bool marker, const packet_callback &);
+
+	void single(const nal_unit &, bool marker, const packet_callback &);
+	void aggregate(std::span<const nal_unit>, bool marker, const packet_callback &);
+	void fragment(const nal_unit &, bool marker, const packet_callback &);
+
+public:
+	rtp_packetizer(const config &);
+
+	// SPS and PPS in Annex B format, as returned by video_encoder_h264::get_sps_pps
+	void set_parameter_sets(std::span<const uint8_t> annexb);
+
+	// Packetize an access unit in Annex B format, timestamp in the 90kHz
+	// clock. The marker bit is set on its last packet.
+	void packetize(std::span<const uint8_t> access_unit, uint32_t timestamp, const packet_callback & on_packet);
+
+	// Largest payload of a packet
+	size_t max_payload() const;
+
+	// sequence number of the next packet
+	uint16_t next_sequence() const
+	{
+		return sequence;
+	}
+};
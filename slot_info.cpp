@@ -1,6 +1,15 @@
 #include "slot_info.h"
 
 #include <algorithm>
+#include <set>
+#include <stdexcept>
+
+namespace
+{
+// frames whose references are remembered, losses of older frames
+// invalidate every later reference
+const size_t max_history = 1024;
+} // namespace
 
 #ifdef DPB_CHAOS_MODE
 #include <random>
@@ -8,22 +17,272 @@
 static std::mt19937 rnd;
 #endif
 
-size_t slot_info::get_slot()
+slot_info::slot_info(const config & cfg, reference_policy policy) :
+        cfg(cfg), policy(std::move(policy)), slots(slot_count(cfg))
 {
-	auto i = std::ranges::min_element(frames);
-	return i - std::begin(frames);
+	if (cfg.num_short_term == 0)
+		throw std::invalid_argument("slot_info: at least one short-term reference is required");
+	if (cfg.max_active_references == 0 or cfg.max_active_references > cfg.max_references())
+		throw std::invalid_argument("slot_info: invalid number of active references");
+	if (not this->policy)
+		throw std::invalid_argument("slot_info: no reference policy");
 }
 
-std::optional<size_t> slot_info::get_ref()
+std::vector<size_t> slot_info::most_recent(const slot_info &, std::span<const size_t> candidates, size_t max)
 {
 #ifdef DPB_CHAOS_MODE
-	size_t i = rnd() % frames.size();
-	if (frames[i] >= 0 and i != get_slot())
-		return i;
+	return {candidates[rnd() % candidates.size()]};
 #else
-	auto i = std::ranges::max_element(frames);
-	if (*i >= 0)
-		return i - std::begin(frames);
+	candidates = candidates.first(std::min(max, candidates.size()));
+	return {candidates.begin(), candidates.end()};
 #endif
-	return {};
+}
+
+std::vector<size_t> slot_info::prefer_long_term(const slot_info & dpb, std::span<const size_t> candidates, size_t max)
+{
+	std::vector<size_t> res;
+	if (not dpb[candidates[0]].long_term_idx)
+		res.push_back(candidates[0]);
+	for (size_t slot: candidates)
+	{
+		if (res.size() < max and dpb[slot].long_term_idx)
+			res.push_back(slot);
+	}
+	return res;
+}
+
+void slot_info::reset()
+{
+	std::ranges::fill(slots, entry{});
+	max_long_term_idx_plus1.reset();
+	next_long_term_idx = 0;
+	frames_since_long_term = 0;
+	recovering = false;
+	marking_lost = false;
+}
+
+void slot_info::invalidate(int64_t first, int64_t last)
+{
+	std::set<int64_t> lost;
+	// the marking of frames older than the history is not known
+	bool conservative = history.empty() or first < history.front().frame;
+	if (not conservative)
+	{
+		for (const auto & h: history)
+		{
+			bool missing = h.frame >= first and h.frame <= last;
+			bool depends = std::ranges::any_of(h.references, [&](int64_t ref) { return lost.contains(ref); });
+			if (missing or depends)
+				lost.insert(h.frame);
+			// damaged frames are still marked by decoders, missing ones are not
+			if (missing and h.marking)
+				marking_lost = true;
+		}
+	}
+	else
+	{
+		marking_lost = true;
+	}
+
+	for (auto & e: slots)
+	{
+		if (not e.used())
+			continue;
+		if (marking_lost or lost.contains(e.frame))
+			e.invalid = true;
+	}
+	recovering = true;
+}
+
+void slot_info::acknowledge(int64_t frame)
+{
+	// walk back the history for the frames it depends on
+	std::set<int64_t> decoded{frame};
+	for (auto h = history.rbegin(); h != history.rend(); ++h)
+	{
+		if (decoded.contains(h->frame))
+			decoded.insert(h->references.begin(), h->references.end());
+	}
+
+	for (auto & e: slots)
+	{
+		if (e.used() and decoded.contains(e.frame))
+			e.acknowledged = true;
+	}
+}
+
+bool slot_info::has_valid_reference() const
+{
+	return std::ranges::any_of(slots, [](const entry & e) { return e.used() and not e.invalid; });
+}
+
+std::vector<size_t> slot_info::initial_list() const
+{
+	std::vector<size_t> res;
+	for (size_t i = 0; i < slots.size(); ++i)
+	{
+		if (slots[i].used())
+			res.push_back(i);
+	}
+	// short-term by descending PicNum, then long-term by ascending LongTermPicNum
+	std::ranges::sort(res, [this](size_t a, size_t b) {
+		const entry & x = slots[a];
+		const entry & y = slots[b];
+		if (x.long_term_idx.has_value() != y.long_term_idx.has_value())
+			return not x.long_term_idx;
+		if (x.long_term_idx)
+			return *x.long_term_idx < *y.long_term_idx;
+		return x.frame_num > y.frame_num;
+	});
+	return res;
+}
+
+std::optional<size_t> slot_info::oldest_short_term() const
+{
+	std::optional<size_t> res;
+	for (size_t i = 0; i < slots.size(); ++i)
+	{
+		if (slots[i].used() and not slots[i].long_term_idx and (not res or slots[i].frame_num < slots[*res].frame_num))
+			res = i;
+	}
+	return res;
+}
+
+std::vector<slot_info::list_modification> slot_info::modifications(std::span<const size_t> references, uint32_t frame_num) const
+{
+	auto initial = initial_list();
+	if (std::ranges::equal(references, std::span(initial).first(references.size())))
+		return {};
+
+	// frame numbers are not wrapped, so PicNum is frame_num as long as
+	// references are less than MaxFrameNum frames old
+	std::vector<list_modification> res;
+	uint32_t pred = frame_num;
+	for (size_t slot: references)
+	{
+		const entry & ref = slots[slot];
+		if (ref.long_term_idx)
+		{
+			res.push_back({list_modification::long_term, *ref.long_term_idx});
+			continue;
+		}
+		if (ref.frame_num < pred)
+			res.push_back({list_modification::subtract, pred - ref.frame_num - 1});
+		else
+			res.push_back({list_modification::add, ref.frame_num - pred - 1});
+		pred = ref.frame_num;
+	}
+	return res;
+}
+
+slot_info::frame_info slot_info::add_frame(int64_t frame, uint32_t frame_num, bool idr, bool predicted)
+{
+	if (idr)
+		reset();
+	// the recovery point of intra frames: later frames are only predicted
+	// from them and the frames that follow
+	if (not idr and not predicted)
+	{
+		for (auto & e: slots)
+			e.invalid = e.invalid or e.used();
+	}
+
+	frame_info info{};
+	auto free_slot = std::ranges::find_if(slots, [](const entry & e) { return not e.used(); });
+	// the marking process of the previous frame keeps at most max_references
+	info.slot = free_slot - slots.begin();
+	for (size_t i = 0; i < slots.size(); ++i)
+	{
+		if (slots[i].used() and not slots[i].invalid)
+			info.reference_set.push_back(i);
+	}
+
+	if (predicted and not idr)
+	{
+		auto candidates = initial_list();
+		std::erase_if(candidates, [this](size_t slot) { return slots[slot].invalid; });
+		if (recovering and std::ranges::any_of(candidates, [this](size_t slot) { return slots[slot].acknowledged; }))
+			std::erase_if(candidates, [this](size_t slot) { return not slots[slot].acknowledged; });
+		if (candidates.empty())
+			throw std::logic_error("slot_info: no valid reference");
+
+		info.references = policy(*this, candidates, cfg.max_active_references);
+		if (info.references.empty() or info.references.size() > cfg.max_active_references or
+		    std::ranges::any_of(info.references, [&](size_t slot) {
+			    return std::ranges::count(candidates, slot) != 1 or std::ranges::count(info.references, slot) != 1;
+		    }))
+			throw std::logic_error("slot_info: invalid references from policy");
+		info.list_modifications = modifications(info.references, frame_num);
+	}
+
+	// before marking may free the reference slots
+	history_entry h{.frame = frame, .references = {}, .marking = idr};
+	for (size_t slot: info.references)
+		h.references.push_back(slots[slot].frame);
+
+	auto used_count = [this]() {
+		return std::ranges::count_if(slots, [](const entry & e) { return e.used(); });
+	};
+
+	entry current{
+	        .frame = frame,
+	        .frame_num = frame_num,
+	        .long_term_idx = {},
+	        .invalid = false,
+	        .acknowledged = false,
+	};
+	if (idr)
+	{
+		if (cfg.num_long_term > 0)
+		{
+			// long_term_reference_flag sets MaxLongTermFrameIdx to 0
+			current.long_term_idx = 0;
+			max_long_term_idx_plus1 = 1;
+			next_long_term_idx = 1 % cfg.num_long_term;
+		}
+	}
+	else if (cfg.num_long_term > 0 and cfg.long_term_interval > 0 and ++frames_since_long_term >= cfg.long_term_interval)
+	{
+		frames_since_long_term = 0;
+		uint32_t idx = next_long_term_idx;
+		next_long_term_idx = (idx + 1) % cfg.num_long_term;
+
+		// assigning an index unmarks the picture that had it
+		for (auto & e: slots)
+		{
+			if (e.used() and e.long_term_idx == idx)
+				e = {};
+		}
+
+		// the sliding window does not apply with adaptive marking, make
+		// room for the current picture explicitly
+		if (size_t(used_count()) == cfg.max_references())
+		{
+			size_t oldest = *oldest_short_term();
+			info.marking.push_back({marking_operation::unmark_short_term, frame_num - slots[oldest].frame_num - 1});
+			slots[oldest] = {};
+		}
+		if (max_long_term_idx_plus1.value_or(0) < cfg.num_long_term)
+		{
+			max_long_term_idx_plus1 = cfg.num_long_term;
+			info.marking.push_back({marking_operation::max_long_term_idx, cfg.num_long_term});
+		}
+		info.marking.push_back({marking_operation::mark_current_long_term, idx});
+		current.long_term_idx = idx;
+	}
+	else if (size_t(used_count()) == cfg.max_references())
+	{
+		// sliding window
+		slots[*oldest_short_term()] = {};
+	}
+
+	info.long_term_idx = current.long_term_idx;
+	slots[info.slot] = current;
+	h.marking = h.marking or not info.marking.empty();
+
+	history.push_back(std::move(h));
+	if (history.size() > max_history)
+		history.pop_front();
+	recovering = false;
+	return info;
 }
@@ -1,24 +1,203 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <optional>
+#include <span>
 #include <vector>
 
+// Decoded picture buffer state, following the H.264 reference marking
+// process so that the encoder and decoders agree on which pictures are
+// available. Does not depend on Vulkan.
+//
+// Each slot holds one reconstructed picture, there is always one more slot
+// than references so the current picture has somewhere to go.
 class slot_info
 {
-	std::vector<int32_t> frames;
+public:
+	struct config
+	{
+		// References kept by the sliding window, at least 1
+		uint32_t num_short_term = 1;
+		// Long-term reference indices, 0 to disable long-term references.
+		// When enabled, IDR frames are marked long-term with index 0.
+		uint32_t num_long_term = 0;
+		// Mark one frame every long_term_interval frames as long-term,
+		// replacing the oldest long-term reference. 0 to only mark IDR frames.
+		uint32_t long_term_interval = 0;
+		// Maximum number of references of a frame
+		uint32_t max_active_references = 1;
+
+		// max_num_ref_frames of the sequence
+		uint32_t max_references() const
+		{
+			return num_short_term + num_long_term;
+		}
+	};
+
+	struct entry
+	{
+		// index of the frame given to add_frame, -1 if the slot is unused
+		int64_t frame = -1;
+		// not wrapped, counts from the last IDR frame
+		uint32_t frame_num = 0;
+		std::optional<uint32_t> long_term_idx;
+		// lost, predicted from a lost frame or older than the last intra
+		// frame, never used as reference
+		bool invalid = false;
+		// reported as decoded by the receiver
+		bool acknowledged = false;
+
+		bool used() const
+		{
+			return frame >= 0;
+		}
+	};
+
+	// memory_management_control_operation, the end of list (0) is implicit
+	struct marking_operation
+	{
+		enum op_type : uint32_t
+		{
+			unmark_short_term = 1,
+			unmark_long_term = 2,
+			max_long_term_idx = 4,
+			mark_current_long_term = 6,
+		};
+		op_type op;
+		// difference_of_pic_nums_minus1, long_term_pic_num,
+		// max_long_term_frame_idx_plus1 or long_term_frame_idx
+		uint32_t value;
+	};
+
+	// modification_of_pic_nums_idc, the end of list (3) is implicit
+	struct list_modification
+	{
+		enum op_type : uint32_t
+		{
+			subtract = 0,
+			add = 1,
+			long_term = 2,
+		};
+		op_type op;
+		// abs_diff_pic_num_minus1 or long_term_pic_num
+		uint32_t value;
+	};
+
+	struct frame_info
+	{
+		// where the reconstructed picture is stored
+		size_t slot;
+		// slots holding valid references while the frame is decoded, before
+		// its own marking: the H.265 reference picture set
+		std::vector<size_t> reference_set;
+		// RefPicList0, as slot indices
+		std::vector<size_t> references;
+		// empty if references is the start of the initial list
+		std::vector<list_modification> list_modifications;
+		// long_term_reference_flag for IDR frames, MMCO 6 for others
+		std::optional<uint32_t> long_term_idx;
+		// empty for the sliding window
+		std::vector<marking_operation> marking;
+	};
+
+	// Chooses the references of a frame. candidates are the slots of
+	// valid references, in initial list order (short-term from the most
+	// recent, then long-term by index). Returns at most max slot indices,
+	// in RefPicList0 order.
+	using reference_policy = std::function<std::vector<size_t>(const slot_info &, std::span<const size_t> candidates, size_t max)>;
+
+	// The max most recent candidates
+	static std::vector<size_t> most_recent(const slot_info &, std::span<const size_t> candidates, size_t max);
+	// The most recent short-term candidate, then long-term ones
+	static std::vector<size_t> prefer_long_term(const slot_info &, std::span<const size_t> candidates, size_t max);
+
+private:
+	config cfg;
+	reference_policy policy;
+	std::vector<entry> slots;
+
+	// state of decoders, updated by the marking process
+	std::optional<uint32_t> max_long_term_idx_plus1;
+	uint32_t next_long_term_idx = 0;
+	uint32_t frames_since_long_term = 0;
+
+	// references of the last frames, to find which frames depend on lost ones
+	struct history_entry
+	{
+		int64_t frame;
+		std::vector<int64_t> references;
+		// IDR frame or memory management operations, decoders that miss
+		// it no longer have the same references
+		bool marking;
+	};
+	std::deque<history_entry> history;
+	// only use acknowledged references, if any, for the next frame
+	bool recovering = false;
+	// a lost frame changed the marking
+	bool marking_lost = false;
+
+	// used slots in initial list order
+	std::vector<size_t> initial_list() const;
+	std::optional<size_t> oldest_short_term() const;
+	std::vector<list_modification> modifications(std::span<const size_t> references, uint32_t frame_num) const;
 
 public:
-	slot_info(size_t size) :
-	        frames(size, -1) {}
+	slot_info(const config & cfg, reference_policy policy = most_recent);
+	slot_info() :
+	        slot_info(config{}) {}
 
-    std::pair<size_t, std::optional<size_t>> add_frame(int32_t frame);
-	size_t get_slot();
+	// Number of slots needed for cfg
+	static size_t slot_count(const config & cfg)
+	{
+		return cfg.max_references() + 1;
+	}
+	size_t size() const
+	{
+		return slots.size();
+	}
+	const config & get_config() const
+	{
+		return cfg;
+	}
+
+	// Picks a slot and references for the next frame, and updates the
+	// state as decoders will once it is decoded.
+	// frame: increasing index of the frame
+	// frame_num: as coded, not wrapped, 0 for IDR frames
+	// predicted: false for intra frames, requires has_valid_reference() otherwise.
+	// Frames older than an intra frame are not used as references after it.
+	frame_info add_frame(int64_t frame, uint32_t frame_num, bool idr, bool predicted);
 
-	int32_t & operator[](size_t slot)
+	// Mark all slots as unused
+	void reset();
+
+	// Stop using frames first to last as references, and the frames that
+	// were predicted from them. The next frame is predicted from the
+	// acknowledged references if there are any, from the remaining valid
+	// ones otherwise. If a lost frame was an IDR frame or had marking
+	// operations, no reference is left and idr_required() is set.
+	void invalidate(int64_t first, int64_t last);
+	// The receiver decoded frame, and therefore the frames it depends on
+	void acknowledge(int64_t frame);
+	// Whether a predicted frame can be coded, an intra frame is needed otherwise
+	bool has_valid_reference() const;
+	// The DPB of decoders is unknown after the loss of a frame that changed
+	// the marking, only an IDR frame resets it
+	bool idr_required() const
 	{
-		return frames[slot];
+		return marking_lost;
+	}
+	// Frames were invalidated since the last add_frame: decoders show a
+	// damaged picture until the next frame
+	bool recovering_from_loss() const
+	{
+		return recovering;
 	}
 
-	std::optional<size_t> get_ref();
+	const entry & operator[](size_t slot) const
+	{
+		return slots[slot];
+	}
 };
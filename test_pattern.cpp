@@ -4,53 +4,35 @@
 
 #include "spirv_pattern.h"
 
-test_pattern::test_pattern(vk::PhysicalDevice phys_dev, vk::Device dev, vk::Extent2D extent) :
-        device(dev), extent(extent)
+test_pattern::test_pattern(vk::Device dev, mini_vma & allocator, vk::Extent2D extent) :
+        device(dev), allocator(allocator), extent(extent)
 {
-	std::array formats = {vk::Format::eR8Unorm, vk::Format::eR8G8Unorm};
-
-	mini_vma memory_allocator;
-
-	for (int i = 0; i < 2; ++i)
-	{
-		auto & img = i == 0 ? img_y : img_uv;
-		img = dev.createImage({
-		        .imageType = vk::ImageType::e2D,
-		        .format = formats[i],
-		        .extent = {extent.width / (i + 1), extent.height / (i + 1), 1},
-		        .mipLevels = 1,
-		        .arrayLayers = 1,
-		        .samples = vk::SampleCountFlagBits::e1,
-		        .tiling = vk::ImageTiling::eOptimal,
-		        .usage = vk::ImageUsageFlagBits::eStorage |
-		                 vk::ImageUsageFlagBits::eTransferSrc,
-		        .sharingMode = vk::SharingMode::eExclusive,
-		});
+	img = dev.createImage({
+	        .imageType = vk::ImageType::e2D,
+	        .format = vk::Format::eR8G8B8A8Unorm,
+	        .extent = {extent.width, extent.height, 1},
+	        .mipLevels = 1,
+	        .arrayLayers = 1,
+	        .samples = vk::SampleCountFlagBits::e1,
+	        .tiling = vk::ImageTiling::eOptimal,
+	        .usage = vk::ImageUsageFlagBits::eStorage |
+	                 vk::ImageUsageFlagBits::eSampled,
+	        .sharingMode = vk::SharingMode::eExclusive,
+	});
 
-		memory_allocator.request(
-		        device.getImageMemoryRequirements(img), [this, img](vk::DeviceMemory mem, size_t offset) {
-			        device.bindImageMemory(img, mem, offset);
-		        },
-		        vk::MemoryPropertyFlagBits::eDeviceLocal);
-	}
-	mem = memory_allocator.alloc_and_bind(phys_dev, dev);
+	mem.push_back(allocator.bind(img, vk::MemoryPropertyFlagBits::eDeviceLocal));
 
-	for (int i = 0; i < 2; ++i)
-	{
-		auto & view = i == 0 ? view_y : view_uv;
-
-		view = dev.createImageView(
-		        {
-		                .image = i == 0 ? img_y : img_uv,
-		                .viewType = vk::ImageViewType::e2D,
-		                .format = formats[i],
-		                .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
-		                                     .baseMipLevel = 0,
-		                                     .levelCount = 1,
-		                                     .baseArrayLayer = 0,
-		                                     .layerCount = 1},
-		        });
-	}
+	view = dev.createImageView(
+	        {
+	                .image = img,
+	                .viewType = vk::ImageViewType::e2D,
+	                .format = vk::Format::eR8G8B8A8Unorm,
+	                .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+	                                     .baseMipLevel = 0,
+	                                     .levelCount = 1,
+	                                     .baseArrayLayer = 0,
+	                                     .layerCount = 1},
+	        });
 
 	std::array ds_layout_binding{
 	        vk::DescriptorSetLayoutBinding{
@@ -59,12 +41,6 @@ test_pattern::test_pattern(vk::PhysicalDevice phys_dev, vk::Device dev, vk::Exte
 	                .descriptorCount = 1,
 	                .stageFlags = vk::ShaderStageFlagBits::eCompute,
 	        },
-	        vk::DescriptorSetLayoutBinding{
-	                .binding = 1,
-	                .descriptorType = vk::DescriptorType::eStorageImage,
-	                .descriptorCount = 1,
-	                .stageFlags = vk::ShaderStageFlagBits::eCompute,
-	        },
 	};
 
 	ds_layout = dev.createDescriptorSetLayout({
@@ -106,11 +82,11 @@ test_pattern::test_pattern(vk::PhysicalDevice phys_dev, vk::Device dev, vk::Exte
 
 	vk::DescriptorPoolSize pool_size{
 	        .type = vk::DescriptorType::eStorageImage,
-	        .descriptorCount = 2,
+	        .descriptorCount = 1,
 	};
 
 	dp = dev.createDescriptorPool({
-	        .maxSets = 2,
+	        .maxSets = 1,
 	        .poolSizeCount = 1,
 	        .pPoolSizes = &pool_size,
 	});
@@ -121,12 +97,8 @@ test_pattern::test_pattern(vk::PhysicalDevice phys_dev, vk::Device dev, vk::Exte
 	        .pSetLayouts = &ds_layout,
 	})[0];
 
-	vk::DescriptorImageInfo desc_img_info_y{
-	        .imageView = view_y,
-	        .imageLayout = vk::ImageLayout::eGeneral,
-	};
-	vk::DescriptorImageInfo desc_img_info_cb_cr{
-	        .imageView = view_uv,
+	vk::DescriptorImageInfo desc_img_info{
+	        .imageView = view,
 	        .imageLayout = vk::ImageLayout::eGeneral,
 	};
 
@@ -137,55 +109,44 @@ test_pattern::test_pattern(vk::PhysicalDevice phys_dev, vk::Device dev, vk::Exte
 	                        .dstBinding = 0,
 	                        .descriptorCount = 1,
 	                        .descriptorType = vk::DescriptorType::eStorageImage,
-	                        .pImageInfo = &desc_img_info_y,
-	                },
-	                vk::WriteDescriptorSet{
-	                        .dstSet = ds,
-	                        .dstBinding = 1,
-	                        .descriptorCount = 1,
-	                        .descriptorType = vk::DescriptorType::eStorageImage,
-	                        .pImageInfo = &desc_img_info_cb_cr,
+	                        .pImageInfo = &desc_img_info,
 	                },
 	        },
 	        nullptr);
 }
 
+test_pattern::~test_pattern()
+{
+	device.destroy(dp);
+	device.destroy(pipeline);
+	device.destroy(layout);
+	device.destroy(ds_layout);
+	device.destroy(view);
+	device.destroy(img);
+	for (auto & m: mem)
+		allocator.free(m);
+}
+
 void test_pattern::record_draw_commands(vk::CommandBuffer cmd_buf)
 {
-	std::array im_barriers = {
-	        vk::ImageMemoryBarrier2{
-	                .srcStageMask = vk::PipelineStageFlagBits2KHR::eNone,
-	                .srcAccessMask = vk::AccessFlagBits2::eNone,
-	                .dstStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader,
-	                .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
-	                .oldLayout = vk::ImageLayout::eUndefined,
-	                .newLayout = vk::ImageLayout::eGeneral,
-	                .image = img_y,
-	                .subresourceRange = {.aspectMask =
-	                                             vk::ImageAspectFlagBits::eColor,
-	                                     .baseMipLevel = 0,
-	                                     .levelCount = 1,
-	                                     .baseArrayLayer = 0,
-	                                     .layerCount = 1},
-	        },
-	        vk::ImageMemoryBarrier2{
-	                .srcStageMask = vk::PipelineStageFlagBits2KHR::eNone,
-	                .srcAccessMask = vk::AccessFlagBits2::eNone,
-	                .dstStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader,
-	                .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
-	                .oldLayout = vk::ImageLayout::eUndefined,
-	                .newLayout = vk::ImageLayout::eGeneral,
-	                .image = img_uv,
-	                .subresourceRange = {.aspectMask =
-	                                             vk::ImageAspectFlagBits::eColor,
-	                                     .baseMipLevel = 0,
-	                                     .levelCount = 1,
-	                                     .baseArrayLayer = 0,
-	                                     .layerCount = 1},
-	        },
+	// the previous frame may still be read
+	vk::ImageMemoryBarrier2 barrier{
+	        .srcStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader,
+	        .srcAccessMask = vk::AccessFlagBits2::eNone,
+	        .dstStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader,
+	        .dstAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+	        .oldLayout = vk::ImageLayout::eUndefined,
+	        .newLayout = vk::ImageLayout::eGeneral,
+	        .image = img,
+	        .subresourceRange = {.aspectMask =
+	                                     vk::ImageAspectFlagBits::eColor,
+	                             .baseMipLevel = 0,
+	                             .levelCount = 1,
+	                             .baseArrayLayer = 0,
+	                             .layerCount = 1},
 	};
 	vk::DependencyInfo dep_info{};
-	dep_info.setImageMemoryBarriers(im_barriers);
+	dep_info.setImageMemoryBarriers(barrier);
 	cmd_buf.pipelineBarrier2(dep_info);
 
 	cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
@@ -193,16 +154,12 @@ void test_pattern::record_draw_commands(vk::CommandBuffer cmd_buf)
 	cmd_buf.pushConstants<push_constant>(layout, vk::ShaderStageFlagBits::eCompute, 0, counter);
 	cmd_buf.dispatch(extent.width/16, extent.height/16, 1);
 
-	for (auto & barrier: im_barriers)
-	{
-		barrier.srcStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader;
-		barrier.srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite;
-		barrier.dstStageMask = vk::PipelineStageFlagBits2KHR::eTransfer;
-		barrier.dstAccessMask = vk::AccessFlagBits2::eTransferRead;
-		barrier.oldLayout = vk::ImageLayout::eGeneral;
-		barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
-	}
+	barrier.srcStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader;
+	barrier.srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite;
+	barrier.dstStageMask = vk::PipelineStageFlagBits2KHR::eComputeShader;
+	barrier.dstAccessMask = vk::AccessFlagBits2::eShaderSampledRead;
+	barrier.oldLayout = vk::ImageLayout::eGeneral;
+	barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
 	cmd_buf.pipelineBarrier2(dep_info);
 	counter += 10;
-
 }
@@ -3,19 +3,20 @@
 #include <vector>
 #include <vulkan/vulkan.hpp>
 
+#include "memory_allocator.h"
+
 class test_pattern
 {
 	vk::Device device;
+	mini_vma & allocator;
 	vk::Extent2D extent;
 
 public:
-	vk::Image img_y;
-	vk::Image img_uv;
+	// RGBA colour bars
+	vk::Image img;
+	vk::ImageView view;
 private:
-	std::vector<vk::DeviceMemory> mem;
-
-	vk::ImageView view_y;
-	vk::ImageView view_uv;
+	std::vector<mini_vma::allocation> mem;
 
 	vk::DescriptorSetLayout ds_layout = nullptr;
 	vk::PipelineLayout layout = nullptr;
@@ -28,6 +29,10 @@ private:
 	uint32_t counter = 0;
 
 public:
-	test_pattern(vk::PhysicalDevice phys_dev, vk::Device dev, vk::Extent2D extent);
+	// allocator must outlive the test pattern
+	test_pattern(vk::Device dev, mini_vma & allocator, vk::Extent2D extent);
+	test_pattern(const test_pattern &) = delete;
+	~test_pattern();
+	// Leaves img in shader read only layout, visible to compute shaders
 	void record_draw_commands(vk::CommandBuffer cmd_buf);
 };
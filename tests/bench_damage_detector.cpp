@@ -0,0 +1,72 @@
+#include "damage_detector.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace
+{
+// Static frames are the slowest case: every byte is compared
+void bench(const char * name, uint32_t width, uint32_t height, std::mt19937 & rnd)
+{
+	std::vector<uint8_t> data(4 * size_t(width) * height);
+	for (auto & byte: data)
+		byte = rnd();
+	host_frame frame{
+	        .format = host_pixel_format::bgra,
+	        .width = width,
+	        .height = height,
+	        .planes = {data.data()},
+	        .strides = {4 * size_t(width)},
+	};
+	double frame_bytes = data.size();
+
+	printf("%s %ux%u\n", name, width, height);
+	damage_detector detector;
+	detector.detect(frame);
+
+	const int iterations = 100;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+		detector.detect(frame);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	printf("  static   %8.0f MB/s %8.1f fps\n", frame_bytes * iterations / elapsed.count() / 1e6, iterations / elapsed.count());
+
+	// one pixel in each tile: the rest of the tile is skipped
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		for (uint32_t y = 0; y < height; y += 64)
+			for (uint32_t x = 0; x < width; x += 64)
+				++data[4 * (size_t(y) * width + x)];
+		detector.detect(frame);
+	}
+	elapsed = std::chrono::steady_clock::now() - start;
+	printf("  changed  %8.0f MB/s %8.1f fps\n", frame_bytes * iterations / elapsed.count() / 1e6, iterations / elapsed.count());
+
+	std::vector<uint8_t> flags((width + 63) / 64);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		for (uint32_t y = 0; y < height; ++y)
+		{
+			const uint8_t * row = data.data() + 4 * size_t(y) * width;
+			mark_changed_tiles_scalar(row, row, 4 * size_t(width), 4 * 64, flags.data());
+		}
+	}
+	elapsed = std::chrono::steady_clock::now() - start;
+	printf("  scalar   %8.0f MB/s\n", frame_bytes * iterations / elapsed.count() / 1e6);
+}
+} // namespace
+
+int main()
+{
+	printf("implementation: %s\n", damage_detector_isa());
+
+	std::mt19937 rnd(42);
+	bench("bgra", 1920, 1080, rnd);
+	bench("bgra", 3840, 2160, rnd);
+
+	return 0;
+}
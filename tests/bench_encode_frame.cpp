@@ -0,0 +1,100 @@
+#include "mock_vulkan.h"
+#include "video_encoder_h264.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+
+namespace
+{
+// Host time spent in submit_frame and in retiring frames, including the
+// mock entry points. Frames are retired once complete, so waiting for the
+// mock is not counted.
+void bench(const char * name, const encoder_settings & settings, const mock_vulkan::config & cfg, int frames)
+{
+	using clock = std::chrono::steady_clock;
+
+	mock_vulkan::fixture f(cfg);
+	{
+		auto encoder = video_encoder_h264::create(f.ctx.physical_device, f.ctx.device, f.allocator, f.queue, {1920, 1080}, settings);
+
+		clock::duration submit_time{};
+		clock::duration retire_time{};
+		auto retire = [&] {
+			uint64_t value = video_encoder::timeline_value(encoder->next_frame() - encoder->frames_pending());
+			vk::Semaphore semaphore = encoder->encode_semaphore();
+			auto res = f.ctx.device.waitSemaphores(
+			        vk::SemaphoreWaitInfo{
+			                .semaphoreCount = 1,
+			                .pSemaphores = &semaphore,
+			                .pValues = &value,
+			        },
+			        UINT64_MAX);
+			assert(res == vk::Result::eSuccess);
+
+			auto start = clock::now();
+			auto frame = encoder->poll_frame();
+			retire_time += clock::now() - start;
+			assert(frame);
+		};
+
+		auto start = clock::now();
+		for (int i = 0; i < frames; ++i)
+		{
+			if (encoder->frames_pending() == encoder->max_frames_in_flight())
+				retire();
+
+			auto submit_start = clock::now();
+			auto input = encoder->acquire_input_image();
+			encoder->submit_frame(*input, vk::Semaphore{}, f.ctx.queue_family);
+			submit_time += clock::now() - submit_start;
+		}
+		while (encoder->frames_pending())
+			retire();
+		std::chrono::duration<double> elapsed = clock::now() - start;
+
+		std::chrono::duration<double, std::micro> submit_us = submit_time;
+		std::chrono::duration<double, std::micro> retire_us = retire_time;
+		printf("%-28s submit %6.2f us  retire %6.2f us  %8.0f frames/s\n",
+		       name,
+		       submit_us.count() / frames,
+		       retire_us.count() / frames,
+		       frames / elapsed.count());
+	}
+}
+} // namespace
+
+int main()
+{
+	using namespace std::chrono_literals;
+	const int frames = 5000;
+
+	encoder_settings settings;
+	mock_vulkan::config cfg;
+	bench("default", settings, cfg, frames);
+
+	encoder_settings slices = settings;
+	slices.slice_count = 8;
+	bench("8 slices", slices, cfg, frames);
+
+	encoder_settings references = settings;
+	references.references = {.num_short_term = 8, .max_active_references = 4};
+	bench("8 short-term references", references, cfg, frames);
+
+	encoder_settings long_term = settings;
+	long_term.references = {.num_short_term = 2, .num_long_term = 2, .long_term_interval = 10, .max_active_references = 3};
+	bench("long-term references", long_term, cfg, frames);
+
+	encoder_settings staging = settings;
+	staging.readback = encoder_settings::readback_mode::staging;
+	bench("staging readback", staging, cfg, frames);
+
+	// submissions must not block while the device is busy
+	encoder_settings pipelined = settings;
+	pipelined.frames_in_flight = 4;
+	mock_vulkan::config slow = cfg;
+	slow.latency = 1ms;
+	bench("1 ms latency, 4 in flight", pipelined, slow, 500);
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include "nal_utils.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+namespace
+{
+// Random bytes with runs of zeros, so that all patterns occur
+std::vector<uint8_t> make_data(size_t size, int zero_percent, std::mt19937 & rnd)
+{
+	std::vector<uint8_t> data(size);
+	for (auto & byte: data)
+		byte = int(rnd() % 100) < zero_percent ? 0 : rnd() % 5;
+	return data;
+}
+
+template <typename F>
+void measure(const char * name, size_t bytes, F && f)
+{
+	const int iterations = 20;
+	auto start = std::chrono::steady_clock::now();
+	size_t result = 0;
+	for (int i = 0; i < iterations; ++i)
+		result += f();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	printf("  %-36s %6.2f GB/s (%zu)\n", name, bytes * iterations / elapsed.count() / 1e9, result);
+}
+
+void bench(const char * name, const std::vector<uint8_t> & data)
+{
+	printf("%s, %zu bytes\n", name, data.size());
+	const uint8_t * end = data.data() + data.size();
+	auto count_start_codes = [&](auto find) {
+		size_t count = 0;
+		for (const uint8_t * p = find(data.data(), end); p != end; p = find(p + 3, end))
+			++count;
+		return count;
+	};
+	measure("find_start_code", data.size(), [&]() { return count_start_codes(find_start_code); });
+	measure("find_start_code_scalar", data.size(), [&]() { return count_start_codes(find_start_code_scalar); });
+
+	std::vector<uint8_t> out(max_escaped_size(data.size()));
+	measure("remove_emulation_prevention", data.size(), [&]() { return remove_emulation_prevention(data, out.data()); });
+	measure("remove_emulation_prevention_scalar", data.size(), [&]() { return remove_emulation_prevention_scalar(data, out.data()); });
+	measure("add_emulation_prevention", data.size(), [&]() { return add_emulation_prevention(data, out.data()); });
+	measure("add_emulation_prevention_scalar", data.size(), [&]() { return add_emulation_prevention_scalar(data, out.data()); });
+}
+} // namespace
+
+// Optional argument: an Annex B file, such as the out.h264 written by vk_video
+int main(int argc, char ** argv)
+{
+	printf("implementation: %s\n", nal_utils_isa());
+
+	std::mt19937 rnd(42);
+
+	// encoded data rarely has zero bytes
+	auto synthetic = make_data(64 << 20, 1, rnd);
+	for (auto & byte: synthetic)
+		if (byte != 0)
+			byte = 1 + rnd() % 255;
+	for (size_t i = 0; i < synthetic.size(); i += 100'000)
+	{
+		synthetic[i] = synthetic[i + 1] = 0;
+		synthetic[i + 2] = 1;
+	}
+	bench("synthetic", synthetic);
+
+	if (argc > 1)
+	{
+		std::ifstream in(argv[1], std::ios::binary);
+		std::vector<uint8_t> file{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+		bench(argv[1], file);
+	}
+
+	return 0;
+}
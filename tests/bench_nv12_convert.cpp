@@ -0,0 +1,96 @@
+#include "nv12_convert.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace
+{
+struct source
+{
+	host_frame frame;
+	std::vector<uint8_t> data[3];
+
+	source(host_pixel_format format, uint32_t width, uint32_t height, std::mt19937 & rnd) :
+	        frame{.format = format, .width = width, .height = height, .planes = {}, .strides = {}}
+	{
+		int planes = format == host_pixel_format::i420 ? 3 : 1;
+		for (int i = 0; i < planes; ++i)
+		{
+			// padded rows, as with most frame allocators
+			size_t row = i == 0 ? (format == host_pixel_format::i420 ? width : 4 * width) : (width + 1) / 2;
+			size_t rows = i == 0 ? height : (height + 1) / 2;
+			frame.strides[i] = row + 13;
+			data[i].resize(frame.strides[i] * rows);
+			for (auto & byte: data[i])
+				byte = rnd();
+			frame.planes[i] = data[i].data();
+		}
+	}
+};
+
+struct destination
+{
+	nv12_planes planes;
+	std::vector<uint8_t> y;
+	std::vector<uint8_t> cbcr;
+
+	destination(uint32_t width, uint32_t height)
+	{
+		size_t chroma_row = 2 * ((width + 1) / 2);
+		y.resize(width * height);
+		cbcr.resize(chroma_row * ((height + 1) / 2));
+		planes = {y.data(), width, cbcr.data(), chroma_row};
+	}
+};
+
+void bench(host_pixel_format format, const char * name, uint32_t width, uint32_t height, std::mt19937 & rnd)
+{
+	source src(format, width, height, rnd);
+	destination out(width, height);
+	// bytes read
+	double frame_bytes = format == host_pixel_format::i420 ? width * height * 1.5 : width * height * 4.0;
+
+	printf("%s %ux%u\n", name, width, height);
+	uint32_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+	double single = 0;
+	// powers of two, then all cores
+	for (uint32_t threads = 1; threads <= max_threads; threads = threads == max_threads ? threads + 1 : std::min(2 * threads, max_threads))
+	{
+		nv12_converter converter({.threads = threads});
+		const int iterations = 50;
+		converter.convert(src.frame, out.planes);
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; ++i)
+			converter.convert(src.frame, out.planes);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		double rate = frame_bytes * iterations / elapsed.count() / 1e6;
+		if (threads == 1)
+			single = rate;
+		printf("  %2u threads %8.0f MB/s %7.1f fps  scaling %.2f\n", threads, rate, iterations / elapsed.count(), rate / single);
+	}
+
+	auto c = make_nv12_coefficients(make_ycbcr_matrix(color_matrix::bt709, color_range::limited));
+	auto start = std::chrono::steady_clock::now();
+	const int iterations = 10;
+	for (int i = 0; i < iterations; ++i)
+		convert_to_nv12_scalar(src.frame, out.planes, c, 0, height);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	printf("  scalar     %8.0f MB/s\n", frame_bytes * iterations / elapsed.count() / 1e6);
+}
+} // namespace
+
+int main()
+{
+	printf("implementation: %s\n", nv12_convert_isa());
+
+	std::mt19937 rnd(42);
+	bench(host_pixel_format::bgra, "bgra", 1920, 1080, rnd);
+	bench(host_pixel_format::rgba, "rgba", 3840, 2160, rnd);
+	bench(host_pixel_format::i420, "i420", 1920, 1080, rnd);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#include "rtp_packetizer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace
+{
+void append_nal(std::vector<uint8_t> & out, uint8_t header, size_t size, std::mt19937 & rnd)
+{
+	out.insert(out.end(), {0, 0, 0, 1, header});
+	// no zero byte, so that there is no start code in the payload
+	for (size_t i = 1; i < size; ++i)
+		out.push_back(1 + rnd() % 255);
+}
+} // namespace
+
+int main()
+{
+	std::mt19937 rnd(42);
+
+	std::vector<uint8_t> sps_pps;
+	append_nal(sps_pps, 0x67, 20, rnd);
+	append_nal(sps_pps, 0x68, 6, rnd);
+
+	std::vector<uint8_t> idr;
+	append_nal(idr, 0x06, 8, rnd);
+	append_nal(idr, 0x65, 200'000, rnd);
+
+	std::vector<uint8_t> p_frame;
+	append_nal(p_frame, 0x41, 8'000, rnd);
+	append_nal(p_frame, 0x41, 700, rnd);
+	append_nal(p_frame, 0x41, 300, rnd);
+
+	rtp_packetizer packetizer({.mtu = 1200, .ssrc = 1234});
+	packetizer.set_parameter_sets(sps_pps);
+
+	// throughput
+	size_t packets = 0;
+	size_t bytes = 0;
+	auto count = [&](std::span<const iovec> iov) {
+		++packets;
+		for (const auto & v: iov)
+			bytes += v.iov_len;
+	};
+
+	const int iterations = 2000;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+		packetizer.packetize(i % 60 == 0 ? idr : p_frame, i * 1500, count);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	printf("%zu packets, %.1f Mpackets/s, %.2f GB/s\n",
+	       packets,
+	       packets / elapsed.count() / 1e6,
+	       bytes / elapsed.count() / 1e9);
+	return 0;
+}
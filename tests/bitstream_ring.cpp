@@ -0,0 +1,82 @@
+#include "bitstream_ring.h"
+
+#include <cassert>
+#include <deque>
+#include <vector>
+
+int main()
+{
+	std::vector<uint8_t> buffer(1000);
+
+	// the newest reservation is trimmed, older ones keep their whole size
+	{
+		bitstream_ring ring(buffer.data(), buffer.size(), 10);
+		auto a = ring.allocate(300);
+		assert(a and a->offset == 0 and a->size == 300);
+		auto r = ring.commit(*a, 0, 15);
+		assert(r.size() == 15 and ring.used() == 20);
+
+		auto b = ring.allocate(300);
+		auto c = ring.allocate(300);
+		assert(b->offset == 20 and c->offset == 320);
+		auto rb = ring.commit(*b, 5, 10);
+		assert(rb.data().data() == buffer.data() + 25);
+		assert(ring.used() == 620);
+		auto rc = ring.commit(*c, 0, 1);
+		assert(ring.used() == 330);
+
+		// out of order release, reclaimed once older regions are free
+		rb.reset();
+		assert(ring.used() == 330);
+		r.reset();
+		assert(ring.used() == 10);
+		rc.reset();
+		assert(ring.used() == 0);
+	}
+
+	// wrapping, and a full ring
+	{
+		bitstream_ring ring(buffer.data(), buffer.size(), 1);
+		auto a = ring.allocate(400);
+		auto b = ring.allocate(400);
+		assert(b and b->offset == 400);
+		assert(not ring.allocate(400));
+		ring.cancel(*a);
+		auto c = ring.allocate(400);
+		assert(c and c->offset == 0);
+		// the end of the buffer, skipped when wrapping, counts as used
+		assert(ring.used() == 1000);
+		assert(not ring.allocate(1001));
+	}
+
+	// An encoder with frames in flight and a consumer holding the last
+	// frames: each held region pins a whole reservation, the ring needs one
+	// per frame in flight and per held frame, plus two for wrapping and
+	// prefixes, as with the default encoder_settings::output_buffer_size
+	{
+		const size_t frame_size = 4096;
+		const size_t in_flight = 2;
+		const size_t held = 30;
+		std::vector<uint8_t> memory((in_flight + held + 2) * frame_size);
+		bitstream_ring ring(memory.data(), memory.size(), 256);
+
+		std::deque<bitstream_ring::allocation> pending;
+		std::deque<bitstream_ring::region> regions;
+		for (int frame = 0; frame < 500; ++frame)
+		{
+			if (pending.size() == in_flight)
+			{
+				regions.push_back(ring.commit(pending.front(), 0, 100 + frame % 700));
+				pending.pop_front();
+				if (regions.size() > held)
+					regions.pop_front();
+			}
+			// keyframes start with parameter sets
+			auto a = ring.allocate(frame_size + (frame % 5 == 0 ? 256 : 0));
+			assert(a);
+			pending.push_back(*a);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+#include "bounded_queue.h"
+
+#include <atomic>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+int main()
+{
+	// FIFO order, capacity rounded up to a power of two
+	{
+		bounded_queue<int> q(3);
+		assert(q.capacity() == 4 and q.size() == 0);
+		int value;
+		assert(not q.try_pop(value));
+		for (int round = 0; round < 3; ++round)
+		{
+			for (int i = 0; i < 4; ++i)
+				assert(q.try_push(i));
+			assert(not q.try_push(4) and q.size() == 4);
+			for (int i = 0; i < 4; ++i)
+				assert(q.try_pop(value) and value == i);
+			assert(not q.try_pop(value) and q.size() == 0);
+		}
+		assert(bounded_queue<int>(0).capacity() == 2);
+	}
+
+	// several producers and consumers: every value is popped once, and the
+	// values of each producer in order
+	{
+		const int producers = 4;
+		const int consumers = 4;
+		const int count = 100'000;
+		bounded_queue<int> q(64);
+		std::vector<std::vector<int>> popped(consumers);
+
+		std::vector<std::thread> threads;
+		for (int p = 0; p < producers; ++p)
+		{
+			threads.emplace_back([&q, p]() {
+				for (int i = 0; i < count; ++i)
+				{
+					while (not q.try_push(p * count + i))
+						std::this_thread::yield();
+				}
+			});
+		}
+		std::atomic<int> remaining = producers * count;
+		for (int c = 0; c < consumers; ++c)
+		{
+			threads.emplace_back([&, c]() {
+				int value;
+				while (remaining > 0)
+				{
+					if (q.try_pop(value))
+					{
+						popped[c].push_back(value);
+						--remaining;
+					}
+					else
+						std::this_thread::yield();
+				}
+			});
+		}
+		for (auto & t: threads)
+			t.join();
+
+		std::vector<int> seen(producers * count, 0);
+		for (const auto & values: popped)
+		{
+			std::vector<int> last(producers, -1);
+			for (int value: values)
+			{
+				++seen[value];
+				assert(value % count > last[value / count]);
+				last[value / count] = value % count;
+			}
+		}
+		for (int n: seen)
+			assert(n == 1);
+		assert(q.size() == 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include "damage_detector.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace
+{
+struct frame_data
+{
+	host_frame frame;
+	std::vector<uint8_t> data[3];
+
+	frame_data(host_pixel_format format, uint32_t width, uint32_t height) :
+	        frame{.format = format, .width = width, .height = height, .planes = {}, .strides = {}}
+	{
+		int planes = format == host_pixel_format::i420 ? 3 : 1;
+		for (int i = 0; i < planes; ++i)
+		{
+			// padded rows, the padding must not be compared
+			size_t row = i == 0 ? (format == host_pixel_format::i420 ? width : 4 * width) : (width + 1) / 2;
+			size_t rows = i == 0 ? height : (height + 1) / 2;
+			frame.strides[i] = row + 7;
+			data[i].resize(frame.strides[i] * rows, 0x80);
+			frame.planes[i] = data[i].data();
+		}
+	}
+
+	uint8_t & at(int plane, uint32_t x, uint32_t y)
+	{
+		return data[plane][y * frame.strides[plane] + x];
+	}
+};
+
+using rects = std::vector<damage_rect>;
+
+rects detect(damage_detector & d, const frame_data & f)
+{
+	auto r = d.detect(f.frame);
+	return {r.begin(), r.end()};
+}
+} // namespace
+
+int main()
+{
+	// selected implementation against the reference, one differing byte at
+	// each position of rows of all sizes
+	{
+		std::mt19937 rnd(42);
+		for (size_t size = 0; size < 300; ++size)
+		{
+			std::vector<uint8_t> a(size);
+			for (auto & byte: a)
+				byte = rnd();
+			for (size_t tile: {size_t(1), size_t(16), size_t(40), size_t(256)})
+			{
+				std::vector<uint8_t> flags((size + tile - 1) / tile + 1, 0);
+				mark_changed_tiles(a.data(), a.data(), size, tile, flags.data());
+				assert(std::ranges::count(flags, 0) == ptrdiff_t(flags.size()));
+
+				for (size_t i = 0; i < size; ++i)
+				{
+					auto b = a;
+					b[i] ^= 0x10;
+					std::vector<uint8_t> ref(flags.size(), 0);
+					std::vector<uint8_t> out(flags.size(), 0);
+					mark_changed_tiles_scalar(b.data(), a.data(), size, tile, ref.data());
+					mark_changed_tiles(b.data(), a.data(), size, tile, out.data());
+					assert(out == ref);
+					assert(out[i / tile] == 1 and std::ranges::count(out, 1) == 1);
+				}
+			}
+		}
+
+		// flags already set are kept
+		uint8_t a[8] = {};
+		uint8_t flags[2] = {1, 0};
+		mark_changed_tiles(a, a, 8, 4, flags);
+		assert(flags[0] == 1 and flags[1] == 0);
+	}
+
+	// first frame, identical frame, one changed pixel
+	{
+		damage_detector d({.tile_width = 16, .tile_height = 16});
+		frame_data f(host_pixel_format::bgra, 50, 40);
+		assert(detect(d, f) == rects({{0, 0, 50, 40}}));
+		assert(d.tile_columns() == 4 and d.tile_rows() == 3);
+
+		assert(detect(d, f).empty());
+		assert(std::ranges::count(d.tiles(), 0) == 12);
+
+		// last channel of the last pixel: partial tile on both edges
+		f.at(0, 4 * 49 + 3, 39) = 0;
+		assert(detect(d, f) == rects({{48, 32, 2, 8}}));
+		assert(d.tiles()[11] == 1 and std::ranges::count(d.tiles(), 1) == 1);
+		// the previous frame was updated
+		assert(detect(d, f).empty());
+
+		// padding is ignored
+		f.data[0][f.frame.strides[0] - 1] = 0;
+		assert(detect(d, f).empty());
+	}
+
+	// runs of tiles are merged across rows when they have the same columns
+	{
+		damage_detector d({.tile_width = 4, .tile_height = 2});
+		frame_data f(host_pixel_format::rgba, 16, 8);
+		detect(d, f);
+		// tiles (1, 0), (2, 0), (1, 1), (2, 1), (0, 2), (3, 3)
+		for (auto [x, y]: {std::pair{4, 0}, {8, 1}, {5, 3}, {11, 2}, {0, 4}, {15, 7}})
+			f.at(0, 4 * x, y) = 0;
+		assert(detect(d, f) == rects({{4, 0, 8, 4}, {0, 4, 4, 2}, {12, 6, 4, 2}}));
+	}
+
+	// I420, chroma tiles are half the size
+	{
+		damage_detector d({.tile_width = 8, .tile_height = 8});
+		frame_data f(host_pixel_format::i420, 17, 9);
+		assert(detect(d, f) == rects({{0, 0, 17, 9}}));
+		assert(d.tile_columns() == 3 and d.tile_rows() == 2);
+
+		// last chroma sample, column 8 of 9, row 4 of 5
+		f.at(2, 8, 4) = 0;
+		assert(detect(d, f) == rects({{16, 8, 1, 1}}));
+		f.at(1, 3, 0) = 0;
+		f.at(0, 8, 0) = 0;
+		assert(detect(d, f) == rects({{0, 0, 16, 8}}));
+	}
+
+	// new size or format, reset
+	{
+		damage_detector d;
+		frame_data f(host_pixel_format::bgra, 128, 64);
+		frame_data g(host_pixel_format::rgba, 128, 64);
+		frame_data h(host_pixel_format::bgra, 64, 128);
+		detect(d, f);
+		assert(detect(d, f).empty());
+		assert(detect(d, g) == rects({{0, 0, 128, 64}}));
+		assert(detect(d, h) == rects({{0, 0, 64, 128}}));
+		d.reset();
+		assert(detect(d, h) == rects({{0, 0, 64, 128}}));
+		assert(detect(d, h).empty());
+
+		frame_data empty(host_pixel_format::bgra, 0, 0);
+		assert(detect(d, empty).empty());
+	}
+
+	for (auto cfg: {damage_detector::config{.tile_width = 0, .tile_height = 16},
+	                damage_detector::config{.tile_width = 16, .tile_height = 3}})
+	{
+		try
+		{
+			damage_detector d(cfg);
+			assert(false);
+		}
+		catch (std::invalid_argument &)
+		{
+		}
+	}
+
+	return 0;
+}
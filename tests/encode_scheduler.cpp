@@ -0,0 +1,239 @@
+#include "encode_scheduler.h"
+#include "mock_vulkan.h"
+#include "video_encoder_h264.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+
+int main()
+{
+	// streams spread over the queues and the workers, frames returned in
+	// order for each stream
+	{
+		mock_vulkan::config cfg;
+		cfg.queue_count = 2;
+		mock_vulkan::fixture f(cfg);
+		const uint64_t frames = 30;
+
+		{
+			// all the queues of the family
+			encode_scheduler scheduler(f.ctx.physical_device, f.ctx.device, f.ctx.queue_family, 3);
+			assert(scheduler.queue_count() == 2);
+
+			std::mutex mutex;
+			std::condition_variable cv;
+			std::map<encode_scheduler::stream_id, std::vector<uint64_t>> tickets;
+			auto on_frame = [&](encode_scheduler::stream_id id, video_encoder::encoded_frame frame) {
+				assert(not frame.info.failed() and frame.bitstream.size() > 0);
+				std::lock_guard lock(mutex);
+				tickets[id].push_back(frame.ticket);
+				cv.notify_all();
+			};
+
+			encoder_settings settings;
+			settings.frames_in_flight = 2;
+			std::vector<encode_scheduler::stream_id> ids;
+			for (int i = 0; i < 4; ++i)
+			{
+				ids.push_back(scheduler.add_stream(
+				        [&](std::shared_ptr<submit_queue> queue) {
+					        return video_encoder_h264::create(f.ctx.physical_device, f.ctx.device, f.allocator, queue, {320, 180}, settings);
+				        },
+				        on_frame));
+			}
+
+			for (uint64_t i = 0; i < frames; ++i)
+			{
+				for (auto id: ids)
+				{
+					// inputs come back once the worker submitted them
+					auto input = scheduler.encoder(id).acquire_input_image();
+					while (not input)
+					{
+						std::this_thread::yield();
+						input = scheduler.encoder(id).acquire_input_image();
+					}
+					scheduler.encode(id, *input, vk::Semaphore{}, f.ctx.queue_family);
+				}
+			}
+
+			// removal retires the pending frames
+			scheduler.remove_stream(ids.back());
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&]() {
+					return std::ranges::all_of(ids, [&](auto id) { return tickets[id].size() == frames; });
+				});
+			}
+			for (auto id: ids)
+			{
+				std::vector<uint64_t> expected(frames);
+				std::iota(expected.begin(), expected.end(), 0);
+				assert(tickets[id] == expected);
+			}
+
+			try
+			{
+				scheduler.encoder(ids.back());
+				assert(false);
+			}
+			catch (std::out_of_range &)
+			{
+			}
+		}
+
+		// two streams on each queue
+		auto submissions = mock_vulkan::queue_submissions();
+		assert(submissions.size() == 2);
+		for (size_t count: submissions)
+			assert(count >= 2 * frames);
+		assert(mock_vulkan::executed_encodes().size() == 4 * frames);
+	}
+
+	// A stream with all its frames in flight does not hold up the other
+	// streams of its worker
+	{
+		mock_vulkan::config cfg;
+		cfg.queue_count = 2;
+		mock_vulkan::fixture f(cfg);
+		vk::StructureChain timeline_create{
+		        vk::SemaphoreCreateInfo{},
+		        vk::SemaphoreTypeCreateInfo{.semaphoreType = vk::SemaphoreType::eTimeline},
+		};
+		auto blocked = f.ctx.device.createSemaphore(timeline_create.get());
+
+		{
+			// one worker, the streams on different queues
+			encode_scheduler scheduler(f.ctx.physical_device, f.ctx.device, f.ctx.queue_family, 1);
+			std::mutex mutex;
+			std::condition_variable cv;
+			std::map<encode_scheduler::stream_id, uint64_t> frames;
+			auto on_frame = [&](encode_scheduler::stream_id id, video_encoder::encoded_frame) {
+				std::lock_guard lock(mutex);
+				++frames[id];
+				cv.notify_all();
+			};
+			encoder_settings settings;
+			settings.frames_in_flight = 2;
+			settings.input_images = 8;
+			auto create = [&](std::shared_ptr<submit_queue> queue) {
+				return video_encoder_h264::create(f.ctx.physical_device, f.ctx.device, f.allocator, queue, {320, 180}, settings);
+			};
+			auto a = scheduler.add_stream(create, on_frame);
+			auto b = scheduler.add_stream(create, on_frame);
+
+			// the frames of a wait for the host, more than fit in flight
+			for (uint64_t i = 0; i < 4; ++i)
+			{
+				auto input = scheduler.encoder(a).acquire_input_image();
+				assert(input);
+				scheduler.encode(a, *input, blocked, i + 1, f.ctx.queue_family);
+			}
+			for (int i = 0; i < 6; ++i)
+			{
+				auto input = scheduler.encoder(b).acquire_input_image();
+				while (not input)
+				{
+					std::this_thread::yield();
+					input = scheduler.encoder(b).acquire_input_image();
+				}
+				scheduler.encode(b, *input, vk::Semaphore{}, f.ctx.queue_family);
+			}
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&]() { return frames[b] == 6; });
+				assert(frames[a] == 0);
+			}
+
+			// the queued frames of a follow once it can make progress
+			f.ctx.device.signalSemaphore({.semaphore = blocked, .value = 4});
+			std::unique_lock lock(mutex);
+			cv.wait(lock, [&]() { return frames[a] == 4; });
+		}
+
+		f.ctx.device.destroy(blocked);
+	}
+
+	// A frame that cannot be submitted leaves its binary wait semaphore
+	// unsignaled, so that it can be used again
+	{
+		mock_vulkan::fixture f;
+		auto binary = f.ctx.device.createSemaphore({});
+		auto signal = [&]() {
+			vk::SemaphoreSubmitInfo signal_info{
+			        .semaphore = binary,
+			        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+			};
+			vk::SubmitInfo2 submit{};
+			submit.setSignalSemaphoreInfos(signal_info);
+			f.ctx.queue.submit2(submit);
+		};
+
+		{
+			encode_scheduler scheduler(f.ctx.physical_device, f.ctx.device, f.ctx.queue_family, 1);
+			std::mutex mutex;
+			std::condition_variable cv;
+			std::map<encode_scheduler::stream_id, uint64_t> frames;
+			auto on_frame = [&](encode_scheduler::stream_id id, video_encoder::encoded_frame) {
+				std::lock_guard lock(mutex);
+				++frames[id];
+				cv.notify_all();
+			};
+			auto wait_frames = [&](encode_scheduler::stream_id id, uint64_t count) {
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&]() { return frames[id] == count; });
+			};
+
+			// room for a single frame in the output buffer, keyframes after
+			// the first one need more for their recovery point
+			encoder_settings settings;
+			settings.input_images = 2;
+			settings.open_gop = true;
+			settings.max_frame_size = 65536;
+			settings.output_buffer_size = settings.max_frame_size;
+			auto a = scheduler.add_stream(
+			        [&](std::shared_ptr<submit_queue> queue) {
+				        return video_encoder_h264::create(f.ctx.physical_device, f.ctx.device, f.allocator, queue, {320, 180}, settings);
+			        },
+			        on_frame);
+			auto b = scheduler.add_stream(
+			        [&](std::shared_ptr<submit_queue> queue) {
+				        return video_encoder_h264::create(f.ctx.physical_device, f.ctx.device, f.allocator, queue, {320, 180}, encoder_settings{});
+			        },
+			        on_frame);
+
+			scheduler.encode(a, *scheduler.encoder(a).acquire_input_image(), vk::Semaphore{}, f.ctx.queue_family);
+			wait_frames(a, 1);
+
+			signal();
+			scheduler.encoder(a).request_keyframe();
+			scheduler.encode(a, *scheduler.encoder(a).acquire_input_image(), binary, f.ctx.queue_family);
+			// the worker handles the jobs of a before those of b
+			scheduler.encode(b, *scheduler.encoder(b).acquire_input_image(), vk::Semaphore{}, f.ctx.queue_family);
+			wait_frames(b, 1);
+			f.ctx.device.waitIdle();
+			{
+				std::lock_guard lock(mutex);
+				assert(frames[a] == 1);
+			}
+
+			// the input image of the failed frame went back to the pool
+			assert(scheduler.encoder(a).acquire_input_image());
+			assert(scheduler.encoder(a).acquire_input_image());
+		}
+
+		// invalid if the failed frame left it signaled
+		signal();
+		f.ctx.device.waitIdle();
+
+		f.ctx.device.destroy(binary);
+	}
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include "encode_telemetry.h"
+
+#include <cassert>
+#include <thread>
+#include <vector>
+
+int main()
+{
+	// buckets are contiguous and bounded to 1/16 of their values
+	{
+		using h = latency_histogram;
+		assert(h::bucket(0) == 0);
+		assert(h::bucket(15) == 15);
+		assert(h::bucket(16) == 16);
+		assert(h::bucket(31) == 31);
+		assert(h::bucket(32) == 32 and h::bucket(33) == 32);
+		assert(h::bucket(UINT64_MAX) == h::bucket_count - 1);
+		for (size_t i = 0; i + 1 < h::bucket_count; ++i)
+		{
+			assert(h::bucket_max(i) + 1 == h::bucket_min(i + 1));
+			assert(h::bucket(h::bucket_min(i)) == i);
+			assert(h::bucket(h::bucket_max(i)) == i);
+			assert(h::bucket_max(i) - h::bucket_min(i) <= h::bucket_min(i) / 16);
+		}
+	}
+
+	// percentiles
+	{
+		latency_histogram h;
+		assert(h.read().percentile(0.5) == 0);
+		for (uint64_t i = 1; i <= 1000; ++i)
+			h.record(i * 1000);
+		auto s = h.read();
+		assert(s.count == 1000);
+		assert(s.max == 1'000'000);
+		assert(s.mean() == 500'500);
+		for (double p: {0.01, 0.5, 0.9, 0.99})
+		{
+			uint64_t exact = p * 1'000'000;
+			uint64_t value = s.percentile(p);
+			assert(value >= exact and value <= exact + exact / 16);
+		}
+		assert(s.percentile(1) == 1'000'000);
+	}
+
+	// concurrent recording
+	{
+		latency_histogram h;
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t)
+			threads.emplace_back([&h, t] {
+				for (uint64_t i = 0; i < 100'000; ++i)
+					h.record(i + t);
+			});
+		for (auto & t: threads)
+			t.join();
+		auto s = h.read();
+		assert(s.count == 400'000);
+		assert(s.max == 99'999 + 3);
+	}
+
+	// frames and bitrate
+	{
+		using namespace std::chrono_literals;
+		encode_telemetry telemetry;
+		auto before = telemetry.read();
+
+		auto t = encode_telemetry::clock::now();
+		for (uint64_t i = 0; i < 10; ++i)
+		{
+			telemetry.add({
+			        .ticket = i,
+			        .intra = i == 0,
+			        .idr = i == 0,
+			        .setup_slot = int32_t(i % 2),
+			        .references = i == 0 ? 0u : 1u,
+			        .submit = t,
+			        .submitted = t + 20us,
+			        .completed = t + 3ms,
+			        .retired = t + 4ms,
+			        .device_time = 2ms,
+			        .bytes = i == 0 ? 10'000u : 1'000u,
+			        .status = i == 5 ? -1 : 1,
+			});
+		}
+		auto after = telemetry.read();
+		assert(after.frames == 10);
+		assert(after.intra_frames == 1);
+		assert(after.failed_frames == 1);
+		assert(after.bytes == 19'000);
+		assert(after.submit.max == 20'000);
+		assert(after.encode.max == 2'980'000);
+		assert(after.device.count == 10);
+		assert(after.readback.max == 1'000'000);
+		assert(after.total.max == 4'000'000);
+
+		after.time = before.time + 1s;
+		assert(encode_telemetry::bitrate(before, after) == 152'000);
+	}
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+#include "encode_worker.h"
+#include "mock_vulkan.h"
+#include "video_encoder_h264.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace
+{
+struct fixture : mock_vulkan::fixture
+{
+	std::unique_ptr<video_encoder_h264> encoder;
+
+	// frames passed to the callback, by index
+	std::mutex mutex;
+	std::vector<int64_t> encoded;
+	// the callback waits for release before returning
+	std::atomic<bool> entered = false;
+	std::atomic<bool> release = true;
+
+	static encoder_settings default_settings()
+	{
+		encoder_settings settings;
+		settings.frames_in_flight = 2;
+		settings.input_images = 8;
+		return settings;
+	}
+
+	fixture(const mock_vulkan::config & cfg = {}, const encoder_settings & settings = default_settings()) :
+	        mock_vulkan::fixture(cfg)
+	{
+		encoder = video_encoder_h264::create(ctx.physical_device, ctx.device, allocator, queue, {320, 180}, settings);
+	}
+
+	encode_worker::frame_callback callback()
+	{
+		return [this](const encode_worker::frame & f, video_encoder::encoded_frame frame) {
+			assert(not frame.info.failed());
+			{
+				std::lock_guard lock(mutex);
+				encoded.push_back(f.timestamp.time_since_epoch().count());
+			}
+			entered = true;
+			entered.notify_all();
+			release.wait(false);
+		};
+	}
+
+	// the timestamp identifies the frame
+	encode_worker::frame make_frame(int64_t index)
+	{
+		auto input = encoder->acquire_input_image();
+		assert(input);
+		return {
+		        .input = *input,
+		        .wait_semaphore = nullptr,
+		        .wait_value = 0,
+		        .src_queue = ctx.queue_family,
+		        .timestamp = encode_worker::clock::time_point(encode_worker::clock::duration(index)),
+		};
+	}
+
+	// Push frame 0 and wait until the worker is stuck in the callback, so
+	// that later frames stay in the queue
+	void stall(encode_worker & worker)
+	{
+		release = false;
+		assert(worker.push(make_frame(0)));
+		entered.wait(false);
+	}
+
+	void unstall()
+	{
+		release = true;
+		release.notify_all();
+	}
+};
+} // namespace
+
+int main()
+{
+	// The worker sleeps until the frame is encoded, with no other push to
+	// wake it up
+	{
+		mock_vulkan::config cfg;
+		cfg.latency = std::chrono::milliseconds(20);
+		fixture f(cfg);
+		encode_worker worker(f.ctx.device, *f.encoder, 2, encode_worker::backpressure::block, f.callback());
+		assert(worker.push(f.make_frame(0)));
+		f.entered.wait(false);
+		assert(f.encoded == std::vector<int64_t>{0});
+
+		// again after a sleep with no frame in flight
+		f.entered = false;
+		assert(worker.push(f.make_frame(1)));
+		f.entered.wait(false);
+		assert((f.encoded == std::vector<int64_t>{0, 1}));
+	}
+
+	// block: the producer waits for room in the queue, nothing is dropped
+	{
+		fixture f;
+		std::optional<encode_worker> worker;
+		worker.emplace(f.ctx.device, *f.encoder, 2, encode_worker::backpressure::block, f.callback());
+		f.stall(*worker);
+		assert(worker->push(f.make_frame(1)));
+		assert(worker->push(f.make_frame(2)));
+		assert(worker->get_metrics().queue_depth == 2);
+
+		std::atomic<bool> pushed = false;
+		std::thread producer([&]() {
+			assert(worker->push(f.make_frame(3)));
+			pushed = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		assert(not pushed);
+		f.unstall();
+		producer.join();
+		worker.reset();
+
+		assert((f.encoded == std::vector<int64_t>{0, 1, 2, 3}));
+	}
+
+	// drop_newest: pushing to a full queue fails
+	{
+		fixture f;
+		std::optional<encode_worker> worker;
+		worker.emplace(f.ctx.device, *f.encoder, 2, encode_worker::backpressure::drop_newest, f.callback());
+		f.stall(*worker);
+		assert(worker->push(f.make_frame(1)));
+		assert(worker->push(f.make_frame(2)));
+		assert(not worker->push(f.make_frame(3)));
+		auto metrics = worker->get_metrics();
+		assert(metrics.pushed == 3 and metrics.dropped == 1);
+		f.unstall();
+		worker.reset();
+
+		assert((f.encoded == std::vector<int64_t>{0, 1, 2}));
+	}
+
+	// drop_oldest: the oldest queued frames make room for new ones
+	{
+		fixture f;
+		std::optional<encode_worker> worker;
+		worker.emplace(f.ctx.device, *f.encoder, 2, encode_worker::backpressure::drop_oldest, f.callback());
+		f.stall(*worker);
+		for (int64_t i = 1; i < 5; ++i)
+			assert(worker->push(f.make_frame(i)));
+		auto metrics = worker->get_metrics();
+		assert(metrics.pushed == 5 and metrics.dropped == 2 and metrics.queue_depth == 2);
+		f.unstall();
+		worker.reset();
+
+		assert((f.encoded == std::vector<int64_t>{0, 3, 4}));
+		// the input images of dropped frames went back to the pool
+		std::vector<video_encoder::input_image> inputs;
+		while (auto input = f.encoder->acquire_input_image())
+			inputs.push_back(*input);
+		assert(inputs.size() == f.encoder->input_image_count());
+		for (const auto & input: inputs)
+			f.encoder->release_input_image(input);
+	}
+
+	// A frame the worker fails to submit leaves its binary wait semaphore
+	// unsignaled, even when no producer drains dropped_semaphores
+	{
+		// room for a single frame in the output buffer, keyframes after the
+		// first one need more for their recovery point
+		auto settings = fixture::default_settings();
+		settings.open_gop = true;
+		settings.max_frame_size = 65536;
+		settings.output_buffer_size = settings.max_frame_size;
+		fixture f({}, settings);
+		auto binary = f.ctx.device.createSemaphore({});
+		auto signal = [&]() {
+			vk::SemaphoreSubmitInfo signal_info{
+			        .semaphore = binary,
+			        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+			};
+			vk::SubmitInfo2 submit{};
+			submit.setSignalSemaphoreInfos(signal_info);
+			f.ctx.queue.submit2(submit);
+		};
+
+		{
+			encode_worker worker(f.ctx.device, *f.encoder, 2, encode_worker::backpressure::drop_oldest, f.callback());
+			assert(worker.push(f.make_frame(0)));
+			f.entered.wait(false);
+
+			signal();
+			f.encoder->request_keyframe();
+			auto frame = f.make_frame(1);
+			frame.wait_semaphore = binary;
+			assert(worker.push(frame));
+			while (worker.get_metrics().dropped == 0)
+				std::this_thread::yield();
+		}
+		assert(f.encoded == std::vector<int64_t>{0});
+
+		// invalid if the failed frame left it signaled
+		signal();
+		f.ctx.device.waitIdle();
+		f.ctx.device.destroy(binary);
+	}
+
+	return 0;
+}
@@ -0,0 +1,163 @@
+#include "bit_writer.h"
+#include "h264_parameter_sets.h"
+#include "nal_utils.h"
+
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+using bytes = std::vector<uint8_t>;
+
+void check(const bytes & actual, const bytes & expected)
+{
+	if (actual != expected)
+	{
+		for (uint8_t b: actual)
+			fprintf(stderr, "%02x ", b);
+		fprintf(stderr, "\n");
+	}
+	assert(actual == expected);
+}
+
+// The parameter sets of video_encoder_h264 at 1920x1080
+StdVideoH264SequenceParameterSet main_sps()
+{
+	StdVideoH264SequenceParameterSet sps{};
+	sps.flags.frame_mbs_only_flag = 1;
+	sps.flags.delta_pic_order_always_zero_flag = 1;
+	sps.flags.gaps_in_frame_num_value_allowed_flag = 1;
+	sps.flags.frame_cropping_flag = 1;
+	sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_MAIN;
+	sps.level_idc = STD_VIDEO_H264_LEVEL_IDC_4_1;
+	sps.chroma_format_idc = STD_VIDEO_H264_CHROMA_FORMAT_IDC_420;
+	sps.log2_max_frame_num_minus4 = 12;
+	sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_2;
+	sps.max_num_ref_frames = 1;
+	sps.pic_width_in_mbs_minus1 = 119;
+	sps.pic_height_in_map_units_minus1 = 67;
+	sps.frame_crop_bottom_offset = 4;
+	return sps;
+}
+} // namespace
+
+int main()
+{
+	// Exp-Golomb codes
+	{
+		bit_writer w;
+		w.write_ue(0);  // 1
+		w.write_ue(1);  // 010
+		w.write_ue(2);  // 011
+		w.write_ue(3);  // 00100
+		w.write_se(1);  // 010
+		w.write_se(-1); // 011
+		w.write_se(2);  // 00100
+		w.write_bits(0b101, 3);
+		assert(w.bit_count() == 26 and not w.byte_aligned());
+		w.write_trailing_bits();
+		check(w.data(), {0b10100110, 0b01000100, 0b11001001, 0b01100000});
+	}
+	{
+		// 2^32 - 1 and INT32_MIN take 65 bits
+		bit_writer w;
+		w.write_ue(UINT32_MAX);
+		assert(w.bit_count() == 65);
+		w.write_se(INT32_MIN);
+		assert(w.bit_count() == 130);
+		w.write_trailing_bits();
+		check(w.data(), {0, 0, 0, 0, 0x80, 0, 0, 0, 0, 0, 0, 0, 0x40, 0, 0, 0, 0x60});
+	}
+	{
+		bit_writer w;
+		w.write_flag(true);
+		try
+		{
+			w.data();
+			assert(false);
+		}
+		catch (std::logic_error &)
+		{
+		}
+	}
+
+	// Main profile with the low latency VUI, contains emulation prevention bytes
+	{
+		auto vui = make_h264_low_latency_vui({.framerate_num = 60, .framerate_den = 1});
+		assert(vui.flags.bitstream_restriction_flag);
+		assert(vui.max_num_reorder_frames == 0 and vui.max_dec_frame_buffering == 1);
+
+		auto sps = main_sps();
+		sps.flags.vui_parameters_present_flag = 1;
+		sps.pSequenceParameterSetVui = &vui;
+		auto nal = write_h264_sps(sps);
+		check(nal, {0x00, 0x00, 0x00, 0x01, 0x67, 0x4d, 0x00, 0x29, 0x8d, 0x6a, 0x07, 0x80, 0x22,
+		            0x5e, 0x59, 0xa8, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00,
+		            0x03, 0x00, 0xf0, 0x1e, 0x10, 0x08, 0x54});
+
+		bytes rbsp(nal.size());
+		rbsp.resize(remove_emulation_prevention(std::span(nal).subspan(5), rbsp.data()));
+		assert(rbsp.size() == nal.size() - 7);
+
+		// frame buffering covers the references
+		vui = make_h264_low_latency_vui({.max_num_ref_frames = 4});
+		assert(vui.max_dec_frame_buffering == 4);
+	}
+
+	// High profile: chroma format and bit depths, POC type 0
+	{
+		StdVideoH264SequenceParameterSet sps{};
+		sps.flags.frame_mbs_only_flag = 1;
+		sps.flags.direct_8x8_inference_flag = 1;
+		sps.flags.frame_cropping_flag = 1;
+		sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_HIGH;
+		sps.level_idc = STD_VIDEO_H264_LEVEL_IDC_3_1;
+		sps.chroma_format_idc = STD_VIDEO_H264_CHROMA_FORMAT_IDC_420;
+		sps.seq_parameter_set_id = 1;
+		sps.log2_max_frame_num_minus4 = 4;
+		sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_0;
+		sps.log2_max_pic_order_cnt_lsb_minus4 = 2;
+		sps.max_num_ref_frames = 4;
+		sps.pic_width_in_mbs_minus1 = 39;
+		sps.pic_height_in_map_units_minus1 = 22;
+		sps.frame_crop_bottom_offset = 4;
+		check(write_h264_sps(sps),
+		      {0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x1f, 0x4b, 0x0b, 0x65, 0x02, 0x80, 0xbf, 0xe5, 0x40});
+
+		sps.flags.vui_parameters_present_flag = 1;
+		try
+		{
+			write_h264_sps(sps);
+			assert(false);
+		}
+		catch (std::invalid_argument &)
+		{
+		}
+	}
+
+	// PPS of video_encoder_h264
+	{
+		StdVideoH264PictureParameterSet pps{};
+		pps.flags.entropy_coding_mode_flag = 1;
+		pps.flags.redundant_pic_cnt_present_flag = 1;
+		check(write_h264_pps(pps), {0x00, 0x00, 0x00, 0x01, 0x68, 0xee, 0x39, 0x80});
+	}
+
+	// PPS with the High profile extension
+	{
+		StdVideoH264PictureParameterSet pps{};
+		pps.flags.transform_8x8_mode_flag = 1;
+		pps.flags.deblocking_filter_control_present_flag = 1;
+		pps.seq_parameter_set_id = 1;
+		pps.pic_parameter_set_id = 1;
+		pps.num_ref_idx_l0_default_active_minus1 = 2;
+		pps.pic_init_qp_minus26 = -3;
+		pps.chroma_qp_index_offset = 2;
+		pps.second_chroma_qp_index_offset = -2;
+		check(write_h264_pps(pps), {0x00, 0x00, 0x00, 0x01, 0x68, 0x48, 0xb8, 0x3c, 0x92, 0x2c});
+	}
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+#include "host_upload.h"
+#include "mock_vulkan.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace
+{
+const vk::Extent2D extent{64, 36};
+
+struct frame_data
+{
+	std::vector<uint8_t> bgra;
+	host_frame frame;
+
+	frame_data(std::mt19937 & rnd) :
+	        bgra(4 * extent.width * extent.height)
+	{
+		for (auto & byte: bgra)
+			byte = rnd();
+		frame = {
+		        .format = host_pixel_format::bgra,
+		        .width = extent.width,
+		        .height = extent.height,
+		        .planes = {bgra.data()},
+		        .strides = {4 * extent.width},
+		};
+	}
+
+	// expected content of the destination image, as given by
+	// mock_vulkan::image_data
+	std::vector<uint8_t> nv12() const
+	{
+		const size_t y_size = extent.width * extent.height;
+		const uint32_t cbcr_stride = 2 * ((extent.width + 1) / 2);
+		std::vector<uint8_t> out(y_size + cbcr_stride * ((extent.height + 1) / 2));
+		auto c = make_nv12_coefficients(make_ycbcr_matrix(color_matrix::bt709, color_range::limited));
+		convert_to_nv12_scalar(frame, {out.data(), extent.width, out.data() + y_size, cbcr_stride}, c, 0, extent.height);
+		return out;
+	}
+};
+} // namespace
+
+int main()
+{
+	// Three frames through two staging slots: the third one reuses the slot
+	// of the first once its copy has executed
+	{
+		mock_vulkan::fixture f;
+		vk::StructureChain timeline_create{
+		        vk::SemaphoreCreateInfo{},
+		        vk::SemaphoreTypeCreateInfo{
+		                .semaphoreType = vk::SemaphoreType::eTimeline,
+		                .initialValue = 0,
+		        },
+		};
+		auto done = f.ctx.device.createSemaphore(timeline_create.get());
+		auto pool = f.ctx.device.createCommandPool({.queueFamilyIndex = f.ctx.queue_family});
+		auto cmd_bufs = f.ctx.device.allocateCommandBuffers({
+		        .commandPool = pool,
+		        .level = vk::CommandBufferLevel::ePrimary,
+		        .commandBufferCount = 3,
+		});
+
+		std::mt19937 rnd(42);
+		std::vector<frame_data> frames;
+		std::vector<vk::Image> images;
+		for (int i = 0; i < 3; ++i)
+		{
+			frames.emplace_back(rnd);
+			images.push_back(f.ctx.device.createImage({
+			        .imageType = vk::ImageType::e2D,
+			        .format = vk::Format::eG8B8R82Plane420Unorm,
+			        .extent = {extent.width, extent.height, 1},
+			        .mipLevels = 1,
+			        .arrayLayers = 1,
+			        .samples = vk::SampleCountFlagBits::e1,
+			        .tiling = vk::ImageTiling::eOptimal,
+			        .usage = vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eVideoEncodeSrcKHR,
+			        .sharingMode = vk::SharingMode::eExclusive,
+			        .initialLayout = vk::ImageLayout::eUndefined,
+			}));
+		}
+
+		std::optional<host_upload> upload;
+		upload.emplace(f.ctx.device, f.allocator, extent, 2);
+		auto record = [&](int i, uint32_t dst_family) {
+			cmd_bufs[i].begin(vk::CommandBufferBeginInfo{});
+			upload->upload(cmd_bufs[i], frames[i].frame, images[i], f.ctx.queue_family, dst_family, done, i + 1);
+			cmd_bufs[i].end();
+		};
+		auto submit = [&](int i) {
+			vk::CommandBufferSubmitInfo cmd_info{
+			        .commandBuffer = cmd_bufs[i],
+			};
+			vk::SemaphoreSubmitInfo signal_info{
+			        .semaphore = done,
+			        .value = uint64_t(i + 1),
+			        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+			};
+			vk::SubmitInfo2 submit{};
+			submit.setCommandBufferInfos(cmd_info);
+			submit.setSignalSemaphoreInfos(signal_info);
+			f.ctx.queue.submit2(submit);
+		};
+
+		// the first two are released to another queue family
+		const uint32_t encode_family = f.ctx.queue_family + 1;
+		record(0, encode_family);
+		record(1, encode_family);
+
+		std::atomic<bool> recorded = false;
+		std::thread third([&]() {
+			record(2, f.ctx.queue_family);
+			recorded = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		assert(not recorded);
+		submit(0);
+		third.join();
+		submit(1);
+		submit(2);
+		f.ctx.queue.waitIdle();
+
+		// the first frame was copied before its slot was overwritten
+		for (int i = 0; i < 3; ++i)
+			assert(mock_vulkan::image_data(images[i]) == frames[i].nv12());
+
+		// each image is discarded, then ownership is released with a
+		// transition to the encoder input layout only across families
+		auto barriers = mock_vulkan::executed_barriers();
+		assert(barriers.size() == 5);
+		for (int i = 0; i < 3; ++i)
+		{
+			const auto & discard = barriers[2 * i];
+			assert(discard.image == images[i]);
+			assert(discard.old_layout == vk::ImageLayout::eUndefined);
+			assert(discard.new_layout == vk::ImageLayout::eTransferDstOptimal);
+			assert(discard.src_queue_family == discard.dst_queue_family);
+			if (i == 2)
+				break;
+
+			const auto & release = barriers[2 * i + 1];
+			assert(release.image == images[i]);
+			assert(release.old_layout == vk::ImageLayout::eTransferDstOptimal);
+			assert(release.new_layout == vk::ImageLayout::eVideoEncodeSrcKHR);
+			assert(release.src_queue_family == f.ctx.queue_family);
+			assert(release.dst_queue_family == encode_family);
+		}
+
+		upload.reset();
+		for (auto image: images)
+			f.ctx.device.destroy(image);
+		f.ctx.device.destroy(pool);
+		f.ctx.device.destroy(done);
+	}
+
+	return 0;
+}
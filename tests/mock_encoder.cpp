@@ -0,0 +1,762 @@
+#include "fmp4_muxer.h"
+#include "mock_vulkan.h"
+#include "nal_utils.h"
+#include "video_encoder_h264.h"
+#include "video_encoder_h265.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <optional>
+#include <thread>
+
+namespace
+{
+// encoders on the mock device, destroyed before it
+struct fixture : mock_vulkan::fixture
+{
+	using mock_vulkan::fixture::fixture;
+
+	std::unique_ptr<video_encoder_h264> encoder(const encoder_settings & settings)
+	{
+		return video_encoder_h264::create(ctx.physical_device, ctx.device, allocator, queue, {640, 360}, settings);
+	}
+
+	std::unique_ptr<video_encoder_h265> h265_encoder(const encoder_settings & settings)
+	{
+		return video_encoder_h265::create(ctx.physical_device, ctx.device, allocator, queue, {640, 360}, settings);
+	}
+
+	uint64_t submit(video_encoder & encoder)
+	{
+		auto input = encoder.acquire_input_image();
+		assert(input);
+		return encoder.submit_frame(*input, vk::Semaphore{}, ctx.queue_family);
+	}
+};
+
+void check_frame(const video_encoder::encoded_frame & frame, size_t size, bool idr, uint32_t slices)
+{
+	auto data = frame.bitstream.data();
+	assert(data.size() == size);
+	assert(frame.info.ticket == frame.ticket and not frame.info.failed());
+	assert(frame.info.bytes == size and frame.info.idr == idr);
+	assert(frame.info.submit <= frame.info.submitted and frame.info.submitted <= frame.info.completed);
+	assert(frame.info.completed <= frame.info.retired);
+	assert(frame.info.device_time);
+	uint32_t nal_units = 0;
+	for (size_t i = 0; i + 4 < data.size(); ++i)
+	{
+		if (data[i] == 0 and data[i + 1] == 0 and data[i + 2] == 0 and data[i + 3] == 1)
+		{
+			assert((data[i + 4] & 0x1f) == (idr ? 5 : 1));
+			++nal_units;
+		}
+	}
+	assert(nal_units == slices);
+}
+
+// Replays the encodes executed by the mock: reference slots must hold the
+// pictures the encoder describes. Returns the frames each encode references.
+std::vector<std::vector<int64_t>> check_references(const std::vector<mock_vulkan::encode_record> & encodes, size_t dpb_size)
+{
+	std::vector<int64_t> slot_frame(dpb_size, -1);
+	std::vector<uint32_t> slot_frame_num(dpb_size);
+	std::vector<std::vector<int64_t>> res;
+	for (size_t i = 0; i < encodes.size(); ++i)
+	{
+		const auto & e = encodes[i];
+		assert(e.setup_slot >= 0 and size_t(e.setup_slot) < dpb_size);
+		assert(e.setup_info.FrameNum == e.picture.frame_num);
+		assert(e.ref_pic_list0.size() == e.reference_slots.size());
+
+		if (e.picture.flags.IdrPicFlag)
+		{
+			assert(e.picture.frame_num == 0);
+			assert(e.reference_slots.empty());
+			std::ranges::fill(slot_frame, -1);
+		}
+
+		auto & references = res.emplace_back();
+		for (size_t k = 0; k < e.reference_slots.size(); ++k)
+		{
+			int32_t slot = e.reference_slots[k];
+			assert(slot != e.setup_slot);
+			assert(e.ref_pic_list0[k] == slot);
+			assert(slot_frame[slot] >= 0);
+			assert(e.reference_info[k].FrameNum == slot_frame_num[slot]);
+			references.push_back(slot_frame[slot]);
+		}
+
+		slot_frame[e.setup_slot] = i;
+		slot_frame_num[e.setup_slot] = e.picture.frame_num;
+	}
+	return res;
+}
+
+struct h265_references
+{
+	// frames of the short-term reference picture set, closest first
+	std::vector<int64_t> set;
+	// frames used by the picture, in RefPicList0 order
+	std::vector<int64_t> used;
+};
+
+// Same for H.265: decoders drop the pictures left out of the short-term
+// reference picture set, the ones used by the current picture must be the
+// reference slots, in the order of RefPicList0.
+std::vector<h265_references> check_h265_references(const std::vector<mock_vulkan::encode_record> & encodes, size_t dpb_size)
+{
+	std::vector<int64_t> slot_frame(dpb_size, -1);
+	std::vector<int32_t> slot_poc(dpb_size);
+	std::vector<h265_references> res;
+	for (size_t i = 0; i < encodes.size(); ++i)
+	{
+		const auto & e = encodes[i];
+		assert(e.h265);
+		const auto & picture = e.h265->picture;
+		const auto & rps = e.h265->short_term_rps;
+		assert(e.setup_slot >= 0 and size_t(e.setup_slot) < dpb_size);
+		assert(e.h265->setup_info.PicOrderCntVal == picture.PicOrderCntVal);
+		assert(e.ref_pic_list0.size() == e.reference_slots.size());
+		assert(rps.num_positive_pics == 0);
+
+		if (picture.pic_type == STD_VIDEO_H265_PICTURE_TYPE_IDR)
+		{
+			assert(picture.flags.IrapPicFlag and picture.PicOrderCntVal == 0);
+			assert(e.reference_slots.empty() and rps.num_negative_pics == 0);
+			std::ranges::fill(slot_frame, -1);
+		}
+
+		// previous pictures from the POC deltas
+		auto & references = res.emplace_back();
+		std::vector<int32_t> used_pocs;
+		int32_t poc = picture.PicOrderCntVal;
+		for (uint32_t k = 0; k < rps.num_negative_pics; ++k)
+		{
+			poc -= rps.delta_poc_s0_minus1[k] + 1;
+			size_t slot = 0;
+			while (slot < dpb_size and (slot_frame[slot] < 0 or slot_poc[slot] != poc))
+				++slot;
+			assert(slot < dpb_size);
+			references.set.push_back(slot_frame[slot]);
+			if (rps.used_by_curr_pic_s0_flag & (1 << k))
+				used_pocs.push_back(poc);
+		}
+		assert((rps.used_by_curr_pic_s0_flag >> rps.num_negative_pics) == 0);
+		for (size_t s = 0; s < dpb_size; ++s)
+		{
+			if (slot_frame[s] >= 0 and not std::ranges::count(references.set, slot_frame[s]))
+				slot_frame[s] = -1;
+		}
+
+		assert(used_pocs.size() == e.reference_slots.size());
+		for (size_t k = 0; k < e.reference_slots.size(); ++k)
+		{
+			int32_t slot = e.reference_slots[k];
+			assert(slot != e.setup_slot);
+			assert(e.ref_pic_list0[k] == slot);
+			assert(slot_frame[slot] >= 0);
+			assert(e.h265->reference_info[k].PicOrderCntVal == slot_poc[slot]);
+			assert(slot_poc[slot] == used_pocs[k]);
+			references.used.push_back(slot_frame[slot]);
+		}
+
+		slot_frame[e.setup_slot] = i;
+		slot_poc[e.setup_slot] = picture.PicOrderCntVal;
+	}
+	return res;
+}
+} // namespace
+
+int main()
+{
+	// pipelined stream with periodic IDR frames
+	{
+		mock_vulkan::config cfg;
+		fixture f(cfg);
+
+		encoder_settings settings;
+		settings.frames_in_flight = 3;
+		settings.idr_period = 30;
+		settings.slice_count = 2;
+		settings.references = {.num_short_term = 3, .max_active_references = 2};
+		auto encoder = f.encoder(settings);
+
+		auto parameter_sets = encoder->get_parameter_sets();
+		assert(parameter_sets.size() > 10 and (parameter_sets[4] & 0x1f) == 7);
+
+		const uint64_t frames = 100;
+		auto check = [&](const video_encoder::encoded_frame & frame) {
+			bool idr = frame.ticket % settings.idr_period == 0;
+			check_frame(frame, idr ? cfg.intra_size : cfg.inter_size, idr, settings.slice_count);
+		};
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			if (encoder->frames_pending() == encoder->max_frames_in_flight())
+				check(encoder->wait_frame());
+			assert(f.submit(*encoder) == i);
+		}
+		while (encoder->frames_pending())
+			check(encoder->wait_frame());
+
+		auto encodes = mock_vulkan::executed_encodes();
+		assert(encodes.size() == frames);
+		auto references = check_references(encodes, slot_info::slot_count(settings.references));
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			uint64_t since_idr = i % settings.idr_period;
+			assert(bool(encodes[i].picture.flags.IdrPicFlag) == (since_idr == 0));
+			assert(encodes[i].slices.size() == settings.slice_count);
+			// the most recent frames, up to max_active_references
+			assert(references[i].size() == std::min<uint64_t>(since_idr, 2));
+			for (size_t k = 0; k < references[i].size(); ++k)
+				assert(references[i][k] == int64_t(i - 1 - k));
+		}
+
+		auto stats = encoder->telemetry();
+		assert(stats.frames == frames and stats.intra_frames == 4 and stats.failed_frames == 0);
+		assert(stats.bytes == 4 * cfg.intra_size + (frames - 4) * cfg.inter_size);
+		assert(stats.total.count == frames and stats.device.count == frames);
+		assert(stats.total.percentile(1) >= stats.encode.percentile(1));
+	}
+
+	// a muxer holding the frames of a whole fragment, which keep their
+	// output regions reserved
+	{
+		fixture f;
+		const uint64_t frame_duration = 1500;
+		fmp4_muxer::config mp4_config{.width = 640, .height = 360};
+
+		encoder_settings settings;
+		settings.frames_in_flight = 3;
+		settings.idr_period = 20;
+		settings.open_gop = true;
+		settings.retained_frames = mp4_config.fragment_duration / frame_duration;
+		auto encoder = f.encoder(settings);
+
+		size_t written = 0;
+		std::optional<fmp4_muxer> mp4;
+		mp4.emplace(mp4_config, encoder->get_parameter_sets(), [&](std::span<const iovec> iov) {
+			for (const auto & v: iov)
+				written += v.iov_len;
+		});
+		auto add = [&](const video_encoder::encoded_frame & frame) {
+			assert(not frame.info.failed());
+			mp4->add_frame(frame.bitstream.data(), frame.bitstream.owner(), frame.ticket * frame_duration);
+		};
+
+		const uint64_t frames = 200;
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			if (encoder->frames_pending() == encoder->max_frames_in_flight())
+				add(encoder->wait_frame());
+			f.submit(*encoder);
+			while (auto frame = encoder->poll_frame())
+				add(*frame);
+		}
+		while (encoder->frames_pending())
+			add(encoder->wait_frame());
+		mp4.reset();
+
+		auto stats = encoder->telemetry();
+		assert(stats.frames == frames and stats.failed_frames == 0);
+		assert(written > stats.bytes);
+	}
+
+	// parameter sets written on the host, with a VUI
+	{
+		fixture f;
+		encoder_settings settings;
+		settings.host_parameter_sets = true;
+		auto encoder = f.encoder(settings);
+
+		auto parameter_sets = encoder->get_parameter_sets();
+		std::vector<uint8_t> types;
+		for_each_nal_unit(parameter_sets, [&](std::span<const uint8_t> nal) { types.push_back(nal[0]); });
+		assert((types == std::vector<uint8_t>{0x67, 0x68}));
+		// profile_idc, constraint flags, level_idc
+		assert(parameter_sets[5] == 77 and parameter_sets[6] == 0 and parameter_sets[7] == 50);
+		assert(parameter_sets != f.encoder({})->get_parameter_sets());
+	}
+
+	// parameter sets overridden by the implementation cannot be written on
+	// the host
+	{
+		mock_vulkan::config cfg;
+		cfg.parameter_overrides = true;
+		fixture f(cfg);
+		encoder_settings settings;
+		settings.host_parameter_sets = true;
+		try
+		{
+			f.encoder(settings);
+			assert(false);
+		}
+		catch (std::runtime_error &)
+		{
+		}
+
+		// those of the implementation are still available
+		auto parameter_sets = f.encoder({})->get_parameter_sets();
+		std::vector<uint8_t> types;
+		for_each_nal_unit(parameter_sets, [&](std::span<const uint8_t> nal) { types.push_back(nal[0]); });
+		assert((types == std::vector<uint8_t>{0x67, 0x68}));
+	}
+
+	// keyframe requests and loss recovery
+	{
+		fixture f;
+		encoder_settings settings;
+		settings.frames_in_flight = 1;
+		settings.references = {.num_short_term = 4, .max_active_references = 1};
+		auto encoder = f.encoder(settings);
+
+		for (int i = 0; i < 20; ++i)
+		{
+			if (i == 8)
+				encoder->request_keyframe();
+			if (i == 15)
+				encoder->invalidate_frames(12, 13);
+			auto input = encoder->acquire_input_image();
+			assert(input);
+			encoder->encode_frame(*input, vk::Semaphore{}, f.ctx.queue_family);
+		}
+
+		auto encodes = mock_vulkan::executed_encodes();
+		auto references = check_references(encodes, slot_info::slot_count(settings.references));
+		assert(encodes[8].picture.flags.IdrPicFlag);
+		assert(references[14] == std::vector<int64_t>{13});
+		// 14 depends on 13, the most recent valid reference is 11
+		assert(references[15] == std::vector<int64_t>{11});
+		assert(references[16] == std::vector<int64_t>{15});
+	}
+
+	// skipped frames count towards the keyframe period and the buffer model,
+	// unless the next frame has to be encoded
+	{
+		fixture f;
+		encoder_settings settings;
+		settings.frames_in_flight = 1;
+		settings.idr_period = 4;
+		settings.rate.rc_mode = rate_control::mode::vbr;
+		auto encoder = f.encoder(settings);
+		assert(not encoder->skip_frame());
+
+		uint64_t bytes = 0;
+		auto encode = [&] {
+			auto input = encoder->acquire_input_image();
+			assert(input);
+			bytes += encoder->encode_frame(*input, vk::Semaphore{}, f.ctx.queue_family).info.bytes;
+		};
+		encode();
+		for (int i = 0; i < 3; ++i)
+			assert(encoder->skip_frame());
+		// IDR frame due
+		assert(not encoder->skip_frame());
+		encode();
+		assert(encoder->skip_frame());
+		encoder->request_keyframe();
+		assert(not encoder->skip_frame());
+		encode();
+		assert(encoder->skip_frame());
+		encode();
+		encoder->invalidate_frames(3, 3);
+		assert(not encoder->skip_frame());
+		encode();
+
+		auto encodes = mock_vulkan::executed_encodes();
+		assert(encodes.size() == 5);
+		for (size_t i = 0; i < encodes.size(); ++i)
+			assert(bool(encodes[i].picture.flags.IdrPicFlag) == (i < 3));
+		// skipped frames are not in the stream, frame_num does not count them
+		assert(encodes[3].picture.frame_num == 1 and encodes[4].picture.frame_num == 2);
+		check_references(encodes, slot_info::slot_count(settings.references));
+
+		auto stats = encoder->telemetry();
+		assert(stats.frames == 5 and stats.skipped_frames == 5);
+		const auto & vbv = encoder->buffer_model();
+		assert(vbv);
+		assert(std::abs(vbv->average_bitrate() - 8. * bytes * 60 / 10) < 1);
+
+		encoder->set_extent({320, 180});
+		assert(not encoder->skip_frame());
+	}
+
+	// failed encodes are returned empty and not referenced
+	{
+		mock_vulkan::config cfg;
+		cfg.status = [](const mock_vulkan::encode_record & r) {
+			return r.picture.frame_num == 5 ? VK_QUERY_RESULT_STATUS_ERROR_KHR : VK_QUERY_RESULT_STATUS_COMPLETE_KHR;
+		};
+		fixture f(cfg);
+		encoder_settings settings;
+		settings.frames_in_flight = 1;
+		settings.references = {.num_short_term = 2, .max_active_references = 1};
+		auto encoder = f.encoder(settings);
+
+		for (int i = 0; i < 8; ++i)
+		{
+			auto input = encoder->acquire_input_image();
+			assert(input);
+			auto frame = encoder->encode_frame(*input, vk::Semaphore{}, f.ctx.queue_family);
+			assert(frame.info.failed() == (i == 5));
+			if (i == 5)
+			{
+				assert(frame.bitstream.size() == 0);
+				assert(frame.info.status == VK_QUERY_RESULT_STATUS_ERROR_KHR);
+			}
+		}
+
+		auto references = check_references(mock_vulkan::executed_encodes(), slot_info::slot_count(settings.references));
+		assert(references[5] == std::vector<int64_t>{4});
+		assert(references[6] == std::vector<int64_t>{4});
+		assert(references[7] == std::vector<int64_t>{6});
+
+		auto stats = encoder->telemetry();
+		assert(stats.frames == 8 and stats.failed_frames == 1);
+	}
+
+	// resolution changes on a running session
+	{
+		fixture f;
+		encoder_settings settings;
+		settings.frames_in_flight = 2;
+		settings.references = {.num_short_term = 2, .max_active_references = 1};
+		settings.max_extent = {1280, 720};
+		auto encoder = f.encoder(settings);
+		assert(encoder->max_extent() == settings.max_extent);
+
+		try
+		{
+			encoder->set_extent({1920, 1080});
+			assert(false);
+		}
+		catch (std::runtime_error &)
+		{
+		}
+		// back to the current extent before the next frame: no change
+		encoder->set_extent({1280, 720});
+		encoder->set_extent({640, 360});
+		assert(encoder->frame_extent() == vk::Extent2D{640, 360});
+
+		// enough changes for the parameter set ids to wrap
+		const vk::Extent2D extents[] = {{640, 360}, {1280, 720}, {1000, 562}, {320, 180}};
+		const uint64_t frames = 120;
+		std::vector<vk::Extent2D> frame_extents;
+		auto check = [&](const video_encoder::encoded_frame & frame) {
+			bool changed = frame.ticket > 0 and frame.ticket % 3 == 0;
+			std::vector<uint8_t> types;
+			for_each_nal_unit(frame.bitstream.data(), [&](std::span<const uint8_t> nal) { types.push_back(nal[0]); });
+			if (changed)
+				assert((types == std::vector<uint8_t>{0x67, 0x68, 0x65}));
+			else
+				assert(types.size() == 1 and types[0] == (frame.ticket == 0 ? 0x65 : 0x61));
+		};
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			if (i > 0 and i % 3 == 0)
+				encoder->set_extent(extents[(i / 3) % 4]);
+			frame_extents.push_back(encoder->frame_extent());
+			if (encoder->frames_pending() == encoder->max_frames_in_flight())
+				check(encoder->wait_frame());
+			f.submit(*encoder);
+		}
+		while (encoder->frames_pending())
+			check(encoder->wait_frame());
+
+		auto encodes = mock_vulkan::executed_encodes();
+		check_references(encodes, slot_info::slot_count(settings.references));
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			assert(encodes[i].coded_extent == frame_extents[i]);
+			assert(bool(encodes[i].picture.flags.IdrPicFlag) == (i % 3 == 0));
+			assert(encodes[i].picture.seq_parameter_set_id == (i / 3) % 32);
+
+			// cropped from whole macroblocks, in chroma samples
+			const auto & sps = encodes[i].sps;
+			auto extent = frame_extents[i];
+			assert(16 * (sps.pic_width_in_mbs_minus1 + 1) - 2 * sps.frame_crop_right_offset == extent.width);
+			assert(16 * (sps.pic_height_in_map_units_minus1 + 1) - 2 * sps.frame_crop_bottom_offset == extent.height);
+			assert(sps.frame_crop_left_offset == 0 and sps.frame_crop_top_offset == 0);
+			assert(bool(sps.flags.frame_cropping_flag) == (extent.width % 16 or extent.height % 16));
+			if (extent == vk::Extent2D{320, 180})
+				assert(sps.frame_crop_right_offset == 0 and sps.frame_crop_bottom_offset == 6);
+			if (extent == vk::Extent2D{1000, 562})
+				assert(sps.frame_crop_right_offset == 4 and sps.frame_crop_bottom_offset == 7);
+		}
+	}
+
+	// H.265 reference picture sets and loss recovery
+	{
+		fixture f;
+		encoder_settings settings;
+		settings.frames_in_flight = 1;
+		settings.references = {.num_short_term = 4, .max_active_references = 2};
+		auto encoder = f.h265_encoder(settings);
+
+		for (int i = 0; i < 20; ++i)
+		{
+			if (i == 8)
+				encoder->request_keyframe();
+			if (i == 15)
+				encoder->invalidate_frames(12, 13);
+			auto input = encoder->acquire_input_image();
+			assert(input);
+			auto frame = encoder->encode_frame(*input, vk::Semaphore{}, f.ctx.queue_family);
+			std::vector<uint8_t> types;
+			for_each_nal_unit(frame.bitstream.data(), [&](std::span<const uint8_t> nal) { types.push_back(nal[0] >> 1); });
+			// IDR_W_RADL or TRAIL_R
+			assert(types == std::vector<uint8_t>{uint8_t(i == 0 or i == 8 ? 19 : 1)});
+		}
+
+		auto encodes = mock_vulkan::executed_encodes();
+		auto references = check_h265_references(encodes, slot_info::slot_count(settings.references));
+		assert(encodes[8].h265->picture.pic_type == STD_VIDEO_H265_PICTURE_TYPE_IDR);
+		assert(encodes[9].h265->picture.PicOrderCntVal == 1);
+		assert((references[9].set == std::vector<int64_t>{8}));
+		// the set keeps the short-term references, the closest are used
+		assert((references[14].set == std::vector<int64_t>{13, 12, 11, 10}));
+		assert((references[14].used == std::vector<int64_t>{13, 12}));
+		assert(encodes[14].h265->short_term_rps.used_by_curr_pic_s0_flag == 0b0011);
+		// 14 depends on 13, the invalid pictures are dropped from the set
+		const auto & rps = encodes[15].h265->short_term_rps;
+		assert((references[15].set == std::vector<int64_t>{11}));
+		assert((references[15].used == std::vector<int64_t>{11}));
+		assert(rps.num_negative_pics == 1 and rps.delta_poc_s0_minus1[0] == 3 and rps.used_by_curr_pic_s0_flag == 1);
+		assert((references[16].set == std::vector<int64_t>{15}));
+		assert((references[19].set == std::vector<int64_t>{18, 17, 16, 15}));
+		assert((references[19].used == std::vector<int64_t>{18, 17}));
+	}
+
+	// H.265 resolution changes: SPS and PPS added to the session
+	// parameters, a new object when the ids wrap
+	{
+		fixture f;
+		encoder_settings settings;
+		settings.frames_in_flight = 2;
+		settings.references = {.num_short_term = 2, .max_active_references = 1};
+		settings.max_extent = {1280, 720};
+		auto encoder = f.h265_encoder(settings);
+
+		const vk::Extent2D extents[] = {{640, 360}, {1280, 720}, {1000, 562}, {320, 180}};
+		const uint64_t frames = 120;
+		std::vector<vk::Extent2D> frame_extents;
+		auto check = [&](const video_encoder::encoded_frame & frame) {
+			bool changed = frame.ticket > 0 and frame.ticket % 3 == 0;
+			std::vector<uint8_t> types;
+			for_each_nal_unit(frame.bitstream.data(), [&](std::span<const uint8_t> nal) { types.push_back(nal[0] >> 1); });
+			// VPS, SPS, PPS, IDR_W_RADL
+			if (changed)
+				assert((types == std::vector<uint8_t>{32, 33, 34, 19}));
+			else
+				assert(types.size() == 1 and types[0] == (frame.ticket == 0 ? 19 : 1));
+		};
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			if (i > 0 and i % 3 == 0)
+				encoder->set_extent(extents[(i / 3) % 4]);
+			frame_extents.push_back(encoder->frame_extent());
+			if (encoder->frames_pending() == encoder->max_frames_in_flight())
+				check(encoder->wait_frame());
+			f.submit(*encoder);
+		}
+		while (encoder->frames_pending())
+			check(encoder->wait_frame());
+
+		auto encodes = mock_vulkan::executed_encodes();
+		check_h265_references(encodes, slot_info::slot_count(settings.references));
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			const auto & picture = encodes[i].h265->picture;
+			assert(encodes[i].coded_extent == frame_extents[i]);
+			assert((picture.pic_type == STD_VIDEO_H265_PICTURE_TYPE_IDR) == (i % 3 == 0));
+			assert(picture.pps_seq_parameter_set_id == (i / 3) % 16);
+			assert(picture.pps_pic_parameter_set_id == picture.pps_seq_parameter_set_id);
+
+			// conformance window of whole minimum coding blocks, in chroma
+			// samples
+			const auto & sps = encodes[i].h265->sps;
+			auto extent = frame_extents[i];
+			assert(sps.sps_seq_parameter_set_id == picture.pps_seq_parameter_set_id);
+			assert(sps.pic_width_in_luma_samples - 2 * sps.conf_win_right_offset == extent.width);
+			assert(sps.pic_height_in_luma_samples - 2 * sps.conf_win_bottom_offset == extent.height);
+			assert(bool(sps.flags.conformance_window_flag) == (extent.width % 8 or extent.height % 8));
+			if (extent == vk::Extent2D{1000, 562})
+				assert(sps.pic_width_in_luma_samples == 1000 and sps.pic_height_in_luma_samples == 568);
+		}
+	}
+
+	// regions of interest with a quantization delta map
+	{
+		mock_vulkan::config cfg;
+		cfg.quantization_map = true;
+		cfg.min_qp_delta = -10;
+		cfg.max_qp_delta = 10;
+		fixture f(cfg);
+
+		try
+		{
+			auto encoder = f.encoder({});
+			assert(not encoder->supports_qp_map());
+			encoder->set_roi({});
+			assert(false);
+		}
+		catch (std::runtime_error &)
+		{
+		}
+
+		encoder_settings settings;
+		settings.frames_in_flight = 1;
+		settings.quantization_map = true;
+		settings.max_extent = {640, 360};
+		settings.rate.rc_mode = rate_control::mode::cqp;
+		auto encoder = f.encoder(settings);
+		assert(encoder->supports_qp_map());
+		assert(encoder->qp_map_texel_size() == vk::Extent2D{16, 16});
+
+		const qp_region regions[] = {
+		        {.x = 0, .y = 0, .width = 640, .height = 360, .delta_qp = 4},
+		        {.x = 100, .y = 40, .width = 50, .height = 20, .delta_qp = -20},
+		};
+		auto expected = make_delta_qp_map(640, 360, 16, 16, regions);
+		expected.clamp(-10, 10);
+		auto small = make_delta_qp_map(320, 180, 16, 16, regions);
+		small.clamp(-10, 10);
+		delta_qp_map explicit_map(320, 180, 16, 16);
+		explicit_map.at(1, 2) = -3;
+
+		auto cqp = settings.rate;
+		auto cbr = settings.rate;
+		cbr.rc_mode = rate_control::mode::cbr;
+		for (int i = 0; i < 9; ++i)
+		{
+			if (i == 1)
+				encoder->set_roi(regions);
+			if (i == 3)
+				encoder->set_rate_control(cbr);
+			if (i == 5)
+				encoder->set_rate_control(cqp);
+			if (i == 6)
+				encoder->set_extent({320, 180});
+			if (i == 7)
+			{
+				encoder->set_roi({});
+				try
+				{
+					encoder->set_qp_map(delta_qp_map(640, 360, 16, 16));
+					assert(false);
+				}
+				catch (std::invalid_argument &)
+				{
+				}
+			}
+			if (i == 8)
+				encoder->set_qp_map(explicit_map);
+			auto input = encoder->acquire_input_image();
+			assert(input);
+			encoder->encode_frame(*input, vk::Semaphore{}, f.ctx.queue_family);
+		}
+
+		// the map is only used without rate control
+		auto encodes = mock_vulkan::executed_encodes();
+		assert(encodes[0].qp_map.empty());
+		for (int i: {1, 2, 5})
+		{
+			assert(encodes[i].qp_map_extent == vk::Extent2D{40, 23});
+			assert(encodes[i].qp_map == expected.values);
+		}
+		assert(encodes[3].qp_map.empty() and encodes[4].qp_map.empty());
+		assert(encodes[6].qp_map_extent == vk::Extent2D{20, 12});
+		assert(encodes[6].qp_map == small.values);
+		assert(encodes[7].qp_map.empty());
+		assert(encodes[8].qp_map == explicit_map.values);
+	}
+
+	// allocations still held are freed with the allocator, dedicated ones
+	// included
+	{
+		mock_vulkan::config cfg;
+		cfg.dedicated_allocations = true;
+		fixture f(cfg);
+		f.encoder({}).reset();
+		size_t count = mock_vulkan::device_memory_count();
+
+		auto buffer = f.ctx.device.createBuffer({
+		        .size = 1024,
+		        .usage = vk::BufferUsageFlagBits::eTransferSrc,
+		});
+		f.allocator->bind(buffer, vk::MemoryPropertyFlagBits::eHostVisible);
+		assert(mock_vulkan::device_memory_count() == count + 1);
+		f.ctx.device.destroy(buffer);
+		f.allocator.reset();
+		assert(mock_vulkan::device_memory_count() == 0);
+	}
+
+	// staging readback, waiting on the input semaphore
+	{
+		using namespace std::chrono_literals;
+		mock_vulkan::config cfg;
+		cfg.latency = 2ms;
+		cfg.frame_size = [](const mock_vulkan::encode_record & r) { return 1000 + 100 * r.picture.frame_num; };
+		fixture f(cfg);
+
+		encoder_settings settings;
+		settings.readback = encoder_settings::readback_mode::staging;
+		auto encoder = f.encoder(settings);
+
+		for (uint32_t i = 0; i < 5; ++i)
+		{
+			auto input = encoder->acquire_input_image();
+			assert(input);
+			uint64_t ticket = encoder->submit_frame(*input, f.ctx.queue_family);
+			std::this_thread::sleep_for(5ms);
+			assert(not encoder->poll_frame());
+
+			f.ctx.device.signalSemaphore({
+			        .semaphore = encoder->input_semaphore(),
+			        .value = video_encoder::timeline_value(ticket),
+			});
+			check_frame(encoder->wait_frame(), 1000 + 100 * i, i == 0, 1);
+		}
+	}
+
+	// POC keeps increasing when frame_num wraps, so that references from
+	// before the wrap, such as the long-term IDR frame, stay in the past
+	{
+		fixture f;
+		encoder_settings settings;
+		settings.frames_in_flight = 4;
+		settings.references = {.num_short_term = 1, .num_long_term = 1, .max_active_references = 2};
+		auto encoder = f.encoder(settings);
+
+		const uint64_t max_frame_num = 1 << 16;
+		uint64_t checked = 0;
+		auto check = [&]() {
+			while (encoder->frames_pending())
+				encoder->wait_frame();
+			for (const auto & encode: mock_vulkan::executed_encodes())
+			{
+				assert(encode.picture.frame_num == checked % max_frame_num);
+				assert(encode.picture.PicOrderCnt == int32_t(2 * checked));
+				assert(encode.reference_info.size() == std::min<uint64_t>(checked, 2));
+				for (const auto & reference: encode.reference_info)
+					assert(reference.PicOrderCnt < encode.picture.PicOrderCnt);
+				++checked;
+			}
+			mock_vulkan::clear_executed_encodes();
+		};
+		for (uint64_t i = 0; i < max_frame_num + 8; ++i)
+		{
+			if (encoder->frames_pending() == encoder->max_frames_in_flight())
+				encoder->wait_frame();
+			f.submit(*encoder);
+			if (i % 4096 == 4095)
+				check();
+		}
+		check();
+		assert(checked == max_frame_num + 8);
+	}
+
+	return 0;
+}
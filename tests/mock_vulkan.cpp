@@ -0,0 +1,1928 @@
+#include "mock_vulkan.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+
+VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
+
+namespace mock_vulkan
+{
+namespace
+{
+// Handles are pointers to the objects below, dispatchable ones to static
+// placeholders since there is only one of each
+template <class T, class H>
+T * get(H handle)
+{
+	return (T *)(uintptr_t)handle;
+}
+template <class H, class T>
+H make_handle(T * object)
+{
+	return (H)(uintptr_t)object;
+}
+
+template <class T>
+const T * find_next(const void * next, VkStructureType type)
+{
+	for (auto i = (const VkBaseInStructure *)next; i; i = i->pNext)
+	{
+		if (i->sType == type)
+			return (const T *)i;
+	}
+	return nullptr;
+}
+
+constexpr VkDeviceSize non_coherent_atom_size = 64;
+constexpr VkDeviceSize bitstream_alignment = 256;
+
+// device local, host coherent, host cached but not coherent
+constexpr VkMemoryPropertyFlags memory_types[] = {
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+};
+constexpr uint32_t all_memory_types = (1 << std::size(memory_types)) - 1;
+
+struct dispatchable
+{
+	void * loader_data = nullptr;
+};
+dispatchable instance_object;
+dispatchable physical_device_object;
+dispatchable device_object;
+dispatchable queue_objects[max_queues];
+
+struct device_memory
+{
+	// not initialised, so that large allocations are not committed
+	std::unique_ptr<uint8_t[]> data;
+	VkDeviceSize size;
+};
+
+struct buffer
+{
+	VkDeviceSize size;
+	device_memory * memory = nullptr;
+	VkDeviceSize offset = 0;
+};
+
+struct image
+{
+	VkExtent3D extent;
+	uint32_t layers;
+	// only for quantization maps, one byte per texel, and NV12 transfer
+	// destinations, the Y plane then the CbCr plane
+	std::vector<uint8_t> texels;
+};
+
+struct image_view
+{
+	image * target;
+};
+
+struct semaphore
+{
+	bool timeline;
+	// binary semaphores are 0 or 1
+	uint64_t value;
+};
+
+struct query_pool
+{
+	VkQueryType type;
+	VkVideoEncodeFeedbackFlagsKHR feedback;
+	struct result
+	{
+		uint32_t offset = 0;
+		uint32_t bytes = 0;
+		VkQueryResultStatusKHR status = VK_QUERY_RESULT_STATUS_COMPLETE_KHR;
+		// nanoseconds, for timestamp queries
+		uint64_t timestamp = 0;
+		bool available = false;
+	};
+	std::vector<result> results;
+};
+
+struct video_session
+{
+	uint32_t max_dpb_slots;
+	uint32_t max_active_references;
+	VkExtent2D max_coded_extent;
+	bool quantization_delta_map;
+};
+
+// Parameter sets by id, kept after destruction to detect use by pending
+// command buffers
+struct session_parameters
+{
+	uint32_t max_vps;
+	uint32_t max_sps;
+	uint32_t max_pps;
+	// H.264
+	std::map<uint32_t, StdVideoH264SequenceParameterSet> sps;
+	std::set<uint32_t> pps_ids;
+	// H.265, PPS by VPS, SPS and PPS id
+	std::set<uint32_t> vps_ids;
+	std::map<uint32_t, StdVideoH265SequenceParameterSet> h265_sps;
+	std::set<std::tuple<uint32_t, uint32_t, uint32_t>> h265_pps_ids;
+	uint32_t update_count = 0;
+	bool quantization_map_compatible = false;
+	bool destroyed = false;
+};
+
+struct command_buffer
+{
+	// executed with the state mutex held
+	std::vector<std::function<void()>> commands;
+	// submissions not executed yet, protected by the state mutex
+	uint32_t pending = 0;
+
+	// recording state
+	bool recording = false;
+	video_session * session = nullptr;
+	session_parameters * parameters = nullptr;
+	// from the last rate control state given in the video coding scope
+	VkVideoEncodeRateControlModeFlagBitsKHR rate_control_mode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR;
+	struct bound_slot
+	{
+		int32_t index;
+		VkImageView view;
+		uint32_t layer;
+	};
+	// from vkCmdBeginVideoCodingKHR, empty outside of a video coding scope
+	std::optional<std::vector<bound_slot>> bound_slots;
+	query_pool * active_pool = nullptr;
+	uint32_t active_query = 0;
+};
+
+struct command_pool
+{
+	std::vector<command_buffer *> buffers;
+};
+
+struct submission
+{
+	// index in the queue family
+	size_t queue;
+	std::vector<std::pair<semaphore *, uint64_t>> waits;
+	std::vector<command_buffer *> command_buffers;
+	std::vector<std::pair<semaphore *, uint64_t>> signals;
+	std::chrono::steady_clock::time_point not_before;
+};
+
+struct state
+{
+	config cfg;
+
+	std::mutex mutex;
+	// notified when a submission is added or executed and when the host
+	// signals a semaphore
+	std::condition_variable cv;
+	std::deque<submission> pending;
+	bool busy = false;
+	bool quit = false;
+	std::vector<encode_record> executed;
+	std::vector<image_barrier> barriers;
+	size_t queue_submissions[max_queues] = {};
+
+	std::mutex errors_mutex;
+	std::vector<std::string> errors;
+
+	std::vector<std::unique_ptr<session_parameters>> destroyed_parameters;
+	std::atomic<size_t> device_memory_count = 0;
+
+	std::thread worker;
+};
+std::unique_ptr<state> mock;
+
+void report(std::string message)
+{
+	std::lock_guard lock(mock->errors_mutex);
+	mock->errors.push_back(std::move(message));
+}
+
+template <class T>
+VkResult fill_array(const T & value, uint32_t * count, T * out)
+{
+	if (not out)
+	{
+		*count = 1;
+		return VK_SUCCESS;
+	}
+	if (*count < 1)
+		return VK_INCOMPLETE;
+	*count = 1;
+	// keep the chain set by the caller, if any
+	if constexpr (requires { value.pNext; })
+	{
+		auto next = out->pNext;
+		*out = value;
+		out->pNext = next;
+	}
+	else
+	{
+		*out = value;
+	}
+	return VK_SUCCESS;
+}
+
+// Worker thread, executes the submissions of each queue in order
+bool waits_satisfied(const submission & s)
+{
+	return std::ranges::all_of(s.waits, [](const auto & wait) { return wait.first->value >= wait.second; });
+}
+
+// Oldest submission that can execute, a submission waiting for a semaphore
+// only holds up the later ones to the same queue
+std::deque<submission>::iterator next_submission()
+{
+	for (auto it = mock->pending.begin(); it != mock->pending.end(); ++it)
+	{
+		bool first = std::none_of(mock->pending.begin(), it, [&](const submission & s) { return s.queue == it->queue; });
+		if (first and waits_satisfied(*it))
+			return it;
+	}
+	return mock->pending.end();
+}
+
+void run()
+{
+	std::unique_lock lock(mock->mutex);
+	for (;;)
+	{
+		mock->cv.wait(lock, [] { return mock->quit or next_submission() != mock->pending.end(); });
+		if (mock->quit)
+			return;
+
+		auto next = next_submission();
+		submission s = std::move(*next);
+		mock->pending.erase(next);
+		mock->busy = true;
+
+		lock.unlock();
+		std::this_thread::sleep_until(s.not_before);
+		lock.lock();
+
+		for (auto [sem, value]: s.waits)
+		{
+			if (not sem->timeline)
+				sem->value = 0;
+		}
+		for (auto cb: s.command_buffers)
+		{
+			for (auto & command: cb->commands)
+				command();
+			--cb->pending;
+		}
+		for (auto [sem, value]: s.signals)
+		{
+			if (sem->timeline and sem->value >= value)
+				report("timeline semaphore signaled with a value that does not increase");
+			if (not sem->timeline and sem->value)
+				report("binary semaphore signaled again before being waited on");
+			sem->value = value;
+		}
+		mock->busy = false;
+		mock->cv.notify_all();
+	}
+}
+
+void wait_idle()
+{
+	std::unique_lock lock(mock->mutex);
+	mock->cv.wait(lock, [] { return mock->pending.empty() and not mock->busy; });
+}
+
+size_t slice_count(const encode_record & r)
+{
+	return r.h265 ? r.h265->slices.size() : r.slices.size();
+}
+
+// Synthetic H.264 or H.265 frame: one NAL unit per slice, filler bytes that
+// cannot form a start code
+uint32_t write_frame(uint8_t * out, VkDeviceSize range, const encode_record & r, uint32_t size)
+{
+	const uint32_t slices = std::max<uint32_t>(slice_count(r), 1);
+	const uint32_t min_size = (r.h265 ? 6 : 5) * slices;
+	if (range < min_size)
+	{
+		report("destination range too small for an encoded frame");
+		return 0;
+	}
+	size = std::clamp<VkDeviceSize>(size, min_size, range);
+
+	const uint8_t nal_ref_idc = r.picture.flags.is_reference ? 3 : 0;
+	const uint8_t nal_unit_type = r.picture.flags.IdrPicFlag ? 5 : 1;
+	std::memset(out, 0xaa, size);
+	for (uint32_t i = 0; i < slices; ++i)
+	{
+		uint8_t * nal = out + i * (size / slices);
+		nal[0] = 0;
+		nal[1] = 0;
+		nal[2] = 0;
+		nal[3] = 1;
+		if (r.h265)
+		{
+			// IDR_W_RADL or TRAIL_R, nuh_layer_id 0, nuh_temporal_id_plus1 1
+			nal[4] = (r.h265->picture.flags.IrapPicFlag ? 19 : 1) << 1;
+			nal[5] = 1;
+		}
+		else
+			nal[4] = (nal_ref_idc << 5) | nal_unit_type;
+	}
+	return size;
+}
+
+bool is_intra(const encode_record & r)
+{
+	if (r.h265)
+		return r.h265->picture.pic_type == STD_VIDEO_H265_PICTURE_TYPE_IDR or
+		       r.h265->picture.pic_type == STD_VIDEO_H265_PICTURE_TYPE_I;
+	return r.picture.primary_pic_type == STD_VIDEO_H264_PICTURE_TYPE_IDR or
+	       r.picture.primary_pic_type == STD_VIDEO_H264_PICTURE_TYPE_I;
+}
+
+// Instance and physical device
+VKAPI_ATTR VkResult VKAPI_CALL create_instance(const VkInstanceCreateInfo *, const VkAllocationCallbacks *, VkInstance * instance)
+{
+	*instance = (VkInstance)&instance_object;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_instance(VkInstance, const VkAllocationCallbacks *)
+{}
+
+VKAPI_ATTR VkResult VKAPI_CALL enumerate_physical_devices(VkInstance, uint32_t * count, VkPhysicalDevice * devices)
+{
+	return fill_array((VkPhysicalDevice)&physical_device_object, count, devices);
+}
+
+VKAPI_ATTR void VKAPI_CALL get_physical_device_properties(VkPhysicalDevice, VkPhysicalDeviceProperties * props)
+{
+	*props = {};
+	props->apiVersion = VK_API_VERSION_1_3;
+	props->deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU;
+	std::strcpy(props->deviceName, "mock video encoder");
+	props->limits.bufferImageGranularity = 1024;
+	props->limits.nonCoherentAtomSize = non_coherent_atom_size;
+	props->limits.timestampPeriod = 1;
+}
+
+VKAPI_ATTR void VKAPI_CALL get_physical_device_memory_properties(VkPhysicalDevice, VkPhysicalDeviceMemoryProperties * props)
+{
+	*props = {};
+	props->memoryHeapCount = 2;
+	props->memoryHeaps[0] = {.size = 1ull << 32, .flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT};
+	props->memoryHeaps[1] = {.size = 1ull << 32, .flags = 0};
+	props->memoryTypeCount = std::size(memory_types);
+	for (size_t i = 0; i < std::size(memory_types); ++i)
+	{
+		props->memoryTypes[i] = {
+		        .propertyFlags = memory_types[i],
+		        .heapIndex = memory_types[i] & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT ? 0u : 1u,
+		};
+	}
+}
+
+VkQueueFamilyProperties queue_family()
+{
+	return {
+	        .queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT | VK_QUEUE_VIDEO_ENCODE_BIT_KHR,
+	        .queueCount = mock->cfg.queue_count,
+	        .timestampValidBits = 64,
+	        .minImageTransferGranularity = {1, 1, 1},
+	};
+}
+
+VKAPI_ATTR void VKAPI_CALL get_physical_device_queue_family_properties(VkPhysicalDevice, uint32_t * count, VkQueueFamilyProperties * props)
+{
+	fill_array(queue_family(), count, props);
+}
+
+VKAPI_ATTR void VKAPI_CALL get_physical_device_queue_family_properties2(VkPhysicalDevice, uint32_t * count, VkQueueFamilyProperties2 * props)
+{
+	if (not props)
+	{
+		*count = 1;
+		return;
+	}
+	if (*count < 1)
+		return;
+	*count = 1;
+	props->queueFamilyProperties = queue_family();
+	for (auto next = (VkBaseOutStructure *)props->pNext; next; next = next->pNext)
+	{
+		if (next->sType == VK_STRUCTURE_TYPE_QUEUE_FAMILY_VIDEO_PROPERTIES_KHR)
+			((VkQueueFamilyVideoPropertiesKHR *)next)->videoCodecOperations =
+			        VK_VIDEO_CODEC_OPERATION_ENCODE_H264_BIT_KHR | VK_VIDEO_CODEC_OPERATION_ENCODE_H265_BIT_KHR;
+		if (next->sType == VK_STRUCTURE_TYPE_QUEUE_FAMILY_QUERY_RESULT_STATUS_PROPERTIES_KHR)
+			((VkQueueFamilyQueryResultStatusPropertiesKHR *)next)->queryResultStatusSupport = VK_TRUE;
+	}
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL get_physical_device_video_capabilities(VkPhysicalDevice, const VkVideoProfileInfoKHR * profile, VkVideoCapabilitiesKHR * caps)
+{
+	const bool h265_profile = profile->videoCodecOperation == VK_VIDEO_CODEC_OPERATION_ENCODE_H265_BIT_KHR;
+	if (profile->videoCodecOperation != VK_VIDEO_CODEC_OPERATION_ENCODE_H264_BIT_KHR and not h265_profile)
+		return VK_ERROR_VIDEO_PROFILE_CODEC_NOT_SUPPORTED_KHR;
+
+	const config & cfg = mock->cfg;
+	caps->flags = 0;
+	caps->minBitstreamBufferOffsetAlignment = bitstream_alignment;
+	caps->minBitstreamBufferSizeAlignment = bitstream_alignment;
+	caps->pictureAccessGranularity = {16, 16};
+	caps->minCodedExtent = {16, 16};
+	caps->maxCodedExtent = {4096, 4096};
+	caps->maxDpbSlots = cfg.max_dpb_slots;
+	caps->maxActiveReferencePictures = cfg.max_active_references;
+	if (h265_profile)
+	{
+		std::strcpy(caps->stdHeaderVersion.extensionName, VK_STD_VULKAN_VIDEO_CODEC_H265_ENCODE_EXTENSION_NAME);
+		caps->stdHeaderVersion.specVersion = VK_STD_VULKAN_VIDEO_CODEC_H265_ENCODE_SPEC_VERSION;
+	}
+	else
+	{
+		std::strcpy(caps->stdHeaderVersion.extensionName, VK_STD_VULKAN_VIDEO_CODEC_H264_ENCODE_EXTENSION_NAME);
+		caps->stdHeaderVersion.specVersion = VK_STD_VULKAN_VIDEO_CODEC_H264_ENCODE_SPEC_VERSION;
+	}
+
+	for (auto next = (VkBaseOutStructure *)caps->pNext; next; next = next->pNext)
+	{
+		if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_CAPABILITIES_KHR)
+		{
+			auto encode = (VkVideoEncodeCapabilitiesKHR *)next;
+			encode->flags = cfg.quantization_map ? VK_VIDEO_ENCODE_CAPABILITY_QUANTIZATION_DELTA_MAP_BIT_KHR : 0;
+			encode->rateControlModes = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR |
+			                           VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR |
+			                           VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR |
+			                           VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR;
+			encode->maxRateControlLayers = 1;
+			encode->maxBitrate = 1'000'000'000;
+			encode->maxQualityLevels = 1;
+			encode->encodeInputPictureGranularity = {16, 16};
+			encode->supportedEncodeFeedbackFlags = VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_BUFFER_OFFSET_BIT_KHR |
+			                                       VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_BYTES_WRITTEN_BIT_KHR |
+			                                       VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_HAS_OVERRIDES_BIT_KHR;
+		}
+		else if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_CAPABILITIES_KHR)
+		{
+			auto h264 = (VkVideoEncodeH264CapabilitiesKHR *)next;
+			h264->flags = 0;
+			h264->maxLevelIdc = STD_VIDEO_H264_LEVEL_IDC_6_2;
+			h264->maxSliceCount = cfg.max_slice_count;
+			h264->maxPPictureL0ReferenceCount = cfg.max_active_references;
+			h264->maxBPictureL0ReferenceCount = 0;
+			h264->maxL1ReferenceCount = 0;
+			h264->maxTemporalLayerCount = 1;
+			h264->expectDyadicTemporalLayerPattern = VK_FALSE;
+			h264->minQp = 0;
+			h264->maxQp = 51;
+			h264->prefersGopRemainingFrames = VK_FALSE;
+			h264->requiresGopRemainingFrames = VK_FALSE;
+			h264->stdSyntaxFlags = 0;
+		}
+		else if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_CAPABILITIES_KHR)
+		{
+			auto h265 = (VkVideoEncodeH265CapabilitiesKHR *)next;
+			h265->flags = 0;
+			h265->maxLevelIdc = STD_VIDEO_H265_LEVEL_IDC_6_2;
+			h265->maxSliceSegmentCount = cfg.max_slice_count;
+			h265->maxTiles = {1, 1};
+			h265->ctbSizes = VK_VIDEO_ENCODE_H265_CTB_SIZE_16_BIT_KHR | VK_VIDEO_ENCODE_H265_CTB_SIZE_32_BIT_KHR;
+			h265->transformBlockSizes = VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_4_BIT_KHR |
+			                            VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_8_BIT_KHR |
+			                            VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_16_BIT_KHR |
+			                            VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_32_BIT_KHR;
+			h265->maxPPictureL0ReferenceCount = cfg.max_active_references;
+			h265->maxBPictureL0ReferenceCount = 0;
+			h265->maxL1ReferenceCount = 0;
+			h265->maxSubLayerCount = 1;
+			h265->expectDyadicTemporalSubLayerPattern = VK_FALSE;
+			h265->minQp = 0;
+			h265->maxQp = 51;
+			h265->prefersGopRemainingFrames = VK_FALSE;
+			h265->requiresGopRemainingFrames = VK_FALSE;
+			h265->stdSyntaxFlags = 0;
+		}
+		else if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUANTIZATION_MAP_CAPABILITIES_KHR or
+		         next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_QUANTIZATION_MAP_CAPABILITIES_KHR or
+		         next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_QUANTIZATION_MAP_CAPABILITIES_KHR)
+		{
+			if (not cfg.quantization_map)
+				report("vkGetPhysicalDeviceVideoCapabilitiesKHR: VK_KHR_video_encode_quantization_map is not supported");
+			if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUANTIZATION_MAP_CAPABILITIES_KHR)
+				((VkVideoEncodeQuantizationMapCapabilitiesKHR *)next)->maxQuantizationMapExtent = {256, 256};
+			else if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_QUANTIZATION_MAP_CAPABILITIES_KHR)
+			{
+				((VkVideoEncodeH264QuantizationMapCapabilitiesKHR *)next)->minQpDelta = cfg.min_qp_delta;
+				((VkVideoEncodeH264QuantizationMapCapabilitiesKHR *)next)->maxQpDelta = cfg.max_qp_delta;
+			}
+			else
+			{
+				((VkVideoEncodeH265QuantizationMapCapabilitiesKHR *)next)->minQpDelta = cfg.min_qp_delta;
+				((VkVideoEncodeH265QuantizationMapCapabilitiesKHR *)next)->maxQpDelta = cfg.max_qp_delta;
+			}
+		}
+	}
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL get_physical_device_video_format_properties(VkPhysicalDevice,
+                                                                           const VkPhysicalDeviceVideoFormatInfoKHR * info,
+                                                                           uint32_t * count,
+                                                                           VkVideoFormatPropertiesKHR * props)
+{
+	if (info->imageUsage & VK_IMAGE_USAGE_VIDEO_ENCODE_QUANTIZATION_DELTA_MAP_BIT_KHR)
+	{
+		if (not mock->cfg.quantization_map)
+		{
+			*count = 0;
+			return VK_ERROR_FORMAT_NOT_SUPPORTED;
+		}
+		auto res = fill_array(
+		        VkVideoFormatPropertiesKHR{
+		                .sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR,
+		                .pNext = nullptr,
+		                .format = VK_FORMAT_R8_SINT,
+		                .componentMapping = {},
+		                .imageCreateFlags = 0,
+		                .imageType = VK_IMAGE_TYPE_2D,
+		                .imageTiling = VK_IMAGE_TILING_OPTIMAL,
+		                .imageUsageFlags = info->imageUsage,
+		        },
+		        count,
+		        props);
+		if (props and *count)
+		{
+			if (auto texel = find_next<VkVideoFormatQuantizationMapPropertiesKHR>(
+			            props->pNext, VK_STRUCTURE_TYPE_VIDEO_FORMAT_QUANTIZATION_MAP_PROPERTIES_KHR))
+				const_cast<VkVideoFormatQuantizationMapPropertiesKHR *>(texel)->quantizationMapTexelSize = {16, 16};
+		}
+		return res;
+	}
+
+	// input images can have single plane views for compute shaders
+	VkImageCreateFlags flags = 0;
+	if (info->imageUsage & VK_IMAGE_USAGE_VIDEO_ENCODE_SRC_BIT_KHR)
+		flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+
+	return fill_array(
+	        VkVideoFormatPropertiesKHR{
+	                .sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR,
+	                .pNext = nullptr,
+	                .format = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM,
+	                .componentMapping = {},
+	                .imageCreateFlags = flags,
+	                .imageType = VK_IMAGE_TYPE_2D,
+	                .imageTiling = VK_IMAGE_TILING_OPTIMAL,
+	                .imageUsageFlags = info->imageUsage,
+	        },
+	        count,
+	        props);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL create_device(VkPhysicalDevice, const VkDeviceCreateInfo * info, const VkAllocationCallbacks *, VkDevice * device)
+{
+	for (uint32_t i = 0; i < info->queueCreateInfoCount; ++i)
+	{
+		const auto & queue = info->pQueueCreateInfos[i];
+		if (queue.queueFamilyIndex != 0 or queue.queueCount == 0 or queue.queueCount > mock->cfg.queue_count)
+			report("vkCreateDevice: invalid queue create info");
+	}
+	*device = (VkDevice)&device_object;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_device(VkDevice, const VkAllocationCallbacks *)
+{}
+
+VKAPI_ATTR void VKAPI_CALL get_device_queue(VkDevice, uint32_t family, uint32_t index, VkQueue * queue)
+{
+	if (family != 0 or index >= mock->cfg.queue_count)
+	{
+		report("vkGetDeviceQueue: no such queue");
+		index = 0;
+	}
+	*queue = (VkQueue)&queue_objects[index];
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL device_wait_idle(VkDevice)
+{
+	wait_idle();
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL queue_wait_idle(VkQueue)
+{
+	wait_idle();
+	return VK_SUCCESS;
+}
+
+// Memory
+VKAPI_ATTR VkResult VKAPI_CALL allocate_memory(VkDevice, const VkMemoryAllocateInfo * info, const VkAllocationCallbacks *, VkDeviceMemory * memory)
+{
+	if (info->memoryTypeIndex >= std::size(memory_types))
+	{
+		report("vkAllocateMemory: invalid memory type");
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+	*memory = make_handle<VkDeviceMemory>(new device_memory{
+	        .data = std::make_unique_for_overwrite<uint8_t[]>(info->allocationSize),
+	        .size = info->allocationSize,
+	});
+	++mock->device_memory_count;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL free_memory(VkDevice, VkDeviceMemory memory, const VkAllocationCallbacks *)
+{
+	if (not memory)
+		return;
+	delete get<device_memory>(memory);
+	--mock->device_memory_count;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL map_memory(VkDevice, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize, VkMemoryMapFlags, void ** data)
+{
+	*data = get<device_memory>(memory)->data.get() + offset;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL unmap_memory(VkDevice, VkDeviceMemory)
+{}
+
+void check_ranges(const char * function, uint32_t count, const VkMappedMemoryRange * ranges)
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const auto & range = ranges[i];
+		auto memory = get<device_memory>(range.memory);
+		if (range.offset % non_coherent_atom_size)
+			report(std::string(function) + ": offset is not a multiple of nonCoherentAtomSize");
+		if (range.size == VK_WHOLE_SIZE)
+			continue;
+		if (range.offset + range.size > memory->size)
+			report(std::string(function) + ": range exceeds the allocation");
+		else if (range.size % non_coherent_atom_size and range.offset + range.size != memory->size)
+			report(std::string(function) + ": size is not a multiple of nonCoherentAtomSize");
+	}
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL flush_mapped_memory_ranges(VkDevice, uint32_t count, const VkMappedMemoryRange * ranges)
+{
+	check_ranges("vkFlushMappedMemoryRanges", count, ranges);
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL invalidate_mapped_memory_ranges(VkDevice, uint32_t count, const VkMappedMemoryRange * ranges)
+{
+	check_ranges("vkInvalidateMappedMemoryRanges", count, ranges);
+	return VK_SUCCESS;
+}
+
+void fill_requirements(VkMemoryRequirements2 * req, VkDeviceSize size, VkDeviceSize alignment)
+{
+	req->memoryRequirements = {
+	        .size = (size + alignment - 1) / alignment * alignment,
+	        .alignment = alignment,
+	        .memoryTypeBits = all_memory_types,
+	};
+	for (auto next = (VkBaseOutStructure *)req->pNext; next; next = next->pNext)
+	{
+		if (next->sType == VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS)
+		{
+			((VkMemoryDedicatedRequirements *)next)->prefersDedicatedAllocation = mock->cfg.dedicated_allocations;
+			((VkMemoryDedicatedRequirements *)next)->requiresDedicatedAllocation = VK_FALSE;
+		}
+	}
+}
+
+// Buffers and images
+VKAPI_ATTR VkResult VKAPI_CALL create_buffer(VkDevice, const VkBufferCreateInfo * info, const VkAllocationCallbacks *, VkBuffer * b)
+{
+	*b = make_handle<VkBuffer>(new buffer{.size = info->size});
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_buffer(VkDevice, VkBuffer b, const VkAllocationCallbacks *)
+{
+	delete get<buffer>(b);
+}
+
+VKAPI_ATTR void VKAPI_CALL get_buffer_memory_requirements2(VkDevice, const VkBufferMemoryRequirementsInfo2 * info, VkMemoryRequirements2 * req)
+{
+	fill_requirements(req, get<buffer>(info->buffer)->size, bitstream_alignment);
+}
+
+VKAPI_ATTR void VKAPI_CALL get_buffer_memory_requirements(VkDevice, VkBuffer b, VkMemoryRequirements * req)
+{
+	VkMemoryRequirements2 req2{.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2, .pNext = nullptr, .memoryRequirements = {}};
+	fill_requirements(&req2, get<buffer>(b)->size, bitstream_alignment);
+	*req = req2.memoryRequirements;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL bind_buffer_memory(VkDevice, VkBuffer b, VkDeviceMemory memory, VkDeviceSize offset)
+{
+	auto buf = get<buffer>(b);
+	buf->memory = get<device_memory>(memory);
+	buf->offset = offset;
+	if (offset + buf->size > buf->memory->size)
+		report("vkBindBufferMemory: buffer exceeds the allocation");
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL create_image(VkDevice, const VkImageCreateInfo * info, const VkAllocationCallbacks *, VkImage * i)
+{
+	auto img = new image{.extent = info->extent, .layers = info->arrayLayers};
+	if (info->usage & VK_IMAGE_USAGE_VIDEO_ENCODE_QUANTIZATION_DELTA_MAP_BIT_KHR)
+	{
+		if (info->format != VK_FORMAT_R8_SINT)
+			report("vkCreateImage: unsupported quantization map format");
+		img->texels.resize(size_t(info->extent.width) * info->extent.height);
+	}
+	else if (info->format == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM and (info->usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT) and
+	         info->arrayLayers == 1)
+	{
+		img->texels.resize(size_t(info->extent.width) * info->extent.height +
+		                   2 * size_t((info->extent.width + 1) / 2) * ((info->extent.height + 1) / 2));
+	}
+	*i = make_handle<VkImage>(img);
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_image(VkDevice, VkImage i, const VkAllocationCallbacks *)
+{
+	delete get<image>(i);
+}
+
+VKAPI_ATTR void VKAPI_CALL get_image_memory_requirements2(VkDevice, const VkImageMemoryRequirementsInfo2 * info, VkMemoryRequirements2 * req)
+{
+	// the size of an NV12 picture, the content is never stored
+	auto i = get<image>(info->image);
+	fill_requirements(req, VkDeviceSize(i->extent.width) * i->extent.height * 3 / 2 * i->layers, 4096);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL bind_image_memory(VkDevice, VkImage, VkDeviceMemory, VkDeviceSize)
+{
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL create_image_view(VkDevice, const VkImageViewCreateInfo * info, const VkAllocationCallbacks *, VkImageView * view)
+{
+	// compared to bound DPB slots, quantization maps are read through them
+	*view = make_handle<VkImageView>(new image_view{.target = get<image>(info->image)});
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_image_view(VkDevice, VkImageView view, const VkAllocationCallbacks *)
+{
+	delete get<image_view>(view);
+}
+
+// Video session
+VKAPI_ATTR VkResult VKAPI_CALL create_video_session(VkDevice, const VkVideoSessionCreateInfoKHR * info, const VkAllocationCallbacks *, VkVideoSessionKHR * session)
+{
+	if (info->maxDpbSlots > mock->cfg.max_dpb_slots or info->maxActiveReferencePictures > mock->cfg.max_active_references)
+		report("vkCreateVideoSessionKHR: limits above the capabilities");
+	*session = make_handle<VkVideoSessionKHR>(new video_session{
+	        .max_dpb_slots = info->maxDpbSlots,
+	        .max_active_references = info->maxActiveReferencePictures,
+	        .max_coded_extent = info->maxCodedExtent,
+	        .quantization_delta_map = bool(info->flags & VK_VIDEO_SESSION_CREATE_ALLOW_ENCODE_QUANTIZATION_DELTA_MAP_BIT_KHR),
+	});
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_video_session(VkDevice, VkVideoSessionKHR session, const VkAllocationCallbacks *)
+{
+	delete get<video_session>(session);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL get_video_session_memory_requirements(VkDevice, VkVideoSessionKHR, uint32_t * count, VkVideoSessionMemoryRequirementsKHR * req)
+{
+	return fill_array(
+	        VkVideoSessionMemoryRequirementsKHR{
+	                .sType = VK_STRUCTURE_TYPE_VIDEO_SESSION_MEMORY_REQUIREMENTS_KHR,
+	                .pNext = nullptr,
+	                .memoryBindIndex = 0,
+	                .memoryRequirements = {.size = 65536, .alignment = 4096, .memoryTypeBits = all_memory_types},
+	        },
+	        count,
+	        req);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL bind_video_session_memory(VkDevice, VkVideoSessionKHR, uint32_t count, const VkBindVideoSessionMemoryInfoKHR * infos)
+{
+	if (count != 1 or infos[0].memoryBindIndex != 0)
+		report("vkBindVideoSessionMemoryKHR: unexpected bind indices");
+	return VK_SUCCESS;
+}
+
+void add_parameters(session_parameters & p, const VkVideoEncodeH264SessionParametersAddInfoKHR * add, const char * function)
+{
+	if (not add)
+		return;
+	for (uint32_t i = 0; i < add->stdSPSCount; ++i)
+	{
+		// the pointed structures are not kept
+		auto sps = add->pStdSPSs[i];
+		sps.pOffsetForRefFrame = nullptr;
+		sps.pScalingLists = nullptr;
+		sps.pSequenceParameterSetVui = nullptr;
+		if (not p.sps.emplace(sps.seq_parameter_set_id, sps).second)
+			report(std::string(function) + ": SPS id already used");
+	}
+	for (uint32_t i = 0; i < add->stdPPSCount; ++i)
+	{
+		if (not p.pps_ids.insert(add->pStdPPSs[i].pic_parameter_set_id).second)
+			report(std::string(function) + ": PPS id already used");
+	}
+	if (p.sps.size() > p.max_sps or p.pps_ids.size() > p.max_pps)
+		report(std::string(function) + ": too many parameter sets");
+}
+
+void add_parameters(session_parameters & p, const VkVideoEncodeH265SessionParametersAddInfoKHR * add, const char * function)
+{
+	if (not add)
+		return;
+	for (uint32_t i = 0; i < add->stdVPSCount; ++i)
+	{
+		if (not p.vps_ids.insert(add->pStdVPSs[i].vps_video_parameter_set_id).second)
+			report(std::string(function) + ": VPS id already used");
+	}
+	for (uint32_t i = 0; i < add->stdSPSCount; ++i)
+	{
+		// the pointed structures are not kept
+		auto sps = add->pStdSPSs[i];
+		sps.pProfileTierLevel = nullptr;
+		sps.pDecPicBufMgr = nullptr;
+		sps.pScalingLists = nullptr;
+		sps.pShortTermRefPicSet = nullptr;
+		sps.pLongTermRefPicsSps = nullptr;
+		sps.pSequenceParameterSetVui = nullptr;
+		sps.pPredictorPaletteEntries = nullptr;
+		if (not p.vps_ids.contains(sps.sps_video_parameter_set_id))
+			report(std::string(function) + ": SPS with an unknown VPS id");
+		if (not p.h265_sps.emplace(sps.sps_seq_parameter_set_id, sps).second)
+			report(std::string(function) + ": SPS id already used");
+	}
+	for (uint32_t i = 0; i < add->stdPPSCount; ++i)
+	{
+		const auto & pps = add->pStdPPSs[i];
+		if (not p.h265_sps.contains(pps.pps_seq_parameter_set_id))
+			report(std::string(function) + ": PPS with an unknown SPS id");
+		if (not p.h265_pps_ids.emplace(pps.sps_video_parameter_set_id, pps.pps_seq_parameter_set_id, pps.pps_pic_parameter_set_id).second)
+			report(std::string(function) + ": PPS id already used");
+	}
+	if (p.vps_ids.size() > p.max_vps or p.h265_sps.size() > p.max_sps or p.h265_pps_ids.size() > p.max_pps)
+		report(std::string(function) + ": too many parameter sets");
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL create_video_session_parameters(VkDevice,
+                                                               const VkVideoSessionParametersCreateInfoKHR * info,
+                                                               const VkAllocationCallbacks *,
+                                                               VkVideoSessionParametersKHR * params)
+{
+	auto p = new session_parameters{.max_vps = 0, .max_sps = 0, .max_pps = 0};
+	if (info->flags & VK_VIDEO_SESSION_PARAMETERS_CREATE_QUANTIZATION_MAP_COMPATIBLE_BIT_KHR)
+	{
+		auto texel = find_next<VkVideoEncodeQuantizationMapSessionParametersCreateInfoKHR>(
+		        info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUANTIZATION_MAP_SESSION_PARAMETERS_CREATE_INFO_KHR);
+		if (not texel or texel->quantizationMapTexelSize.width != 16 or texel->quantizationMapTexelSize.height != 16)
+			report("vkCreateVideoSessionParametersKHR: unsupported quantization map texel size");
+		p->quantization_map_compatible = true;
+	}
+	if (auto h264 = find_next<VkVideoEncodeH264SessionParametersCreateInfoKHR>(
+	            info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_CREATE_INFO_KHR))
+	{
+		p->max_sps = h264->maxStdSPSCount;
+		p->max_pps = h264->maxStdPPSCount;
+		add_parameters(*p, h264->pParametersAddInfo, "vkCreateVideoSessionParametersKHR");
+	}
+	else if (auto h265 = find_next<VkVideoEncodeH265SessionParametersCreateInfoKHR>(
+	                 info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_CREATE_INFO_KHR))
+	{
+		p->max_vps = h265->maxStdVPSCount;
+		p->max_sps = h265->maxStdSPSCount;
+		p->max_pps = h265->maxStdPPSCount;
+		add_parameters(*p, h265->pParametersAddInfo, "vkCreateVideoSessionParametersKHR");
+	}
+	*params = make_handle<VkVideoSessionParametersKHR>(p);
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL update_video_session_parameters(VkDevice,
+                                                               VkVideoSessionParametersKHR params,
+                                                               const VkVideoSessionParametersUpdateInfoKHR * info)
+{
+	auto p = get<session_parameters>(params);
+	if (info->updateSequenceCount != p->update_count + 1)
+		report("vkUpdateVideoSessionParametersKHR: updateSequenceCount is not incremented by 1");
+	p->update_count = info->updateSequenceCount;
+	add_parameters(*p,
+	               find_next<VkVideoEncodeH264SessionParametersAddInfoKHR>(
+	                       info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_ADD_INFO_KHR),
+	               "vkUpdateVideoSessionParametersKHR");
+	add_parameters(*p,
+	               find_next<VkVideoEncodeH265SessionParametersAddInfoKHR>(
+	                       info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_ADD_INFO_KHR),
+	               "vkUpdateVideoSessionParametersKHR");
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_video_session_parameters(VkDevice, VkVideoSessionParametersKHR params, const VkAllocationCallbacks *)
+{
+	if (not params)
+		return;
+	std::lock_guard lock(mock->mutex);
+	auto p = get<session_parameters>(params);
+	p->destroyed = true;
+	mock->destroyed_parameters.emplace_back(p);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL get_encoded_video_session_parameters(VkDevice,
+                                                                    const VkVideoEncodeSessionParametersGetInfoKHR * info,
+                                                                    VkVideoEncodeSessionParametersFeedbackInfoKHR * feedback,
+                                                                    size_t * size,
+                                                                    void * data)
+{
+	// not decodable, only the NAL unit types are meaningful
+	static const uint8_t sps[] = {0, 0, 0, 1, 0x67, 0x4d, 0x00, 0x32, 0xaa};
+	static const uint8_t pps[] = {0, 0, 0, 1, 0x68, 0xee, 0x3c, 0x80};
+	static const uint8_t h265_vps[] = {0, 0, 0, 1, 0x40, 0x01, 0x0c, 0x01};
+	static const uint8_t h265_sps[] = {0, 0, 0, 1, 0x42, 0x01, 0x01, 0x01};
+	static const uint8_t h265_pps[] = {0, 0, 0, 1, 0x44, 0x01, 0xc1, 0x72};
+
+	std::vector<uint8_t> encoded;
+	if (auto h264 = find_next<VkVideoEncodeH264SessionParametersGetInfoKHR>(
+	            info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_GET_INFO_KHR))
+	{
+		auto p = get<session_parameters>(info->videoSessionParameters);
+		if ((h264->writeStdSPS and not p->sps.contains(h264->stdSPSId)) or
+		    (h264->writeStdPPS and not p->pps_ids.contains(h264->stdPPSId)))
+			report("vkGetEncodedVideoSessionParametersKHR: unknown parameter set id");
+		if (h264->writeStdSPS)
+			encoded.insert(encoded.end(), std::begin(sps), std::end(sps));
+		if (h264->writeStdPPS)
+			encoded.insert(encoded.end(), std::begin(pps), std::end(pps));
+	}
+	else if (auto h265 = find_next<VkVideoEncodeH265SessionParametersGetInfoKHR>(
+	                 info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_GET_INFO_KHR))
+	{
+		auto p = get<session_parameters>(info->videoSessionParameters);
+		if ((h265->writeStdVPS and not p->vps_ids.contains(h265->stdVPSId)) or
+		    (h265->writeStdSPS and not p->h265_sps.contains(h265->stdSPSId)) or
+		    (h265->writeStdPPS and not p->h265_pps_ids.contains({h265->stdVPSId, h265->stdSPSId, h265->stdPPSId})))
+			report("vkGetEncodedVideoSessionParametersKHR: unknown parameter set id");
+		if (h265->writeStdVPS)
+			encoded.insert(encoded.end(), std::begin(h265_vps), std::end(h265_vps));
+		if (h265->writeStdSPS)
+			encoded.insert(encoded.end(), std::begin(h265_sps), std::end(h265_sps));
+		if (h265->writeStdPPS)
+			encoded.insert(encoded.end(), std::begin(h265_pps), std::end(h265_pps));
+	}
+
+	if (feedback)
+	{
+		const VkBool32 overrides = mock->cfg.parameter_overrides;
+		feedback->hasOverrides = overrides;
+		for (auto next = (VkBaseOutStructure *)feedback->pNext; next; next = next->pNext)
+		{
+			if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_FEEDBACK_INFO_KHR)
+			{
+				((VkVideoEncodeH264SessionParametersFeedbackInfoKHR *)next)->hasStdSPSOverrides = overrides;
+				((VkVideoEncodeH264SessionParametersFeedbackInfoKHR *)next)->hasStdPPSOverrides = overrides;
+			}
+			else if (next->sType == VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_FEEDBACK_INFO_KHR)
+			{
+				((VkVideoEncodeH265SessionParametersFeedbackInfoKHR *)next)->hasStdVPSOverrides = VK_FALSE;
+				((VkVideoEncodeH265SessionParametersFeedbackInfoKHR *)next)->hasStdSPSOverrides = overrides;
+				((VkVideoEncodeH265SessionParametersFeedbackInfoKHR *)next)->hasStdPPSOverrides = overrides;
+			}
+		}
+	}
+
+	if (not data)
+	{
+		*size = encoded.size();
+		return VK_SUCCESS;
+	}
+	if (*size < encoded.size())
+		return VK_INCOMPLETE;
+	std::ranges::copy(encoded, (uint8_t *)data);
+	*size = encoded.size();
+	return VK_SUCCESS;
+}
+
+// Queries
+VKAPI_ATTR VkResult VKAPI_CALL create_query_pool(VkDevice, const VkQueryPoolCreateInfo * info, const VkAllocationCallbacks *, VkQueryPool * pool)
+{
+	auto feedback = find_next<VkQueryPoolVideoEncodeFeedbackCreateInfoKHR>(
+	        info->pNext, VK_STRUCTURE_TYPE_QUERY_POOL_VIDEO_ENCODE_FEEDBACK_CREATE_INFO_KHR);
+	if (info->queryType != VK_QUERY_TYPE_TIMESTAMP and
+	    (info->queryType != VK_QUERY_TYPE_VIDEO_ENCODE_FEEDBACK_KHR or not feedback))
+		report("vkCreateQueryPool: only timestamp and video encode feedback queries are supported");
+
+	auto p = new query_pool{
+	        .type = info->queryType,
+	        .feedback = feedback ? feedback->encodeFeedbackFlags : 0,
+	        .results = {},
+	};
+	p->results.resize(info->queryCount);
+	*pool = make_handle<VkQueryPool>(p);
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_query_pool(VkDevice, VkQueryPool pool, const VkAllocationCallbacks *)
+{
+	delete get<query_pool>(pool);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL get_query_pool_results(VkDevice,
+                                                      VkQueryPool handle,
+                                                      uint32_t first,
+                                                      uint32_t count,
+                                                      size_t data_size,
+                                                      void * data,
+                                                      VkDeviceSize stride,
+                                                      VkQueryResultFlags flags)
+{
+	auto pool = get<query_pool>(handle);
+	if (first + count > pool->results.size())
+	{
+		report("vkGetQueryPoolResults: queries out of range");
+		return VK_ERROR_UNKNOWN;
+	}
+
+	const bool timestamp = pool->type == VK_QUERY_TYPE_TIMESTAMP;
+	if (timestamp and (flags & VK_QUERY_RESULT_WITH_STATUS_BIT_KHR))
+		report("vkGetQueryPoolResults: no result status for timestamp queries");
+
+	// in the order of the flag bits, then status and availability
+	const size_t values = (timestamp ? 1 : std::popcount(pool->feedback)) +
+	                      bool(flags & VK_QUERY_RESULT_WITH_STATUS_BIT_KHR) +
+	                      bool(flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	const size_t value_size = flags & VK_QUERY_RESULT_64_BIT ? 8 : 4;
+	if (count > 1 and stride < values * value_size)
+		report("vkGetQueryPoolResults: stride too small");
+	if (count > 0 and data_size < (count - 1) * stride + values * value_size)
+	{
+		report("vkGetQueryPoolResults: data size too small");
+		return VK_ERROR_UNKNOWN;
+	}
+
+	std::unique_lock lock(mock->mutex);
+	auto begin = pool->results.begin() + first;
+	auto end = begin + count;
+	if (flags & VK_QUERY_RESULT_WAIT_BIT)
+		mock->cv.wait(lock, [&] { return std::all_of(begin, end, [](const auto & r) { return r.available; }); });
+
+	VkResult res = VK_SUCCESS;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const auto & r = begin[i];
+		if (not r.available)
+		{
+			res = VK_NOT_READY;
+			if (not(flags & (VK_QUERY_RESULT_WITH_AVAILABILITY_BIT | VK_QUERY_RESULT_WITH_STATUS_BIT_KHR)))
+				continue;
+		}
+
+		std::vector<uint64_t> v;
+		if (timestamp)
+			v.push_back(r.timestamp);
+		if (pool->feedback & VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_BUFFER_OFFSET_BIT_KHR)
+			v.push_back(r.offset);
+		if (pool->feedback & VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_BYTES_WRITTEN_BIT_KHR)
+			v.push_back(r.bytes);
+		if (pool->feedback & VK_VIDEO_ENCODE_FEEDBACK_BITSTREAM_HAS_OVERRIDES_BIT_KHR)
+			v.push_back(0);
+		if (flags & VK_QUERY_RESULT_WITH_STATUS_BIT_KHR)
+			v.push_back(uint64_t(int64_t(r.available ? r.status : VK_QUERY_RESULT_STATUS_NOT_READY_KHR)));
+		if (flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT)
+			v.push_back(r.available);
+
+		uint8_t * out = (uint8_t *)data + i * stride;
+		for (size_t j = 0; j < v.size(); ++j)
+		{
+			if (value_size == 8)
+				std::memcpy(out + 8 * j, &v[j], 8);
+			else
+			{
+				uint32_t v32 = v[j];
+				std::memcpy(out + 4 * j, &v32, 4);
+			}
+		}
+	}
+	return res;
+}
+
+// Command buffers
+VKAPI_ATTR VkResult VKAPI_CALL create_command_pool(VkDevice, const VkCommandPoolCreateInfo *, const VkAllocationCallbacks *, VkCommandPool * pool)
+{
+	*pool = make_handle<VkCommandPool>(new command_pool);
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_command_pool(VkDevice, VkCommandPool handle, const VkAllocationCallbacks *)
+{
+	auto pool = get<command_pool>(handle);
+	if (not pool)
+		return;
+	for (auto cb: pool->buffers)
+		delete cb;
+	delete pool;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL allocate_command_buffers(VkDevice, const VkCommandBufferAllocateInfo * info, VkCommandBuffer * buffers)
+{
+	auto pool = get<command_pool>(info->commandPool);
+	for (uint32_t i = 0; i < info->commandBufferCount; ++i)
+	{
+		auto cb = pool->buffers.emplace_back(new command_buffer);
+		buffers[i] = make_handle<VkCommandBuffer>(cb);
+	}
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL free_command_buffers(VkDevice, VkCommandPool handle, uint32_t count, const VkCommandBuffer * buffers)
+{
+	auto pool = get<command_pool>(handle);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		auto cb = get<command_buffer>(buffers[i]);
+		std::erase(pool->buffers, cb);
+		delete cb;
+	}
+}
+
+void reset(command_buffer & cb, const char * function)
+{
+	{
+		std::lock_guard lock(mock->mutex);
+		if (cb.pending)
+			report(std::string(function) + ": command buffer is pending execution");
+	}
+	cb.commands.clear();
+	cb.session = nullptr;
+	cb.bound_slots.reset();
+	cb.active_pool = nullptr;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL begin_command_buffer(VkCommandBuffer handle, const VkCommandBufferBeginInfo *)
+{
+	auto cb = get<command_buffer>(handle);
+	reset(*cb, "vkBeginCommandBuffer");
+	cb->recording = true;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL end_command_buffer(VkCommandBuffer handle)
+{
+	auto cb = get<command_buffer>(handle);
+	if (cb->bound_slots)
+		report("vkEndCommandBuffer: video coding scope not ended");
+	if (cb->active_pool)
+		report("vkEndCommandBuffer: query not ended");
+	cb->recording = false;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL reset_command_buffer(VkCommandBuffer handle, VkCommandBufferResetFlags)
+{
+	auto cb = get<command_buffer>(handle);
+	reset(*cb, "vkResetCommandBuffer");
+	cb->recording = false;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_pipeline_barrier2(VkCommandBuffer handle, const VkDependencyInfo * info)
+{
+	std::vector<image_barrier> barriers;
+	for (uint32_t i = 0; i < info->imageMemoryBarrierCount; ++i)
+	{
+		const auto & b = info->pImageMemoryBarriers[i];
+		barriers.push_back({
+		        .image = vk::Image(b.image),
+		        .old_layout = vk::ImageLayout(b.oldLayout),
+		        .new_layout = vk::ImageLayout(b.newLayout),
+		        .src_queue_family = b.srcQueueFamilyIndex,
+		        .dst_queue_family = b.dstQueueFamilyIndex,
+		});
+	}
+	if (barriers.empty())
+		return;
+	get<command_buffer>(handle)->commands.push_back([barriers = std::move(barriers)] {
+		mock->barriers.insert(mock->barriers.end(), barriers.begin(), barriers.end());
+	});
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_copy_buffer(VkCommandBuffer handle, VkBuffer src_handle, VkBuffer dst_handle, uint32_t count, const VkBufferCopy * regions)
+{
+	auto src = get<buffer>(src_handle);
+	auto dst = get<buffer>(dst_handle);
+	get<command_buffer>(handle)->commands.push_back([src, dst, copies = std::vector(regions, regions + count)] {
+		for (const auto & copy: copies)
+		{
+			if (copy.srcOffset + copy.size > src->size or copy.dstOffset + copy.size > dst->size)
+			{
+				report("vkCmdCopyBuffer: region out of range");
+				continue;
+			}
+			std::memcpy(dst->memory->data.get() + dst->offset + copy.dstOffset,
+			            src->memory->data.get() + src->offset + copy.srcOffset,
+			            copy.size);
+		}
+	});
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_copy_buffer_to_image(VkCommandBuffer handle,
+                                                   VkBuffer src_handle,
+                                                   VkImage dst_handle,
+                                                   VkImageLayout,
+                                                   uint32_t count,
+                                                   const VkBufferImageCopy * regions)
+{
+	// only quantization maps and NV12 transfer destinations hold data
+	auto src = get<buffer>(src_handle);
+	auto dst = get<image>(dst_handle);
+	if (dst->texels.empty())
+		return;
+	get<command_buffer>(handle)->commands.push_back([src, dst, copies = std::vector(regions, regions + count)] {
+		for (const auto & copy: copies)
+		{
+			// the CbCr plane has 2 bytes texels at half resolution, after
+			// the Y plane
+			uint32_t texel_size = 1;
+			uint32_t width = dst->extent.width;
+			uint32_t height = dst->extent.height;
+			size_t plane_offset = 0;
+			if (copy.imageSubresource.aspectMask == VK_IMAGE_ASPECT_PLANE_1_BIT)
+			{
+				texel_size = 2;
+				plane_offset = size_t(width) * height;
+				width = (width + 1) / 2;
+				height = (height + 1) / 2;
+			}
+
+			uint32_t row_length = copy.bufferRowLength ? copy.bufferRowLength : copy.imageExtent.width;
+			if (copy.imageOffset.x < 0 or copy.imageOffset.y < 0 or
+			    copy.imageOffset.x + copy.imageExtent.width > width or
+			    copy.imageOffset.y + copy.imageExtent.height > height or
+			    copy.bufferOffset + VkDeviceSize(row_length) * copy.imageExtent.height * texel_size > src->size)
+			{
+				report("vkCmdCopyBufferToImage: region out of range");
+				continue;
+			}
+			for (uint32_t y = 0; y < copy.imageExtent.height; ++y)
+			{
+				std::memcpy(dst->texels.data() + plane_offset + ((copy.imageOffset.y + y) * width + copy.imageOffset.x) * texel_size,
+				            src->memory->data.get() + src->offset + copy.bufferOffset + y * row_length * texel_size,
+				            copy.imageExtent.width * texel_size);
+			}
+		}
+	});
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_reset_query_pool(VkCommandBuffer handle, VkQueryPool pool_handle, uint32_t first, uint32_t count)
+{
+	auto pool = get<query_pool>(pool_handle);
+	get<command_buffer>(handle)->commands.push_back([pool, first, count] {
+		for (uint32_t i = first; i < first + count; ++i)
+			pool->results[i] = {};
+	});
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_write_timestamp2(VkCommandBuffer handle, VkPipelineStageFlags2, VkQueryPool pool_handle, uint32_t query)
+{
+	auto pool = get<query_pool>(pool_handle);
+	if (pool->type != VK_QUERY_TYPE_TIMESTAMP or query >= pool->results.size())
+		report("vkCmdWriteTimestamp2: not a timestamp query");
+	get<command_buffer>(handle)->commands.push_back([pool, query] {
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		pool->results[query].timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+		pool->results[query].available = true;
+	});
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_begin_query(VkCommandBuffer handle, VkQueryPool pool, uint32_t query, VkQueryControlFlags)
+{
+	auto cb = get<command_buffer>(handle);
+	if (cb->active_pool)
+		report("vkCmdBeginQuery: a query is already active");
+	cb->active_pool = get<query_pool>(pool);
+	cb->active_query = query;
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_end_query(VkCommandBuffer handle, VkQueryPool pool_handle, uint32_t query)
+{
+	auto cb = get<command_buffer>(handle);
+	auto pool = get<query_pool>(pool_handle);
+	if (cb->active_pool != pool or cb->active_query != query)
+		report("vkCmdEndQuery: query is not active");
+	cb->active_pool = nullptr;
+	cb->commands.push_back([pool, query] { pool->results[query].available = true; });
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_begin_video_coding(VkCommandBuffer handle, const VkVideoBeginCodingInfoKHR * info)
+{
+	auto cb = get<command_buffer>(handle);
+	if (cb->bound_slots)
+		report("vkCmdBeginVideoCodingKHR: video coding scope already begun");
+	cb->session = get<video_session>(info->videoSession);
+	cb->parameters = get<session_parameters>(info->videoSessionParameters);
+	auto rate = find_next<VkVideoEncodeRateControlInfoKHR>(info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_RATE_CONTROL_INFO_KHR);
+	cb->rate_control_mode = rate ? rate->rateControlMode : VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR;
+	if (cb->parameters)
+	{
+		cb->commands.push_back([parameters = cb->parameters] {
+			if (parameters->destroyed)
+				report("vkCmdBeginVideoCodingKHR: session parameters destroyed before execution");
+		});
+	}
+	cb->bound_slots.emplace();
+	for (uint32_t i = 0; i < info->referenceSlotCount; ++i)
+	{
+		const auto & slot = info->pReferenceSlots[i];
+		if (not slot.pPictureResource)
+			continue;
+		cb->bound_slots->push_back({
+		        .index = slot.slotIndex,
+		        .view = slot.pPictureResource->imageViewBinding,
+		        .layer = slot.pPictureResource->baseArrayLayer,
+		});
+	}
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_end_video_coding(VkCommandBuffer handle, const VkVideoEndCodingInfoKHR *)
+{
+	auto cb = get<command_buffer>(handle);
+	if (not cb->bound_slots)
+		report("vkCmdEndVideoCodingKHR: no video coding scope");
+	cb->bound_slots.reset();
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_control_video_coding(VkCommandBuffer handle, const VkVideoCodingControlInfoKHR * info)
+{
+	auto cb = get<command_buffer>(handle);
+	if (not cb->bound_slots)
+		report("vkCmdControlVideoCodingKHR: no video coding scope");
+	if (info->flags & VK_VIDEO_CODING_CONTROL_ENCODE_RATE_CONTROL_BIT_KHR)
+	{
+		auto rate = find_next<VkVideoEncodeRateControlInfoKHR>(info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_RATE_CONTROL_INFO_KHR);
+		cb->rate_control_mode = rate ? rate->rateControlMode : VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR;
+	}
+}
+
+StdVideoEncodeH264ReferenceInfo std_reference_info(const VkVideoReferenceSlotInfoKHR & slot)
+{
+	auto dpb = find_next<VkVideoEncodeH264DpbSlotInfoKHR>(slot.pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_DPB_SLOT_INFO_KHR);
+	if (not dpb or not dpb->pStdReferenceInfo)
+	{
+		report("vkCmdEncodeVideoKHR: missing H.264 DPB slot info");
+		return {};
+	}
+	return *dpb->pStdReferenceInfo;
+}
+
+StdVideoEncodeH265ReferenceInfo h265_reference_info(const VkVideoReferenceSlotInfoKHR & slot)
+{
+	auto dpb = find_next<VkVideoEncodeH265DpbSlotInfoKHR>(slot.pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_DPB_SLOT_INFO_KHR);
+	if (not dpb or not dpb->pStdReferenceInfo)
+	{
+		report("vkCmdEncodeVideoKHR: missing H.265 DPB slot info");
+		return {};
+	}
+	return *dpb->pStdReferenceInfo;
+}
+
+// Whether slot was bound by vkCmdBeginVideoCodingKHR, with the same index
+// unless it is the setup slot, which may be activated by the encode
+bool is_bound(const command_buffer & cb, const VkVideoReferenceSlotInfoKHR & slot, bool setup)
+{
+	if (not slot.pPictureResource)
+		return false;
+	return std::ranges::any_of(*cb.bound_slots, [&](const auto & bound) {
+		return bound.view == slot.pPictureResource->imageViewBinding and
+		       bound.layer == slot.pPictureResource->baseArrayLayer and
+		       (bound.index == slot.slotIndex or (setup and bound.index < 0));
+	});
+}
+
+void record_h264(const command_buffer & cb, const VkVideoEncodeH264PictureInfoKHR & h264, encode_record & r)
+{
+	r.picture = *h264.pStdPictureInfo;
+	r.picture.pRefLists = nullptr;
+	if (cb.parameters and (not cb.parameters->sps.contains(r.picture.seq_parameter_set_id) or
+	                       not cb.parameters->pps_ids.contains(r.picture.pic_parameter_set_id)))
+		report("vkCmdEncodeVideoKHR: parameter sets not in the session parameters");
+	else if (cb.parameters)
+		r.sps = cb.parameters->sps.at(r.picture.seq_parameter_set_id);
+
+	if (auto lists = h264.pStdPictureInfo->pRefLists)
+	{
+		for (uint8_t entry: lists->RefPicList0)
+		{
+			if (entry == STD_VIDEO_H264_NO_REFERENCE_PICTURE)
+				break;
+			r.ref_pic_list0.push_back(entry);
+		}
+		if (lists->refList0ModOpCount)
+			r.list_modifications.assign(lists->pRefList0ModOperations, lists->pRefList0ModOperations + lists->refList0ModOpCount);
+		if (lists->refPicMarkingOpCount)
+			r.marking.assign(lists->pRefPicMarkingOperations, lists->pRefPicMarkingOperations + lists->refPicMarkingOpCount);
+	}
+	for (uint32_t i = 0; i < h264.naluSliceEntryCount; ++i)
+	{
+		auto header = *h264.pNaluSliceEntries[i].pStdSliceHeader;
+		header.pWeightTable = nullptr;
+		r.slices.push_back(header);
+	}
+}
+
+void record_h265(const command_buffer & cb, const VkVideoEncodeH265PictureInfoKHR & h265, encode_record & r)
+{
+	auto & h = r.h265.emplace();
+	h.picture = *h265.pStdPictureInfo;
+	h.picture.pRefLists = nullptr;
+	h.picture.pShortTermRefPicSet = nullptr;
+	h.picture.pLongTermRefPics = nullptr;
+	if (cb.parameters and (not cb.parameters->h265_sps.contains(h.picture.pps_seq_parameter_set_id) or
+	                       not cb.parameters->h265_pps_ids.contains({h.picture.sps_video_parameter_set_id,
+	                                                                 h.picture.pps_seq_parameter_set_id,
+	                                                                 h.picture.pps_pic_parameter_set_id})))
+		report("vkCmdEncodeVideoKHR: parameter sets not in the session parameters");
+	else if (cb.parameters)
+		h.sps = cb.parameters->h265_sps.at(h.picture.pps_seq_parameter_set_id);
+
+	// the reference picture set is sent in the slice headers
+	if (h.picture.flags.short_term_ref_pic_set_sps_flag or not h265.pStdPictureInfo->pShortTermRefPicSet)
+		report("vkCmdEncodeVideoKHR: missing H.265 short-term reference picture set");
+	else
+		h.short_term_rps = *h265.pStdPictureInfo->pShortTermRefPicSet;
+
+	if (auto lists = h265.pStdPictureInfo->pRefLists)
+	{
+		for (uint8_t entry: lists->RefPicList0)
+		{
+			if (entry == STD_VIDEO_H265_NO_REFERENCE_PICTURE)
+				break;
+			r.ref_pic_list0.push_back(entry);
+		}
+	}
+	for (uint32_t i = 0; i < h265.naluSliceSegmentEntryCount; ++i)
+	{
+		auto header = *h265.pNaluSliceSegmentEntries[i].pStdSliceSegmentHeader;
+		header.pWeightTable = nullptr;
+		h.slices.push_back(header);
+	}
+}
+
+encode_record make_record(const command_buffer & cb, const VkVideoEncodeInfoKHR & info)
+{
+	encode_record r{};
+	r.setup_slot = -1;
+	r.dst_range = info.dstBufferRange;
+
+	auto h264 = find_next<VkVideoEncodeH264PictureInfoKHR>(info.pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_PICTURE_INFO_KHR);
+	auto h265 = find_next<VkVideoEncodeH265PictureInfoKHR>(info.pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_PICTURE_INFO_KHR);
+	if (h264 and h264->pStdPictureInfo)
+		record_h264(cb, *h264, r);
+	else if (h265 and h265->pStdPictureInfo)
+		record_h265(cb, *h265, r);
+	else
+	{
+		report("vkCmdEncodeVideoKHR: missing H.264 or H.265 picture info");
+		return r;
+	}
+
+	r.coded_extent = info.srcPictureResource.codedExtent;
+	if (cb.session and (r.coded_extent.width > cb.session->max_coded_extent.width or
+	                    r.coded_extent.height > cb.session->max_coded_extent.height))
+		report("vkCmdEncodeVideoKHR: coded extent above maxCodedExtent");
+	if (slice_count(r) == 0 or slice_count(r) > mock->cfg.max_slice_count)
+		report("vkCmdEncodeVideoKHR: invalid slice count");
+
+	if (not cb.bound_slots)
+	{
+		report("vkCmdEncodeVideoKHR: no video coding scope");
+		return r;
+	}
+
+	if (info.pSetupReferenceSlot)
+	{
+		r.setup_slot = info.pSetupReferenceSlot->slotIndex;
+		if (r.h265)
+			r.h265->setup_info = h265_reference_info(*info.pSetupReferenceSlot);
+		else
+			r.setup_info = std_reference_info(*info.pSetupReferenceSlot);
+		if (not is_bound(cb, *info.pSetupReferenceSlot, true))
+			report("vkCmdEncodeVideoKHR: setup slot picture not bound");
+		if (r.setup_slot < 0 or uint32_t(r.setup_slot) >= cb.session->max_dpb_slots)
+			report("vkCmdEncodeVideoKHR: invalid setup slot index");
+	}
+	for (uint32_t i = 0; i < info.referenceSlotCount; ++i)
+	{
+		const auto & slot = info.pReferenceSlots[i];
+		r.reference_slots.push_back(slot.slotIndex);
+		if (r.h265)
+			r.h265->reference_info.push_back(h265_reference_info(slot));
+		else
+			r.reference_info.push_back(std_reference_info(slot));
+		if (not is_bound(cb, slot, false))
+			report("vkCmdEncodeVideoKHR: reference slot " + std::to_string(slot.slotIndex) + " not bound");
+		if (slot.slotIndex == r.setup_slot)
+			report("vkCmdEncodeVideoKHR: setup slot used as reference");
+	}
+	if (info.referenceSlotCount > cb.session->max_active_references)
+		report("vkCmdEncodeVideoKHR: too many references");
+	return r;
+}
+
+VKAPI_ATTR void VKAPI_CALL cmd_encode_video(VkCommandBuffer handle, const VkVideoEncodeInfoKHR * info)
+{
+	auto cb = get<command_buffer>(handle);
+	auto dst = get<buffer>(info->dstBuffer);
+	if (info->dstBufferOffset % bitstream_alignment or info->dstBufferRange % bitstream_alignment)
+		report("vkCmdEncodeVideoKHR: destination range not aligned");
+	if (info->dstBufferOffset + info->dstBufferRange > dst->size)
+		report("vkCmdEncodeVideoKHR: destination range out of the buffer");
+	if (not cb->active_pool)
+		report("vkCmdEncodeVideoKHR: no active feedback query");
+
+	// read when the encode executes, after copies recorded before it
+	const image * qp_map = nullptr;
+	auto qp_map_info = find_next<VkVideoEncodeQuantizationMapInfoKHR>(info->pNext, VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUANTIZATION_MAP_INFO_KHR);
+	if (info->flags & VK_VIDEO_ENCODE_WITH_QUANTIZATION_DELTA_MAP_BIT_KHR)
+	{
+		if (not qp_map_info or not qp_map_info->quantizationMap)
+			report("vkCmdEncodeVideoKHR: missing quantization map");
+		else if (not cb->session or not cb->session->quantization_delta_map)
+			report("vkCmdEncodeVideoKHR: session does not allow quantization delta maps");
+		else if (not cb->parameters or not cb->parameters->quantization_map_compatible)
+			report("vkCmdEncodeVideoKHR: session parameters are not quantization map compatible");
+		else if (cb->rate_control_mode != VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR)
+			report("vkCmdEncodeVideoKHR: quantization delta map with rate control");
+		else
+		{
+			qp_map = get<image_view>(qp_map_info->quantizationMap)->target;
+			auto & extent = qp_map_info->quantizationMapExtent;
+			if (extent.width != (info->srcPictureResource.codedExtent.width + 15) / 16 or
+			    extent.height != (info->srcPictureResource.codedExtent.height + 15) / 16 or
+			    extent.width > qp_map->extent.width or extent.height > qp_map->extent.height)
+			{
+				report("vkCmdEncodeVideoKHR: invalid quantization map extent");
+				qp_map = nullptr;
+			}
+		}
+	}
+
+	cb->commands.push_back([record = make_record(*cb, *info),
+	                        qp_map,
+	                        qp_map_extent = qp_map_info ? qp_map_info->quantizationMapExtent : VkExtent2D{},
+	                        dst,
+	                        offset = info->dstBufferOffset,
+	                        pool = cb->active_pool,
+	                        query = cb->active_query] {
+		encode_record r = record;
+		if (qp_map)
+		{
+			r.qp_map_extent = qp_map_extent;
+			for (uint32_t y = 0; y < qp_map_extent.height; ++y)
+			{
+				auto row = qp_map->texels.data() + y * qp_map->extent.width;
+				r.qp_map.insert(r.qp_map.end(), row, row + qp_map_extent.width);
+			}
+		}
+		const config & cfg = mock->cfg;
+		uint32_t size = cfg.frame_size ? cfg.frame_size(r) : is_intra(r) ? cfg.intra_size
+		                                                                 : cfg.inter_size;
+		auto status = cfg.status ? cfg.status(r) : VK_QUERY_RESULT_STATUS_COMPLETE_KHR;
+		r.size = status < 0 ? 0 : write_frame(dst->memory->data.get() + dst->offset + offset, r.dst_range, r, size);
+		if (pool)
+		{
+			pool->results[query].offset = 0;
+			pool->results[query].bytes = r.size;
+			pool->results[query].status = status;
+		}
+		mock->executed.push_back(std::move(r));
+	});
+}
+
+// Synchronisation
+VKAPI_ATTR VkResult VKAPI_CALL create_semaphore(VkDevice, const VkSemaphoreCreateInfo * info, const VkAllocationCallbacks *, VkSemaphore * s)
+{
+	auto type = find_next<VkSemaphoreTypeCreateInfo>(info->pNext, VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO);
+	bool timeline = type and type->semaphoreType == VK_SEMAPHORE_TYPE_TIMELINE;
+	*s = make_handle<VkSemaphore>(new semaphore{
+	        .timeline = timeline,
+	        .value = timeline ? type->initialValue : 0,
+	});
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL destroy_semaphore(VkDevice, VkSemaphore s, const VkAllocationCallbacks *)
+{
+	delete get<semaphore>(s);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL get_semaphore_counter_value(VkDevice, VkSemaphore s, uint64_t * value)
+{
+	std::lock_guard lock(mock->mutex);
+	*value = get<semaphore>(s)->value;
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL wait_semaphores(VkDevice, const VkSemaphoreWaitInfo * info, uint64_t timeout)
+{
+	auto done = [info] {
+		bool any = info->flags & VK_SEMAPHORE_WAIT_ANY_BIT;
+		for (uint32_t i = 0; i < info->semaphoreCount; ++i)
+		{
+			bool reached = get<semaphore>(info->pSemaphores[i])->value >= info->pValues[i];
+			if (reached == any)
+				return any;
+		}
+		return not any;
+	};
+
+	std::unique_lock lock(mock->mutex);
+	// long timeouts would overflow the clock
+	if (timeout >= uint64_t(std::chrono::nanoseconds(std::chrono::hours(24)).count()))
+	{
+		mock->cv.wait(lock, done);
+		return VK_SUCCESS;
+	}
+	return mock->cv.wait_for(lock, std::chrono::nanoseconds(timeout), done) ? VK_SUCCESS : VK_TIMEOUT;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL signal_semaphore(VkDevice, const VkSemaphoreSignalInfo * info)
+{
+	std::lock_guard lock(mock->mutex);
+	auto s = get<semaphore>(info->semaphore);
+	if (s->value >= info->value)
+		report("vkSignalSemaphore: value does not increase");
+	s->value = info->value;
+	mock->cv.notify_all();
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL queue_submit2(VkQueue queue, uint32_t count, const VkSubmitInfo2 * submits, VkFence fence)
+{
+	if (fence)
+		report("vkQueueSubmit2: fences are not supported");
+
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard lock(mock->mutex);
+	const size_t queue_index = (dispatchable *)queue - queue_objects;
+	mock->queue_submissions[queue_index] += count;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const auto & info = submits[i];
+		submission s;
+		s.queue = queue_index;
+		s.not_before = now + mock->cfg.latency;
+		for (uint32_t j = 0; j < info.waitSemaphoreInfoCount; ++j)
+		{
+			auto sem = get<semaphore>(info.pWaitSemaphoreInfos[j].semaphore);
+			s.waits.emplace_back(sem, sem->timeline ? info.pWaitSemaphoreInfos[j].value : 1);
+		}
+		for (uint32_t j = 0; j < info.commandBufferInfoCount; ++j)
+		{
+			auto cb = get<command_buffer>(info.pCommandBufferInfos[j].commandBuffer);
+			if (cb->recording)
+				report("vkQueueSubmit2: command buffer is still recording");
+			++cb->pending;
+			s.command_buffers.push_back(cb);
+		}
+		for (uint32_t j = 0; j < info.signalSemaphoreInfoCount; ++j)
+		{
+			auto sem = get<semaphore>(info.pSignalSemaphoreInfos[j].semaphore);
+			s.signals.emplace_back(sem, sem->timeline ? info.pSignalSemaphoreInfos[j].value : 1);
+		}
+		mock->pending.push_back(std::move(s));
+	}
+	mock->cv.notify_all();
+	return VK_SUCCESS;
+}
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL get_instance_proc_addr(VkInstance, const char * name);
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL get_device_proc_addr(VkDevice, const char * name)
+{
+	return get_instance_proc_addr(nullptr, name);
+}
+
+template <class F>
+PFN_vkVoidFunction entry(F * function)
+{
+	return reinterpret_cast<PFN_vkVoidFunction>(function);
+}
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL get_instance_proc_addr(VkInstance, const char * name)
+{
+	// promoted functions are also exposed under their extension name
+	static const std::map<std::string_view, PFN_vkVoidFunction> entry_points{
+	        {"vkGetInstanceProcAddr", entry(get_instance_proc_addr)},
+	        {"vkGetDeviceProcAddr", entry(get_device_proc_addr)},
+	        {"vkCreateInstance", entry(create_instance)},
+	        {"vkDestroyInstance", entry(destroy_instance)},
+	        {"vkEnumeratePhysicalDevices", entry(enumerate_physical_devices)},
+	        {"vkGetPhysicalDeviceProperties", entry(get_physical_device_properties)},
+	        {"vkGetPhysicalDeviceMemoryProperties", entry(get_physical_device_memory_properties)},
+	        {"vkGetPhysicalDeviceQueueFamilyProperties", entry(get_physical_device_queue_family_properties)},
+	        {"vkGetPhysicalDeviceQueueFamilyProperties2", entry(get_physical_device_queue_family_properties2)},
+	        {"vkGetPhysicalDeviceQueueFamilyProperties2KHR", entry(get_physical_device_queue_family_properties2)},
+	        {"vkGetPhysicalDeviceVideoCapabilitiesKHR", entry(get_physical_device_video_capabilities)},
+	        {"vkGetPhysicalDeviceVideoFormatPropertiesKHR", entry(get_physical_device_video_format_properties)},
+	        {"vkCreateDevice", entry(create_device)},
+	        {"vkDestroyDevice", entry(destroy_device)},
+	        {"vkGetDeviceQueue", entry(get_device_queue)},
+	        {"vkDeviceWaitIdle", entry(device_wait_idle)},
+	        {"vkQueueWaitIdle", entry(queue_wait_idle)},
+	        {"vkAllocateMemory", entry(allocate_memory)},
+	        {"vkFreeMemory", entry(free_memory)},
+	        {"vkMapMemory", entry(map_memory)},
+	        {"vkUnmapMemory", entry(unmap_memory)},
+	        {"vkFlushMappedMemoryRanges", entry(flush_mapped_memory_ranges)},
+	        {"vkInvalidateMappedMemoryRanges", entry(invalidate_mapped_memory_ranges)},
+	        {"vkCreateBuffer", entry(create_buffer)},
+	        {"vkDestroyBuffer", entry(destroy_buffer)},
+	        {"vkGetBufferMemoryRequirements", entry(get_buffer_memory_requirements)},
+	        {"vkGetBufferMemoryRequirements2", entry(get_buffer_memory_requirements2)},
+	        {"vkGetBufferMemoryRequirements2KHR", entry(get_buffer_memory_requirements2)},
+	        {"vkBindBufferMemory", entry(bind_buffer_memory)},
+	        {"vkCreateImage", entry(create_image)},
+	        {"vkDestroyImage", entry(destroy_image)},
+	        {"vkGetImageMemoryRequirements2", entry(get_image_memory_requirements2)},
+	        {"vkGetImageMemoryRequirements2KHR", entry(get_image_memory_requirements2)},
+	        {"vkBindImageMemory", entry(bind_image_memory)},
+	        {"vkCreateImageView", entry(create_image_view)},
+	        {"vkDestroyImageView", entry(destroy_image_view)},
+	        {"vkCreateVideoSessionKHR", entry(create_video_session)},
+	        {"vkDestroyVideoSessionKHR", entry(destroy_video_session)},
+	        {"vkGetVideoSessionMemoryRequirementsKHR", entry(get_video_session_memory_requirements)},
+	        {"vkBindVideoSessionMemoryKHR", entry(bind_video_session_memory)},
+	        {"vkCreateVideoSessionParametersKHR", entry(create_video_session_parameters)},
+	        {"vkUpdateVideoSessionParametersKHR", entry(update_video_session_parameters)},
+	        {"vkDestroyVideoSessionParametersKHR", entry(destroy_video_session_parameters)},
+	        {"vkGetEncodedVideoSessionParametersKHR", entry(get_encoded_video_session_parameters)},
+	        {"vkCreateQueryPool", entry(create_query_pool)},
+	        {"vkDestroyQueryPool", entry(destroy_query_pool)},
+	        {"vkGetQueryPoolResults", entry(get_query_pool_results)},
+	        {"vkCreateCommandPool", entry(create_command_pool)},
+	        {"vkDestroyCommandPool", entry(destroy_command_pool)},
+	        {"vkAllocateCommandBuffers", entry(allocate_command_buffers)},
+	        {"vkFreeCommandBuffers", entry(free_command_buffers)},
+	        {"vkBeginCommandBuffer", entry(begin_command_buffer)},
+	        {"vkEndCommandBuffer", entry(end_command_buffer)},
+	        {"vkResetCommandBuffer", entry(reset_command_buffer)},
+	        {"vkCmdPipelineBarrier2", entry(cmd_pipeline_barrier2)},
+	        {"vkCmdPipelineBarrier2KHR", entry(cmd_pipeline_barrier2)},
+	        {"vkCmdCopyBuffer", entry(cmd_copy_buffer)},
+	        {"vkCmdCopyBufferToImage", entry(cmd_copy_buffer_to_image)},
+	        {"vkCmdResetQueryPool", entry(cmd_reset_query_pool)},
+	        {"vkCmdWriteTimestamp2", entry(cmd_write_timestamp2)},
+	        {"vkCmdWriteTimestamp2KHR", entry(cmd_write_timestamp2)},
+	        {"vkCmdBeginQuery", entry(cmd_begin_query)},
+	        {"vkCmdEndQuery", entry(cmd_end_query)},
+	        {"vkCmdBeginVideoCodingKHR", entry(cmd_begin_video_coding)},
+	        {"vkCmdEndVideoCodingKHR", entry(cmd_end_video_coding)},
+	        {"vkCmdControlVideoCodingKHR", entry(cmd_control_video_coding)},
+	        {"vkCmdEncodeVideoKHR", entry(cmd_encode_video)},
+	        {"vkCreateSemaphore", entry(create_semaphore)},
+	        {"vkDestroySemaphore", entry(destroy_semaphore)},
+	        {"vkGetSemaphoreCounterValue", entry(get_semaphore_counter_value)},
+	        {"vkGetSemaphoreCounterValueKHR", entry(get_semaphore_counter_value)},
+	        {"vkWaitSemaphores", entry(wait_semaphores)},
+	        {"vkWaitSemaphoresKHR", entry(wait_semaphores)},
+	        {"vkSignalSemaphore", entry(signal_semaphore)},
+	        {"vkSignalSemaphoreKHR", entry(signal_semaphore)},
+	        {"vkQueueSubmit2", entry(queue_submit2)},
+	        {"vkQueueSubmit2KHR", entry(queue_submit2)},
+	};
+
+	auto it = entry_points.find(name);
+	return it == entry_points.end() ? nullptr : it->second;
+}
+} // namespace
+
+context create(const config & cfg)
+{
+	if (mock)
+		throw std::logic_error("mock_vulkan::create: a context already exists");
+	if (cfg.queue_count == 0 or cfg.queue_count > max_queues)
+		throw std::invalid_argument("mock_vulkan::create: invalid queue count");
+	mock = std::make_unique<state>();
+	mock->cfg = cfg;
+	mock->worker = std::thread(run);
+
+	VULKAN_HPP_DEFAULT_DISPATCHER.init(get_instance_proc_addr);
+
+	context ctx;
+	ctx.instance = vk::createInstance(vk::InstanceCreateInfo{});
+	VULKAN_HPP_DEFAULT_DISPATCHER.init(ctx.instance);
+	ctx.physical_device = ctx.instance.enumeratePhysicalDevices().at(0);
+
+	std::vector<float> priorities(cfg.queue_count, 1);
+	vk::DeviceQueueCreateInfo queue_info{.queueFamilyIndex = ctx.queue_family};
+	queue_info.setQueuePriorities(priorities);
+	vk::DeviceCreateInfo device_info{};
+	device_info.setQueueCreateInfos(queue_info);
+	ctx.device = ctx.physical_device.createDevice(device_info);
+	VULKAN_HPP_DEFAULT_DISPATCHER.init(ctx.device);
+	ctx.queue = ctx.device.getQueue(ctx.queue_family, 0);
+	return ctx;
+}
+
+void destroy(const context & ctx)
+{
+	ctx.device.waitIdle();
+	{
+		std::lock_guard lock(mock->mutex);
+		mock->quit = true;
+		mock->cv.notify_all();
+	}
+	mock->worker.join();
+	ctx.device.destroy();
+	ctx.instance.destroy();
+	mock.reset();
+}
+
+fixture::fixture(const config & cfg) :
+        ctx(create(cfg)),
+        allocator(std::make_shared<mini_vma>(ctx.physical_device, ctx.device)),
+        queue(std::make_shared<submit_queue>())
+{
+	queue->queue = ctx.queue;
+	queue->family_index = ctx.queue_family;
+}
+
+fixture::~fixture()
+{
+	auto errors = validation_errors();
+	for (const auto & error: errors)
+		fprintf(stderr, "%s\n", error.c_str());
+	assert(errors.empty());
+
+	allocator.reset();
+	destroy(ctx);
+}
+
+std::vector<encode_record> executed_encodes()
+{
+	std::lock_guard lock(mock->mutex);
+	return mock->executed;
+}
+
+void clear_executed_encodes()
+{
+	std::lock_guard lock(mock->mutex);
+	mock->executed.clear();
+}
+
+std::vector<image_barrier> executed_barriers()
+{
+	std::lock_guard lock(mock->mutex);
+	return mock->barriers;
+}
+
+std::vector<uint8_t> image_data(vk::Image i)
+{
+	std::lock_guard lock(mock->mutex);
+	return get<image>(static_cast<VkImage>(i))->texels;
+}
+
+std::vector<size_t> queue_submissions()
+{
+	std::lock_guard lock(mock->mutex);
+	return {mock->queue_submissions, mock->queue_submissions + mock->cfg.queue_count};
+}
+
+size_t device_memory_count()
+{
+	return mock->device_memory_count;
+}
+
+std::vector<std::string> validation_errors()
+{
+	std::lock_guard lock(mock->errors_mutex);
+	return mock->errors;
+}
+} // namespace mock_vulkan
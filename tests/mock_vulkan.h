@@ -0,0 +1,179 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "memory_allocator.h"
+#include "video_encoder.h"
+
+// Headless implementation of the Vulkan entry points used by video_encoder,
+// installed in VULKAN_HPP_DEFAULT_DISPATCHER so that encoders can be tested
+// and benchmarked on machines without a video encode capable GPU.
+//
+// Memory is host memory, images hold no data except quantization maps and
+// single layer NV12 transfer destinations.
+// Submissions execute on a thread of the mock, in order for each queue,
+// once their waits are satisfied and the configured latency has elapsed.
+// Encode commands write a synthetic H.264 or H.265 frame, one NAL unit of
+// filler bytes per slice, report its size through the feedback query and
+// record what the encoder passed them. Timestamps are in nanoseconds of the
+// host steady clock. H.264 and H.265 encode are exposed.
+namespace mock_vulkan
+{
+// Codec specific parameters of an H.265 encode command
+struct h265_record
+{
+	// pRefLists, pShortTermRefPicSet and pLongTermRefPics are not kept,
+	// see below
+	StdVideoEncodeH265PictureInfo picture;
+	StdVideoH265ShortTermRefPicSet short_term_rps;
+	// pStdReferenceInfo of the setup and reference slots
+	StdVideoEncodeH265ReferenceInfo setup_info;
+	std::vector<StdVideoEncodeH265ReferenceInfo> reference_info;
+	std::vector<StdVideoEncodeH265SliceSegmentHeader> slices;
+	// SPS of the picture in the bound session parameters, without the
+	// pointed structures
+	StdVideoH265SequenceParameterSet sps;
+};
+
+// Parameters of an encode command, copied when it is recorded. The H.264
+// structures are left empty for H.265 encodes.
+struct encode_record
+{
+	int32_t setup_slot;
+	std::vector<int32_t> reference_slots;
+	// pStdReferenceInfo of the setup and reference slots
+	StdVideoEncodeH264ReferenceInfo setup_info;
+	std::vector<StdVideoEncodeH264ReferenceInfo> reference_info;
+
+	// pRefLists is not kept, see below
+	StdVideoEncodeH264PictureInfo picture;
+	// RefPicList0 up to the first STD_VIDEO_H264_NO_REFERENCE_PICTURE or
+	// STD_VIDEO_H265_NO_REFERENCE_PICTURE, for both codecs
+	std::vector<uint8_t> ref_pic_list0;
+	std::vector<StdVideoEncodeH264RefListModEntry> list_modifications;
+	std::vector<StdVideoEncodeH264RefPicMarkingEntry> marking;
+	std::vector<StdVideoEncodeH264SliceHeader> slices;
+
+	// SPS of the picture in the bound session parameters, without the
+	// pointed structures
+	StdVideoH264SequenceParameterSet sps;
+
+	// set for H.265 encodes
+	std::optional<h265_record> h265;
+
+	// srcPictureResource
+	vk::Extent2D coded_extent;
+	// content of the quantization delta map when the encode executed, row
+	// major, empty if none was used
+	vk::Extent2D qp_map_extent;
+	std::vector<int8_t> qp_map;
+
+	// written range of the destination buffer, relative to dstBufferOffset
+	vk::DeviceSize dst_range;
+	uint32_t size;
+};
+
+// Image memory barrier, when it executed
+struct image_barrier
+{
+	vk::Image image;
+	vk::ImageLayout old_layout;
+	vk::ImageLayout new_layout;
+	uint32_t src_queue_family;
+	uint32_t dst_queue_family;
+};
+
+struct config
+{
+	// encoded sizes in bytes, clamped to the destination range
+	uint32_t intra_size = 20'000;
+	uint32_t inter_size = 4'000;
+	// overrides the sizes above if set
+	std::function<uint32_t(const encode_record &)> frame_size = nullptr;
+	// result status of the feedback query, nothing is written on failure
+	std::function<VkQueryResultStatusKHR(const encode_record &)> status = nullptr;
+
+	// from submission to completion, if the waits are satisfied earlier
+	std::chrono::microseconds latency{0};
+
+	// reported capabilities
+	uint32_t max_dpb_slots = 17;
+	uint32_t max_active_references = 16;
+	uint32_t max_slice_count = 8;
+	// VK_KHR_video_encode_quantization_map: delta maps of R8_SINT texels
+	// covering 16x16 pixels
+	bool quantization_map = false;
+	int32_t min_qp_delta = -26;
+	int32_t max_qp_delta = 25;
+	// the implementation overrides parameters of the SPS and PPS it is
+	// given, as reported by vkGetEncodedVideoSessionParametersKHR
+	bool parameter_overrides = false;
+	// buffers and images prefer dedicated allocations
+	bool dedicated_allocations = false;
+	// queues in the family, at most max_queues
+	uint32_t queue_count = 1;
+};
+
+const uint32_t max_queues = 8;
+
+struct context
+{
+	vk::Instance instance;
+	vk::PhysicalDevice physical_device;
+	vk::Device device;
+	// the only queue family, with graphics, compute, transfer and encode,
+	// queue is its first queue
+	vk::Queue queue;
+	uint32_t queue_family = 0;
+};
+
+// Installs the mock in VULKAN_HPP_DEFAULT_DISPATCHER and creates a device,
+// only one context can exist at a time
+context create(const config & = {});
+// Waits for pending submissions
+void destroy(const context &);
+
+// Mock device of a test, with an allocator and a submit_queue for the first
+// queue. Objects using them must be destroyed first: the destructor prints
+// the validation errors and asserts there are none.
+struct fixture
+{
+	context ctx;
+	std::shared_ptr<mini_vma> allocator;
+	std::shared_ptr<submit_queue> queue;
+
+	fixture(const config & = {});
+	fixture(const fixture &) = delete;
+	~fixture();
+};
+
+// Encode commands executed so far, in execution order
+std::vector<encode_record> executed_encodes();
+void clear_executed_encodes();
+
+// Image memory barriers executed so far, in execution order
+std::vector<image_barrier> executed_barriers();
+
+// Content of an image holding data: the Y plane then the CbCr plane for
+// NV12 images, tightly packed
+std::vector<uint8_t> image_data(vk::Image);
+
+// Submissions to each queue of the family
+std::vector<size_t> queue_submissions();
+
+// Device memory objects allocated and not freed
+size_t device_memory_count();
+
+// Invalid usage detected so far: encode outside of a video coding scope,
+// slots not bound by vkCmdBeginVideoCodingKHR, too many references, binary
+// semaphores signaled twice...
+std::vector<std::string> validation_errors();
+} // namespace mock_vulkan
@@ -0,0 +1,81 @@
+#include "nal_utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <vector>
+
+namespace
+{
+// Random bytes with runs of zeros, so that all patterns occur
+std::vector<uint8_t> make_data(size_t size, int zero_percent, std::mt19937 & rnd)
+{
+	std::vector<uint8_t> data(size);
+	for (auto & byte: data)
+		byte = int(rnd() % 100) < zero_percent ? 0 : rnd() % 5;
+	return data;
+}
+
+void check(const std::vector<uint8_t> & data)
+{
+	const uint8_t * end = data.data() + data.size();
+	for (const uint8_t * p = data.data(); p != end; ++p)
+	{
+		p = find_start_code(p, end);
+		assert(p == find_start_code_scalar(p, end));
+		if (p == end)
+			break;
+	}
+	for (const uint8_t * p = data.data(); p < end; p += 7)
+		assert(find_start_code(p, end) == find_start_code_scalar(p, end));
+
+	std::vector<uint8_t> escaped(max_escaped_size(data.size()));
+	std::vector<uint8_t> escaped_ref(max_escaped_size(data.size()));
+	size_t escaped_size = add_emulation_prevention(data, escaped.data());
+	assert(escaped_size == add_emulation_prevention_scalar(data, escaped_ref.data()));
+	assert(std::equal(escaped.begin(), escaped.begin() + escaped_size, escaped_ref.begin()));
+
+	// escaping hides all start codes, and is reverted exactly
+	escaped.resize(escaped_size);
+	assert(find_start_code_scalar(escaped.data(), escaped.data() + escaped.size()) == escaped.data() + escaped.size());
+
+	std::vector<uint8_t> unescaped(escaped.size());
+	size_t size = remove_emulation_prevention(escaped, unescaped.data());
+	assert(size == remove_emulation_prevention_scalar(escaped, escaped_ref.data()));
+	assert(std::equal(unescaped.begin(), unescaped.begin() + size, escaped_ref.begin()));
+	if (data.empty() or data.back() != 0)
+	{
+		assert(size == data.size());
+		assert(std::equal(data.begin(), data.end(), unescaped.begin()));
+	}
+
+	// in place
+	size = remove_emulation_prevention(escaped, escaped.data());
+	assert(std::equal(escaped.begin(), escaped.begin() + size, escaped_ref.begin()));
+}
+
+} // namespace
+
+int main()
+{
+	// known escapes
+	{
+		const uint8_t rbsp[] = {0, 0, 0, 0, 0, 1, 0, 0, 2, 0, 0, 3, 0, 0};
+		const uint8_t expected[] = {0, 0, 3, 0, 0, 3, 0, 1, 0, 0, 3, 2, 0, 0, 3, 3, 0, 0, 3};
+		std::vector<uint8_t> escaped(max_escaped_size(sizeof(rbsp)));
+		size_t size = add_emulation_prevention(rbsp, escaped.data());
+		assert(size == sizeof(expected));
+		assert(std::equal(expected, expected + size, escaped.begin()));
+		assert(remove_emulation_prevention({escaped.data(), size}, escaped.data()) == sizeof(rbsp));
+		assert(std::equal(rbsp, rbsp + sizeof(rbsp), escaped.begin()));
+	}
+
+	// the selected implementation matches the scalar one
+	std::mt19937 rnd(42);
+	for (size_t size = 0; size < 200; ++size)
+		check(make_data(size, 60, rnd));
+	for (int i = 0; i < 20; ++i)
+		check(make_data(100'000 + rnd() % 1000, 10 * (i % 10), rnd));
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include "nv12_convert.h"
+
+#include <cassert>
+#include <random>
+#include <vector>
+
+namespace
+{
+struct source
+{
+	host_frame frame;
+	std::vector<uint8_t> data[3];
+
+	source(host_pixel_format format, uint32_t width, uint32_t height, std::mt19937 & rnd) :
+	        frame{.format = format, .width = width, .height = height, .planes = {}, .strides = {}}
+	{
+		int planes = format == host_pixel_format::i420 ? 3 : 1;
+		for (int i = 0; i < planes; ++i)
+		{
+			// padded rows, as with most frame allocators
+			size_t row = i == 0 ? (format == host_pixel_format::i420 ? width : 4 * width) : (width + 1) / 2;
+			size_t rows = i == 0 ? height : (height + 1) / 2;
+			frame.strides[i] = row + 13;
+			data[i].resize(frame.strides[i] * rows);
+			for (auto & byte: data[i])
+				byte = rnd();
+			frame.planes[i] = data[i].data();
+		}
+	}
+};
+
+struct destination
+{
+	nv12_planes planes;
+	std::vector<uint8_t> y;
+	std::vector<uint8_t> cbcr;
+
+	destination(uint32_t width, uint32_t height)
+	{
+		size_t chroma_row = 2 * ((width + 1) / 2);
+		y.resize(width * height);
+		cbcr.resize(chroma_row * ((height + 1) / 2));
+		planes = {y.data(), width, cbcr.data(), chroma_row};
+	}
+};
+
+void check(host_pixel_format format, uint32_t width, uint32_t height, std::mt19937 & rnd)
+{
+	source src(format, width, height, rnd);
+	destination ref(width, height);
+	destination out(width, height);
+	destination threaded(width, height);
+
+	auto c = make_nv12_coefficients(make_ycbcr_matrix(color_matrix::bt709, color_range::limited));
+	convert_to_nv12_scalar(src.frame, ref.planes, c, 0, height);
+	convert_to_nv12(src.frame, out.planes, c, 0, height);
+	assert(out.y == ref.y);
+	assert(out.cbcr == ref.cbcr);
+
+	nv12_converter converter({.threads = 3});
+	converter.convert(src.frame, threaded.planes);
+	assert(threaded.y == ref.y);
+	assert(threaded.cbcr == ref.cbcr);
+}
+
+void check_values()
+{
+	struct
+	{
+		uint8_t rgb[3];
+		uint8_t y, cb, cr;
+	} colours[] = {
+	        {{255, 255, 255}, 235, 128, 128},
+	        {{0, 0, 0}, 16, 128, 128},
+	        {{128, 128, 128}, 126, 128, 128},
+	        {{255, 0, 0}, 63, 102, 240},
+	        {{0, 0, 255}, 32, 240, 118},
+	};
+	auto c = make_nv12_coefficients(make_ycbcr_matrix(color_matrix::bt709, color_range::limited));
+	for (const auto & colour: colours)
+	{
+		uint8_t pixels[2 * 2 * 4];
+		for (int i = 0; i < 4; ++i)
+		{
+			// BGRA
+			pixels[4 * i] = colour.rgb[2];
+			pixels[4 * i + 1] = colour.rgb[1];
+			pixels[4 * i + 2] = colour.rgb[0];
+			pixels[4 * i + 3] = 255;
+		}
+		host_frame src{
+		        .format = host_pixel_format::bgra,
+		        .width = 2,
+		        .height = 2,
+		        .planes = {pixels},
+		        .strides = {8},
+		};
+		destination out(2, 2);
+		convert_to_nv12(src, out.planes, c, 0, 2);
+		for (uint8_t y: out.y)
+			assert(y == colour.y);
+		assert(out.cbcr[0] == colour.cb);
+		assert(out.cbcr[1] == colour.cr);
+	}
+}
+
+} // namespace
+
+int main()
+{
+	check_values();
+
+	// the selected implementation and the threaded converter match the
+	// scalar one, for all sizes of the vector tails
+	std::mt19937 rnd(42);
+	for (auto format: {host_pixel_format::bgra, host_pixel_format::rgba, host_pixel_format::i420})
+	{
+		for (uint32_t height: {1, 2, 5, 16})
+			for (uint32_t width = 1; width < 70; ++width)
+				check(format, width, height, rnd);
+	}
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include "quantization_map.h"
+
+#include <cassert>
+#include <stdexcept>
+#include <vector>
+
+int main()
+{
+	// partial texels on the edges
+	{
+		delta_qp_map map(1000, 562, 16, 16);
+		assert(map.width == 63 and map.height == 36);
+		assert(map.values.size() == 63 * 36);
+		assert(map.empty());
+
+		delta_qp_map ctb(1920, 1080, 64, 32);
+		assert(ctb.width == 30 and ctb.height == 34);
+	}
+
+	// overlapped texels take the region QP, later regions on top
+	{
+		const qp_region regions[] = {
+		        {.x = 0, .y = 0, .width = 64, .height = 64, .delta_qp = 6},
+		        // texels 1 and 2 of row 1
+		        {.x = 17, .y = 16, .width = 16, .height = 1, .delta_qp = -8},
+		        // empty
+		        {.x = 0, .y = 0, .width = 0, .height = 10, .delta_qp = 3},
+		};
+		auto map = make_delta_qp_map(64, 48, 16, 16, regions);
+		assert(map.width == 4 and map.height == 3);
+		std::vector<int8_t> expected = {
+		        6, 6, 6, 6,
+		        6, -8, -8, 6,
+		        6, 6, 6, 6};
+		assert(map.values == expected);
+		assert(map.at(2, 1) == -8);
+		assert(not map.empty());
+
+		map.clamp(-4, 4);
+		expected = {
+		        4, 4, 4, 4,
+		        4, -4, -4, 4,
+		        4, 4, 4, 4};
+		assert(map.values == expected);
+	}
+
+	// regions outside of the picture, or past its edges
+	{
+		delta_qp_map map(64, 32, 16, 16);
+		map.add({.x = 64, .y = 0, .width = 16, .height = 16, .delta_qp = -1});
+		map.add({.x = 0, .y = 100, .width = 16, .height = 16, .delta_qp = -1});
+		assert(map.empty());
+		map.add({.x = 40, .y = 20, .width = UINT32_MAX, .height = UINT32_MAX, .delta_qp = -200});
+		std::vector<int8_t> expected = {
+		        0, 0, 0, 0,
+		        0, 0, -128, -128};
+		assert(map.values == expected);
+	}
+
+	{
+		try
+		{
+			delta_qp_map map(64, 64, 0, 16);
+			assert(false);
+		}
+		catch (std::invalid_argument &)
+		{
+		}
+		delta_qp_map map(64, 64, 16, 16);
+		try
+		{
+			map.clamp(1, -1);
+			assert(false);
+		}
+		catch (std::invalid_argument &)
+		{
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+#include "range_allocator.h"
+
+#include <cassert>
+#include <cstdio>
+
+int main()
+{
+	range_allocator ranges(1024);
+	assert(ranges.empty());
+
+	// alignment
+	auto a = ranges.allocate(100, 64);
+	assert(a == 0);
+	auto b = ranges.allocate(100, 64);
+	assert(b == 128);
+	assert(ranges.available() == 1024 - 200);
+	assert(ranges.fragments() == 2);
+
+	// too large
+	assert(not ranges.allocate(1024, 1));
+	assert(not ranges.allocate(0, 1));
+
+	// best fit picks the smallest hole
+	auto c = ranges.allocate(500, 1);
+	assert(c == 228);
+	ranges.free(*a, 100);
+	auto d = ranges.allocate(90, 1);
+	assert(d == 0);
+	ranges.free(*d, 90);
+
+	// coalescing
+	ranges.free(*b, 100);
+	ranges.free(*c, 500);
+	assert(ranges.empty());
+	assert(ranges.fragments() == 1);
+	assert(ranges.allocate(1024, 1) == 0);
+	assert(ranges.available() == 0);
+	ranges.free(0, 1024);
+
+	// reuse after fragmentation
+	uint64_t offsets[8];
+	for (auto & offset: offsets)
+		offset = *ranges.allocate(128, 128);
+	for (int i = 0; i < 8; i += 2)
+		ranges.free(offsets[i], 128);
+	assert(not ranges.allocate(256, 1));
+	ranges.free(offsets[1], 128);
+	assert(ranges.allocate(384, 1) == 0);
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "rate_control.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+int main()
+{
+	// 1.2 Mbit/s at 30 fps: 40000 bits per frame, 1.2 Mbit buffer, half full
+	rate_control rc{
+	        .rc_mode = rate_control::mode::cbr,
+	        .target_bitrate = 1'200'000,
+	        .framerate_num = 30,
+	};
+	{
+		vbv_model vbv(rc);
+		assert(vbv.capacity() == 1'200'000);
+		assert(vbv.level() == 600'000);
+		assert(vbv.max_frame_bytes() == 75'000);
+
+		// frames at the target size keep the level steady
+		for (int i = 0; i < 100; ++i)
+		{
+			auto r = vbv.add_frame(5000);
+			assert(not r.underflow and not r.overflow);
+			assert(r.fullness == 560'000);
+		}
+		assert(vbv.level() == 600'000);
+		assert(std::abs(vbv.average_bitrate() - 1'200'000) < 1);
+
+		// a large keyframe drains the buffer, following frames refill it
+		auto r = vbv.add_frame(70'000);
+		assert(not r.underflow);
+		assert(r.fullness == 40'000);
+		r = vbv.add_frame(20'000);
+		assert(r.underflow);
+		assert(r.fullness == 0);
+		assert(vbv.underflows() == 1);
+		assert(vbv.level() == 40'000);
+	}
+
+	// small frames overflow in cbr
+	{
+		vbv_model vbv(rc);
+		for (int i = 0; i < 100; ++i)
+			vbv.add_frame(100);
+		assert(vbv.overflows() > 0);
+		assert(vbv.level() == vbv.capacity());
+	}
+
+	// in vbr the buffer is sized at the target bitrate, fills at the max
+	// bitrate and stops filling when full
+	{
+		rc.rc_mode = rate_control::mode::vbr;
+		rc.max_bitrate = 2'400'000;
+		vbv_model vbv(rc);
+		assert(vbv.capacity() == 1'200'000);
+		assert(vbv.level() == 600'000);
+		auto r = vbv.add_frame(0);
+		assert(r.fullness == 600'000);
+		assert(vbv.level() == 680'000);
+		for (int i = 0; i < 100; ++i)
+		{
+			r = vbv.add_frame(100);
+			assert(not r.overflow);
+		}
+		assert(vbv.overflows() == 0);
+		assert(vbv.level() == vbv.capacity());
+	}
+
+	printf("ok\n");
+	return 0;
+}
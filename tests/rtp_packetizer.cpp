@@ -0,0 +1,105 @@
+#include "rtp_packetizer.h"
+
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace
+{
+void append_nal(std::vector<uint8_t> & out, uint8_t header, size_t size, std::mt19937 & rnd)
+{
+	out.insert(out.end(), {0, 0, 0, 1, header});
+	// no zero byte, so that there is no start code in the payload
+	for (size_t i = 1; i < size; ++i)
+		out.push_back(1 + rnd() % 255);
+}
+
+// Reassemble the NAL units of an access unit from its packets
+std::vector<uint8_t> depacketize(const std::vector<std::vector<uint8_t>> & packets)
+{
+	std::vector<uint8_t> out;
+	for (const auto & p: packets)
+	{
+		assert(p.size() > 12);
+		assert(p[0] == 0x80);
+		const uint8_t * payload = p.data() + 12;
+		size_t size = p.size() - 12;
+		uint8_t type = payload[0] & 0x1f;
+		if (type == 24)
+		{
+			for (size_t i = 1; i < size;)
+			{
+				size_t nal_size = (payload[i] << 8) | payload[i + 1];
+				out.insert(out.end(), {0, 0, 0, 1});
+				out.insert(out.end(), payload + i + 2, payload + i + 2 + nal_size);
+				i += 2 + nal_size;
+			}
+		}
+		else if (type == 28)
+		{
+			if (payload[1] & 0x80)
+				out.insert(out.end(), {0, 0, 0, 1, uint8_t((payload[0] & 0xe0) | (payload[1] & 0x1f))});
+			out.insert(out.end(), payload + 2, payload + size);
+		}
+		else
+		{
+			out.insert(out.end(), {0, 0, 0, 1});
+			out.insert(out.end(), payload, payload + size);
+		}
+	}
+	return out;
+}
+} // namespace
+
+int main()
+{
+	std::mt19937 rnd(42);
+
+	std::vector<uint8_t> sps_pps;
+	append_nal(sps_pps, 0x67, 20, rnd);
+	append_nal(sps_pps, 0x68, 6, rnd);
+
+	std::vector<uint8_t> idr;
+	append_nal(idr, 0x06, 8, rnd);
+	append_nal(idr, 0x65, 200'000, rnd);
+
+	std::vector<uint8_t> p_frame;
+	append_nal(p_frame, 0x41, 8'000, rnd);
+	append_nal(p_frame, 0x41, 700, rnd);
+	append_nal(p_frame, 0x41, 300, rnd);
+
+	rtp_packetizer packetizer({.mtu = 1200, .ssrc = 1234});
+	packetizer.set_parameter_sets(sps_pps);
+
+	std::vector<std::vector<uint8_t>> packets;
+	auto collect = [&](std::span<const iovec> iov) {
+		auto & p = packets.emplace_back();
+		for (const auto & v: iov)
+			p.insert(p.end(), (const uint8_t *)v.iov_base, (const uint8_t *)v.iov_base + v.iov_len);
+		assert(p.size() <= 1200);
+	};
+
+	// packets carry the parameter sets and the frame, in order
+	{
+		packetizer.packetize(idr, 0, collect);
+		std::vector<uint8_t> expected = sps_pps;
+		expected.insert(expected.end(), idr.begin(), idr.end());
+		assert(depacketize(packets) == expected);
+		// SPS, PPS and SEI aggregated
+		assert((packets.front()[12] & 0x1f) == 24);
+		assert(packets.back()[1] & 0x80);
+		for (size_t i = 0; i + 1 < packets.size(); ++i)
+			assert(not(packets[i][1] & 0x80));
+	}
+
+	// without a keyframe, the parameter sets are not repeated
+	{
+		packets.clear();
+		packetizer.packetize(p_frame, 3000, collect);
+		assert(depacketize(packets) == p_frame);
+		assert(packetizer.next_sequence() > packets.size());
+	}
+
+	return 0;
+}
@@ -0,0 +1,352 @@
+#include "slot_info.h"
+
+#include <cassert>
+#include <cstdio>
+#include <set>
+#include <stdexcept>
+
+namespace
+{
+struct frame
+{
+	slot_info::frame_info info;
+	// frames in the reference slots, before add_frame updates them
+	std::vector<int64_t> references;
+
+	std::set<int64_t> reference_set() const
+	{
+		return {references.begin(), references.end()};
+	}
+};
+
+frame add(slot_info & dpb, int64_t index, uint32_t frame_num, bool idr, bool predicted)
+{
+	slot_info before = dpb;
+	frame res{dpb.add_frame(index, frame_num, idr, predicted), {}};
+	for (size_t slot: res.info.references)
+		res.references.push_back(before[slot].frame);
+	return res;
+}
+
+size_t used(const slot_info & dpb)
+{
+	size_t res = 0;
+	for (size_t i = 0; i < dpb.size(); ++i)
+		res += dpb[i].used();
+	return res;
+}
+} // namespace
+
+int main()
+{
+	// single reference: the previous frame, two slots
+	{
+		slot_info dpb;
+		assert(dpb.size() == 2);
+		auto f = add(dpb, 0, 0, true, false);
+		assert(f.info.references.empty());
+		assert(not f.info.long_term_idx);
+		for (uint32_t i = 1; i < 10; ++i)
+		{
+			size_t previous = f.info.slot;
+			f = add(dpb, i, i, false, true);
+			assert(f.info.slot != previous);
+			assert(f.info.references.size() == 1 and f.info.references[0] == previous);
+			assert(f.info.list_modifications.empty());
+			assert(f.info.marking.empty());
+			assert(used(dpb) == 1);
+		}
+	}
+
+	// sliding window over 3 short-term references
+	{
+		slot_info dpb({
+		        .num_short_term = 3,
+		        .max_active_references = 3,
+		});
+		assert(dpb.size() == 4);
+		add(dpb, 0, 0, true, false);
+		for (uint32_t i = 1; i < 10; ++i)
+		{
+			auto f = add(dpb, i, i, false, true);
+			std::set<int64_t> expected;
+			for (int64_t f = std::max<int64_t>(0, int64_t(i) - 3); f < i; ++f)
+				expected.insert(f);
+			assert(f.reference_set() == expected);
+			// most recent first
+			assert(f.references[0] == i - 1);
+			assert(f.info.reference_set.size() == std::min(i, 3u));
+			assert(f.info.list_modifications.empty());
+			assert(f.info.marking.empty());
+		}
+		assert(used(dpb) == 3);
+
+		// IDR frames drop all references
+		auto f = add(dpb, 10, 0, true, true);
+		assert(f.info.references.empty());
+		assert(f.info.reference_set.empty());
+		assert(used(dpb) == 1);
+	}
+
+	// intra frames are recovery points: later frames do not reference
+	// older ones, which stay in the DPB until the sliding window drops them
+	{
+		slot_info dpb({
+		        .num_short_term = 2,
+		        .num_long_term = 1,
+		        .max_active_references = 3,
+		});
+		add(dpb, 0, 0, true, false);
+		add(dpb, 1, 1, false, true);
+		auto f = add(dpb, 2, 2, false, false);
+		assert(f.info.references.empty());
+		assert(f.info.reference_set.empty());
+		assert(used(dpb) == 3);
+		f = add(dpb, 3, 3, false, true);
+		assert(f.references == std::vector<int64_t>{2});
+		assert(f.info.reference_set.size() == 1);
+		f = add(dpb, 4, 4, false, true);
+		assert(f.references == (std::vector<int64_t>{3, 2}));
+		assert(used(dpb) == 3);
+	}
+
+	// long-term references every 4 frames, IDR is long-term 0
+	{
+		slot_info dpb({
+		        .num_short_term = 2,
+		        .num_long_term = 2,
+		        .long_term_interval = 4,
+		        .max_active_references = 4,
+		});
+		assert(dpb.size() == 5);
+		auto f = add(dpb, 0, 0, true, false);
+		assert(f.info.long_term_idx == 0u);
+		assert(f.info.marking.empty());
+
+		for (uint32_t i = 1; i < 4; ++i)
+		{
+			f = add(dpb, i, i, false, true);
+			assert(not f.info.long_term_idx);
+			assert(f.info.marking.empty());
+			// short-term first, long-term last
+			assert(f.references.back() == 0);
+			assert(dpb[f.info.references.back()].long_term_idx == 0u);
+		}
+		// 4 references: the IDR and frames 1, 2, 3
+		assert(used(dpb) == 4);
+
+		// frame 4 becomes long-term 1: MaxLongTermFrameIdx is raised and
+		// frame 1 is unmarked since the sliding window does not apply
+		f = add(dpb, 4, 4, false, true);
+		assert(f.info.long_term_idx == 1u);
+		assert(f.info.marking.size() == 3);
+		assert(f.info.marking[0].op == slot_info::marking_operation::unmark_short_term);
+		assert(f.info.marking[0].value == 2); // 4 - 1 - 1
+		assert(f.info.marking[1].op == slot_info::marking_operation::max_long_term_idx);
+		assert(f.info.marking[1].value == 2);
+		assert(f.info.marking[2].op == slot_info::marking_operation::mark_current_long_term);
+		assert(f.info.marking[2].value == 1);
+		assert(used(dpb) == 4);
+
+		// sliding window on short-term references only
+		for (uint32_t i = 5; i < 8; ++i)
+		{
+			f = add(dpb, i, i, false, true);
+			assert(f.info.marking.empty());
+			assert(used(dpb) == 4);
+		}
+		f = add(dpb, 8, 8, false, true);
+		assert((f.reference_set() == std::set<int64_t>{0, 4, 6, 7}));
+
+		// frame 8 replaced frame 0 as long-term 0, without unmarking a
+		// short-term reference
+		assert(f.info.long_term_idx == 0u);
+		assert(f.info.marking.size() == 1);
+		assert(f.info.marking[0].op == slot_info::marking_operation::mark_current_long_term);
+		assert(f.info.marking[0].value == 0);
+		f = add(dpb, 9, 9, false, true);
+		assert((f.reference_set() == std::set<int64_t>{8, 4, 6, 7}));
+		// initial list: short-term 7, 6 then long-term 0 (frame 8), 1 (frame 4)
+		assert(f.references[0] == 7);
+		assert(f.references[2] == 8);
+		assert(f.references[3] == 4);
+	}
+
+	// reordering the list
+	{
+		slot_info dpb(
+		        {
+		                .num_short_term = 3,
+		                .num_long_term = 1,
+		                .max_active_references = 2,
+		        },
+		        slot_info::prefer_long_term);
+		add(dpb, 0, 0, true, false);
+		add(dpb, 1, 1, false, true);
+		add(dpb, 2, 2, false, true);
+		auto f = add(dpb, 3, 3, false, true);
+		// initial list 2, 1, 0 (long-term): 0 is moved to the second entry
+		assert(f.references[0] == 2);
+		assert(f.references[1] == 0);
+		assert(f.info.list_modifications.size() == 2);
+		assert(f.info.list_modifications[0].op == slot_info::list_modification::subtract);
+		assert(f.info.list_modifications[0].value == 0);
+		assert(f.info.list_modifications[1].op == slot_info::list_modification::long_term);
+		assert(f.info.list_modifications[1].value == 0);
+	}
+
+	// custom policy: the oldest short-term reference
+	{
+		slot_info dpb(
+		        {
+		                .num_short_term = 3,
+		                .max_active_references = 1,
+		        },
+		        [](const slot_info &, std::span<const size_t> candidates, size_t) {
+			        return std::vector<size_t>{candidates.back()};
+		        });
+		add(dpb, 0, 0, true, false);
+		add(dpb, 1, 1, false, true);
+		add(dpb, 2, 2, false, true);
+		add(dpb, 3, 3, false, true);
+		auto f = add(dpb, 4, 4, false, true);
+		assert(f.references[0] == 1);
+		// abs_diff_pic_num_minus1 = 4 - 1 - 1
+		assert(f.info.list_modifications.size() == 1);
+		assert(f.info.list_modifications[0].op == slot_info::list_modification::subtract);
+		assert(f.info.list_modifications[0].value == 2);
+	}
+
+	// loss of frame 4: frame 5 was predicted from it, frame 6 uses frame 3
+	{
+		slot_info dpb({.num_short_term = 3});
+		add(dpb, 0, 0, true, false);
+		for (uint32_t i = 1; i < 6; ++i)
+			add(dpb, i, i, false, true);
+		dpb.invalidate(4, 4);
+		assert(dpb.has_valid_reference());
+		auto f = add(dpb, 6, 6, false, true);
+		assert(f.references == std::vector<int64_t>{3});
+		// initial list 5, 4, 3
+		assert(f.info.list_modifications.size() == 1);
+		assert(f.info.list_modifications[0].op == slot_info::list_modification::subtract);
+		assert(f.info.list_modifications[0].value == 2);
+		f = add(dpb, 7, 7, false, true);
+		assert(f.references == std::vector<int64_t>{6});
+
+		// nothing left to predict from
+		dpb.invalidate(5, 7);
+		assert(not dpb.has_valid_reference());
+		bool thrown = false;
+		try
+		{
+			add(dpb, 8, 8, false, true);
+		}
+		catch (std::logic_error &)
+		{
+			thrown = true;
+		}
+		assert(thrown);
+		add(dpb, 8, 8, false, false);
+		assert(dpb.has_valid_reference());
+	}
+
+	// recovery from an acknowledged frame
+	{
+		slot_info dpb({.num_short_term = 4});
+		add(dpb, 0, 0, true, false);
+		for (uint32_t i = 1; i < 6; ++i)
+			add(dpb, i, i, false, true);
+		// frame 2 and the frames it depends on were decoded
+		dpb.acknowledge(2);
+		for (size_t i = 0; i < dpb.size(); ++i)
+			assert(dpb[i].acknowledged == (dpb[i].frame == 2));
+		dpb.invalidate(5, 5);
+		auto f = add(dpb, 6, 6, false, true);
+		assert(f.references == std::vector<int64_t>{2});
+		// then back to the most recent
+		f = add(dpb, 7, 7, false, true);
+		assert(f.references == std::vector<int64_t>{6});
+	}
+
+	// frames predicted from a long-term reference survive the loss of
+	// short-term ones
+	{
+		slot_info dpb(
+		        {
+		                .num_short_term = 1,
+		                .num_long_term = 1,
+		                .max_active_references = 1,
+		        },
+		        [](const slot_info & dpb, std::span<const size_t> candidates, size_t) {
+			        // frame 3 is only predicted from the IDR
+			        for (size_t slot: candidates)
+			        {
+				        if (dpb[slot].long_term_idx and candidates.size() == 2 and dpb[candidates[0]].frame == 2)
+					        return std::vector<size_t>{slot};
+			        }
+			        return std::vector<size_t>{candidates[0]};
+		        });
+		add(dpb, 0, 0, true, false);
+		add(dpb, 1, 1, false, true);
+		add(dpb, 2, 2, false, true);
+		auto f = add(dpb, 3, 3, false, true);
+		assert(f.references == std::vector<int64_t>{0});
+		dpb.invalidate(1, 1);
+		f = add(dpb, 4, 4, false, true);
+		assert(f.references == std::vector<int64_t>{3});
+	}
+
+	// loss of a frame with marking operations: decoders do not know which
+	// pictures are references, an IDR frame is required
+	{
+		slot_info dpb({
+		        .num_short_term = 2,
+		        .num_long_term = 1,
+		        .long_term_interval = 3,
+		        .max_active_references = 1,
+		});
+		add(dpb, 0, 0, true, false);
+		for (uint32_t i = 1; i < 6; ++i)
+		{
+			auto f = add(dpb, i, i, false, true);
+			assert(f.info.marking.empty() == (i != 3));
+		}
+		// frame 4 uses the sliding window, frame 5 was predicted from it
+		dpb.invalidate(4, 4);
+		assert(dpb.has_valid_reference() and not dpb.idr_required());
+		auto f = add(dpb, 6, 6, false, true);
+		assert(f.references == std::vector<int64_t>{3});
+
+		// frame 3 became long-term 0 with MMCO 6
+		dpb.invalidate(3, 3);
+		assert(not dpb.has_valid_reference() and dpb.idr_required());
+		// an intra frame does not reset the marking
+		add(dpb, 7, 7, false, false);
+		assert(dpb.idr_required());
+		add(dpb, 8, 0, true, false);
+		assert(not dpb.idr_required() and dpb.has_valid_reference());
+
+		// as well as IDR frames
+		add(dpb, 9, 1, false, true);
+		dpb.invalidate(8, 8);
+		assert(dpb.idr_required());
+	}
+
+	// invalid configurations
+	{
+		bool thrown = false;
+		try
+		{
+			slot_info dpb({.num_short_term = 0});
+		}
+		catch (std::invalid_argument &)
+		{
+			thrown = true;
+		}
+		assert(thrown);
+	}
+
+	printf("slot_info: OK\n");
+	return 0;
+}
@@ -1,11 +1,65 @@
 #include "video_encoder.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <utility>
 
 #include "memory_allocator.h"
 
+namespace
+{
+// Map for extent with the given texels
+bool qp_map_fits(const delta_qp_map & map, vk::Extent2D extent, vk::Extent2D texel)
+{
+	return map.texel_width == texel.width and map.texel_height == texel.height and
+	       map.width == (extent.width + texel.width - 1) / texel.width and
+	       map.height == (extent.height + texel.height - 1) / texel.height and
+	       map.values.size() == size_t(map.width) * map.height;
+}
+} // namespace
+
+video_encoder::readback_mode video_encoder::select_readback_mode(
+        vk::PhysicalDevice physical_device,
+        uint32_t output_memory_type_bits)
+{
+	bool cached = find_memory_type(physical_device,
+	                               output_memory_type_bits,
+	                               vk::MemoryPropertyFlagBits::eHostVisible |
+	                                       vk::MemoryPropertyFlagBits::eHostCached)
+	                      .has_value();
+
+	switch (settings.readback)
+	{
+		case readback_mode::automatic:
+			return cached ? readback_mode::host_cached : readback_mode::staging;
+		case readback_mode::host_cached:
+			if (not cached)
+				throw std::runtime_error("encode output cannot be written to host cached memory");
+			return readback_mode::host_cached;
+		case readback_mode::host_coherent:
+		case readback_mode::staging:
+			return settings.readback;
+	}
+	throw std::runtime_error("invalid readback mode");
+}
+
+vk::MemoryPropertyFlags video_encoder::readback_memory_properties(
+        vk::PhysicalDevice physical_device,
+        uint32_t memory_type_bits)
+{
+	vk::MemoryPropertyFlags cached = vk::MemoryPropertyFlagBits::eHostVisible |
+	                                 vk::MemoryPropertyFlagBits::eHostCached;
+	if (readback != readback_mode::host_coherent and
+	    find_memory_type(physical_device, memory_type_bits, cached))
+		return cached;
+
+	return vk::MemoryPropertyFlagBits::eHostVisible |
+	       vk::MemoryPropertyFlagBits::eHostCoherent;
+}
+
 vk::VideoFormatPropertiesKHR video_encoder::select_video_format(
         vk::PhysicalDevice physical_device,
         const vk::PhysicalDeviceVideoFormatInfoKHR & format_info)
@@ -25,23 +79,44 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
                          void * video_session_create_next,
                          void * session_params_next)
 {
-	static const uint32_t num_dpb_slots = 4;
+	if (settings.frames_in_flight == 0)
+		throw std::runtime_error("frames_in_flight must be at least 1");
+
+	dpb_status = slot_info(settings.references, settings.reference_policy);
+	const uint32_t num_dpb_slots = dpb_status.size();
+	if (num_dpb_slots > video_caps.maxDpbSlots)
+		throw std::runtime_error("too many references: not enough DPB slots");
+	if (settings.references.max_active_references > video_caps.maxActiveReferencePictures)
+		throw std::runtime_error("too many active references");
 
-	fence = device.createFence({});
+	if (max_coded_extent.width > video_caps.maxCodedExtent.width or max_coded_extent.height > video_caps.maxCodedExtent.height)
+		throw std::runtime_error("extent above the maximum supported extent");
+	if (extent.width > max_coded_extent.width or extent.height > max_coded_extent.height)
+		throw std::runtime_error("extent above max_extent");
+	min_coded_extent = video_caps.minCodedExtent;
 
-	mini_vma mem_allocator;
+	rate_control_modes = encode_caps.rateControlModes;
+	max_bitrate = encode_caps.maxBitrate;
+	check_rate_control(settings.rate);
+	active_rate = settings.rate;
+	if (active_rate.rc_mode == rate_control::mode::cbr or active_rate.rc_mode == rate_control::mode::vbr)
+		vbv.emplace(active_rate);
 
 	vk::VideoProfileListInfoKHR video_profile_list{
 	        .profileCount = 1,
 	        .pProfiles = &video_profile,
 	};
 
-	// Input image
+	// Input images
 	vk::VideoFormatPropertiesKHR picture_format;
 	{
+		vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eVideoEncodeSrcKHR;
+		if (settings.input_storage)
+			usage |= vk::ImageUsageFlagBits::eStorage;
+
 		vk::PhysicalDeviceVideoFormatInfoKHR video_fmt{
 		        .pNext = &video_profile_list,
-		        .imageUsage = vk::ImageUsageFlagBits::eVideoEncodeSrcKHR,
+		        .imageUsage = usage,
 		};
 
 		picture_format = select_video_format(physical_device, video_fmt);
@@ -54,11 +129,17 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		}
 
 		vk::Extent3D aligned_extent{
-		        .width = align(extent.width, encode_caps.encodeInputPictureGranularity.width),
-		        .height = align(extent.height, encode_caps.encodeInputPictureGranularity.height),
+		        .width = align(max_coded_extent.width, encode_caps.encodeInputPictureGranularity.width),
+		        .height = align(max_coded_extent.height, encode_caps.encodeInputPictureGranularity.height),
 		        .depth = 1,
 		};
 
+		// Plane views use a different format and only storage usage
+		const vk::ImageCreateFlags storage_flags = vk::ImageCreateFlagBits::eMutableFormat |
+		                                           vk::ImageCreateFlagBits::eExtendedUsage;
+		if (settings.input_storage and (picture_format.imageCreateFlags & storage_flags) != storage_flags)
+			throw std::runtime_error("encoder input image cannot be used as storage image");
+
 		// TODO: check format capabilities
 		//
 		vk::ImageCreateInfo img_create_info{
@@ -72,18 +153,16 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		        .samples = vk::SampleCountFlagBits::e1,
 		        .tiling = picture_format.imageTiling,
 		        .usage = vk::ImageUsageFlagBits::eTransferDst |
-		                 picture_format.imageUsageFlags,
+		                 picture_format.imageUsageFlags | usage,
 		        .sharingMode = vk::SharingMode::eExclusive,
 		};
 
-		input_image = device.createImage(img_create_info);
-
-		mem_allocator.request(
-		        device.getImageMemoryRequirements(input_image),
-		        [this](vk::DeviceMemory memory, size_t offset) {
-			        device.bindImageMemory(input_image, memory, offset);
-		        },
-		        vk::MemoryPropertyFlagBits::eDeviceLocal);
+		inputs.resize(settings.input_images ? settings.input_images : settings.frames_in_flight + 1);
+		for (auto & input: inputs)
+		{
+			input.image = device.createImage(img_create_info);
+			mem.push_back(allocator->bind(input.image, vk::MemoryPropertyFlagBits::eDeviceLocal));
+		}
 	}
 
 	// Decode picture buffer (DPB) images
@@ -100,8 +179,8 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		// TODO: use multiple images if array levels are not supported
 
 		vk::Extent3D aligned_extent{
-		        .width = align(extent.width, video_caps.pictureAccessGranularity.width),
-		        .height = align(extent.height, video_caps.pictureAccessGranularity.height),
+		        .width = align(max_coded_extent.width, video_caps.pictureAccessGranularity.width),
+		        .height = align(max_coded_extent.height, video_caps.pictureAccessGranularity.height),
 		        .depth = 1,
 		};
 
@@ -120,12 +199,95 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		};
 
 		dpb_image = device.createImage(img_create_info);
-		mem_allocator.request(
-		        device.getImageMemoryRequirements(dpb_image),
-		        [this](vk::DeviceMemory memory, size_t offset) {
-			        device.bindImageMemory(dpb_image, memory, offset);
-		        },
-		        vk::MemoryPropertyFlagBits::eDeviceLocal);
+		mem.push_back(allocator->bind(dpb_image, vk::MemoryPropertyFlagBits::eDeviceLocal));
+	}
+
+	// Quantization delta map, left out if no format has texels small enough
+	// for max_coded_extent or if the encode queue cannot copy to it
+	vk::VideoSessionCreateFlagsKHR session_flags{};
+	if (qp_map_caps and (encode_caps.flags & vk::VideoEncodeCapabilityFlagBitsKHR::eQuantizationDeltaMap))
+	{
+		vk::PhysicalDeviceVideoFormatInfoKHR video_fmt{
+		        .pNext = &video_profile_list,
+		        .imageUsage = vk::ImageUsageFlagBits::eVideoEncodeQuantizationDeltaMapKHR,
+		};
+		auto formats = physical_device.getVideoFormatPropertiesKHR<
+		        vk::StructureChain<vk::VideoFormatPropertiesKHR, vk::VideoFormatQuantizationMapPropertiesKHR>>(video_fmt);
+
+		// the finest map within the implementation limits
+		const vk::VideoFormatPropertiesKHR * map_format = nullptr;
+		vk::Extent2D map_extent;
+		for (const auto & chain: formats)
+		{
+			const auto & format = chain.get<vk::VideoFormatPropertiesKHR>();
+			auto texel = chain.get<vk::VideoFormatQuantizationMapPropertiesKHR>().quantizationMapTexelSize;
+			size_t bytes = format.format == vk::Format::eR8Sint    ? 1
+			               : format.format == vk::Format::eR16Sint ? 2
+			               : format.format == vk::Format::eR32Sint ? 4
+			                                                       : 0;
+			if (bytes == 0 or texel.width == 0 or texel.height == 0)
+				continue;
+			vk::Extent2D extent{
+			        .width = (max_coded_extent.width + texel.width - 1) / texel.width,
+			        .height = (max_coded_extent.height + texel.height - 1) / texel.height,
+			};
+			if (extent.width > qp_map_caps->max_extent.width or extent.height > qp_map_caps->max_extent.height)
+				continue;
+			if (map_format and texel.width * texel.height >= qp_map_texel.width * qp_map_texel.height)
+				continue;
+			map_format = &format;
+			map_extent = extent;
+			qp_map_texel = texel;
+			qp_map_texel_bytes = bytes;
+		}
+
+		auto queue_flags = physical_device.getQueueFamilyProperties()[encode_queue_family_index].queueFlags;
+		bool transfer = bool(queue_flags & (vk::QueueFlagBits::eTransfer | vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute));
+		if (map_format and transfer)
+		{
+			qp_map_image = device.createImage({
+			        .pNext = &video_profile_list,
+			        .flags = map_format->imageCreateFlags,
+			        .imageType = map_format->imageType,
+			        .format = map_format->format,
+			        .extent = {.width = map_extent.width, .height = map_extent.height, .depth = 1},
+			        .mipLevels = 1,
+			        .arrayLayers = 1,
+			        .samples = vk::SampleCountFlagBits::e1,
+			        .tiling = map_format->imageTiling,
+			        .usage = map_format->imageUsageFlags |
+			                 vk::ImageUsageFlagBits::eVideoEncodeQuantizationDeltaMapKHR |
+			                 vk::ImageUsageFlagBits::eTransferDst,
+			        .sharingMode = vk::SharingMode::eExclusive,
+			});
+			mem.push_back(allocator->bind(qp_map_image, vk::MemoryPropertyFlagBits::eDeviceLocal));
+			qp_map_view = device.createImageView({
+			        .image = qp_map_image,
+			        .viewType = vk::ImageViewType::e2D,
+			        .format = map_format->format,
+			        .components = map_format->componentMapping,
+			        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+			                             .baseMipLevel = 0,
+			                             .levelCount = 1,
+			                             .baseArrayLayer = 0,
+			                             .layerCount = 1},
+			});
+
+			// Only written by the host, coherent memory avoids flushes
+			qp_map_staging_stride = align(map_extent.width * map_extent.height * qp_map_texel_bytes, 256);
+			qp_map_staging = device.createBuffer({
+			        .size = qp_map_staging_stride * settings.frames_in_flight,
+			        .usage = vk::BufferUsageFlagBits::eTransferSrc,
+			        .sharingMode = vk::SharingMode::eExclusive,
+			});
+			const auto & staging_mem = mem.emplace_back(
+			        allocator->bind(qp_map_staging, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent));
+			qp_map_staging_data = (uint8_t *)staging_mem.mapped;
+
+			min_qp_delta = qp_map_caps->min_qp_delta;
+			max_qp_delta = qp_map_caps->max_qp_delta;
+			session_flags |= vk::VideoSessionCreateFlagBitsKHR::eAllowEncodeQuantizationDeltaMap;
+		}
 	}
 
 	// video session
@@ -137,87 +299,92 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		                .pNext = video_session_create_next,
 		                .queueFamilyIndex = encode_queue_family_index,
 		                //.flags = vk::VideoSessionCreateFlagBitsKHR::eAllowEncodeParameterOptimizations,
+		                .flags = session_flags,
 		                .pVideoProfile = &video_profile,
 		                .pictureFormat = picture_format.format,
-		                .maxCodedExtent = extent,
+		                .maxCodedExtent = max_coded_extent,
 		                .referencePictureFormat = reference_picture_format.format,
 		                .maxDpbSlots = num_dpb_slots,
-		                .maxActiveReferencePictures = 1,
+		                .maxActiveReferencePictures = settings.references.max_active_references,
 		                .pStdHeaderVersion = &std_header_version,
 		        });
 
-		auto video_req = device.getVideoSessionMemoryRequirementsKHR(video_session);
-		// FIXME: allocating on a single device memory seems to fail
-#if 0
-		auto video_session_bind = std::make_shared<std::vector<vk::BindVideoSessionMemoryInfoKHR>>();
-		for (const auto & req: video_req)
-		{
-			mem_allocator.request(
-			        req.memoryRequirements,
-			        [this, video_session_bind, index = req.memoryBindIndex, size = req.memoryRequirements.size, bind_size = video_req.size()](vk::DeviceMemory mem,
-			                                                                                                                                  size_t offset) {
-				        video_session_bind->push_back({
-				                .memoryBindIndex = index,
-				                .memory = mem,
-				                .memoryOffset = offset,
-				                .memorySize = size,
-				        });
-				        if (video_session_bind->size() == bind_size)
-				        {
-					        device.bindVideoSessionMemoryKHR(video_session,
-					                                         *video_session_bind);
-				        }
-			        },
-			        vk::MemoryPropertyFlagBits::eDeviceLocal);
-		}
-#else
-		std::vector<vk::BindVideoSessionMemoryInfoKHR> video_session_bind;
-		for (const auto & req: video_req)
-		{
-			vk::MemoryAllocateInfo alloc_info{
-			        .allocationSize = req.memoryRequirements.size,
-			        .memoryTypeIndex = get_memory_type(
-			                physical_device, req.memoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal)};
-
-			const auto & mem_item = mem.emplace_back(device.allocateMemory(alloc_info));
-			video_session_bind.push_back({
-			        .memoryBindIndex = req.memoryBindIndex,
-			        .memory = mem_item,
-			        .memoryOffset = 0,
-			        .memorySize = alloc_info.allocationSize,
-			});
-		}
-		device.bindVideoSessionMemoryKHR(video_session, video_session_bind);
-#endif
+		auto session_mem = allocator->bind(video_session, vk::MemoryPropertyFlagBits::eDeviceLocal);
+		mem.insert(mem.end(), session_mem.begin(), session_mem.end());
 
 		// Output buffer
 		{
-			// very conservative bound
-			output_buffer_size = extent.width * extent.height * 3;
-			output_buffer_size = align(output_buffer_size, video_caps.minBitstreamBufferSizeAlignment);
+			size_t alignment = std::max(video_caps.minBitstreamBufferOffsetAlignment,
+			                            video_caps.minBitstreamBufferSizeAlignment);
+			output_frame_size = settings.max_frame_size;
+			if (output_frame_size == 0)
+				output_frame_size = max_coded_extent.width * max_coded_extent.height * 3 / 2;
+			output_frame_size = align(output_frame_size, alignment);
+
+			output_buffer_size = settings.output_buffer_size;
+			if (output_buffer_size == 0)
+				output_buffer_size = (size_t(settings.frames_in_flight) + settings.retained_frames + 2) * output_frame_size;
+			output_buffer_size = align(output_buffer_size, alignment);
+			if (output_buffer_size < output_frame_size)
+				throw std::runtime_error("output buffer is smaller than max_frame_size");
+
 			output_buffer = device.createBuffer(
 			        {.pNext = &video_profile_list,
 			         .size = output_buffer_size,
-			         .usage = vk::BufferUsageFlagBits::eVideoEncodeDstKHR,
+			         .usage = vk::BufferUsageFlagBits::eVideoEncodeDstKHR |
+			                  vk::BufferUsageFlagBits::eTransferSrc,
 			         .sharingMode = vk::SharingMode::eExclusive});
 
-			mem_allocator.request(
-			        device.getBufferMemoryRequirements(output_buffer),
-			        [this](vk::DeviceMemory memory, size_t offset) {
-				        device.bindBufferMemory(output_buffer, memory, offset);
-				        mapped_buffer = device.mapMemory(memory, offset, output_buffer_size);
-			        },
-			        vk::MemoryPropertyFlagBits::eHostVisible |
-			                vk::MemoryPropertyFlagBits::eHostCoherent);
+			auto output_req = device.getBufferMemoryRequirements(output_buffer);
+			readback = select_readback_mode(physical_device, output_req.memoryTypeBits);
+
+			if (readback == readback_mode::staging)
+			{
+				auto queue_families = physical_device.getQueueFamilyProperties();
+				if (not(queue_families[encode_queue_family_index].queueFlags & vk::QueueFlagBits::eTransfer))
+					throw std::runtime_error("staging readback requires transfer support on the encode queue");
+
+				mem.push_back(allocator->bind(output_buffer, vk::MemoryPropertyFlagBits::eDeviceLocal));
+
+				staging_buffer = device.createBuffer(
+				        {.size = output_buffer_size,
+				         .usage = vk::BufferUsageFlagBits::eTransferDst,
+				         .sharingMode = vk::SharingMode::eExclusive});
+			}
+			vk::Buffer readback_buffer = readback == readback_mode::staging ? staging_buffer : output_buffer;
+
+			auto readback_props = readback_memory_properties(
+			        physical_device,
+			        device.getBufferMemoryRequirements(readback_buffer).memoryTypeBits);
+			const auto & readback_mem = mem.emplace_back(allocator->bind(readback_buffer, readback_props));
+
+			// The allocator keeps non coherent allocations on separate atoms
+			non_coherent_atom_size = physical_device.getProperties().limits.nonCoherentAtomSize;
+			readback_memory = readback_mem.memory;
+			readback_memory_offset = readback_mem.offset;
+			readback_memory_size = readback_mem.size;
+			readback_coherent = bool(physical_device.getMemoryProperties()
+			                                 .memoryTypes[readback_mem.memory_type]
+			                                 .propertyFlags &
+			                         vk::MemoryPropertyFlagBits::eHostCoherent);
+			mapped_buffer = readback_mem.mapped;
 		}
 	}
 
-	mem = mem_allocator.alloc_and_bind(physical_device, device);
+	output_alignment = std::max(video_caps.minBitstreamBufferOffsetAlignment,
+	                            video_caps.minBitstreamBufferSizeAlignment);
+	output_ring.emplace(mapped_buffer, output_buffer_size, output_alignment);
 
-	// input image view
+	// input image views
+	for (auto & input: inputs)
 	{
+		// the image may have storage usage, unsupported by its format
+		vk::ImageViewUsageCreateInfo view_usage{
+		        .usage = vk::ImageUsageFlagBits::eVideoEncodeSrcKHR,
+		};
 		vk::ImageViewCreateInfo img_view_create_info{
-		        .image = input_image,
+		        .pNext = &view_usage,
+		        .image = input.image,
 		        .viewType = vk::ImageViewType::e2D,
 		        .format = picture_format.format,
 		        .components = picture_format.componentMapping,
@@ -227,7 +394,7 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		                             .baseArrayLayer = 0,
 		                             .layerCount = 1},
 		};
-		input_image_view = device.createImageView(img_view_create_info);
+		input.view = device.createImageView(img_view_create_info);
 	}
 
 	// DPB image views
@@ -273,16 +440,11 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 			        .pPictureResource = nullptr,
 			});
 		}
-
-		dpb_status = slot_info(num_dpb_slots);
 	}
 
 	// video session parameters
 	{
-		video_session_parameters = device.createVideoSessionParametersKHR({
-		        .pNext = session_params_next,
-		        .videoSession = video_session,
-		});
+		video_session_parameters = create_session_parameters(session_params_next);
 	}
 
 	// query pool
@@ -290,7 +452,7 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		vk::StructureChain query_pool_create = {
 		        vk::QueryPoolCreateInfo{
 		                .queryType = vk::QueryType::eVideoEncodeFeedbackKHR,
-		                .queryCount = 1,
+		                .queryCount = settings.frames_in_flight,
 
 		        },
 		        vk::QueryPoolVideoEncodeFeedbackCreateInfoKHR{
@@ -302,23 +464,93 @@ void video_encoder::init(vk::PhysicalDevice physical_device,
 		};
 
 		query_pool = device.createQueryPool(query_pool_create.get());
+
+		auto timestamp_bits = physical_device.getQueueFamilyProperties()[encode_queue_family_index].timestampValidBits;
+		if (timestamp_bits > 0)
+		{
+			timestamp_pool = device.createQueryPool({
+			        .queryType = vk::QueryType::eTimestamp,
+			        .queryCount = 2 * settings.frames_in_flight,
+			});
+			timestamp_mask = timestamp_bits >= 64 ? UINT64_MAX : (uint64_t(1) << timestamp_bits) - 1;
+			timestamp_period = physical_device.getProperties().limits.timestampPeriod;
+		}
 	}
 
-	// command pool and buffer
+	// command pool and command buffers for each frame in flight
 	{
 		command_pool = device.createCommandPool({
 		        .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
 		        .queueFamilyIndex = encode_queue_family_index,
 		});
 
-		command_buffer = device.allocateCommandBuffers({.commandPool = command_pool,
-		                                                .commandBufferCount = 1})[0];
+		auto command_buffers = device.allocateCommandBuffers({.commandPool = command_pool,
+		                                                      .commandBufferCount = settings.frames_in_flight});
+
+		for (uint32_t i = 0; i < settings.frames_in_flight; ++i)
+		{
+			frames.push_back({
+			        .command_buffer = command_buffers[i],
+			        .query = i,
+			});
+		}
+	}
+
+	// timeline semaphores
+	{
+		vk::StructureChain timeline_create{
+		        vk::SemaphoreCreateInfo{},
+		        vk::SemaphoreTypeCreateInfo{
+		                .semaphoreType = vk::SemaphoreType::eTimeline,
+		                .initialValue = 0,
+		        },
+		};
+		input_timeline = device.createSemaphore(timeline_create.get());
+		encode_timeline = device.createSemaphore(timeline_create.get());
 	}
 }
 
 video_encoder::~video_encoder()
 {
-	// TODO: delete stuff
+	try
+	{
+		if (frames_pending() > 0 and wait_encoded(next_ticket - 1, UINT64_MAX) != vk::Result::eSuccess)
+			std::cerr << "~video_encoder: failed to wait for pending frames" << std::endl;
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "~video_encoder: " << e.what() << std::endl;
+	}
+
+	device.destroy(query_pool);
+	device.destroy(timestamp_pool);
+	device.destroy(command_pool);
+	device.destroy(input_timeline);
+	device.destroy(encode_timeline);
+
+	device.destroy(video_session_parameters);
+	for (auto & old: retired_parameters)
+		device.destroy(old.parameters);
+	device.destroy(video_session);
+
+	for (auto & input: inputs)
+	{
+		device.destroy(input.view);
+		device.destroy(input.image);
+	}
+	for (auto & view: dpb_image_views)
+		device.destroy(view);
+	device.destroy(dpb_image);
+
+	device.destroy(output_buffer);
+	device.destroy(staging_buffer);
+
+	device.destroy(qp_map_view);
+	device.destroy(qp_map_image);
+	device.destroy(qp_map_staging);
+
+	for (auto & allocation: mem)
+		allocator->free(allocation);
 }
 
 std::vector<uint8_t> video_encoder::get_encoded_parameters(void * next)
@@ -330,8 +562,102 @@ std::vector<uint8_t> video_encoder::get_encoded_parameters(void * next)
 	return encoded;
 }
 
-std::span<uint8_t> video_encoder::encode_frame(vk::Semaphore wait_semaphore, uint32_t src_queue)
+std::optional<video_encoder::input_image> video_encoder::acquire_input_image()
 {
+	std::lock_guard lock(input_mutex);
+	input_slot * lru = nullptr;
+	for (auto & input: inputs)
+	{
+		if (not input.acquired and (not lru or input.last_use < lru->last_use))
+			lru = &input;
+	}
+	if (not lru)
+		return {};
+
+	lru->acquired = true;
+	uint64_t wait_value = lru->last_use;
+	if (wait_value and device.getSemaphoreCounterValue(encode_timeline) >= wait_value)
+		wait_value = 0;
+	return input_image{
+	        .image = lru->image,
+	        .index = uint32_t(lru - inputs.data()),
+	        .wait_value = wait_value,
+	};
+}
+
+void video_encoder::release_input_image(const input_image & input)
+{
+	std::lock_guard lock(input_mutex);
+	inputs.at(input.index).acquired = false;
+}
+
+uint64_t video_encoder::submit_frame(const input_image & input, vk::Semaphore wait_semaphore, uint64_t wait_value, uint32_t src_queue)
+{
+	auto submit_time = encode_telemetry::clock::now();
+	{
+		std::lock_guard lock(input_mutex);
+		if (input.index >= inputs.size() or not inputs[input.index].acquired)
+			throw std::runtime_error("input image was not acquired");
+	}
+	if (frames_pending() == frames.size())
+		throw std::runtime_error("too many frames in flight");
+	const input_slot & slot_input = inputs[input.index];
+
+	if (pending_extent)
+	{
+		apply_extent(*pending_extent);
+		pending_extent.reset();
+	}
+
+	// New parameter sets start a new coded video sequence
+	bool first_frame = next_ticket == 0;
+	frame_type type = frame_type::inter;
+	if (first_frame or send_parameter_sets)
+		type = frame_type::idr;
+	else if (keyframe_requested.exchange(false) or
+	         (settings.idr_period and frames_since_keyframe >= settings.idr_period))
+		type = settings.open_gop ? frame_type::intra : frame_type::idr;
+
+	// All references may have been invalidated, or decoders may have lost
+	// track of the marking
+	std::unique_lock dpb_lock(dpb_mutex);
+	if (type == frame_type::inter and not dpb_status.has_valid_reference())
+		type = settings.open_gop ? frame_type::intra : frame_type::idr;
+	if (dpb_status.idr_required())
+		type = frame_type::idr;
+
+	// Intra frames are preceded by a recovery point written by the host,
+	// and the first frame of a new extent by its parameter sets. Reserve
+	// room for them in front of the encoder output.
+	std::span<const uint8_t> prefix;
+	std::vector<uint8_t> parameter_sets;
+	if (type == frame_type::intra)
+		prefix = recovery_point_sei();
+	if (send_parameter_sets)
+	{
+		parameter_sets = get_parameter_sets();
+		prefix = parameter_sets;
+	}
+	size_t prefix_size = align(prefix.size(), output_alignment);
+
+	auto output = output_ring->allocate(output_frame_size + prefix_size);
+	if (not output)
+	{
+		if (type != frame_type::inter)
+			keyframe_requested = true;
+		throw std::runtime_error("output buffer full");
+	}
+
+	auto & frame = frames[next_ticket % frames.size()];
+	frame.ticket = next_ticket;
+	frame.output = *output;
+	frame.prefix_storage = std::move(parameter_sets);
+	frame.prefix = frame.prefix_storage.empty() ? prefix : frame.prefix_storage;
+	frame.prefix_size = prefix_size;
+	send_parameter_sets = false;
+	frame.intra = type != frame_type::inter;
+	auto & command_buffer = frame.command_buffer;
+
 	command_buffer.reset();
 	command_buffer.begin(vk::CommandBufferBeginInfo{});
 	vk::ImageMemoryBarrier2 barrier{
@@ -339,46 +665,118 @@ std::span<uint8_t> video_encoder::encode_frame(vk::Semaphore wait_semaphore, uin
 	        .srcAccessMask = vk::AccessFlagBits2::eMemoryWrite | vk::AccessFlagBits2::eMemoryRead,
 	        .dstStageMask = vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR,
 	        .dstAccessMask = vk::AccessFlagBits2::eVideoEncodeReadKHR,
-	        .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+	        .oldLayout = settings.input_layout,
 	        .newLayout = vk::ImageLayout::eVideoEncodeSrcKHR,
-	        .srcQueueFamilyIndex = src_queue,
-	        .dstQueueFamilyIndex = encode_queue_family_index,
-	        .image = input_image,
+	        .srcQueueFamilyIndex = src_queue == encode_queue_family_index ? VK_QUEUE_FAMILY_IGNORED : src_queue,
+	        .dstQueueFamilyIndex = src_queue == encode_queue_family_index ? VK_QUEUE_FAMILY_IGNORED : encode_queue_family_index,
+	        .image = slot_input.image,
 	        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
 	                             .baseMipLevel = 0,
 	                             .levelCount = 1,
 	                             .baseArrayLayer = 0,
 	                             .layerCount = 1},
 	};
-	vk::DependencyInfo dep_info{
-	        .imageMemoryBarrierCount = 1,
-	        .pImageMemoryBarriers = &barrier,
+	// Previous frames may still be executing, make their reconstructed
+	// pictures visible before they are used as reference
+	vk::MemoryBarrier2 reference_barrier{
+	        .srcStageMask = vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR,
+	        .srcAccessMask = vk::AccessFlagBits2::eVideoEncodeWriteKHR,
+	        .dstStageMask = vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR,
+	        .dstAccessMask = vk::AccessFlagBits2::eVideoEncodeReadKHR | vk::AccessFlagBits2::eVideoEncodeWriteKHR,
 	};
+	vk::DependencyInfo dep_info{};
+	dep_info.setImageMemoryBarriers(barrier);
+	if (not first_frame)
+		dep_info.setMemoryBarriers(reference_barrier);
 	command_buffer.pipelineBarrier2(dep_info);
-	command_buffer.resetQueryPool(query_pool, 0, 1);
+	command_buffer.resetQueryPool(query_pool, frame.query, 1);
+	// The first timestamp is written once previous encodes are done, the
+	// difference is the execution time of this frame even if the queue
+	// was busy when it was submitted
+	if (timestamp_pool)
+	{
+		command_buffer.resetQueryPool(timestamp_pool, 2 * frame.query, 2);
+		command_buffer.writeTimestamp2(vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR, timestamp_pool, 2 * frame.query);
+	}
+
+	// Delta maps only apply without rate control, the mode of this frame
+	// may be changed by pending_rate below
+	const bool use_qp_map = qp_map and (pending_rate ? *pending_rate : active_rate).rc_mode == rate_control::mode::cqp;
+	if (use_qp_map and qp_map_changed)
+	{
+		upload_qp_map(command_buffer, next_ticket % frames.size());
+		qp_map_changed = false;
+	}
+
+	if (type == frame_type::idr)
+		frame_num = 0;
+	if (type != frame_type::inter)
+		frames_since_keyframe = 0;
 
+	auto dpb_frame = dpb_status.add_frame(next_ticket, frame_num, type == frame_type::idr, type == frame_type::inter);
+	dpb_lock.unlock();
 	// slot: where the encoded picture will be stored in DPB
-	size_t slot = dpb_status.get_slot();
-	// ref_slot: which image to use as reference
-	auto ref_slot = dpb_status.get_ref();
-	assert(not(ref_slot and (*ref_slot == slot)));
-	dpb_status[slot] = frame_num;
+	size_t slot = dpb_frame.slot;
+
+	frame.record = {
+	        .ticket = next_ticket,
+	        .intra = type != frame_type::inter,
+	        .idr = type == frame_type::idr,
+	        .setup_slot = int32_t(slot),
+	        .references = uint32_t(dpb_frame.references.size()),
+	        .submit = submit_time,
+	};
 
 	dpb_slots[slot].slotIndex = -1;
 	dpb_slots[slot].pPictureResource = &dpb_resource[slot];
 
 	{
+		// Must match the rate control state of the session
+		rate_control_info begin_rate;
 		vk::VideoBeginCodingInfoKHR video_coding_begin_info{
 		        .videoSession = video_session,
 		        .videoSessionParameters = video_session_parameters,
 		};
+		if (not first_frame and active_rate.rc_mode != rate_control::mode::driver_default)
+		{
+			fill_rate_control_info(begin_rate, active_rate);
+			video_coding_begin_info.pNext = &begin_rate.info;
+		}
 		video_coding_begin_info.setReferenceSlots(dpb_slots);
 		command_buffer.beginVideoCodingKHR(video_coding_begin_info);
 	}
 
-	if (frame_num == 0)
+	// Reset clears the rate control state, set it again afterwards
+	{
+		vk::VideoCodingControlInfoKHR control{};
+		rate_control_info control_rate;
+		if (first_frame)
+			control.flags |= vk::VideoCodingControlFlagBitsKHR::eReset;
+		if (pending_rate)
+		{
+			active_rate = *pending_rate;
+			pending_rate.reset();
+			if (active_rate.rc_mode == rate_control::mode::cbr or active_rate.rc_mode == rate_control::mode::vbr)
+				vbv.emplace(active_rate);
+			else
+				vbv.reset();
+			control.flags |= vk::VideoCodingControlFlagBitsKHR::eEncodeRateControl;
+		}
+		else if (first_frame and active_rate.rc_mode != rate_control::mode::driver_default)
+		{
+			control.flags |= vk::VideoCodingControlFlagBitsKHR::eEncodeRateControl;
+		}
+		if (control.flags & vk::VideoCodingControlFlagBitsKHR::eEncodeRateControl)
+		{
+			fill_rate_control_info(control_rate, active_rate);
+			control.pNext = &control_rate.info;
+		}
+		if (control.flags)
+			command_buffer.controlVideoCodingKHR(control);
+	}
+
+	if (first_frame)
 	{
-		command_buffer.controlVideoCodingKHR({.flags = vk::VideoCodingControlFlagBitsKHR::eReset});
 		vk::ImageMemoryBarrier2 dpb_barrier{
 		        .srcStageMask = vk::PipelineStageFlagBits2KHR::eNone,
 		        .srcAccessMask = vk::AccessFlagBits2::eNone,
@@ -391,7 +789,7 @@ std::span<uint8_t> video_encoder::encode_frame(vk::Semaphore wait_semaphore, uin
 		                             .baseMipLevel = 0,
 		                             .levelCount = 1,
 		                             .baseArrayLayer = 0,
-		                             .layerCount = 1},
+		                             .layerCount = VK_REMAINING_ARRAY_LAYERS},
 		};
 		command_buffer.pipelineBarrier2({
 		        .imageMemoryBarrierCount = 1,
@@ -401,22 +799,74 @@ std::span<uint8_t> video_encoder::encode_frame(vk::Semaphore wait_semaphore, uin
 
 	dpb_slots[slot].slotIndex = slot;
 	vk::VideoEncodeInfoKHR encode_info{
-	        .pNext = encode_info_next(frame_num, slot, ref_slot),
+	        .pNext = encode_info_next(type, frame_num, dpb_frame),
 	        .dstBuffer = output_buffer,
-	        .dstBufferOffset = 0,
-	        .dstBufferRange = output_buffer_size,
+	        .dstBufferOffset = frame.output.offset + prefix_size,
+	        .dstBufferRange = frame.output.size - prefix_size,
 	        .srcPictureResource = {.codedExtent = extent,
 	                               .baseArrayLayer = 0,
-	                               .imageViewBinding = input_image_view},
+	                               .imageViewBinding = slot_input.view},
 	        .pSetupReferenceSlot = &dpb_slots[slot],
 	};
-	if (ref_slot)
-		encode_info.setReferenceSlots(dpb_slots[*ref_slot]);
+	std::vector<vk::VideoReferenceSlotInfoKHR> reference_slots;
+	for (size_t ref: dpb_frame.references)
+		reference_slots.push_back(dpb_slots[ref]);
+	encode_info.setReferenceSlots(reference_slots);
+	vk::VideoEncodeQuantizationMapInfoKHR qp_map_info{};
+	if (use_qp_map)
+	{
+		qp_map_info.pNext = encode_info.pNext;
+		qp_map_info.quantizationMap = qp_map_view;
+		qp_map_info.quantizationMapExtent = vk::Extent2D{qp_map->width, qp_map->height};
+		encode_info.pNext = &qp_map_info;
+		encode_info.flags |= vk::VideoEncodeFlagBitsKHR::eWithQuantizationDeltaMap;
+	}
 
-	command_buffer.beginQuery(query_pool, 0, {});
+	command_buffer.beginQuery(query_pool, frame.query, {});
 	command_buffer.encodeVideoKHR(encode_info);
-	command_buffer.endQuery(query_pool, 0);
+	command_buffer.endQuery(query_pool, frame.query);
 	command_buffer.endVideoCodingKHR(vk::VideoEndCodingInfoKHR{});
+	if (timestamp_pool)
+		command_buffer.writeTimestamp2(vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR, timestamp_pool, 2 * frame.query + 1);
+
+	if (readback == readback_mode::staging)
+	{
+		// The written range is only known on the host, copy the whole
+		// reservation and invalidate what was written on retire
+		vk::BufferMemoryBarrier2 copy_barrier{
+		        .srcStageMask = vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR,
+		        .srcAccessMask = vk::AccessFlagBits2::eVideoEncodeWriteKHR,
+		        .dstStageMask = vk::PipelineStageFlagBits2KHR::eCopy,
+		        .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+		        .buffer = output_buffer,
+		        .offset = frame.output.offset,
+		        .size = frame.output.size,
+		};
+		command_buffer.pipelineBarrier2({
+		        .bufferMemoryBarrierCount = 1,
+		        .pBufferMemoryBarriers = &copy_barrier,
+		});
+		command_buffer.copyBuffer(output_buffer,
+		                          staging_buffer,
+		                          vk::BufferCopy{
+		                                  .srcOffset = frame.output.offset,
+		                                  .dstOffset = frame.output.offset,
+		                                  .size = frame.output.size,
+		                          });
+		vk::BufferMemoryBarrier2 host_barrier{
+		        .srcStageMask = vk::PipelineStageFlagBits2KHR::eCopy,
+		        .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+		        .dstStageMask = vk::PipelineStageFlagBits2KHR::eHost,
+		        .dstAccessMask = vk::AccessFlagBits2::eHostRead,
+		        .buffer = staging_buffer,
+		        .offset = frame.output.offset,
+		        .size = frame.output.size,
+		};
+		command_buffer.pipelineBarrier2({
+		        .bufferMemoryBarrierCount = 1,
+		        .pBufferMemoryBarriers = &host_barrier,
+		});
+	}
 	command_buffer.end();
 
 	vk::SubmitInfo2 submit{};
@@ -424,33 +874,510 @@ std::span<uint8_t> video_encoder::encode_frame(vk::Semaphore wait_semaphore, uin
 	        .commandBuffer = command_buffer,
 	};
 	submit.setCommandBufferInfos(cmd_info);
-	vk::SemaphoreSubmitInfo sem_info{
+	vk::SemaphoreSubmitInfo wait_info{
 	        .semaphore = wait_semaphore,
+	        .value = wait_value,
 	        .stageMask = vk::PipelineStageFlagBits2::eVideoEncodeKHR,
 	};
-	submit.setWaitSemaphoreInfos(sem_info);
-	encode_queue.submit2(submit, fence);
+	if (wait_semaphore)
+		submit.setWaitSemaphoreInfos(wait_info);
+	vk::SemaphoreSubmitInfo signal_info{
+	        .semaphore = encode_timeline,
+	        .value = timeline_value(next_ticket),
+	        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+	};
+	submit.setSignalSemaphoreInfos(signal_info);
+	encode_queue->submit(submit, nullptr);
+	frame.record.submitted = encode_telemetry::clock::now();
 
-	if (auto res = device.waitForFences(fence, true, 1'000'000'000);
-	    res != vk::Result::eSuccess)
 	{
-		throw std::runtime_error("wait for fences: " + vk::to_string(res));
+		std::lock_guard lock(input_mutex);
+		inputs[input.index].acquired = false;
+		inputs[input.index].last_use = timeline_value(next_ticket);
 	}
 
+	++frame_num;
+	++frames_since_keyframe;
+	frame.skipped_before = std::exchange(skipped_frames, 0);
+
+	return next_ticket++;
+}
+
+video_encoder::encoded_frame video_encoder::retire_frame()
+{
+	auto & frame = frames[next_retired % frames.size()];
+
+	auto & record = frame.record;
+
+	// offset, bytes written and VkQueryResultStatusKHR
 	auto [res, feedback] = device.getQueryPoolResults<uint32_t>(query_pool,
-	                                                            0,
+	                                                            frame.query,
 	                                                            1,
 	                                                            3 * sizeof(uint32_t),
 	                                                            0,
-	                                                            vk::QueryResultFlagBits::eWait);
-	if (res != vk::Result::eSuccess)
+	                                                            vk::QueryResultFlagBits::eWait |
+	                                                                    vk::QueryResultFlagBits::eWithStatusKHR);
+	record.status = res == vk::Result::eSuccess ? int32_t(feedback[2]) : int32_t(vk::QueryResultStatusKHR::eError);
+
+	if (timestamp_pool)
 	{
-		std::cerr << "device.getQueryPoolResults: " << vk::to_string(res) << std::endl;
+		auto [ts_res, timestamps] = device.getQueryPoolResults<uint64_t>(timestamp_pool,
+		                                                                 2 * frame.query,
+		                                                                 2,
+		                                                                 2 * sizeof(uint64_t),
+		                                                                 sizeof(uint64_t),
+		                                                                 vk::QueryResultFlagBits::eWait |
+		                                                                         vk::QueryResultFlagBits::e64);
+		if (ts_res == vk::Result::eSuccess)
+			record.device_time = std::chrono::nanoseconds(
+			        uint64_t(((timestamps[1] - timestamps[0]) & timestamp_mask) * double(timestamp_period)));
 	}
 
-	device.resetFences(fence);
+	++next_retired;
 
-	++frame_num;
+	while (not retired_parameters.empty() and retired_parameters.front().first <= next_retired)
+	{
+		device.destroy(retired_parameters.front().parameters);
+		retired_parameters.erase(retired_parameters.begin());
+	}
+
+	// The buffer kept filling during the skipped frames
+	if (vbv)
+	{
+		for (uint32_t i = 0; i < frame.skipped_before; ++i)
+			vbv->add_frame(0);
+	}
+
+	if (record.failed())
+	{
+		// Nothing usable was written, and the reconstructed picture must not
+		// be referenced: handle it like a frame lost in transmission
+		record.bytes = 0;
+		record.retired = encode_telemetry::clock::now();
+		stats.add(record);
+		invalidate_frames(frame.ticket, frame.ticket);
+		return {
+		        .ticket = frame.ticket,
+		        .bitstream = output_ring->commit(frame.output, 0, 0),
+		        .info = record,
+		};
+	}
+
+	if (vbv)
+		vbv->add_frame(feedback[1]);
+	(frame.intra ? last_intra_size : last_inter_size) = feedback[1];
+
+	size_t offset = frame.prefix_size + feedback[0];
+	size_t size = feedback[1];
+
+	// Only fetch the bytes that were written from cached memory
+	if (not readback_coherent and size > 0)
+		device.invalidateMappedMemoryRanges(mapped_range(frame.output.offset + offset, size));
+
+	if (not frame.prefix.empty())
+	{
+		// Written right before the encoded data, so the frame stays contiguous
+		offset -= frame.prefix.size();
+		size += frame.prefix.size();
+		std::ranges::copy(frame.prefix, (uint8_t *)mapped_buffer + frame.output.offset + offset);
+		// Dirty cache lines must not be written back over later frames
+		if (not readback_coherent)
+			device.flushMappedMemoryRanges(mapped_range(frame.output.offset + offset, frame.prefix.size()));
+	}
+
+	record.bytes = size;
+	record.retired = encode_telemetry::clock::now();
+	stats.add(record);
+
+	return {
+	        .ticket = frame.ticket,
+	        .bitstream = output_ring->commit(frame.output, offset, size),
+	        .info = record,
+	};
+}
+
+uint32_t video_encoder::slices_for_frame(frame_type type, uint32_t max_slices) const
+{
+	size_t count = settings.slice_count;
+	if (settings.slice_size)
+	{
+		size_t last_size = type == frame_type::inter ? last_inter_size : last_intra_size;
+		count = (last_size + settings.slice_size - 1) / settings.slice_size;
+	}
+	return std::clamp<size_t>(count, 1, std::max<uint32_t>(max_slices, 1));
+}
+
+vk::MappedMemoryRange video_encoder::mapped_range(size_t offset, size_t size)
+{
+	vk::DeviceSize begin = readback_memory_offset + offset;
+	vk::DeviceSize end = begin + size;
+	begin -= begin % non_coherent_atom_size;
+	end = std::min<vk::DeviceSize>(align(end, non_coherent_atom_size),
+	                               readback_memory_offset + readback_memory_size);
+	return {
+	        .memory = readback_memory,
+	        .offset = begin,
+	        .size = end - begin,
+	};
+}
+
+vk::Result video_encoder::wait_encoded(uint64_t ticket, uint64_t timeout)
+{
+	uint64_t value = timeline_value(ticket);
+	if (timeout == 0)
+	{
+		uint64_t current = device.getSemaphoreCounterValue(encode_timeline);
+		mark_completed(current);
+		if (current >= value)
+			return vk::Result::eSuccess;
+		return vk::Result::eTimeout;
+	}
+
+	auto res = device.waitSemaphores(
+	        vk::SemaphoreWaitInfo{
+	                .semaphoreCount = 1,
+	                .pSemaphores = &encode_timeline,
+	                .pValues = &value,
+	        },
+	        timeout);
+	if (res == vk::Result::eSuccess)
+		mark_completed(value);
+	return res;
+}
+
+void video_encoder::mark_completed(uint64_t value)
+{
+	auto now = encode_telemetry::clock::now();
+	for (uint64_t ticket = next_retired; ticket < next_ticket and timeline_value(ticket) <= value; ++ticket)
+	{
+		auto & record = frames[ticket % frames.size()].record;
+		if (record.completed == encode_telemetry::clock::time_point{})
+			record.completed = now;
+	}
+}
+
+std::optional<video_encoder::encoded_frame> video_encoder::poll_frame(uint64_t timeout)
+{
+	if (frames_pending() == 0)
+		return {};
+
+	if (auto res = wait_encoded(next_retired, timeout); res != vk::Result::eSuccess)
+	{
+		if (res == vk::Result::eTimeout)
+			return {};
+		throw std::runtime_error("wait for semaphores: " + vk::to_string(res));
+	}
+
+	return retire_frame();
+}
+
+video_encoder::encoded_frame video_encoder::wait_frame()
+{
+	if (frames_pending() == 0)
+		throw std::runtime_error("no frame pending");
+
+	if (auto res = wait_encoded(next_retired, 1'000'000'000); res != vk::Result::eSuccess)
+		throw std::runtime_error("wait for semaphores: " + vk::to_string(res));
+
+	return retire_frame();
+}
+
+void video_encoder::discard_wait_semaphores(std::span<const vk::Semaphore> semaphores)
+{
+	std::vector<vk::SemaphoreSubmitInfo> wait_info;
+	for (auto semaphore: semaphores)
+	{
+		if (semaphore)
+			wait_info.push_back({
+			        .semaphore = semaphore,
+			        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+			});
+	}
+	if (wait_info.empty())
+		return;
+
+	vk::SubmitInfo2 submit{};
+	submit.setWaitSemaphoreInfos(wait_info);
+	encode_queue->submit(submit, nullptr);
+}
+
+video_encoder::encoded_frame video_encoder::encode_frame(const input_image & input, vk::Semaphore wait_semaphore, uint32_t src_queue)
+{
+	if (frames_pending() != 0)
+		throw std::runtime_error("encode_frame called with frames in flight");
+
+	submit_frame(input, wait_semaphore, src_queue);
+	return wait_frame();
+}
+
+static vk::VideoEncodeRateControlModeFlagBitsKHR to_vk(rate_control::mode mode)
+{
+	switch (mode)
+	{
+		case rate_control::mode::driver_default:
+			return vk::VideoEncodeRateControlModeFlagBitsKHR::eDefault;
+		case rate_control::mode::cbr:
+			return vk::VideoEncodeRateControlModeFlagBitsKHR::eCbr;
+		case rate_control::mode::vbr:
+			return vk::VideoEncodeRateControlModeFlagBitsKHR::eVbr;
+		case rate_control::mode::cqp:
+			return vk::VideoEncodeRateControlModeFlagBitsKHR::eDisabled;
+	}
+	throw std::runtime_error("invalid rate control mode");
+}
+
+void video_encoder::check_rate_control(const rate_control & rc)
+{
+	if (rc.rc_mode == rate_control::mode::driver_default)
+		return;
+
+	if (not(rate_control_modes & to_vk(rc.rc_mode)))
+		throw std::runtime_error("Unsupported rate control mode " + vk::to_string(to_vk(rc.rc_mode)));
+
+	if (rc.rc_mode == rate_control::mode::cqp)
+		return;
+
+	if (rc.target_bitrate == 0 or rc.framerate_num == 0 or rc.framerate_den == 0)
+		throw std::runtime_error("bitrate and frame rate must not be 0");
+	if (rc.peak_bitrate() < rc.target_bitrate)
+		throw std::runtime_error("max_bitrate must not be lower than target_bitrate");
+	if (rc.peak_bitrate() > max_bitrate)
+		throw std::runtime_error("bitrate above the maximum of " + std::to_string(max_bitrate));
+}
+
+void video_encoder::fill_rate_control_info(rate_control_info & out, const rate_control & rc)
+{
+	out.info = vk::VideoEncodeRateControlInfoKHR{
+	        .rateControlMode = to_vk(rc.rc_mode),
+	};
+
+	if (rc.rc_mode != rate_control::mode::cbr and rc.rc_mode != rate_control::mode::vbr)
+		return;
+
+	out.layer = vk::VideoEncodeRateControlLayerInfoKHR{
+	        .averageBitrate = rc.target_bitrate,
+	        .maxBitrate = rc.peak_bitrate(),
+	        .frameRateNumerator = rc.framerate_num,
+	        .frameRateDenominator = rc.framerate_den,
+	};
+	out.info.setLayers(out.layer);
+	out.info.virtualBufferSizeInMs = rc.virtual_buffer_size_ms;
+	out.info.initialVirtualBufferSizeInMs = rc.initial_virtual_buffer_size_ms;
+}
+
+void video_encoder::invalidate_frames(uint64_t first, uint64_t last)
+{
+	std::lock_guard lock(dpb_mutex);
+	dpb_status.invalidate(first, last);
+}
+
+void video_encoder::acknowledge_frame(uint64_t frame)
+{
+	std::lock_guard lock(dpb_mutex);
+	dpb_status.acknowledge(frame);
+}
+
+bool video_encoder::skip_frame()
+{
+	if (next_ticket == 0 or pending_extent or send_parameter_sets or keyframe_requested)
+		return false;
+	if (settings.idr_period and frames_since_keyframe >= settings.idr_period)
+		return false;
+	{
+		std::lock_guard lock(dpb_mutex);
+		if (dpb_status.recovering_from_loss() or not dpb_status.has_valid_reference())
+			return false;
+	}
+
+	++frames_since_keyframe;
+	++skipped_frames;
+	stats.add_skipped();
+	return true;
+}
+
+void video_encoder::set_rate_control(const rate_control & rc)
+{
+	check_rate_control(rc);
+	pending_rate = rc;
+}
+
+void video_encoder::set_extent(vk::Extent2D new_extent)
+{
+	if (new_extent.width > max_coded_extent.width or new_extent.height > max_coded_extent.height)
+		throw std::runtime_error("extent above max_extent");
+	if (new_extent.width < min_coded_extent.width or new_extent.height < min_coded_extent.height)
+		throw std::runtime_error("extent below the minimum supported extent");
+
+	if (new_extent == extent)
+		pending_extent.reset();
+	else
+		pending_extent = new_extent;
+}
+
+void video_encoder::apply_extent(vk::Extent2D new_extent)
+{
+	uint32_t id = (parameter_set_id + 1) % parameter_set_count();
+	auto parameters = update_parameters(new_extent, id);
+	if (id == 0)
+	{
+		// Entries cannot be replaced, start over with a new object
+		auto new_parameters = create_session_parameters(parameters.create_info);
+		retired_parameters.push_back({
+		        .first = next_ticket,
+		        .parameters = video_session_parameters,
+		});
+		video_session_parameters = new_parameters;
+		parameters_update_count = 0;
+	}
+	else
+	{
+		device.updateVideoSessionParametersKHR(video_session_parameters,
+		                                       vk::VideoSessionParametersUpdateInfoKHR{
+		                                               .pNext = parameters.add_info,
+		                                               .updateSequenceCount = parameters_update_count + 1,
+		                                       });
+		++parameters_update_count;
+	}
+	parameter_set_id = id;
+	extent = new_extent;
+	send_parameter_sets = true;
+
+	if (not roi.empty())
+		build_roi_map(extent);
+	else if (qp_map and not qp_map_fits(*qp_map, extent, qp_map_texel))
+		qp_map.reset();
+
+	// Pictures of the previous extent are never referenced again, the IDR
+	// frame starts from empty slots
+	for (size_t i = 0; i < dpb_slots.size(); ++i)
+	{
+		dpb_resource[i].codedExtent = extent;
+		dpb_slots[i].slotIndex = -1;
+		dpb_slots[i].pPictureResource = nullptr;
+	}
+}
+
+vk::VideoSessionParametersKHR video_encoder::create_session_parameters(void * next)
+{
+	vk::VideoEncodeQuantizationMapSessionParametersCreateInfoKHR qp_map_parameters{
+	        .pNext = next,
+	        .quantizationMapTexelSize = qp_map_texel,
+	};
+	vk::VideoSessionParametersCreateInfoKHR create_info{
+	        .pNext = next,
+	        .videoSession = video_session,
+	};
+	if (qp_map_image)
+	{
+		create_info.pNext = &qp_map_parameters;
+		create_info.flags = vk::VideoSessionParametersCreateFlagBitsKHR::eQuantizationMapCompatible;
+	}
+	return device.createVideoSessionParametersKHR(create_info);
+}
+
+void video_encoder::set_roi(std::span<const qp_region> regions)
+{
+	if (not supports_qp_map())
+		throw std::runtime_error("quantization maps are not supported");
+	roi.assign(regions.begin(), regions.end());
+	build_roi_map(frame_extent());
+}
+
+void video_encoder::build_roi_map(vk::Extent2D map_extent)
+{
+	qp_map.reset();
+	qp_map_changed = true;
+	if (roi.empty())
+		return;
+	auto map = make_delta_qp_map(map_extent.width, map_extent.height, qp_map_texel.width, qp_map_texel.height, roi);
+	map.clamp(min_qp_delta, max_qp_delta);
+	if (not map.empty())
+		qp_map = std::move(map);
+}
+
+void video_encoder::set_qp_map(delta_qp_map map)
+{
+	if (not supports_qp_map())
+		throw std::runtime_error("quantization maps are not supported");
+	if (not qp_map_fits(map, frame_extent(), qp_map_texel))
+		throw std::invalid_argument("quantization map does not match the frame extent");
+	roi.clear();
+	map.clamp(min_qp_delta, max_qp_delta);
+	qp_map.reset();
+	if (not map.empty())
+		qp_map = std::move(map);
+	qp_map_changed = true;
+}
+
+void video_encoder::upload_qp_map(vk::CommandBuffer command_buffer, size_t frame_index)
+{
+	// Staging regions are reused once the frame is retired, when its copy
+	// has executed
+	const vk::DeviceSize offset = frame_index * qp_map_staging_stride;
+	uint8_t * texels = qp_map_staging_data + offset;
+	for (size_t i = 0; i < qp_map->values.size(); ++i)
+	{
+		int32_t value = qp_map->values[i];
+		if (qp_map_texel_bytes == 1)
+			texels[i] = uint8_t(value);
+		else if (qp_map_texel_bytes == 2)
+		{
+			int16_t value16 = value;
+			std::memcpy(texels + 2 * i, &value16, 2);
+		}
+		else
+			std::memcpy(texels + 4 * i, &value, 4);
+	}
 
-	return {((uint8_t *)mapped_buffer) + feedback[0], feedback[1]};
+	// Previous frames may still read the map, its content is replaced
+	vk::ImageMemoryBarrier2 copy_barrier{
+	        .srcStageMask = vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR,
+	        .srcAccessMask = vk::AccessFlagBits2::eNone,
+	        .dstStageMask = vk::PipelineStageFlagBits2KHR::eCopy,
+	        .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+	        .oldLayout = vk::ImageLayout::eUndefined,
+	        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+	        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	        .image = qp_map_image,
+	        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+	                             .baseMipLevel = 0,
+	                             .levelCount = 1,
+	                             .baseArrayLayer = 0,
+	                             .layerCount = 1},
+	};
+	command_buffer.pipelineBarrier2({
+	        .imageMemoryBarrierCount = 1,
+	        .pImageMemoryBarriers = &copy_barrier,
+	});
+	command_buffer.copyBufferToImage(qp_map_staging,
+	                                 qp_map_image,
+	                                 vk::ImageLayout::eTransferDstOptimal,
+	                                 vk::BufferImageCopy{
+	                                         .bufferOffset = offset,
+	                                         .bufferRowLength = 0,
+	                                         .bufferImageHeight = 0,
+	                                         .imageSubresource = {.aspectMask = vk::ImageAspectFlagBits::eColor,
+	                                                              .mipLevel = 0,
+	                                                              .baseArrayLayer = 0,
+	                                                              .layerCount = 1},
+	                                         .imageOffset = {0, 0, 0},
+	                                         .imageExtent = {.width = qp_map->width, .height = qp_map->height, .depth = 1},
+	                                 });
+	vk::ImageMemoryBarrier2 encode_barrier{
+	        .srcStageMask = vk::PipelineStageFlagBits2KHR::eCopy,
+	        .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+	        .dstStageMask = vk::PipelineStageFlagBits2KHR::eVideoEncodeKHR,
+	        .dstAccessMask = vk::AccessFlagBits2::eVideoEncodeReadKHR,
+	        .oldLayout = vk::ImageLayout::eTransferDstOptimal,
+	        .newLayout = vk::ImageLayout::eVideoEncodeQuantizationMapKHR,
+	        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	        .image = qp_map_image,
+	        .subresourceRange = copy_barrier.subresourceRange,
+	};
+	command_buffer.pipelineBarrier2({
+	        .imageMemoryBarrierCount = 1,
+	        .pImageMemoryBarriers = &encode_barrier,
+	});
 }
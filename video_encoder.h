@@ -1,57 +1,310 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <span>
 #include <vector>
 
 #include <vulkan/vulkan.hpp>
 
+#include "bitstream_ring.h"
+#include "color_space.h"
+#include "encode_telemetry.h"
+#include "memory_allocator.h"
+#include "quantization_map.h"
+#include "rate_control.h"
 #include "slot_info.h"
 
+// Queue that may be shared by several encoders, possibly used from different
+// threads: submissions are serialised by its mutex
+struct submit_queue
+{
+	vk::Queue queue;
+	uint32_t family_index;
+	std::mutex mutex;
+
+	void submit(const vk::SubmitInfo2 & submit_info, vk::Fence fence)
+	{
+		std::lock_guard lock(mutex);
+		queue.submit2(submit_info, fence);
+	}
+};
+
+struct encoder_settings
+{
+	// Number of frames that can be submitted before the result of the oldest
+	// one must be retrieved with wait_frame or poll_frame
+	uint32_t frames_in_flight = 2;
+
+	// Space reserved in the output buffer for each submitted frame, 0 for the
+	// size of an uncompressed frame
+	size_t max_frame_size = 0;
+
+	// How encoded data is made available to the host
+	enum class readback_mode
+	{
+		// host_cached if the output buffer can use such memory, staging otherwise
+		automatic,
+		// output written to host cached memory, written range invalidated on retire
+		host_cached,
+		// output written to host coherent memory, which may be slow to read
+		host_coherent,
+		// output written to device local memory, then copied to a host cached buffer
+		staging,
+	};
+	readback_mode readback = readback_mode::automatic;
+
+	// Frames returned by the encoder that consumers keep while later frames
+	// are encoded, such as a muxer holding a fragment. Each pins a whole
+	// max_frame_size reservation of the output buffer until its bitstream
+	// handle is released, not only its encoded size (see bitstream_ring).
+	uint32_t retained_frames = 4;
+
+	// Size of the output buffer ring, 0 for
+	// (frames_in_flight + retained_frames + 2) * max_frame_size, the extra
+	// reservations cover wrapping and the prefixes written before keyframes.
+	// submit_frame fails with the output buffer full if consumers hold more
+	// frames than it can reserve.
+	size_t output_buffer_size = 0;
+
+	// Frames from one keyframe to the next, 0 for only the first frame.
+	// Bounds how long a decoder joining the stream waits.
+	uint32_t idr_period = 0;
+
+	// Code periodic and requested keyframes, except the first one, as intra
+	// frames preceded by a recovery point SEI instead of IDR frames
+	bool open_gop = false;
+
+	// Slices per frame, split on macroblock rows
+	uint32_t slice_count = 1;
+	// If not 0, overrides slice_count: slices are sized to stay below this
+	// many bytes, based on the size of the previous frame of the same type
+	size_t slice_size = 0;
+
+	// Initial rate control, see video_encoder::set_rate_control
+	rate_control rate;
+
+	// Short-term and long-term references kept in the DPB, and how the
+	// references of each frame are chosen among them
+	slot_info::config references;
+	slot_info::reference_policy reference_policy = slot_info::most_recent;
+
+	// Create input images with storage usage and mutable format, so that their
+	// planes can be written by compute shaders through single plane views
+	// (see rgb_to_nv12). Fails if the implementation does not allow it.
+	bool input_storage = false;
+	// Layout of input images when a frame is submitted, their content is
+	// preserved: transfer destination for copies, general for storage writes
+	vk::ImageLayout input_layout = vk::ImageLayout::eTransferDstOptimal;
+
+	// Input images in the pool, 0 for frames_in_flight + 1 so that a
+	// producer can fill one while the others are encoded
+	uint32_t input_images = 0;
+
+	// Largest extent video_encoder::set_extent accepts, 0 for the initial
+	// extent. The session, DPB, input images and output buffer are sized
+	// for it.
+	vk::Extent2D max_extent = {0, 0};
+
+	// Colour description signalled in the stream, must match how the input
+	// images were converted
+	color_matrix matrix = color_matrix::bt709;
+	color_range range = color_range::limited;
+	// H.264 only: return parameter sets written on the host instead of
+	// those of the implementation, which may omit the VUI. Its bitstream
+	// restriction tells decoders frames are never reordered, so that they
+	// output each frame as soon as it is decoded. Encoder creation fails
+	// if the implementation overrides parameters of the SPS or PPS.
+	bool host_parameter_sets = false;
+
+	// The device was created with VK_KHR_video_encode_quantization_map and
+	// its videoEncodeQuantizationMap feature: use quantization delta maps
+	// for video_encoder::set_roi when the implementation supports them.
+	bool quantization_map = false;
+};
+
 class video_encoder
 {
+	// Resources used by a single submitted frame, reused once its result has
+	// been retrieved
+	struct in_flight_frame
+	{
+		vk::CommandBuffer command_buffer;
+		uint32_t query;
+		bitstream_ring::allocation output;
+		uint64_t ticket;
+		// written by the host in the first prefix_size bytes of output,
+		// either static or in prefix_storage
+		std::span<const uint8_t> prefix;
+		std::vector<uint8_t> prefix_storage;
+		size_t prefix_size;
+		bool intra;
+		// frames skipped between the previous frame and this one
+		uint32_t skipped_before;
+		encode_telemetry::frame_record record;
+	};
+
 	vk::Device device;
-	vk::Queue encode_queue;
+	std::shared_ptr<mini_vma> allocator;
+	std::shared_ptr<submit_queue> encode_queue;
 	uint32_t encode_queue_family_index;
 
-	vk::Fence fence;
-
 	vk::VideoSessionKHR video_session;
 	vk::VideoSessionParametersKHR video_session_parameters;
+	// Parameter set ids of the current extent, and updates of
+	// video_session_parameters. When ids wrap, a new parameters object is
+	// created and the previous one is destroyed once the frames before
+	// ticket first are retired.
+	uint32_t parameter_set_id = 0;
+	uint32_t parameters_update_count = 0;
+	struct old_parameters
+	{
+		uint64_t first;
+		vk::VideoSessionParametersKHR parameters;
+	};
+	std::vector<old_parameters> retired_parameters;
 
 	vk::QueryPool query_pool;
 	vk::CommandPool command_pool;
 
-	vk::CommandBuffer command_buffer;
+	// Two timestamps per frame in flight around the encode, null if the
+	// encode queue does not support timestamps
+	vk::QueryPool timestamp_pool;
+	uint64_t timestamp_mask = 0;
+	float timestamp_period = 1;
+	encode_telemetry stats;
+
+	// Timeline semaphores: input_timeline may be signaled by producers,
+	// encode_timeline is signaled to timeline_value(ticket) when a frame is
+	// encoded. Producers cannot share encode_timeline: signals must increase
+	// at execution time, so frame N+1 could not be signaled before the
+	// encode of frame N completes.
+	vk::Semaphore input_timeline;
+	vk::Semaphore encode_timeline;
+
+	std::vector<in_flight_frame> frames;
+	// ticket of the next submitted frame and of the oldest pending one
+	uint64_t next_ticket = 0;
+	uint64_t next_retired = 0;
 
 	vk::Buffer output_buffer;
 	size_t output_buffer_size;
+	size_t output_frame_size;
+	size_t output_alignment;
+	std::optional<bitstream_ring> output_ring;
+
+	// Host visible memory holding the ring, either output_buffer or staging_buffer
+	using readback_mode = encoder_settings::readback_mode;
+	readback_mode readback;
+	vk::Buffer staging_buffer;
+	vk::DeviceMemory readback_memory;
+	vk::DeviceSize readback_memory_offset;
+	vk::DeviceSize readback_memory_size;
+	vk::DeviceSize non_coherent_atom_size;
+	bool readback_coherent;
 	void * mapped_buffer = nullptr;
 
-public:
-	vk::Image input_image;
+	// Atom aligned range of readback_memory for offset in mapped_buffer
+	vk::MappedMemoryRange mapped_range(size_t offset, size_t size);
 
-private:
-	vk::ImageView input_image_view;
+	// Pool of input images, see acquire_input_image
+	struct input_slot
+	{
+		vk::Image image;
+		vk::ImageView view;
+		bool acquired = false;
+		// encode_timeline value of the last frame reading the image, 0 if none
+		uint64_t last_use = 0;
+	};
+	// protects acquired and last_use, producers may acquire images from
+	// other threads
+	std::mutex input_mutex;
+	std::vector<input_slot> inputs;
 
-	slot_info dpb_status = slot_info(0);
+	// invalidate_frames and acknowledge_frame may be called from other threads
+	std::mutex dpb_mutex;
+	slot_info dpb_status;
 
 	vk::Image dpb_image;
 	std::vector<vk::ImageView> dpb_image_views;
 	std::vector<vk::VideoPictureResourceInfoKHR> dpb_resource;
 	std::vector<vk::VideoReferenceSlotInfoKHR> dpb_slots;
 
-	std::vector<vk::DeviceMemory> mem;
+	std::vector<mini_vma::allocation> mem;
+
+	// Quantization delta map of the next frames, see set_roi. It is written
+	// in the region of qp_map_staging of the frame, and copied to
+	// qp_map_image by the first frame using it after a change.
+	vk::Image qp_map_image;
+	vk::ImageView qp_map_view;
+	vk::Extent2D qp_map_texel;
+	// size of a texel of qp_map_image: R8, R16 or R32 SINT
+	size_t qp_map_texel_bytes = 0;
+	int32_t min_qp_delta = 0;
+	int32_t max_qp_delta = 0;
+	vk::Buffer qp_map_staging;
+	uint8_t * qp_map_staging_data = nullptr;
+	vk::DeviceSize qp_map_staging_stride = 0;
+	std::vector<qp_region> roi;
+	std::optional<delta_qp_map> qp_map;
+	bool qp_map_changed = false;
+	void build_roi_map(vk::Extent2D);
+	void upload_qp_map(vk::CommandBuffer, size_t frame_index);
+
+	// With the quantization map texel size if maps are used
+	vk::VideoSessionParametersKHR create_session_parameters(void * next);
+
+	// Rate control of the session once the last recorded command buffer
+	// executes, and changes to apply with the next frame
+	rate_control active_rate;
+	std::optional<rate_control> pending_rate;
+	vk::VideoEncodeRateControlModeFlagsKHR rate_control_modes;
+	uint64_t max_bitrate;
+	std::optional<vbv_model> vbv;
+
+	struct rate_control_info
+	{
+		vk::VideoEncodeRateControlInfoKHR info;
+		vk::VideoEncodeRateControlLayerInfoKHR layer;
+	};
+	void check_rate_control(const rate_control &);
+	static void fill_rate_control_info(rate_control_info &, const rate_control &);
+
+	readback_mode select_readback_mode(vk::PhysicalDevice physical_device,
+	                                   uint32_t output_memory_type_bits);
+	vk::MemoryPropertyFlags readback_memory_properties(vk::PhysicalDevice physical_device,
+	                                                   uint32_t memory_type_bits);
 
 	vk::VideoFormatPropertiesKHR select_video_format(
 	        vk::PhysicalDevice physical_device,
 	        const vk::PhysicalDeviceVideoFormatInfoKHR &);
 
+	// reset on IDR frames, wrapping is left to the codec
 	uint32_t frame_num = 0;
-	const vk::Extent2D extent;
+	uint32_t frames_since_keyframe = 0;
+	std::atomic<bool> keyframe_requested = false;
+	// since the last submitted frame
+	uint32_t skipped_frames = 0;
+
+	// encoded size of the last retired intra and inter frames
+	size_t last_intra_size = 0;
+	size_t last_inter_size = 0;
+	// Coded extent of the frames, changed by set_extent on the next IDR
+	// frame, which is preceded by the new parameter sets
+	vk::Extent2D extent;
+	const vk::Extent2D max_coded_extent;
+	vk::Extent2D min_coded_extent;
+	std::optional<vk::Extent2D> pending_extent;
+	bool send_parameter_sets = false;
+	void apply_extent(vk::Extent2D);
+
+	const encoder_settings settings;
 
 protected:
-	video_encoder(vk::Device device, vk::Queue encode_queue, uint32_t encode_queue_family_index, vk::Extent2D extent) :
-	        device(device), encode_queue(encode_queue), encode_queue_family_index(encode_queue_family_index), extent(extent) {}
+	video_encoder(vk::Device device, std::shared_ptr<mini_vma> allocator, std::shared_ptr<submit_queue> encode_queue, vk::Extent2D extent, const encoder_settings & settings) :
+	        device(device), allocator(std::move(allocator)), encode_queue(std::move(encode_queue)), encode_queue_family_index(this->encode_queue->family_index), extent(extent), max_coded_extent(settings.max_extent.width ? settings.max_extent : extent), settings(settings) {}
 
 	void init(vk::PhysicalDevice physical_device,
 	          const vk::VideoCapabilitiesKHR & video_caps,
@@ -60,15 +313,264 @@ protected:
 		  void *video_session_create_next,
 	          void * session_params_next);
 
-	virtual ~video_encoder();
-
 	std::vector<uint8_t> get_encoded_parameters(void * next);
+	// Also returns the codec specific feedback, which tells whether the
+	// implementation overrides parameters of the sets it was given
+	template <typename Feedback>
+	std::pair<Feedback, std::vector<uint8_t>> get_encoded_parameters(void * next)
+	{
+		auto [feedback, encoded] = device.getEncodedVideoSessionParametersKHR<vk::VideoEncodeSessionParametersFeedbackInfoKHR, Feedback>({
+		        .pNext = next,
+		        .videoSessionParameters = video_session_parameters,
+		});
+		return {feedback.template get<Feedback>(), std::move(encoded)};
+	}
 
 	virtual std::vector<void *> setup_slot_info(size_t dpb_size) = 0;
-	virtual void * encode_info_next(uint32_t frame_num, size_t slot, std::optional<size_t> ref) = 0;
+	enum class frame_type
+	{
+		idr,
+		// intra frame that does not reset references
+		intra,
+		inter,
+	};
+
+	// frame_num is not wrapped, dpb describes the setup slot, references and
+	// marking of the frame
+	virtual void * encode_info_next(frame_type type, uint32_t frame_num, const slot_info::frame_info & dpb) = 0;
 	virtual vk::ExtensionProperties std_header_version() = 0;
+	// Complete NAL unit, with start code, written before intra frames
+	virtual std::span<const uint8_t> recovery_point_sei() = 0;
+
+	// Parameter sets for frames of extent, with id as parameter set ids.
+	// add_info is chained to vk::VideoSessionParametersUpdateInfoKHR,
+	// create_info to vk::VideoSessionParametersCreateInfoKHR when the ids
+	// wrap to 0 and a new parameters object is needed. Both must stay
+	// valid until the next call.
+	struct parameters_info
+	{
+		void * add_info;
+		void * create_info;
+	};
+	virtual parameters_info update_parameters(vk::Extent2D extent, uint32_t id) = 0;
+	// Number of ids update_parameters cycles through, the maximum number of
+	// parameter sets of a session parameters object
+	virtual uint32_t parameter_set_count() const = 0;
+
+	// Quantization map capabilities of the profile, set by the codec before
+	// init when encoder_settings::quantization_map is set
+	struct quantization_map_caps
+	{
+		vk::Extent2D max_extent;
+		int32_t min_qp_delta;
+		int32_t max_qp_delta;
+	};
+	std::optional<quantization_map_caps> qp_map_caps;
+
+	// Number of slices for a frame, between 1 and max_slices
+	uint32_t slices_for_frame(frame_type type, uint32_t max_slices) const;
+
+	// Rate control in effect for the frame being recorded
+	const rate_control & rate() const
+	{
+		return active_rate;
+	}
 
 public:
-	std::span<uint8_t> encode_frame(vk::Semaphore wait_semaphore, uint32_t src_queue);
+	// Waits for pending frames and releases all resources
+	virtual ~video_encoder();
+
+	struct encoded_frame
+	{
+		uint64_t ticket;
+		// Points into the mapped output buffer, the region is not reused until
+		// all copies of the handle are destroyed. Handles must not outlive
+		// the encoder.
+		bitstream_ring::region bitstream;
+		// Timings, size and status of the encode. The bitstream is empty if
+		// it failed, the frame is then invalidated as if it was lost.
+		encode_telemetry::frame_record info;
+	};
+
+	// Input image held by a producer, from acquire_input_image until it is
+	// given back with submit_frame or release_input_image
+	struct input_image
+	{
+		vk::Image image;
+		uint32_t index;
+		// The producer must wait for encode_semaphore() to reach this value
+		// before writing to image, 0 if no pending encode reads it
+		uint64_t wait_value;
+	};
+
+	// Take the least recently used image of the pool, nothing if all are
+	// held by producers. Its content is undefined: it is written with an
+	// undefined old layout, which also needs no ownership transfer back
+	// from the encode queue family. Can be called from any thread.
+	std::optional<input_image> acquire_input_image();
+	// Give back an image that will not be submitted
+	void release_input_image(const input_image &);
+	size_t input_image_count() const
+	{
+		return inputs.size();
+	}
+
+	// Records and submits the encode of an acquired input image, returns
+	// immediately; the image goes back to the pool. The encode waits for
+	// wait_semaphore, a timeline semaphore if wait_value is not 0, a binary
+	// one otherwise. Ownership of the image is acquired from src_queue if
+	// it is not the encode queue family, the producer must release it.
+	// Throws if frames_in_flight frames are already pending or if the output
+	// buffer is full, the image is then still held by the producer.
+	uint64_t submit_frame(const input_image &, vk::Semaphore wait_semaphore, uint64_t wait_value, uint32_t src_queue);
+	uint64_t submit_frame(const input_image & input, vk::Semaphore wait_semaphore, uint32_t src_queue)
+	{
+		return submit_frame(input, wait_semaphore, 0, src_queue);
+	}
+	// Waits for input_semaphore() to reach timeline_value(next_frame())
+	uint64_t submit_frame(const input_image & input, uint32_t src_queue)
+	{
+		return submit_frame(input, input_timeline, timeline_value(next_ticket), src_queue);
+	}
+
+	// Timeline semaphore producers may signal when the input image is ready.
+	// Any increasing sequence of values can be used with submit_frame.
+	vk::Semaphore input_semaphore() const
+	{
+		return input_timeline;
+	}
+	// Reaches timeline_value(ticket) once the frame is encoded, other queues
+	// may wait on it
+	vk::Semaphore encode_semaphore() const
+	{
+		return encode_timeline;
+	}
+	static uint64_t timeline_value(uint64_t ticket)
+	{
+		return ticket + 1;
+	}
+	// Ticket of the next submitted frame
+	uint64_t next_frame() const
+	{
+		return next_ticket;
+	}
+
+	// Retrieve the oldest pending frame, in submission order. poll_frame
+	// waits at most timeout nanoseconds for it to complete.
+	std::optional<encoded_frame> poll_frame(uint64_t timeout = 0);
+	encoded_frame wait_frame();
+
+	// Wait on binary semaphores of frames that will not be encoded, so that
+	// they are unsignaled and can be reused by the producer. Timeline waits
+	// need no such cleanup.
+	void discard_wait_semaphores(std::span<const vk::Semaphore> semaphores);
+
+	// Aggregated timings, sizes and failures of the retired frames, can be
+	// called from any thread
+	encode_telemetry::snapshot telemetry() const
+	{
+		return stats.read();
+	}
+
+	size_t frames_pending() const
+	{
+		return next_ticket - next_retired;
+	}
+
+	size_t max_frames_in_flight() const
+	{
+		return frames.size();
+	}
+
+	// Encode the next submitted frame as a keyframe, for decoders joining the
+	// stream or recovering from losses. Can be called from any thread.
+	void request_keyframe()
+	{
+		keyframe_requested = true;
+	}
+
+	// The input did not change since the last submitted frame, see
+	// damage_detector: nothing is encoded and decoders keep showing that
+	// frame. Call once per skipped frame interval, so that idr_period and
+	// the buffer model still count frame intervals. Returns false, and the
+	// frame must be submitted, when it has to be encoded anyway: first
+	// frame, keyframe requested or due, new extent, or recovery from
+	// losses. Must not be called concurrently with submit_frame.
+	bool skip_frame();
+
+	// Recover from losses without a keyframe, frames are identified by the
+	// ticket returned by submit_frame. Frames first to last were lost: the
+	// next frames are predicted from the most recent references that do not
+	// depend on them, acknowledged ones if there are any. The next frame is a
+	// keyframe if no reference is left. Can be called from any thread.
+	void invalidate_frames(uint64_t first, uint64_t last);
+	// The receiver decoded this frame, and the frames it depends on
+	void acknowledge_frame(uint64_t frame);
+
+	// Change the rate control from the next submitted frame on, without
+	// resetting the session. Throws if the mode is not supported.
+	void set_rate_control(const rate_control &);
+
+	// Change the coded extent from the next submitted frame on, without
+	// recreating the session: new parameter sets are added to the session
+	// parameters and written before the frame, which is an IDR frame. The
+	// producer draws in the top left corner of the input images. Combine
+	// with set_rate_control to adapt the bitrate on the same frame. Throws
+	// if extent is above max_extent() or below what the implementation
+	// supports.
+	void set_extent(vk::Extent2D extent);
+	// Extent of the next submitted frame
+	vk::Extent2D frame_extent() const
+	{
+		return pending_extent.value_or(extent);
+	}
+	vk::Extent2D max_extent() const
+	{
+		return max_coded_extent;
+	}
+
+	// Region of interest coding: the QP of each block is offset by a
+	// quantization delta map. Implementations only take delta maps without
+	// rate control, so it applies to frames using rate_control::mode::cqp
+	// and is ignored in other modes.
+	bool supports_qp_map() const
+	{
+		return bool(qp_map_image);
+	}
+	// Size in pixels of a map texel
+	vk::Extent2D qp_map_texel_size() const
+	{
+		return qp_map_texel;
+	}
+	// Offsets regions from the next submitted frame on, see
+	// delta_qp_map::add for overlaps. Values are clamped to what the
+	// implementation supports. The map is rebuilt by set_extent, an empty
+	// span removes it. Throws if maps are not supported.
+	void set_roi(std::span<const qp_region> regions);
+	// Explicit map for frame_extent(), with qp_map_texel_size() texels.
+	// Removed by set_extent, unless the new extent has the same map size.
+	void set_qp_map(delta_qp_map map);
+
+	// Decoder buffer model fed with the sizes of retired frames, empty
+	// unless the rate control mode is cbr or vbr
+	const std::optional<vbv_model> & buffer_model() const
+	{
+		return vbv;
+	}
+
+	// Parameter sets of the stream with start codes, to write before the
+	// first frame. Those of later extents are in front of the first frame
+	// using them.
+	virtual std::vector<uint8_t> get_parameter_sets() = 0;
+
+	// Synchronous encode, must not be mixed with submit_frame
+	encoded_frame encode_frame(const input_image &, vk::Semaphore wait_semaphore, uint32_t src_queue);
+
+private:
+	vk::Result wait_encoded(uint64_t ticket, uint64_t timeout);
+	// Record the completion time of pending frames, once encode_timeline
+	// has reached value
+	void mark_completed(uint64_t value);
+	encoded_frame retire_frame();
 };
 
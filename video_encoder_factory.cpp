@@ -0,0 +1,57 @@
+#include "video_encoder_factory.h"
+
+#include <stdexcept>
+
+#include "video_encoder_h264.h"
+#include "video_encoder_h265.h"
+
+std::optional<video_codec> parse_video_codec(std::string_view name)
+{
+	if (name == "h264" or name == "avc")
+		return video_codec::h264;
+	if (name == "h265" or name == "hevc")
+		return video_codec::h265;
+	return {};
+}
+
+const char * to_string(video_codec codec)
+{
+	switch (codec)
+	{
+		case video_codec::h264:
+			return "h264";
+		case video_codec::h265:
+			return "h265";
+	}
+	throw std::invalid_argument("invalid codec");
+}
+
+const char * encode_extension_name(video_codec codec)
+{
+	switch (codec)
+	{
+		case video_codec::h264:
+			return VK_KHR_VIDEO_ENCODE_H264_EXTENSION_NAME;
+		case video_codec::h265:
+			return VK_KHR_VIDEO_ENCODE_H265_EXTENSION_NAME;
+	}
+	throw std::invalid_argument("invalid codec");
+}
+
+std::unique_ptr<video_encoder> create_video_encoder(video_codec codec,
+                                                    vk::PhysicalDevice physical_device,
+                                                    vk::Device device,
+                                                    std::shared_ptr<mini_vma> allocator,
+                                                    std::shared_ptr<submit_queue> encode_queue,
+                                                    const vk::Extent2D & extent,
+                                                    const encoder_settings & settings)
+{
+	switch (codec)
+	{
+		case video_codec::h264:
+			return video_encoder_h264::create(physical_device, device, std::move(allocator), std::move(encode_queue), extent, settings);
+		case video_codec::h265:
+			return video_encoder_h265::create(physical_device, device, std::move(allocator), std::move(encode_queue), extent, settings);
+	}
+	throw std::invalid_argument("invalid codec");
+}
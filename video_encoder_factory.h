@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string_view>
+
+#include <vulkan/vulkan.hpp>
+
+#include "video_encoder.h"
+
+enum class video_codec
+{
+	h264,
+	h265,
+};
+
+// "h264" or "h265", also accepts "avc" and "hevc"
+std::optional<video_codec> parse_video_codec(std::string_view name);
+const char * to_string(video_codec);
+
+// Device extension required to encode the codec
+const char * encode_extension_name(video_codec);
+
+std::unique_ptr<video_encoder> create_video_encoder(video_codec codec,
+                                                    vk::PhysicalDevice physical_device,
+                                                    vk::Device device,
+                                                    std::shared_ptr<mini_vma> allocator,
+                                                    std::shared_ptr<submit_queue> encode_queue,
+                                                    const vk::Extent2D & extent,
+                                                    const encoder_settings & settings = {});
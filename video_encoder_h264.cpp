@@ -1,7 +1,20 @@
 #include "video_encoder_h264.h"
 
-video_encoder_h264::video_encoder_h264(vk::Device device, vk::Queue encode_queue, uint32_t encode_queue_family_index, vk::Extent2D extent) :
-        video_encoder(device, encode_queue, encode_queue_family_index, extent),
+#include "h264_parameter_sets.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+video_encoder_h264::video_encoder_h264(vk::Device device, std::shared_ptr<mini_vma> allocator, std::shared_ptr<submit_queue> encode_queue, vk::Extent2D extent, const encoder_settings & settings) :
+        video_encoder(device, std::move(allocator), std::move(encode_queue), extent, settings),
+        vui(make_h264_low_latency_vui({
+                .framerate_num = settings.rate.framerate_num,
+                .framerate_den = settings.rate.framerate_den,
+                .matrix = settings.matrix,
+                .range = settings.range,
+                .max_num_ref_frames = settings.references.max_references(),
+        })),
         sps{
                 .flags =
                         {
@@ -18,9 +31,9 @@ video_encoder_h264::video_encoder_h264(vk::Device device, vk::Queue encode_queue
                                 .separate_colour_plane_flag = 0,
                                 .gaps_in_frame_num_value_allowed_flag = 1,
                                 .qpprime_y_zero_transform_bypass_flag = 0,
-                                .frame_cropping_flag = (extent.width % 16 ) || (extent.height) % 16,
+                                .frame_cropping_flag = 0,
                                 .seq_scaling_matrix_present_flag = 0,
-                                .vui_parameters_present_flag = 0,
+                                .vui_parameters_present_flag = 1,
                         },
                 .profile_idc = STD_VIDEO_H264_PROFILE_IDC_MAIN,
                 .level_idc = STD_VIDEO_H264_LEVEL_IDC_5_0,
@@ -34,18 +47,18 @@ video_encoder_h264::video_encoder_h264(vk::Device device, vk::Queue encode_queue
                 .offset_for_top_to_bottom_field = 0,
                 .log2_max_pic_order_cnt_lsb_minus4 = 0,
                 .num_ref_frames_in_pic_order_cnt_cycle = 0,
-                .max_num_ref_frames = 1,
+                .max_num_ref_frames = uint8_t(settings.references.max_references()),
                 .reserved1 = 0,
-                .pic_width_in_mbs_minus1 = (extent.width - 1) / 16,
-                .pic_height_in_map_units_minus1 = (extent.height - 1) / 16,
+                .pic_width_in_mbs_minus1 = 0,
+                .pic_height_in_map_units_minus1 = 0,
                 .frame_crop_left_offset = 0,
-                .frame_crop_right_offset = (extent.width % 16) / 2,
+                .frame_crop_right_offset = 0,
                 .frame_crop_top_offset = 0,
-                .frame_crop_bottom_offset = (extent.height % 16) / 2,
+                .frame_crop_bottom_offset = 0,
                 .reserved2 = 0,
                 .pOffsetForRefFrame = nullptr,
                 .pScalingLists = nullptr,
-                .pSequenceParameterSetVui = nullptr,
+                .pSequenceParameterSetVui = &vui,
         },
         pps{
                 .flags =
@@ -69,8 +82,21 @@ video_encoder_h264::video_encoder_h264(vk::Device device, vk::Queue encode_queue
                 .chroma_qp_index_offset = 0,
                 .second_chroma_qp_index_offset = 0,
                 .pScalingLists = nullptr,
-        }
-{}
+        },
+        host_parameter_sets(settings.host_parameter_sets)
+{
+	set_coded_extent(extent);
+}
+
+void video_encoder_h264::set_coded_extent(vk::Extent2D extent)
+{
+	sps.flags.frame_cropping_flag = (extent.width % 16) || (extent.height % 16);
+	sps.pic_width_in_mbs_minus1 = (extent.width - 1) / 16;
+	sps.pic_height_in_map_units_minus1 = (extent.height - 1) / 16;
+	// in chroma samples, from the padded macroblock size
+	sps.frame_crop_right_offset = (16 * (sps.pic_width_in_mbs_minus1 + 1) - extent.width) / 2;
+	sps.frame_crop_bottom_offset = (16 * (sps.pic_height_in_map_units_minus1 + 1) - extent.height) / 2;
+}
 
 std::vector<void *> video_encoder_h264::setup_slot_info(size_t dpb_size)
 {
@@ -91,11 +117,12 @@ std::vector<void *> video_encoder_h264::setup_slot_info(size_t dpb_size)
 std::unique_ptr<video_encoder_h264> video_encoder_h264::create(
         vk::PhysicalDevice physical_device,
         vk::Device device,
-        vk::Queue encode_queue,
-        uint32_t encode_queue_family_index,
-        const vk::Extent2D & extent)
+        std::shared_ptr<mini_vma> allocator,
+        std::shared_ptr<submit_queue> encode_queue,
+        const vk::Extent2D & extent,
+        const encoder_settings & settings)
 {
-	std::unique_ptr<video_encoder_h264> self(new video_encoder_h264(device, encode_queue, encode_queue_family_index, extent));
+	std::unique_ptr<video_encoder_h264> self(new video_encoder_h264(device, std::move(allocator), std::move(encode_queue), extent, settings));
 
 	vk::StructureChain video_profile_info{
 	        vk::VideoProfileInfoKHR{
@@ -114,14 +141,15 @@ std::unique_ptr<video_encoder_h264> video_encoder_h264::create(
 	                .tuningMode = vk::VideoEncodeTuningModeKHR::eUltraLowLatency,
 	        }};
 
-	vk::VideoEncodeH264SessionParametersAddInfoKHR h264_add_info{};
-	h264_add_info.setStdSPSs(self->sps);
-	h264_add_info.setStdPPSs(self->pps);
+	self->add_info = vk::VideoEncodeH264SessionParametersAddInfoKHR{};
+	self->add_info.setStdSPSs(self->sps);
+	self->add_info.setStdPPSs(self->pps);
 
-	vk::VideoEncodeH264SessionParametersCreateInfoKHR h264_session_params{
-	        .maxStdSPSCount = 1,
-	        .maxStdPPSCount = 1,
-	        .pParametersAddInfo = &h264_add_info,
+	// Room for the parameter sets of later extents
+	self->session_params = vk::VideoEncodeH264SessionParametersCreateInfoKHR{
+	        .maxStdSPSCount = self->parameter_set_count(),
+	        .maxStdPPSCount = self->parameter_set_count(),
+	        .pParametersAddInfo = &self->add_info,
 	};
 
 	auto [video_caps, encode_caps, encode_h264_caps] =
@@ -130,11 +158,39 @@ std::unique_ptr<video_encoder_h264> video_encoder_h264::create(
 	                vk::VideoEncodeCapabilitiesKHR,
 	                vk::VideoEncodeH264CapabilitiesKHR>(video_profile_info.get());
 
+	// Only queried when the extension is enabled
+	if (settings.quantization_map)
+	{
+		auto qp_caps = physical_device.getVideoCapabilitiesKHR<
+		        vk::VideoCapabilitiesKHR,
+		        vk::VideoEncodeCapabilitiesKHR,
+		        vk::VideoEncodeH264CapabilitiesKHR,
+		        vk::VideoEncodeQuantizationMapCapabilitiesKHR,
+		        vk::VideoEncodeH264QuantizationMapCapabilitiesKHR>(video_profile_info.get());
+		self->qp_map_caps = quantization_map_caps{
+		        .max_extent = qp_caps.get<vk::VideoEncodeQuantizationMapCapabilitiesKHR>().maxQuantizationMapExtent,
+		        .min_qp_delta = qp_caps.get<vk::VideoEncodeH264QuantizationMapCapabilitiesKHR>().minQpDelta,
+		        .max_qp_delta = qp_caps.get<vk::VideoEncodeH264QuantizationMapCapabilitiesKHR>().maxQpDelta,
+		};
+	}
+
 	vk::VideoEncodeH264SessionCreateInfoKHR session_create_info{
                 .useMaxLevelIdc = false,
         };
 
-	self->init(physical_device, video_caps, encode_caps, video_profile_info.get(), &session_create_info, &h264_session_params);
+	if (settings.references.max_active_references > encode_h264_caps.maxPPictureL0ReferenceCount)
+		throw std::runtime_error("too many active references for P frames");
+
+	self->max_slice_count = std::max(encode_h264_caps.maxSliceCount, 1u);
+	self->min_qp = encode_h264_caps.minQp;
+	self->max_qp = encode_h264_caps.maxQp;
+
+	self->init(physical_device, video_caps, encode_caps, video_profile_info.get(), &session_create_info, &self->session_params);
+
+	// Fail now rather than on the first keyframe if the host cannot write
+	// the parameter sets
+	if (self->host_parameter_sets)
+		self->get_sps_pps();
 
 	return self;
 }
@@ -144,52 +200,133 @@ std::vector<uint8_t> video_encoder_h264::get_sps_pps()
 	vk::VideoEncodeH264SessionParametersGetInfoKHR next{
 	        .writeStdSPS = true,
 	        .writeStdPPS = true,
+	        .stdSPSId = sps.seq_parameter_set_id,
+	        .stdPPSId = pps.pic_parameter_set_id,
+	};
+	auto [feedback, encoded] = get_encoded_parameters<vk::VideoEncodeH264SessionParametersFeedbackInfoKHR>(&next);
+	if (not host_parameter_sets)
+		return encoded;
+
+	// Parameter sets written on the host only match the slices if the
+	// implementation did not override any parameter (entropy coding,
+	// transform size, frame_num length...)
+	if (feedback.hasStdSPSOverrides or feedback.hasStdPPSOverrides)
+		throw std::runtime_error("the implementation overrides SPS or PPS parameters, they cannot be written on the host");
+
+	auto res = write_h264_sps(sps);
+	auto pps_nal = write_h264_pps(pps);
+	res.insert(res.end(), pps_nal.begin(), pps_nal.end());
+	return res;
+}
+
+video_encoder::parameters_info video_encoder_h264::update_parameters(vk::Extent2D extent, uint32_t id)
+{
+	set_coded_extent(extent);
+	sps.seq_parameter_set_id = id;
+	pps.seq_parameter_set_id = id;
+	pps.pic_parameter_set_id = id;
+	// add_info already points to sps and pps
+	return {
+	        .add_info = &add_info,
+	        .create_info = &session_params,
 	};
-	return get_encoded_parameters(&next);
 }
 
-void * video_encoder_h264::encode_info_next(uint32_t frame_num, size_t slot, std::optional<size_t> ref)
+void * video_encoder_h264::encode_info_next(frame_type type, uint32_t frame_num, const slot_info::frame_info & dpb)
 {
-	slice_header = {
+	// POC type 2: only used by the implementation to order references,
+	// decoders derive it from FrameNumOffset + frame_num, which does not
+	// wrap with frame_num
+	int32_t poc = (2 * frame_num) & INT32_MAX;
+	// frame_num wraps, short-term references are much less than
+	// MaxFrameNum frames old so their PicNum stay unambiguous
+	frame_num &= (1u << (sps.log2_max_frame_num_minus4 + 4)) - 1;
+
+	const int32_t init_qp = 26 + pps.pic_init_qp_minus26;
+	int32_t qp = init_qp;
+	bool cqp = rate().rc_mode == rate_control::mode::cqp;
+	if (cqp)
+		qp = std::clamp(type == frame_type::inter ? rate().qp_p : rate().qp_i, min_qp, max_qp);
+
+	// Slices cover whole macroblock rows, the implementation may move the
+	// boundaries but keeps the count
+	const uint32_t mb_width = sps.pic_width_in_mbs_minus1 + 1;
+	const uint32_t mb_rows = sps.pic_height_in_map_units_minus1 + 1;
+	const uint32_t slice_count = slices_for_frame(type, std::min(max_slice_count, mb_rows));
+	slice_headers.resize(slice_count);
+	nalu_slices.resize(slice_count);
+
+	slice_headers[0] = {
 	        .flags =
 	                {
 	                        .direct_spatial_mv_pred_flag = 0, //?
-	                        .num_ref_idx_active_override_flag = 0,
+	                        // the PPS default is a single reference
+	                        .num_ref_idx_active_override_flag = dpb.references.size() > 1,
 	                        .reserved = 0,
 	                },
 	        .first_mb_in_slice = 0,
-	        .slice_type = ref ? STD_VIDEO_H264_SLICE_TYPE_P
-	                          : STD_VIDEO_H264_SLICE_TYPE_I,
+	        .slice_type = type == frame_type::inter ? STD_VIDEO_H264_SLICE_TYPE_P
+	                                                : STD_VIDEO_H264_SLICE_TYPE_I,
 	        .slice_alpha_c0_offset_div2 = 0,
 	        .slice_beta_offset_div2 = 0,
-	        .slice_qp_delta = 0,
+	        .slice_qp_delta = int8_t(qp - init_qp),
 	        .reserved1 = 0,
 	        .cabac_init_idc = STD_VIDEO_H264_CABAC_INIT_IDC_0,
 	        .disable_deblocking_filter_idc =
 	                STD_VIDEO_H264_DISABLE_DEBLOCKING_FILTER_IDC_DISABLED,
 	        .pWeightTable = nullptr,
 	};
-	nalu_slice_info = vk::VideoEncodeH264NaluSliceInfoKHR{
-	        .pStdSliceHeader = &slice_header,
-	};
+	for (uint32_t i = 0; i < slice_count; ++i)
+	{
+		slice_headers[i] = slice_headers[0];
+		slice_headers[i].first_mb_in_slice = (i * mb_rows / slice_count) * mb_width;
+		nalu_slices[i] = vk::VideoEncodeH264NaluSliceInfoKHR{
+		        // must be 0 unless rate control is disabled
+		        .constantQp = cqp ? qp : 0,
+		        .pStdSliceHeader = &slice_headers[i],
+		};
+	}
+	ref_list0_modifications.clear();
+	for (const auto & mod: dpb.list_modifications)
+	{
+		ref_list0_modifications.push_back({
+		        .modification_of_pic_nums_idc = StdVideoH264ModificationOfPicNumsIdc(mod.op),
+		        .abs_diff_pic_num_minus1 = uint16_t(mod.op == slot_info::list_modification::long_term ? 0 : mod.value),
+		        .long_term_pic_num = uint16_t(mod.op == slot_info::list_modification::long_term ? mod.value : 0),
+		});
+	}
+
+	ref_pic_marking.clear();
+	for (const auto & op: dpb.marking)
+	{
+		using enum slot_info::marking_operation::op_type;
+		ref_pic_marking.push_back({
+		        .memory_management_control_operation = StdVideoH264MemMgmtControlOp(op.op),
+		        .difference_of_pic_nums_minus1 = uint16_t(op.op == unmark_short_term ? op.value : 0),
+		        .long_term_pic_num = uint16_t(op.op == unmark_long_term ? op.value : 0),
+		        .long_term_frame_idx = uint16_t(op.op == mark_current_long_term ? op.value : 0),
+		        .max_long_term_frame_idx_plus1 = uint16_t(op.op == max_long_term_idx ? op.value : 0),
+		});
+	}
+
 	reference_lists_info = {
 	        .flags =
 	                {
-	                        .ref_pic_list_modification_flag_l0 = 0,
+	                        .ref_pic_list_modification_flag_l0 = not ref_list0_modifications.empty(),
 	                        .ref_pic_list_modification_flag_l1 = 0,
 	                        .reserved = 0,
 	                },
-	        .num_ref_idx_l0_active_minus1 = 0,
+	        .num_ref_idx_l0_active_minus1 = uint8_t(dpb.references.empty() ? 0 : dpb.references.size() - 1),
 	        .num_ref_idx_l1_active_minus1 = 0,
 	        .RefPicList0 = {},
 	        .RefPicList1 = {},
-	        .refList0ModOpCount = 0,
+	        .refList0ModOpCount = uint8_t(ref_list0_modifications.size()),
 	        .refList1ModOpCount = 0,
-	        .refPicMarkingOpCount = 0,
+	        .refPicMarkingOpCount = uint8_t(ref_pic_marking.size()),
 	        .reserved1 = {},
-	        .pRefList0ModOperations = nullptr,
+	        .pRefList0ModOperations = ref_list0_modifications.data(),
 	        .pRefList1ModOperations = nullptr,
-	        .pRefPicMarkingOperations = nullptr,
+	        .pRefPicMarkingOperations = ref_pic_marking.data(),
 	};
 	std::fill(reference_lists_info.RefPicList0,
 	          reference_lists_info.RefPicList0 + sizeof(reference_lists_info.RefPicList0),
@@ -197,47 +334,68 @@ void * video_encoder_h264::encode_info_next(uint32_t frame_num, size_t slot, std
 	std::fill(reference_lists_info.RefPicList1,
 	          reference_lists_info.RefPicList1 + sizeof(reference_lists_info.RefPicList1),
 	          STD_VIDEO_H264_NO_REFERENCE_PICTURE);
-	if (ref)
-	{
-		reference_lists_info.RefPicList0[0] = *ref;
-	}
+	for (size_t i = 0; i < dpb.references.size(); ++i)
+		reference_lists_info.RefPicList0[i] = dpb.references[i];
 
 	std_picture_info = {
 	        .flags =
 	                {
-	                        .IdrPicFlag = uint32_t(ref ? 0 : 1),
+	                        .IdrPicFlag = uint32_t(type == frame_type::idr ? 1 : 0),
 	                        .is_reference = 1,
 	                        .no_output_of_prior_pics_flag = 0,
-	                        .long_term_reference_flag = 0,
-	                        .adaptive_ref_pic_marking_mode_flag = 0,
+	                        .long_term_reference_flag = type == frame_type::idr and dpb.long_term_idx,
+	                        .adaptive_ref_pic_marking_mode_flag = not ref_pic_marking.empty(),
 	                        .reserved = 0,
 	                },
-	        .seq_parameter_set_id = 0,
-	        .pic_parameter_set_id = 0,
+	        .seq_parameter_set_id = sps.seq_parameter_set_id,
+	        .pic_parameter_set_id = pps.pic_parameter_set_id,
 	        .idr_pic_id = idr_id,
-	        .primary_pic_type = ref ? STD_VIDEO_H264_PICTURE_TYPE_P
-	                                : STD_VIDEO_H264_PICTURE_TYPE_IDR,
+	        .primary_pic_type = type == frame_type::idr     ? STD_VIDEO_H264_PICTURE_TYPE_IDR
+	                            : type == frame_type::intra ? STD_VIDEO_H264_PICTURE_TYPE_I
+	                                                        : STD_VIDEO_H264_PICTURE_TYPE_P,
 	        .frame_num = frame_num,
-	        .PicOrderCnt = 0,
+	        .PicOrderCnt = poc,
 	        .temporal_id = 0,
 	        .reserved1 = {},
 	        .pRefLists = &reference_lists_info,
 	};
 	picture_info = vk::VideoEncodeH264PictureInfoKHR{
-	        .naluSliceEntryCount = 1,
-	        .pNaluSliceEntries = &nalu_slice_info,
 	        .pStdPictureInfo = &std_picture_info,
 	        .generatePrefixNalu = false, // check if useful, check if supported
 	};
+	picture_info.setNaluSliceEntries(nalu_slices);
 
-	dpb_std_info[slot].primary_pic_type = std_picture_info.primary_pic_type;
-	dpb_std_info[slot].FrameNum = frame_num;
+	auto & reference_info = dpb_std_info[dpb.slot];
+	reference_info.flags.used_for_long_term_reference = dpb.long_term_idx.has_value();
+	reference_info.primary_pic_type = std_picture_info.primary_pic_type;
+	reference_info.FrameNum = frame_num;
+	reference_info.PicOrderCnt = poc;
+	reference_info.long_term_pic_num = dpb.long_term_idx.value_or(0);
+	reference_info.long_term_frame_idx = dpb.long_term_idx.value_or(0);
 
-	if (not ref)
+	// 16 bits, wraps as allowed by the spec
+	if (type == frame_type::idr)
 		++idr_id;
 
 	return &picture_info;
 }
+std::span<const uint8_t> video_encoder_h264::recovery_point_sei()
+{
+	static const uint8_t sei[] = {
+	        0, 0, 0, 1,
+	        // nal_ref_idc 0, nal_unit_type 6 (SEI)
+	        0x06,
+	        // payloadType 6 (recovery point), payloadSize 1
+	        0x06, 0x01,
+	        // recovery_frame_cnt ue(0), exact_match_flag 1, broken_link_flag 0,
+	        // changing_slice_group_idc 0, payload alignment bits
+	        0b11000100,
+	        // rbsp_trailing_bits
+	        0x80,
+	};
+	return sei;
+}
+
 vk::ExtensionProperties video_encoder_h264::std_header_version()
 {
 	// FIXME: update to version 1.0
@@ -10,34 +10,59 @@
 class video_encoder_h264 : public video_encoder
 {
 	uint16_t idr_id = 0;
+	// supported range for constant QP
+	int32_t min_qp = 0;
+	int32_t max_qp = 51;
+	StdVideoH264SequenceParameterSetVui vui;
 	StdVideoH264SequenceParameterSet sps;
 	StdVideoH264PictureParameterSet pps;
+	bool host_parameter_sets;
+	vk::VideoEncodeH264SessionParametersAddInfoKHR add_info;
+	vk::VideoEncodeH264SessionParametersCreateInfoKHR session_params;
 
-	StdVideoEncodeH264SliceHeader slice_header;
-	vk::VideoEncodeH264NaluSliceInfoKHR nalu_slice_info;
+	uint32_t max_slice_count = 1;
+	std::vector<StdVideoEncodeH264SliceHeader> slice_headers;
+	std::vector<vk::VideoEncodeH264NaluSliceInfoKHR> nalu_slices;
 
 	StdVideoEncodeH264PictureInfo std_picture_info;
 	vk::VideoEncodeH264PictureInfoKHR picture_info;
 
 	StdVideoEncodeH264ReferenceListsInfo reference_lists_info;
+	std::vector<StdVideoEncodeH264RefListModEntry> ref_list0_modifications;
+	std::vector<StdVideoEncodeH264RefPicMarkingEntry> ref_pic_marking;
 
 	std::vector<StdVideoEncodeH264ReferenceInfo> dpb_std_info;
 	std::vector<vk::VideoEncodeH264DpbSlotInfoKHR> dpb_std_slots;
 
-	video_encoder_h264(vk::Device device, vk::Queue encode_queue, uint32_t encode_queue_family_index, vk::Extent2D extent);
+	video_encoder_h264(vk::Device device, std::shared_ptr<mini_vma> allocator, std::shared_ptr<submit_queue> encode_queue, vk::Extent2D extent, const encoder_settings & settings);
+
+	// Frame size and cropping of the SPS
+	void set_coded_extent(vk::Extent2D extent);
 
 protected:
 	std::vector<void *> setup_slot_info(size_t dpb_size) override;
 
-	void * encode_info_next(uint32_t frame_num, size_t slot, std::optional<size_t> ref) override;
+	void * encode_info_next(frame_type type, uint32_t frame_num, const slot_info::frame_info & dpb) override;
 	virtual vk::ExtensionProperties std_header_version() override;
+	std::span<const uint8_t> recovery_point_sei() override;
+	parameters_info update_parameters(vk::Extent2D extent, uint32_t id) override;
+	uint32_t parameter_set_count() const override
+	{
+		// seq_parameter_set_id is at most 31
+		return 32;
+	}
 
 public:
 	static std::unique_ptr<video_encoder_h264> create(vk::PhysicalDevice physical_device,
 	                                 vk::Device device,
-	                                 vk::Queue encode_queue,
-	                                 uint32_t encode_queue_family_index,
-	                                 const vk::Extent2D & extent);
+	                                 std::shared_ptr<mini_vma> allocator,
+	                                 std::shared_ptr<submit_queue> encode_queue,
+	                                 const vk::Extent2D & extent,
+	                                 const encoder_settings & settings = {});
 
 	std::vector<uint8_t> get_sps_pps();
+	std::vector<uint8_t> get_parameter_sets() override
+	{
+		return get_sps_pps();
+	}
 };
@@ -0,0 +1,379 @@
+#include "video_encoder_h265.h"
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+video_encoder_h265::video_encoder_h265(vk::Device device, std::shared_ptr<mini_vma> allocator, std::shared_ptr<submit_queue> encode_queue, vk::Extent2D extent, const encoder_settings & settings) :
+        video_encoder(device, std::move(allocator), std::move(encode_queue), extent, settings),
+        profile_tier_level{},
+        dec_pic_buf_mgr{},
+        vps{},
+        sps{},
+        pps{}
+{
+	profile_tier_level.flags.general_progressive_source_flag = 1;
+	profile_tier_level.flags.general_frame_only_constraint_flag = 1;
+	profile_tier_level.general_profile_idc = STD_VIDEO_H265_PROFILE_IDC_MAIN;
+	profile_tier_level.general_level_idc = STD_VIDEO_H265_LEVEL_IDC_5_1;
+
+	// the current picture and its references, no reordering
+	dec_pic_buf_mgr.max_dec_pic_buffering_minus1[0] = settings.references.max_references();
+	dec_pic_buf_mgr.max_num_reorder_pics[0] = 0;
+	dec_pic_buf_mgr.max_latency_increase_plus1[0] = 0;
+
+	vps.flags.vps_temporal_id_nesting_flag = 1;
+	vps.flags.vps_sub_layer_ordering_info_present_flag = 1;
+	vps.vps_video_parameter_set_id = 0;
+	vps.vps_max_sub_layers_minus1 = 0;
+	vps.pDecPicBufMgr = &dec_pic_buf_mgr;
+	vps.pProfileTierLevel = &profile_tier_level;
+
+	sps.flags.sps_temporal_id_nesting_flag = 1;
+	sps.flags.sps_sub_layer_ordering_info_present_flag = 1;
+	sps.chroma_format_idc = STD_VIDEO_H265_CHROMA_FORMAT_IDC_420;
+	set_coded_extent(extent);
+	sps.sps_video_parameter_set_id = 0;
+	sps.sps_max_sub_layers_minus1 = 0;
+	sps.sps_seq_parameter_set_id = 0;
+	sps.bit_depth_luma_minus8 = 0;
+	sps.bit_depth_chroma_minus8 = 0;
+	sps.log2_max_pic_order_cnt_lsb_minus4 = 12;
+	// reference picture sets are sent in slice headers
+	sps.num_short_term_ref_pic_sets = 0;
+	sps.num_long_term_ref_pics_sps = 0;
+	sps.pProfileTierLevel = &profile_tier_level;
+	sps.pDecPicBufMgr = &dec_pic_buf_mgr;
+
+	pps.flags.pps_loop_filter_across_slices_enabled_flag = 1;
+	pps.pps_pic_parameter_set_id = 0;
+	pps.pps_seq_parameter_set_id = 0;
+	pps.sps_video_parameter_set_id = 0;
+	pps.num_ref_idx_l0_default_active_minus1 = 0;
+	pps.num_ref_idx_l1_default_active_minus1 = 0;
+	pps.init_qp_minus26 = 0;
+}
+
+void video_encoder_h265::set_block_sizes(vk::VideoEncodeH265CtbSizeFlagsKHR ctb_sizes, vk::VideoEncodeH265TransformBlockSizeFlagsKHR transform_sizes)
+{
+	// largest supported coding tree block, minimum coding block of 8
+	if (ctb_sizes & vk::VideoEncodeH265CtbSizeFlagBitsKHR::e64)
+		ctb_size = 64;
+	else if (ctb_sizes & vk::VideoEncodeH265CtbSizeFlagBitsKHR::e32)
+		ctb_size = 32;
+	else
+		ctb_size = 16;
+	const uint32_t log2_ctb_size = std::countr_zero(ctb_size);
+	sps.log2_min_luma_coding_block_size_minus3 = 0;
+	sps.log2_diff_max_min_luma_coding_block_size = log2_ctb_size - 3;
+
+	uint32_t log2_min_transform = 2;
+	for (auto [flag, log2]: {std::pair{vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e4, 2},
+	                         {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e8, 3},
+	                         {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e16, 4},
+	                         {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e32, 5}})
+	{
+		if (transform_sizes & flag)
+		{
+			log2_min_transform = log2;
+			break;
+		}
+	}
+	uint32_t log2_max_transform = log2_min_transform;
+	for (auto [flag, log2]: {std::pair{vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e32, 5},
+	                         {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e16, 4},
+	                         {vk::VideoEncodeH265TransformBlockSizeFlagBitsKHR::e8, 3}})
+	{
+		if (transform_sizes & flag)
+		{
+			// transform blocks may not be larger than coding blocks
+			log2_max_transform = std::min<uint32_t>(log2, log2_ctb_size);
+			break;
+		}
+	}
+	sps.log2_min_luma_transform_block_size_minus2 = log2_min_transform - 2;
+	sps.log2_diff_max_min_luma_transform_block_size = log2_max_transform - log2_min_transform;
+	sps.max_transform_hierarchy_depth_inter = log2_max_transform - log2_min_transform;
+	sps.max_transform_hierarchy_depth_intra = log2_max_transform - log2_min_transform;
+}
+
+std::vector<void *> video_encoder_h265::setup_slot_info(size_t dpb_size)
+{
+	dpb_std_info.resize(dpb_size, {});
+	dpb_std_slots.reserve(dpb_size);
+	std::vector<void *> res;
+	for (size_t i = 0; i < dpb_size; ++i)
+	{
+		dpb_std_slots.push_back({
+		        .pStdReferenceInfo = &dpb_std_info[i],
+		});
+		res.push_back(&dpb_std_slots[i]);
+	}
+
+	return res;
+}
+
+std::unique_ptr<video_encoder_h265> video_encoder_h265::create(
+        vk::PhysicalDevice physical_device,
+        vk::Device device,
+        std::shared_ptr<mini_vma> allocator,
+        std::shared_ptr<submit_queue> encode_queue,
+        const vk::Extent2D & extent,
+        const encoder_settings & settings)
+{
+	if (settings.references.num_long_term > 0)
+		throw std::runtime_error("long-term references are not supported with H.265");
+
+	std::unique_ptr<video_encoder_h265> self(new video_encoder_h265(device, std::move(allocator), std::move(encode_queue), extent, settings));
+
+	vk::StructureChain video_profile_info{
+	        vk::VideoProfileInfoKHR{
+	                .videoCodecOperation =
+	                        vk::VideoCodecOperationFlagBitsKHR::eEncodeH265,
+	                .chromaSubsampling = vk::VideoChromaSubsamplingFlagBitsKHR::e420,
+	                .lumaBitDepth = vk::VideoComponentBitDepthFlagBitsKHR::e8,
+	                .chromaBitDepth = vk::VideoComponentBitDepthFlagBitsKHR::e8,
+	        },
+	        vk::VideoEncodeH265ProfileInfoKHR{
+	                .stdProfileIdc = STD_VIDEO_H265_PROFILE_IDC_MAIN,
+	        },
+	        vk::VideoEncodeUsageInfoKHR{
+	                .videoUsageHints = vk::VideoEncodeUsageFlagBitsKHR::eStreaming,
+	                .videoContentHints = vk::VideoEncodeContentFlagBitsKHR::eRendered,
+	                .tuningMode = vk::VideoEncodeTuningModeKHR::eUltraLowLatency,
+	        }};
+
+	auto [video_caps, encode_caps, encode_h265_caps] =
+	        physical_device.getVideoCapabilitiesKHR<
+	                vk::VideoCapabilitiesKHR,
+	                vk::VideoEncodeCapabilitiesKHR,
+	                vk::VideoEncodeH265CapabilitiesKHR>(video_profile_info.get());
+
+	// Only queried when the extension is enabled
+	if (settings.quantization_map)
+	{
+		auto qp_caps = physical_device.getVideoCapabilitiesKHR<
+		        vk::VideoCapabilitiesKHR,
+		        vk::VideoEncodeCapabilitiesKHR,
+		        vk::VideoEncodeH265CapabilitiesKHR,
+		        vk::VideoEncodeQuantizationMapCapabilitiesKHR,
+		        vk::VideoEncodeH265QuantizationMapCapabilitiesKHR>(video_profile_info.get());
+		self->qp_map_caps = quantization_map_caps{
+		        .max_extent = qp_caps.get<vk::VideoEncodeQuantizationMapCapabilitiesKHR>().maxQuantizationMapExtent,
+		        .min_qp_delta = qp_caps.get<vk::VideoEncodeH265QuantizationMapCapabilitiesKHR>().minQpDelta,
+		        .max_qp_delta = qp_caps.get<vk::VideoEncodeH265QuantizationMapCapabilitiesKHR>().maxQpDelta,
+		};
+	}
+
+	if (settings.references.max_active_references > encode_h265_caps.maxPPictureL0ReferenceCount)
+		throw std::runtime_error("too many active references for P frames");
+
+	self->max_slice_count = std::max(encode_h265_caps.maxSliceSegmentCount, 1u);
+	self->min_qp = encode_h265_caps.minQp;
+	self->max_qp = encode_h265_caps.maxQp;
+	self->profile_tier_level.general_level_idc = std::min(self->profile_tier_level.general_level_idc, encode_h265_caps.maxLevelIdc);
+	self->set_block_sizes(encode_h265_caps.ctbSizes, encode_h265_caps.transformBlockSizes);
+
+	// optional tools, when the implementation can use them
+	auto syntax = encode_h265_caps.stdSyntaxFlags;
+	if (syntax & vk::VideoEncodeH265StdFlagBitsKHR::eSampleAdaptiveOffsetEnabledFlagSet)
+		self->sps.flags.sample_adaptive_offset_enabled_flag = 1;
+	if (syntax & vk::VideoEncodeH265StdFlagBitsKHR::eCuQpDeltaEnabledFlagSet)
+		self->pps.flags.cu_qp_delta_enabled_flag = 1;
+
+	self->add_info = vk::VideoEncodeH265SessionParametersAddInfoKHR{};
+	self->add_info.setStdVPSs(self->vps);
+	self->add_info.setStdSPSs(self->sps);
+	self->add_info.setStdPPSs(self->pps);
+	self->update_info = vk::VideoEncodeH265SessionParametersAddInfoKHR{};
+	self->update_info.setStdSPSs(self->sps);
+	self->update_info.setStdPPSs(self->pps);
+
+	// Room for the parameter sets of later extents
+	self->session_params = vk::VideoEncodeH265SessionParametersCreateInfoKHR{
+	        .maxStdVPSCount = 1,
+	        .maxStdSPSCount = self->parameter_set_count(),
+	        .maxStdPPSCount = self->parameter_set_count(),
+	        .pParametersAddInfo = &self->add_info,
+	};
+
+	vk::VideoEncodeH265SessionCreateInfoKHR session_create_info{
+	        .useMaxLevelIdc = false,
+	};
+
+	self->init(physical_device, video_caps, encode_caps, video_profile_info.get(), &session_create_info, &self->session_params);
+
+	return self;
+}
+
+std::vector<uint8_t> video_encoder_h265::get_vps_sps_pps()
+{
+	vk::VideoEncodeH265SessionParametersGetInfoKHR next{
+	        .writeStdVPS = true,
+	        .writeStdSPS = true,
+	        .writeStdPPS = true,
+	        .stdVPSId = vps.vps_video_parameter_set_id,
+	        .stdSPSId = sps.sps_seq_parameter_set_id,
+	        .stdPPSId = pps.pps_pic_parameter_set_id,
+	};
+	return get_encoded_parameters(&next);
+}
+
+void video_encoder_h265::set_coded_extent(vk::Extent2D extent)
+{
+	// coded size must be a multiple of the minimum coding block (8),
+	// the conformance window is in chroma samples
+	const uint32_t width = (extent.width + 7) & ~7u;
+	const uint32_t height = (extent.height + 7) & ~7u;
+	sps.flags.conformance_window_flag = width != extent.width or height != extent.height;
+	sps.pic_width_in_luma_samples = width;
+	sps.pic_height_in_luma_samples = height;
+	sps.conf_win_right_offset = (width - extent.width) / 2;
+	sps.conf_win_bottom_offset = (height - extent.height) / 2;
+}
+
+video_encoder::parameters_info video_encoder_h265::update_parameters(vk::Extent2D extent, uint32_t id)
+{
+	set_coded_extent(extent);
+	sps.sps_seq_parameter_set_id = id;
+	pps.pps_seq_parameter_set_id = id;
+	pps.pps_pic_parameter_set_id = id;
+	return {
+	        .add_info = &update_info,
+	        .create_info = &session_params,
+	};
+}
+
+void * video_encoder_h265::encode_info_next(frame_type type, uint32_t frame_num, const slot_info::frame_info & dpb)
+{
+	// One picture per frame_num, in output order. Only the least
+	// significant bits are coded, reference picture sets use differences.
+	const int32_t poc = frame_num;
+
+	const int32_t init_qp = 26 + pps.init_qp_minus26;
+	int32_t qp = init_qp;
+	bool cqp = rate().rc_mode == rate_control::mode::cqp;
+	if (cqp)
+		qp = std::clamp(type == frame_type::inter ? rate().qp_p : rate().qp_i, min_qp, max_qp);
+
+	// Short-term reference picture set: every valid reference kept by the
+	// DPB, closest first. Pictures left out are dropped by decoders.
+	std::vector<size_t> rps(dpb.reference_set);
+	std::ranges::sort(rps, [this](size_t a, size_t b) { return dpb_std_info[a].PicOrderCntVal > dpb_std_info[b].PicOrderCntVal; });
+	short_term_rps = {};
+	std::vector<size_t> ref_list;
+	if (type != frame_type::idr)
+	{
+		int32_t previous = poc;
+		for (size_t i = 0; i < rps.size(); ++i)
+		{
+			int32_t ref_poc = dpb_std_info[rps[i]].PicOrderCntVal;
+			short_term_rps.delta_poc_s0_minus1[i] = previous - ref_poc - 1;
+			previous = ref_poc;
+			if (std::ranges::count(dpb.references, rps[i]))
+			{
+				short_term_rps.used_by_curr_pic_s0_flag |= 1 << i;
+				ref_list.push_back(rps[i]);
+			}
+		}
+		short_term_rps.num_negative_pics = rps.size();
+	}
+	long_term_pics = {};
+
+	// Slice segments cover whole CTB rows
+	const uint32_t ctb_width = (sps.pic_width_in_luma_samples + ctb_size - 1) / ctb_size;
+	const uint32_t ctb_rows = (sps.pic_height_in_luma_samples + ctb_size - 1) / ctb_size;
+	const uint32_t slice_count = slices_for_frame(type, std::min(max_slice_count, ctb_rows));
+	slice_headers.resize(slice_count);
+	nalu_slices.resize(slice_count);
+
+	slice_headers[0] = {};
+	auto & header = slice_headers[0];
+	header.flags.first_slice_segment_in_pic_flag = 1;
+	header.flags.slice_sao_luma_flag = sps.flags.sample_adaptive_offset_enabled_flag;
+	header.flags.slice_sao_chroma_flag = sps.flags.sample_adaptive_offset_enabled_flag;
+	// the PPS default is a single reference
+	header.flags.num_ref_idx_active_override_flag = ref_list.size() > 1;
+	header.flags.slice_loop_filter_across_slices_enabled_flag = 1;
+	header.slice_type = type == frame_type::inter ? STD_VIDEO_H265_SLICE_TYPE_P
+	                                              : STD_VIDEO_H265_SLICE_TYPE_I;
+	header.MaxNumMergeCand = 5;
+	header.slice_qp_delta = int8_t(qp - init_qp);
+	header.pWeightTable = nullptr;
+	for (uint32_t i = 0; i < slice_count; ++i)
+	{
+		slice_headers[i] = slice_headers[0];
+		slice_headers[i].flags.first_slice_segment_in_pic_flag = i == 0;
+		slice_headers[i].slice_segment_address = (i * ctb_rows / slice_count) * ctb_width;
+		nalu_slices[i] = vk::VideoEncodeH265NaluSliceSegmentInfoKHR{
+		        // must be 0 unless rate control is disabled
+		        .constantQp = cqp ? qp : 0,
+		        .pStdSliceSegmentHeader = &slice_headers[i],
+		};
+	}
+
+	// The initial list is the used pictures of the set, in the same order
+	reference_lists_info = {};
+	reference_lists_info.num_ref_idx_l0_active_minus1 = ref_list.empty() ? 0 : ref_list.size() - 1;
+	std::ranges::fill(reference_lists_info.RefPicList0, STD_VIDEO_H265_NO_REFERENCE_PICTURE);
+	std::ranges::fill(reference_lists_info.RefPicList1, STD_VIDEO_H265_NO_REFERENCE_PICTURE);
+	for (size_t i = 0; i < ref_list.size(); ++i)
+		reference_lists_info.RefPicList0[i] = ref_list[i];
+
+	std_picture_info = {};
+	std_picture_info.flags.is_reference = 1;
+	std_picture_info.flags.IrapPicFlag = type == frame_type::idr;
+	std_picture_info.flags.pic_output_flag = 1;
+	std_picture_info.flags.short_term_ref_pic_set_sps_flag = 0;
+	std_picture_info.pic_type = type == frame_type::idr     ? STD_VIDEO_H265_PICTURE_TYPE_IDR
+	                            : type == frame_type::intra ? STD_VIDEO_H265_PICTURE_TYPE_I
+	                                                        : STD_VIDEO_H265_PICTURE_TYPE_P;
+	std_picture_info.sps_video_parameter_set_id = 0;
+	std_picture_info.pps_seq_parameter_set_id = sps.sps_seq_parameter_set_id;
+	std_picture_info.pps_pic_parameter_set_id = pps.pps_pic_parameter_set_id;
+	std_picture_info.PicOrderCntVal = poc;
+	std_picture_info.TemporalId = 0;
+	std_picture_info.pRefLists = &reference_lists_info;
+	std_picture_info.pShortTermRefPicSet = &short_term_rps;
+	std_picture_info.pLongTermRefPics = &long_term_pics;
+
+	picture_info = vk::VideoEncodeH265PictureInfoKHR{
+	        .pStdPictureInfo = &std_picture_info,
+	};
+	picture_info.setNaluSliceSegmentEntries(nalu_slices);
+
+	auto & reference_info = dpb_std_info[dpb.slot];
+	reference_info = {};
+	reference_info.pic_type = std_picture_info.pic_type;
+	reference_info.PicOrderCntVal = poc;
+	reference_info.TemporalId = 0;
+
+	return &picture_info;
+}
+
+std::span<const uint8_t> video_encoder_h265::recovery_point_sei()
+{
+	static const uint8_t sei[] = {
+	        0, 0, 0, 1,
+	        // nal_unit_type 39 (prefix SEI), nuh_layer_id 0, nuh_temporal_id_plus1 1
+	        0x4e, 0x01,
+	        // payloadType 6 (recovery point), payloadSize 1
+	        0x06, 0x01,
+	        // recovery_poc_cnt se(0), exact_match_flag 1, broken_link_flag 0,
+	        // payload alignment bits
+	        0b11010000,
+	        // rbsp_trailing_bits
+	        0x80,
+	};
+	return sei;
+}
+
+vk::ExtensionProperties video_encoder_h265::std_header_version()
+{
+	vk::ExtensionProperties std_header_version{
+	        .specVersion = VK_STD_VULKAN_VIDEO_CODEC_H265_ENCODE_SPEC_VERSION,
+	};
+	strcpy(std_header_version.extensionName,
+	       VK_STD_VULKAN_VIDEO_CODEC_H265_ENCODE_EXTENSION_NAME);
+	return std_header_version;
+}
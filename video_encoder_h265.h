@@ -0,0 +1,77 @@
+#pragma once
+
+#include "video_encoder.h"
+
+#include <memory>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+class video_encoder_h265 : public video_encoder
+{
+	// supported range for constant QP
+	int32_t min_qp = 0;
+	int32_t max_qp = 51;
+	uint32_t ctb_size = 32;
+
+	StdVideoH265ProfileTierLevel profile_tier_level;
+	StdVideoH265DecPicBufMgr dec_pic_buf_mgr;
+	StdVideoH265VideoParameterSet vps;
+	StdVideoH265SequenceParameterSet sps;
+	StdVideoH265PictureParameterSet pps;
+	// all parameter sets for a new parameters object, SPS and PPS to update
+	// an existing one
+	vk::VideoEncodeH265SessionParametersAddInfoKHR add_info;
+	vk::VideoEncodeH265SessionParametersAddInfoKHR update_info;
+	vk::VideoEncodeH265SessionParametersCreateInfoKHR session_params;
+
+	uint32_t max_slice_count = 1;
+	std::vector<StdVideoEncodeH265SliceSegmentHeader> slice_headers;
+	std::vector<vk::VideoEncodeH265NaluSliceSegmentInfoKHR> nalu_slices;
+
+	StdVideoEncodeH265PictureInfo std_picture_info;
+	vk::VideoEncodeH265PictureInfoKHR picture_info;
+
+	StdVideoEncodeH265ReferenceListsInfo reference_lists_info;
+	StdVideoH265ShortTermRefPicSet short_term_rps;
+	StdVideoEncodeH265LongTermRefPics long_term_pics;
+
+	std::vector<StdVideoEncodeH265ReferenceInfo> dpb_std_info;
+	std::vector<vk::VideoEncodeH265DpbSlotInfoKHR> dpb_std_slots;
+
+	video_encoder_h265(vk::Device device, std::shared_ptr<mini_vma> allocator, std::shared_ptr<submit_queue> encode_queue, vk::Extent2D extent, const encoder_settings & settings);
+
+	// Picture size and conformance window of the SPS
+	void set_coded_extent(vk::Extent2D extent);
+
+	// Parameters that depend on the implementation capabilities
+	void set_block_sizes(vk::VideoEncodeH265CtbSizeFlagsKHR ctb_sizes, vk::VideoEncodeH265TransformBlockSizeFlagsKHR transform_sizes);
+
+protected:
+	std::vector<void *> setup_slot_info(size_t dpb_size) override;
+
+	void * encode_info_next(frame_type type, uint32_t frame_num, const slot_info::frame_info & dpb) override;
+	virtual vk::ExtensionProperties std_header_version() override;
+	std::span<const uint8_t> recovery_point_sei() override;
+	parameters_info update_parameters(vk::Extent2D extent, uint32_t id) override;
+	uint32_t parameter_set_count() const override
+	{
+		// sps_seq_parameter_set_id is at most 15, the VPS is shared
+		return 16;
+	}
+
+public:
+	// Long-term references are not supported
+	static std::unique_ptr<video_encoder_h265> create(vk::PhysicalDevice physical_device,
+	                                 vk::Device device,
+	                                 std::shared_ptr<mini_vma> allocator,
+	                                 std::shared_ptr<submit_queue> encode_queue,
+	                                 const vk::Extent2D & extent,
+	                                 const encoder_settings & settings = {});
+
+	std::vector<uint8_t> get_vps_sps_pps();
+	std::vector<uint8_t> get_parameter_sets() override
+	{
+		return get_vps_sps_pps();
+	}
+};
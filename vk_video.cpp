@@ -1,10 +1,15 @@
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <vector>
 #include <vulkan/vulkan.hpp>
 
+#include "encode_worker.h"
+#include "fmp4_muxer.h"
+#include "rgb_to_nv12.h"
 #include "test_pattern.h"
-#include "video_encoder_h264.h"
+#include "video_encoder_factory.h"
 
 // Use random frame as a reference, randomly insert references
 // #define DPB_CHAOS_MODE
@@ -15,7 +20,7 @@ struct queue
 	uint32_t familyIndex;
 };
 
-auto make_device(vk::Instance & instance)
+auto make_device(vk::Instance & instance, video_codec codec)
 {
 	for (auto d: instance.enumeratePhysicalDevices())
 	{
@@ -25,12 +30,12 @@ auto make_device(vk::Instance & instance)
 		                       vk::PhysicalDeviceVulkan11Features,
 		                       vk::PhysicalDeviceVulkan12Features,
 		                       vk::PhysicalDeviceVulkan13Features>();
-		if (not feat_13.synchronization2)
+		if (not feat_13.synchronization2 or not feat_12.timelineSemaphore)
 			continue;
 		vk::DeviceCreateInfo create_info{.pNext = &feat};
 		std::vector<const char *> required_extensions = {
 		        VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
-		        VK_KHR_VIDEO_ENCODE_H264_EXTENSION_NAME,
+		        encode_extension_name(codec),
 		        VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
 		        VK_KHR_VIDEO_ENCODE_QUEUE_EXTENSION_NAME,
 		        // VK_KHR_VIDEO_MAINTENANCE_1_EXTENSION_NAME,
@@ -47,38 +52,45 @@ auto make_device(vk::Instance & instance)
 		}
 		create_info.setPEnabledExtensionNames(required_extensions);
 
-		queue encode_queue{nullptr, 0};
-		queue gfx_queue{nullptr, 0};
-
-		std::vector<vk::DeviceQueueCreateInfo> queue_info{};
+		// One queue in the first family with each capability, two different
+		// queues if that is the same family. vk_video encodes one stream
+		// with encode_worker, encode_scheduler would need a device with all
+		// the queues of the encode family.
 		auto queues = d.getQueueFamilyProperties();
-		uint32_t i = 0;
-		float prio = 0.5;
-		for (const auto & q: queues)
+		auto find_family = [&](vk::QueueFlagBits flag) {
+			auto it = std::ranges::find_if(queues, [flag](const auto & q) {
+				return bool(q.queueFlags & flag);
+			});
+			return uint32_t(it - queues.begin());
+		};
+		queue encode_queue{nullptr, find_family(vk::QueueFlagBits::eVideoEncodeKHR)};
+		queue gfx_queue{nullptr, find_family(vk::QueueFlagBits::eGraphics)};
+		if (encode_queue.familyIndex == queues.size() or gfx_queue.familyIndex == queues.size())
 		{
-			if (q.queueFlags & vk::QueueFlagBits::eVideoEncodeKHR)
-			{
-				encode_queue.familyIndex = i;
-				queue_info.push_back({
-				        .queueFamilyIndex = i,
-				        .queueCount = 1,
-				});
-				queue_info.back().setQueuePriorities(prio);
-			}
-			if (q.queueFlags & vk::QueueFlagBits::eGraphics)
-			{
-				gfx_queue.familyIndex = i;
-				queue_info.push_back({
-				        .queueFamilyIndex = i,
-				        .queueCount = 1,
-				});
-				queue_info.back().setQueuePriorities(prio);
-			}
-			if (queue_info.size() == 2)
-				break;
-			++i;
+			throw std::runtime_error("No suitable queue for video encode");
+		}
+
+		const float prios[] = {0.5, 0.5};
+		uint32_t gfx_queue_index = 0;
+		std::vector<vk::DeviceQueueCreateInfo> queue_info{{
+		        .queueFamilyIndex = encode_queue.familyIndex,
+		        .queueCount = 1,
+		        .pQueuePriorities = prios,
+		}};
+		if (gfx_queue.familyIndex != encode_queue.familyIndex)
+		{
+			queue_info.push_back({
+			        .queueFamilyIndex = gfx_queue.familyIndex,
+			        .queueCount = 1,
+			        .pQueuePriorities = prios,
+			});
 		}
-		if (queue_info.size() != 2)
+		else if (queues[gfx_queue.familyIndex].queueCount > 1)
+		{
+			queue_info[0].queueCount = 2;
+			gfx_queue_index = 1;
+		}
+		else
 		{
 			throw std::runtime_error("No suitable queue for video encode");
 		}
@@ -86,7 +98,7 @@ auto make_device(vk::Instance & instance)
 
 		auto dev = d.createDevice(create_info);
 		encode_queue.queue = dev.getQueue(encode_queue.familyIndex, 0);
-		gfx_queue.queue = dev.getQueue(gfx_queue.familyIndex, 0);
+		gfx_queue.queue = dev.getQueue(gfx_queue.familyIndex, gfx_queue_index);
 		return std::make_tuple(d, dev, encode_queue, gfx_queue);
 	}
 	throw std::runtime_error("No vulkan device available");
@@ -94,12 +106,22 @@ auto make_device(vk::Instance & instance)
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
-int main(int /*argc*/, char ** /*argv*/)
+int main(int argc, char ** argv)
 {
 	try
 	{
+		// vk_video [h264|h265]
+		video_codec codec = video_codec::h264;
+		if (argc > 1)
+		{
+			auto parsed = parse_video_codec(argv[1]);
+			if (not parsed)
+				throw std::runtime_error(std::string("unknown codec ") + argv[1]);
+			codec = *parsed;
+		}
+
 		VULKAN_HPP_DEFAULT_DISPATCHER.init();
-		std::ofstream out("out.h264", std::ios::trunc);
+		std::ofstream out(std::string("out.") + to_string(codec), std::ios::trunc);
 
 		vk::Extent2D extent{1920, 1080};
 
@@ -115,7 +137,7 @@ int main(int /*argc*/, char ** /*argv*/)
 		});
 		VULKAN_HPP_DEFAULT_DISPATCHER.init(instance);
 
-		auto [phys_dev, dev, encode_queue, gfx_queue] = make_device(instance);
+		auto [phys_dev, dev, encode_queue, gfx_queue] = make_device(instance, codec);
 		VULKAN_HPP_DEFAULT_DISPATCHER.init(dev);
 
 		auto command_pool = dev.createCommandPool({
@@ -123,106 +145,175 @@ int main(int /*argc*/, char ** /*argv*/)
 		        .queueFamilyIndex = gfx_queue.familyIndex,
 		});
 
-		auto command_buffer = 
-		        dev.allocateCommandBuffers({.commandPool = command_pool,
-		                                    .commandBufferCount = 1})[0];
+		auto allocator = std::make_shared<mini_vma>(phys_dev, dev);
+
+		test_pattern pattern(dev, *allocator, extent);
 
-		test_pattern pattern(phys_dev, dev, extent);
-		auto sem = dev.createSemaphore(vk::SemaphoreCreateInfo{});
-		auto fence = dev.createFence(vk::FenceCreateInfo{});
+		auto encode_submit_queue = std::make_shared<submit_queue>();
+		encode_submit_queue->queue = encode_queue.queue;
+		encode_submit_queue->family_index = encode_queue.familyIndex;
 
-		auto encoder = video_encoder_h264::create(phys_dev, dev, encode_queue.queue, encode_queue.familyIndex, extent);
+		// 60 fps in the 90kHz timescale
+		using mp4_duration = std::chrono::duration<int64_t, std::ratio<1, 90000>>;
+		const uint64_t frame_duration = 1500;
+		fmp4_muxer::config mp4_config{.width = extent.width, .height = extent.height};
 
+		// The test pattern is converted directly into the encoder input
+		// image. The muxer holds the frames of a fragment, each keeps a
+		// max_frame_size reservation of the output buffer: bound the frame
+		// size to a third of the raw picture to keep the buffer small.
+		// Input images are held by the frames in the worker queue, the one
+		// it is submitting and the one being rendered
+		const uint32_t worker_queue_size = 2;
+		auto encoder = create_video_encoder(codec, phys_dev, dev, allocator, encode_submit_queue, extent,
+		                                    encoder_settings{
+		                                            .max_frame_size = size_t(extent.width) * extent.height / 2,
+		                                            .retained_frames = uint32_t(mp4_config.fragment_duration / frame_duration),
+		                                            .input_storage = true,
+		                                            .input_layout = vk::ImageLayout::eGeneral,
+		                                            .input_images = worker_queue_size + 2,
+		                                    });
+		rgb_to_nv12 converter(dev);
+
+		// one per input image, submitted with the frame using it
+		auto command_buffers =
+		        dev.allocateCommandBuffers({.commandPool = command_pool,
+		                                    .commandBufferCount = uint32_t(encoder->input_image_count())});
+
+		auto parameter_sets = encoder->get_parameter_sets();
+		out.write((char *)parameter_sets.data(), parameter_sets.size());
+
+		// the muxer only writes H.264 tracks
+		std::ofstream mp4_out;
+		std::optional<fmp4_muxer> mp4;
+		if (codec == video_codec::h264)
 		{
-			auto sps_pps = encoder->get_sps_pps();
-			out.write((char *)sps_pps.data(), sps_pps.size());
+			mp4_out.open("out.mp4", std::ios::trunc | std::ios::binary);
+			mp4.emplace(mp4_config,
+			            parameter_sets,
+			            [&](std::span<const iovec> iov) {
+				            for (const auto & v: iov)
+					            mp4_out.write((const char *)v.iov_base, v.iov_len);
+			            });
 		}
 
-		for (int frame = 0; frame < 120; ++frame)
+		// Frames are rendered as fast as possible, their timestamp is the
+		// nominal presentation time so that dropped ones leave a gap
+		const auto start = encode_worker::clock::now();
+		auto write_frame = [&](const encode_worker::frame & f, const video_encoder::encoded_frame & encoded) {
+			out.write((const char *)encoded.bitstream.data().data(), encoded.bitstream.size());
+			if (mp4)
+				mp4->add_frame(encoded.bitstream.data(),
+				               encoded.bitstream.owner(),
+				               std::chrono::round<mp4_duration>(f.timestamp - start).count());
+		};
+
+		// Signaled by the graphics queue once the input image of a frame is
+		// written, to the frame index + 1
+		vk::StructureChain timeline_create{
+		        vk::SemaphoreCreateInfo{},
+		        vk::SemaphoreTypeCreateInfo{
+		                .semaphoreType = vk::SemaphoreType::eTimeline,
+		                .initialValue = 0,
+		        },
+		};
+		auto render_timeline = dev.createSemaphore(timeline_create.get());
+		// render_timeline value of the last submission of each command buffer
+		std::vector<uint64_t> command_buffer_values(command_buffers.size(), 0);
+
+		// Submission, readback and output happen on the worker thread. The
+		// render loop never waits for the encoder: when it falls behind, the
+		// oldest queued frame is dropped.
+		std::optional<encode_worker> worker;
+		worker.emplace(dev, *encoder, worker_queue_size, encode_worker::backpressure::drop_oldest,
+		               [&](const encode_worker::frame & f, video_encoder::encoded_frame encoded) {
+			               write_frame(f, encoded);
+		               });
+
+		for (uint64_t frame = 0; frame < 120; ++frame)
 		{
 			std::cerr << "frame " << frame << std::endl;
+
+			auto input = encoder->acquire_input_image();
+			if (not input)
+				throw std::runtime_error("no input image available");
+
+			// The last submission of the command buffer may still be pending
+			// if its frame was dropped
+			auto command_buffer = command_buffers[input->index];
+			uint64_t render_done = command_buffer_values[input->index];
+			(void)dev.waitSemaphores(
+			        vk::SemaphoreWaitInfo{
+			                .semaphoreCount = 1,
+			                .pSemaphores = &render_timeline,
+			                .pValues = &render_done,
+			        },
+			        UINT64_MAX);
+
 			// test pattern
 			{
 				command_buffer.reset();
 				command_buffer.begin(vk::CommandBufferBeginInfo{});
 				pattern.record_draw_commands(command_buffer);
 
-				vk::ImageMemoryBarrier2 barrier{
-				        .srcStageMask = vk::PipelineStageFlagBits2KHR::eNone,
-				        .srcAccessMask = vk::AccessFlagBits2::eNone,
-				        .dstStageMask = vk::PipelineStageFlagBits2KHR::eTransfer,
-				        .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
-				        .oldLayout = vk::ImageLayout::eUndefined,
-				        .newLayout = vk::ImageLayout::eTransferDstOptimal,
-				        .image = encoder->input_image,
-				        .subresourceRange = {.aspectMask = vk::ImageAspectFlagBits::eColor,
-				                             .baseMipLevel = 0,
-				                             .levelCount = 1,
-				                             .baseArrayLayer = 0,
-				                             .layerCount = 1},
-				};
-				vk::DependencyInfo dep_info{
-				        .imageMemoryBarrierCount = 1,
-				        .pImageMemoryBarriers = &barrier,
-				};
-				command_buffer.pipelineBarrier2(dep_info);
-
-				command_buffer.copyImage(
-				        pattern.img_y,
-				        vk::ImageLayout::eTransferSrcOptimal,
-				        encoder->input_image,
-				        vk::ImageLayout::eTransferDstOptimal,
-				        vk::ImageCopy{.srcSubresource = {
-				                              .aspectMask = vk::ImageAspectFlagBits::eColor,
-				                              .layerCount = 1,
-				                      },
-				                      .dstSubresource = {
-				                              .aspectMask = vk::ImageAspectFlagBits::ePlane0,
-				                              .layerCount = 1,
-				                      },
-				                      .extent = {extent.width, extent.height, 1}});
-				command_buffer.copyImage(
-				        pattern.img_uv,
-				        vk::ImageLayout::eTransferSrcOptimal,
-				        encoder->input_image,
-				        vk::ImageLayout::eTransferDstOptimal,
-				        vk::ImageCopy{.srcSubresource = {
-				                              .aspectMask = vk::ImageAspectFlagBits::eColor,
-				                              .layerCount = 1,
-				                      },
-				                      .dstSubresource = {
-				                              .aspectMask = vk::ImageAspectFlagBits::ePlane1,
-				                              .layerCount = 1,
-				                      },
-				                      .extent = {extent.width / 2, extent.height / 2, 1}});
-
-				barrier.srcStageMask = vk::PipelineStageFlagBits2KHR::eTransfer;
-				barrier.srcAccessMask = vk::AccessFlagBits2::eTransferWrite;
-				barrier.dstStageMask = vk::PipelineStageFlagBits2KHR::eTopOfPipe;
-				barrier.dstAccessMask = vk::AccessFlagBits2::eMemoryRead | vk::AccessFlagBits2::eMemoryWrite;
-				barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal,
-				barrier.newLayout = vk::ImageLayout::eVideoEncodeSrcKHR,
-				barrier.srcQueueFamilyIndex = gfx_queue.familyIndex,
-				barrier.dstQueueFamilyIndex = encode_queue.familyIndex,
-				command_buffer.pipelineBarrier2(dep_info);
+				converter.record(command_buffer,
+				                 pattern.view,
+				                 vk::ImageLayout::eShaderReadOnlyOptimal,
+				                 input->image,
+				                 extent,
+				                 gfx_queue.familyIndex,
+				                 encode_queue.familyIndex);
 
 				command_buffer.end();
 
-				vk::SubmitInfo submit{};
-				submit.setCommandBuffers(command_buffer);
-				submit.setSignalSemaphores(sem);
-				gfx_queue.queue.submit(submit, fence);
+				vk::SubmitInfo2 submit{};
+				vk::CommandBufferSubmitInfo cmd_info{
+				        .commandBuffer = command_buffer,
+				};
+				submit.setCommandBufferInfos(cmd_info);
+				// the last encode reading the image, waited for on the device
+				vk::SemaphoreSubmitInfo wait_info{
+				        .semaphore = encoder->encode_semaphore(),
+				        .value = input->wait_value,
+				        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+				};
+				if (input->wait_value)
+					submit.setWaitSemaphoreInfos(wait_info);
+				vk::SemaphoreSubmitInfo signal_info{
+				        .semaphore = render_timeline,
+				        .value = frame + 1,
+				        .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+				};
+				submit.setSignalSemaphoreInfos(signal_info);
+				gfx_queue.queue.submit2(submit);
+				command_buffer_values[input->index] = frame + 1;
 			}
 
-			auto encoded_data = encoder->encode_frame(sem, gfx_queue.familyIndex);
-			out.write((char *)encoded_data.data(), encoded_data.size_bytes());
-			if (auto res = dev.waitForFences(fence, true, 1'000'000'000);
-			    res != vk::Result::eSuccess)
-			{
-				throw std::runtime_error("wait for fences: " + vk::to_string(res));
-			}
-			dev.resetFences(fence);
+			// Rendering of the next frame overlaps with this encode
+			worker->push({
+			        .input = *input,
+			        .wait_semaphore = render_timeline,
+			        .wait_value = frame + 1,
+			        .src_queue = gfx_queue.familyIndex,
+			        .timestamp = start + std::chrono::duration_cast<encode_worker::clock::duration>(mp4_duration(frame * frame_duration)),
+			});
 		}
+		// encodes the queued frames
+		auto metrics = worker->get_metrics();
+		worker.reset();
+		gfx_queue.queue.waitIdle();
+		dev.destroy(render_timeline);
+
+		std::cerr << metrics.pushed << " frames pushed, " << metrics.dropped << " dropped, hand-off latency max "
+		          << std::chrono::duration_cast<std::chrono::microseconds>(metrics.handoff_latency_max).count() << " us\n";
+		auto stats = encoder->telemetry();
+		std::cerr << stats.frames << " frames, " << stats.failed_frames << " failed, " << stats.bytes << " bytes\n"
+		          << "encode latency p50 " << stats.encode.percentile(0.5) / 1000 << " us, p99 "
+		          << stats.encode.percentile(0.99) / 1000 << " us, total p99 " << stats.total.percentile(0.99) / 1000
+		          << " us" << std::endl;
+		if (mp4)
+			mp4->flush();
+		mp4_out.flush();
 		// FIXME: normal exit
 		out.flush();
 		std::quick_exit(0);